@@ -0,0 +1,321 @@
+#ifndef NUMERIX_ADAPTIVERUNGEKUTTASOLVERS_H
+#define NUMERIX_ADAPTIVERUNGEKUTTASOLVERS_H
+
+#include "ODESolver.h"
+#include <math.h>
+#include <algorithm>
+
+namespace numerix
+{
+
+/// Base class for embedded Runge-Kutta solvers, which choose their own step size to keep an error estimate within tolerances.
+/**
+	Each step() is taken as a number of internal steps, whose size is adapted so that the estimated
+	local error of each is within the absolute tolerance plus the relative tolerance times the state,
+	in the root mean square over the state variables.
+
+	With dense output (the default), the internal steps are not shortened to end at the time of a
+	step(). The last one may end past it, and the state at that time is interpolated from the
+	stages of that internal step, so it costs no extra derivative evaluations. The solver then
+	continues from the end of the internal step, which assumes the system doesn't change at the
+	times of step() other than through its states. If it does, e.g. when inputs held constant over
+	a step() change, restart() has to be called first. Without dense output, internal steps are
+	shortened to end at the time of each step().
+
+	The derivative at the end of a step is reused for the start of the next one ("first same as
+	last"), also across step() calls.
+*/
+template <class T>
+class AdaptiveSolver : public ODESolver<T>
+{
+public:
+	/// \a order is the order of the embedded (lower order) solution that the error is estimated for
+	AdaptiveSolver(ODESystem<T>& ode, const int norder)
+	:	ODESolver<T>(ode),
+		dydt(ode.size()),
+		ynew(ode.size()),
+		ystage(ode.size()),
+		kstage(ode.size()),
+		yprev(ode.size()),
+		yout(ode.size()),
+		order(norder),
+		rtol(1e-6),
+		atol(1e-9),
+		hmin(0),
+		hmax(0),
+		h(0),
+		tprev(0),
+		tout(0),
+		dense(true),
+		dydt_valid(false),
+		numsteps(0),
+		numrejected(0),
+		numevaluations(0)
+	{
+	}
+
+	/// Set the tolerances of the error estimate of each internal step
+	void setTolerances(const double relative, const double absolute) { rtol = relative; atol = absolute; }
+	double getRelativeTolerance() const { return rtol; }
+	double getAbsoluteTolerance() const { return atol; }
+	/// Set the smallest and largest internal step size, 0 for no limit
+	/** Steps that would have to be smaller than the smallest step size are taken anyway, with a
+	 larger error than the tolerances allow. */
+	void setStepSizeLimits(const double minimum, const double maximum) { hmin = minimum; hmax = maximum; }
+	/// Set wether internal steps may end past the time of a step(), see AdaptiveSolver
+	void setDenseOutput(const bool value) { dense = value; }
+	bool getDenseOutput() const { return dense; }
+	/// Get the size of the next internal step
+	double getStepSize() const { return h; }
+
+	/// Get the number of internal steps taken since init()
+	unsigned long getNumSteps() const { return numsteps; }
+	/// Get the number of internal steps rejected, and retried with a smaller step size, since init()
+	unsigned long getNumRejectedSteps() const { return numrejected; }
+	/// Get the number of calls to ODESystem::stateDerivatives() since init()
+	unsigned long getNumEvaluations() const { return numevaluations; }
+
+	virtual void init(const double t0 = 0)
+	{
+		ODESolver<T>::init(t0);
+		yout = this->y;
+		tout = tprev = t0;
+		h = 0;
+		dydt_valid = false;
+		numsteps = numrejected = numevaluations = 0;
+	}
+
+	/// Continue from the state of the last step(), rather than from the end of the last internal step
+	virtual void restart()
+	{
+		if (this->t != tout) {
+			this->t = tout;
+			this->y = yout;
+		}
+		dydt_valid = false;
+	}
+
+	virtual void step(const double dt)
+	{
+		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
+		const double tend = tout + dt;
+		if (t < tend && !dydt_valid) {
+			ode.stateDerivatives(t, y, dydt);
+			numevaluations++;
+			dydt_valid = true;
+		}
+		if (t < tend && h <= 0)
+			h = initialStepSize(tend - t);
+		bool rejected = false;
+		while (t < tend) {
+			double hstep = (hmax > 0 && h > hmax) ? hmax : h;
+			bool last = !dense && t + hstep >= tend;
+			if (last)
+				hstep = tend - t;
+			double err = attemptStep(hstep);
+			double factor = (err > 0) ? 0.9*pow(err, -1.0/(order+1)) : 5;
+			if (err <= 1 || hstep <= std::max(hmin, 1e-12*std::max(1.0, fabs(t)))) {
+				tprev = t;
+				yprev = y;
+				acceptStep(hstep);
+				t = last ? tend : t + hstep;
+				numsteps++;
+				double hnew = hstep * std::min(rejected ? 1.0 : 5.0, std::max(0.2, factor));
+				// A step shortened to end at tend doesn't limit the next one
+				h = (last && hnew > hstep) ? std::max(h, hnew) : hnew;
+				rejected = false;
+			} else {
+				numrejected++;
+				h = hstep * std::max(0.2, std::min(1.0, factor));
+				rejected = true;
+			}
+		}
+		if (t > tend)
+			interpolate((tend - tprev)/(t - tprev), yout);
+		else
+			yout = y;
+		tout = tend;
+		ode.stateUpdate(tout, yout);
+	}
+
+protected:
+	/// Compute \c ynew, a step of \a hstep from \c t and \c y, and return its scaled error estimate
+	/** The step is accepted if the error is at most 1, see scaledNorm(). \c dydt holds the derivative at \c t. */
+	virtual double attemptStep(const double hstep)=0;
+	/// Take the step computed by the last attemptStep(), i.e. make \c y \c ynew and \c dydt the derivative there
+	/** \c yprev and \c tprev hold the state at the start of the step. */
+	virtual void acceptStep(const double hstep)=0;
+	/// Compute the state at \a theta (from 0 to 1) into the last step taken, into \a result
+	virtual void interpolate(const double theta, T& result)=0;
+
+	/// Get the root mean square of \a v scaled by the tolerances for states \a y1 and \a y2
+	double scaledNorm(const T& v, const T& y1, const T& y2) const
+	{
+		const int n = this->ode.size();
+		double sum = 0;
+		for (int i = 0; i < n; i++) {
+			double scale = atol + rtol*std::max(fabs(stateElement(y1, i)), fabs(stateElement(y2, i)));
+			double e = stateElement(v, i) / scale;
+			sum += e*e;
+		}
+		return n > 0 ? sqrt(sum/n) : 0;
+	}
+
+	/// Guess a step size from the derivatives, as in Hairer, Norsett & Wanner: Solving Ordinary Differential Equations I
+	/** The step is that for which an Euler step would change the states by a small part of the
+	 tolerances, limited by the local change of the derivatives. */
+	double initialStepSize(const double span)
+	{
+		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
+		double d0 = scaledNorm(y, y, y);
+		double d1 = scaledNorm(dydt, y, y);
+		double h0 = (d0 < 1e-5 || d1 < 1e-5) ? 1e-6 : 0.01*d0/d1;
+		h0 = std::min(h0, span);
+		ystage = y + h0*dydt;
+		ode.stateDerivatives(t + h0, ystage, kstage);
+		numevaluations++;
+		kstage -= dydt;
+		double d2 = scaledNorm(kstage, y, y) / h0;
+		double h1 = (std::max(d1, d2) <= 1e-15) ? std::max(1e-6, 1e-3*h0) : pow(0.01/std::max(d1, d2), 1.0/(order+2));
+		double hinit = std::min(100*h0, h1);
+		return (hmax > 0 && hinit > hmax) ? hmax : hinit;
+	}
+
+	T dydt; ///< derivative at the current state
+	T ynew; ///< state at the end of the step attempted last
+	T ystage, kstage; ///< stage state and derivative workspace
+	T yprev; ///< state at the start of the last step taken
+	T yout; ///< state at the time of the last step()
+	int order;
+	double rtol, atol, hmin, hmax;
+	double h; ///< size of the next internal step, 0 to guess one
+	double tprev; ///< time at the start of the last internal step taken
+	double tout; ///< time of the last step()
+	bool dense, dydt_valid;
+	unsigned long numsteps, numrejected, numevaluations;
+};
+
+/// Dormand-Prince 5(4) solver for systems of ordinary differential equations.
+/**
+	Fifth-order steps with an embedded fourth-order error estimate, seven stages of which the last
+	is the derivative at the end of the step, and a fourth-order continuous extension for dense
+	output (Hairer, Norsett & Wanner: Solving Ordinary Differential Equations I). The method used by
+	e.g. ode45 in MATLAB.
+*/
+template <class T>
+class DormandPrinceSolver : public AdaptiveSolver<T>
+{
+public:
+	DormandPrinceSolver(ODESystem<T>& ode)
+	:	AdaptiveSolver<T>(ode, 4),
+		k2(ode.size()), k3(ode.size()), k4(ode.size()), k5(ode.size()), k6(ode.size()), k7(ode.size()),
+		kprev(ode.size()), err(ode.size()), dense5(ode.size()), diff(ode.size()), bspl(ode.size())
+	{
+	}
+	virtual const char* name() { return "DormandPrince"; }
+
+protected:
+	virtual double attemptStep(const double h)
+	{
+		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t; T& k1 = this->dydt; T& ynew = this->ynew;
+		T& ystage = this->ystage;
+		ystage = y + h*(k1/5);
+		ode.stateDerivatives(t + h/5, ystage, k2);
+		ystage = y + h*(3*k1/40 + 9*k2/40);
+		ode.stateDerivatives(t + 3*h/10, ystage, k3);
+		ystage = y + h*(44*k1/45 - 56*k2/15 + 32*k3/9);
+		ode.stateDerivatives(t + 4*h/5, ystage, k4);
+		ystage = y + h*(19372*k1/6561 - 25360*k2/2187 + 64448*k3/6561 - 212*k4/729);
+		ode.stateDerivatives(t + 8*h/9, ystage, k5);
+		ystage = y + h*(9017*k1/3168 - 355*k2/33 + 46732*k3/5247 + 49*k4/176 - 5103*k5/18656);
+		ode.stateDerivatives(t + h, ystage, k6);
+		ynew = y + h*(35*k1/384 + 500*k3/1113 + 125*k4/192 - 2187*k5/6784 + 11*k6/84);
+		ode.stateDerivatives(t + h, ynew, k7);
+		this->numevaluations += 6;
+		err = h*(71*k1/57600 - 71*k3/16695 + 71*k4/1920 - 17253*k5/339200 + 22*k6/525 - k7/40);
+		return this->scaledNorm(err, y, ynew);
+	}
+
+	virtual void acceptStep(const double h)
+	{
+		T& k1 = this->dydt;
+		// Only the last term of the continuous extension needs the inner stages
+		dense5 = h*(-12715105075.0/11282082432*k1 + 87487479700.0/32700410799*k3 - 10690763975.0/1880347072*k4
+			+ 701980252875.0/199316789632*k5 - 1453857185.0/822651844*k6 + 69997945.0/29380423*k7);
+		kprev = k1;
+		k1 = k7;
+		this->y = this->ynew;
+	}
+
+	virtual void interpolate(const double theta, T& result)
+	{
+		const T& y0 = this->yprev; const T& y1 = this->y;
+		const double h = this->t - this->tprev;
+		diff = y1 - y0;
+		bspl = h*kprev - diff;
+		result = y0 + theta*(diff + (1 - theta)*(bspl + theta*((diff - h*this->dydt - bspl) + (1 - theta)*dense5)));
+	}
+
+	T k2, k3, k4, k5, k6, k7;
+	T kprev; ///< derivative at the start of the last step taken
+	T err, dense5;
+	T diff, bspl; ///< interpolation workspace
+};
+
+/// Bogacki-Shampine 3(2) solver for systems of ordinary differential equations.
+/**
+	Third-order steps with an embedded second-order error estimate, four stages of which the last
+	is the derivative at the end of the step, and cubic Hermite interpolation for dense output. The
+	method used by e.g. ode23 in MATLAB, cheaper than DormandPrinceSolver at loose tolerances.
+*/
+template <class T>
+class BogackiShampineSolver : public AdaptiveSolver<T>
+{
+public:
+	BogackiShampineSolver(ODESystem<T>& ode)
+	:	AdaptiveSolver<T>(ode, 2),
+		k2(ode.size()), k3(ode.size()), k4(ode.size()), kprev(ode.size()), err(ode.size())
+	{
+	}
+	virtual const char* name() { return "BogackiShampine"; }
+
+protected:
+	virtual double attemptStep(const double h)
+	{
+		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t; T& k1 = this->dydt; T& ynew = this->ynew;
+		T& ystage = this->ystage;
+		ystage = y + h*(k1/2);
+		ode.stateDerivatives(t + h/2, ystage, k2);
+		ystage = y + h*(3*k2/4);
+		ode.stateDerivatives(t + 3*h/4, ystage, k3);
+		ynew = y + h*(2*k1/9 + k2/3 + 4*k3/9);
+		ode.stateDerivatives(t + h, ynew, k4);
+		this->numevaluations += 3;
+		err = h*(-5*k1/72 + k2/12 + k3/9 - k4/8);
+		return this->scaledNorm(err, y, ynew);
+	}
+
+	virtual void acceptStep(const double h)
+	{
+		kprev = this->dydt;
+		this->dydt = k4;
+		this->y = this->ynew;
+	}
+
+	virtual void interpolate(const double theta, T& result)
+	{
+		const T& y0 = this->yprev; const T& y1 = this->y;
+		const double h = this->t - this->tprev;
+		const double theta2 = theta*theta, theta3 = theta2*theta;
+		result = (2*theta3 - 3*theta2 + 1)*y0 + (theta3 - 2*theta2 + theta)*h*kprev
+			+ (3*theta2 - 2*theta3)*y1 + (theta3 - theta2)*h*this->dydt;
+	}
+
+	T k2, k3, k4;
+	T kprev; ///< derivative at the start of the last step taken
+	T err;
+};
+
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef NUMERIX_BATCHSOLVERS_H
+#define NUMERIX_BATCHSOLVERS_H
+
+#include <string>
+
+namespace numerix {
+
+/// Interface for a batch of dynamic systems of the same dimension, solved together by a BatchSolver.
+/**
+	The states of the batch are a block with one row per system and one column per state variable,
+	e.g. an \c Eigen::MatrixXd of batchSize() x size(). Stored column-major, each state variable of
+	all systems is contiguous (structure of arrays), so that derivatives can be computed for all
+	systems at once, e.g. \f$ \dot Y = Y A^T + U B^T \f$ as matrix products for linear systems.
+*/
+template <class T>
+class BatchODESystem
+{
+public:
+	virtual ~BatchODESystem() {}
+	/// Compute the initial states of all systems into \a y0
+	virtual void stateInitials(const double t0, T& y0) = 0;
+	/// Compute the state derivatives of all systems into \a dydt
+	virtual void stateDerivatives(const double t, const T& y, T& dydt) = 0;
+	/// Return number of state variables of each system
+	virtual int size() const = 0;
+	/// Return number of systems
+	virtual int batchSize() const = 0;
+	/// New states passed by the solver after each step
+	virtual void stateUpdate(const double t, const T& y) = 0;
+};
+
+/// Base class for a solver for a batch of systems of ordinary differential equations, see BatchODESystem.
+/**
+	The counterpart of ODESolver, stepping the states of all systems of the batch at once. Stage
+	blocks are members, so that stepping doesn't allocate.
+*/
+template <class T>
+class BatchSolver
+{
+public:
+	BatchSolver(BatchODESystem<T>& odenew) : ode(odenew), t(0), y(odenew.batchSize(), odenew.size()) {}
+	virtual ~BatchSolver() {}
+	/// Return a name that can be used to refer to this solver class
+	virtual const char* name()=0;
+	/// Initializes the solver
+	virtual void init(const double t0 = 0)
+	{
+		t = t0;
+		ode.stateInitials(t0, y);
+		ode.stateUpdate(t, y);
+	}
+	/// Steps the solution of all systems the specified time
+	virtual void step(const double dt)=0;
+	BatchODESystem<T>& system() { return ode; }
+
+protected:
+	/// A block the size of the states
+	T block() { return T(ode.batchSize(), ode.size()); }
+
+	BatchODESystem<T>& ode;
+	double t;
+	T y;
+};
+
+/// First order Runge-Kutta (Euler's method) solver for a batch of systems, see EulerSolver
+template <class T>
+class BatchEulerSolver : public BatchSolver<T>
+{
+public:
+	BatchEulerSolver(BatchODESystem<T>& ode) : BatchSolver<T>(ode), k1(this->block()) {}
+	virtual const char* name() { return "Euler"; }
+	virtual void step(const double dt)
+	{
+		BatchODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
+		ode.stateDerivatives(t, y, k1);
+		y += dt*k1;
+		t += dt;
+		ode.stateUpdate(t, y);
+	}
+protected:
+	T k1;
+};
+
+/// Second order Runge-Kutta (Heun's method) solver for a batch of systems, see HeunSolver and MidpointSolver
+template <class T>
+class BatchHeunSolver : public BatchSolver<T>
+{
+public:
+	BatchHeunSolver(BatchODESystem<T>& ode) : BatchSolver<T>(ode), k1(this->block()), k2(this->block()), ystage(this->block()) {}
+	virtual const char* name() { return "Heun"; }
+	virtual void step(const double dt)
+	{
+		BatchODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
+		ode.stateDerivatives(t, y, k1);
+		ystage = y + (0.5*dt)*k1;
+		ode.stateDerivatives(t + 0.5*dt, ystage, k2);
+		y += dt*k2;
+		t += dt;
+		ode.stateUpdate(t, y);
+	}
+protected:
+	T k1, k2, ystage;
+};
+
+/// Third-order Runge-Kutta solver for a batch of systems, see RK3Solver
+template <class T>
+class BatchRK3Solver : public BatchSolver<T>
+{
+public:
+	BatchRK3Solver(BatchODESystem<T>& ode) : BatchSolver<T>(ode), k1(this->block()), k2(this->block()), k3(this->block()), ystage(this->block()) {}
+	virtual const char* name() { return "RK3"; }
+	virtual void step(const double dt)
+	{
+		BatchODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
+		ode.stateDerivatives(t, y, k1);
+		ystage = y + (0.5*dt)*k1;
+		ode.stateDerivatives(t + 0.5*dt, ystage, k2);
+		ystage = y - dt*k1 + (2.0*dt)*k2;
+		ode.stateDerivatives(t + dt, ystage, k3);
+		y += (dt/6.0)*(k1 + 4.0*k2 + k3);
+		t += dt;
+		ode.stateUpdate(t, y);
+	}
+protected:
+	T k1, k2, k3, ystage;
+};
+
+/// Fourth-order Runge-Kutta solver for a batch of systems, see RK4Solver
+template <class T>
+class BatchRK4Solver : public BatchSolver<T>
+{
+public:
+	BatchRK4Solver(BatchODESystem<T>& ode) : BatchSolver<T>(ode), k1(this->block()), k2(this->block()), k3(this->block()), k4(this->block()), ystage(this->block()) {}
+	virtual const char* name() { return "RK4"; }
+	virtual void step(const double dt)
+	{
+		BatchODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
+		ode.stateDerivatives(t, y, k1);
+		ystage = y + (0.5*dt)*k1;
+		ode.stateDerivatives(t + 0.5*dt, ystage, k2);
+		ystage = y + (0.5*dt)*k2;
+		ode.stateDerivatives(t + 0.5*dt, ystage, k3);
+		ystage = y + dt*k3;
+		ode.stateDerivatives(t + dt, ystage, k4);
+		y += (dt/6.0)*(k1 + 2.0*k2 + 2.0*k3 + k4);
+		t += dt;
+		ode.stateUpdate(t, y);
+	}
+protected:
+	T k1, k2, k3, k4, ystage;
+};
+
+/// Creates batch solvers by the names of SolverFactory, for the methods that have a batch version
+template <class T>
+class BatchSolverFactory
+{
+public:
+	static BatchSolver<T>* create(const std::string& name, BatchODESystem<T>& system) {
+		if (name == "euler")
+			return new BatchEulerSolver<T>(system);
+		else if (name == "heun" || name == "midpoint")
+			return new BatchHeunSolver<T>(system);
+		else if (name == "rk3")
+			return new BatchRK3Solver<T>(system);
+		else if (name == "rk4")
+			return new BatchRK4Solver<T>(system);
+		return NULL;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef NUMERIX_IMPLICITSOLVERS_H
+#define NUMERIX_IMPLICITSOLVERS_H
+
+#include "ODESolver.h"
+#include <Eigen/LU>
+#include <math.h>
+#include <algorithm>
+
+namespace numerix
+{
+
+/// Invert \a m into \a inverse by Gaussian elimination with partial pivoting, returns false if singular
+template <class M>
+inline bool invertMatrix(const M& m, M& inverse)
+{
+	Eigen::Inverse<M, true> result(m);
+	if (!result.exists())
+		return false;
+	inverse = result;
+	return true;
+}
+inline bool invertMatrix(const double& m, double& inverse)
+{
+	if (m == 0)
+		return false;
+	inverse = 1/m;
+	return true;
+}
+
+/// \a result = \a m * \a v, evaluated into \a result without a temporary
+template <class M, class T>
+inline void multiplyInto(T& result, const M& m, const T& v) { result = (m*v).lazy(); }
+inline void multiplyInto(double& result, const double& m, const double& v) { result = m*v; }
+
+/// Base class for implicit solvers, for stiff systems that explicit solvers need very small steps to keep stable.
+/**
+	The implicit equations of each step are linear in the iteration matrix \f$ I - \gamma h J \f$,
+	where \e J is the Jacobian of the system. The Jacobian is taken from ODESystem::stateJacobian(),
+	or approximated by finite differences if the system doesn't implement it, and is reused for
+	setJacobianInterval() steps. The iteration matrix is factorized (inverted) only when the
+	Jacobian or the step size has changed, so a linear system stepped with a constant step size
+	factorizes once.
+
+	Past states stay valid when the system changes other than through its states, so restart()
+	does nothing; Jacobians that have changed are picked up when the Newton iteration doesn't converge.
+*/
+template <class T>
+class ImplicitSolver : public ODESolver<T>
+{
+public:
+	typedef JacobianTraits<T> Traits;
+	typedef typename Traits::Matrix Matrix;
+
+	ImplicitSolver(ODESystem<T>& ode)
+	:	ODESolver<T>(ode),
+		jacobian(Traits::zero(ode.size())),
+		newjacobian(Traits::zero(ode.size())),
+		iteration(Traits::identity(ode.size())),
+		f(ode.size()),
+		fbase(ode.size()),
+		yperturbed(ode.size()),
+		residual(ode.size()),
+		delta(ode.size()),
+		z(ode.size()),
+		tolerance(1e-8),
+		maxiterations(8),
+		jacobian_interval(20),
+		jacobian_age(0),
+		gamma(0),
+		jacobian_valid(false),
+		factor_valid(false),
+		analytic(false),
+		numevaluations(0),
+		numjacobians(0),
+		numfactorizations(0),
+		numiterations(0),
+		numfailures(0)
+	{
+	}
+
+	/// Set the number of steps a Jacobian is used for before it is computed again
+	void setJacobianInterval(const unsigned int steps) { jacobian_interval = std::max(steps, 1u); }
+	unsigned int getJacobianInterval() const { return jacobian_interval; }
+	/// Set the tolerance of the Newton iteration, relative to the states (and absolute for states smaller than 1)
+	void setNewtonTolerance(const double value) { tolerance = value; }
+	/// Set the number of Newton iterations before the Jacobian is recomputed, or the step accepted as is
+	void setMaxNewtonIterations(const unsigned int value) { maxiterations = std::max(value, 1u); }
+
+	/// Get the number of calls to ODESystem::stateDerivatives() since init()
+	unsigned long getNumEvaluations() const { return numevaluations; }
+	/// Get the number of Jacobians computed since init()
+	unsigned long getNumJacobians() const { return numjacobians; }
+	/// Get the number of factorizations of the iteration matrix since init()
+	unsigned long getNumFactorizations() const { return numfactorizations; }
+	/// Get the number of Newton iterations since init()
+	unsigned long getNumNewtonIterations() const { return numiterations; }
+	/// Get the number of steps whose Newton iteration didn't converge since init()
+	unsigned long getNumConvergenceFailures() const { return numfailures; }
+	/// Returns true if the Jacobian is taken from ODESystem::stateJacobian()
+	bool isJacobianAnalytic() const { return analytic; }
+
+	virtual void init(const double t0 = 0)
+	{
+		ODESolver<T>::init(t0);
+		jacobian_valid = false;
+		factor_valid = false;
+		numevaluations = numjacobians = numfactorizations = numiterations = numfailures = 0;
+	}
+
+protected:
+	/// Compute the Jacobian at the current state if it is due, \a f0 is the derivative there if known
+	void updateJacobian(const T* f0 = NULL, const bool force = false)
+	{
+		if (jacobian_valid && !force && jacobian_age < jacobian_interval) {
+			jacobian_age++;
+			return;
+		}
+		ODESystem<T>& ode = this->ode; const T& y = this->y; const double t = this->t;
+		const int n = ode.size();
+		numjacobians++;
+		jacobian_valid = true;
+		jacobian_age = 1;
+		analytic = ode.stateJacobian(t, y, newjacobian);
+		if (!analytic) {
+			if (!f0) {
+				ode.stateDerivatives(t, y, fbase);
+				numevaluations++;
+				f0 = &fbase;
+			}
+			for (int j = 0; j < n; j++) {
+				yperturbed = y;
+				stateElement(yperturbed, j) += 1.5e-8 * std::max(1.0, fabs(stateElement(y, j)));
+				const double d = stateElement(yperturbed, j) - stateElement(y, j);
+				ode.stateDerivatives(t, yperturbed, f);
+				numevaluations++;
+				for (int i = 0; i < n; i++)
+					Traits::element(newjacobian, i, j) = (stateElement(f, i) - stateElement(*f0, i)) / d;
+			}
+		}
+		for (int i = 0; i < n && factor_valid; i++)
+			for (int j = 0; j < n && factor_valid; j++)
+				factor_valid = (Traits::element(newjacobian, i, j) == Traits::element(jacobian, i, j));
+		jacobian = newjacobian;
+	}
+
+	/// Make \c iteration the inverse of \f$ I - g J \f$, unless it already is
+	void factorize(const double g)
+	{
+		if (factor_valid && g == gamma)
+			return;
+		// Singular only if 1/g is an eigenvalue of the Jacobian, then fall back on fixed-point iteration
+		if (!invertMatrix(Matrix(Traits::identity(this->ode.size()) - g*jacobian), iteration))
+			iteration = Traits::identity(this->ode.size());
+		gamma = g;
+		factor_valid = true;
+		numfactorizations++;
+	}
+
+	/// Solve \f$ z = r + g f(t_1, z) \f$ by Newton iteration from the guess in \c z, returns false if it didn't converge
+	bool solve(const double t1, const T& r, const double g)
+	{
+		ODESystem<T>& ode = this->ode;
+		const int n = ode.size();
+		factorize(g);
+		for (int pass = 0; pass < 2; pass++) {
+			for (unsigned int k = 0; k < maxiterations; k++) {
+				ode.stateDerivatives(t1, z, f);
+				numevaluations++;
+				numiterations++;
+				residual = r + g*f - z;
+				multiplyInto(delta, iteration, residual);
+				z += delta;
+				// A single iteration with the exact Jacobian solves linear systems
+				if (analytic && ode.isLinear())
+					return true;
+				double sum = 0;
+				for (int i = 0; i < n; i++) {
+					double e = stateElement(delta, i) / (tolerance * std::max(1.0, fabs(stateElement(z, i))));
+					sum += e*e;
+				}
+				if (sum <= n)
+					return true;
+			}
+			// Retry with a new Jacobian, unless it is from this step
+			if (jacobian_age <= 1)
+				break;
+			updateJacobian(NULL, true);
+			factorize(g);
+		}
+		numfailures++;
+		return false;
+	}
+
+	Matrix jacobian, newjacobian;
+	Matrix iteration; ///< inverse of the iteration matrix
+	T f, fbase, yperturbed, residual, delta; ///< workspace, so that steps don't allocate
+	T z; ///< unknown of solve()
+	double tolerance;
+	unsigned int maxiterations, jacobian_interval, jacobian_age;
+	double gamma; ///< \e g of the factorized iteration matrix
+	bool jacobian_valid, factor_valid, analytic;
+	unsigned long numevaluations, numjacobians, numfactorizations, numiterations, numfailures;
+};
+
+/// Backward (implicit) Euler solver for stiff systems of ordinary differential equations.
+/**
+	First order and L-stable, \f$ y_{n+1} = y_n + h f(t_{n+1}, y_{n+1}) \f$.
+*/
+template <class T>
+class BackwardEulerSolver : public ImplicitSolver<T>
+{
+public:
+	BackwardEulerSolver(ODESystem<T>& ode) : ImplicitSolver<T>(ode) {}
+	virtual const char* name() { return "BackwardEuler"; }
+
+	virtual void step(const double dt)
+	{
+		T& y = this->y; double& t = this->t; T& z = this->z;
+		this->updateJacobian();
+		z = y;
+		this->solve(t + dt, y, dt);
+		y = z;
+		t += dt;
+		this->ode.stateUpdate(t, y);
+	}
+};
+
+/// Second-order backward differentiation formula solver for stiff systems of ordinary differential equations.
+/**
+	\f$ y_{n+1} = \frac{(1+\omega)^2}{1+2\omega} y_n - \frac{\omega^2}{1+2\omega} y_{n-1} + h \frac{1+\omega}{1+2\omega} f(t_{n+1}, y_{n+1}) \f$,
+	with \f$ \omega = h_n / h_{n-1} \f$ for varying step sizes. The first step is a backward Euler step.
+*/
+template <class T>
+class BDF2Solver : public ImplicitSolver<T>
+{
+public:
+	BDF2Solver(ODESystem<T>& ode) : ImplicitSolver<T>(ode), yprev(ode.size()), rhs(ode.size()), hprev(0) {}
+	virtual const char* name() { return "BDF2"; }
+
+	virtual void init(const double t0 = 0)
+	{
+		ImplicitSolver<T>::init(t0);
+		hprev = 0;
+	}
+
+	virtual void step(const double dt)
+	{
+		T& y = this->y; double& t = this->t; T& z = this->z;
+		this->updateJacobian();
+		if (hprev > 0) {
+			const double w = dt/hprev;
+			rhs = ((1 + w)*(1 + w)/(1 + 2*w))*y - (w*w/(1 + 2*w))*yprev;
+			z = y + w*(y - yprev);
+			this->solve(t + dt, rhs, dt*(1 + w)/(1 + 2*w));
+		} else {
+			z = y;
+			this->solve(t + dt, y, dt);
+		}
+		yprev = y;
+		hprev = dt;
+		y = z;
+		t += dt;
+		this->ode.stateUpdate(t, y);
+	}
+
+protected:
+	T yprev; ///< state before the last step
+	T rhs;
+	double hprev; ///< size of the last step, 0 before the first one
+};
+
+/// Rosenbrock-W solver for stiff systems of ordinary differential equations.
+/**
+	The second-order, L-stable ROS2 method of Verwer et al. (SIAM J. Sci. Comput. 20, 1999), which
+	solves two linear systems per step rather than iterating:
+	\f[ (I - \gamma h J) k_1 = f(t_n, y_n) + \gamma h f_t \f]
+	\f[ (I - \gamma h J) k_2 = f(t_n + h, y_n + h k_1) - \gamma h f_t - 2 k_1 \f]
+	\f[ y_{n+1} = y_n + \frac{3}{2} h k_1 + \frac{1}{2} h k_2 \f]
+	with \f$ \gamma = 1 + 1/\sqrt 2 \f$. Being a W-method it keeps its order with an approximate or
+	outdated Jacobian, which is what makes reusing it over setJacobianInterval() steps safe. The time
+	derivative \f$ f_t \f$ is approximated by a finite difference, unless the system is autonomous
+	(ODESystem::isAutonomous()), as it is needed for stiff non-autonomous systems to keep the order.
+*/
+template <class T>
+class RosenbrockWSolver : public ImplicitSolver<T>
+{
+public:
+	RosenbrockWSolver(ODESystem<T>& ode) : ImplicitSolver<T>(ode), k1(ode.size()), k2(ode.size()), ft(ode.size()) {}
+	virtual const char* name() { return "RosenbrockW"; }
+
+	virtual void step(const double dt)
+	{
+		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t; T& f = this->f;
+		T& f0 = this->fbase; T& r = this->residual; T& ystage = this->yperturbed;
+		const double gamma = 1 + 1/sqrt(2.0);
+		ode.stateDerivatives(t, y, f0);
+		this->numevaluations++;
+		this->updateJacobian(&f0);
+		this->factorize(gamma*dt);
+		if (ode.isAutonomous()) {
+			multiplyInto(k1, this->iteration, f0);
+			ystage = y + dt*k1;
+			ode.stateDerivatives(t + dt, ystage, f);
+			r = f - 2*k1;
+		} else {
+			const double dtime = 1.5e-8 * std::max(1.0, fabs(t));
+			ode.stateDerivatives(t + dtime, y, ft);
+			ft = (ft - f0) / dtime;
+			this->numevaluations++;
+			r = f0 + (gamma*dt)*ft;
+			multiplyInto(k1, this->iteration, r);
+			ystage = y + dt*k1;
+			ode.stateDerivatives(t + dt, ystage, f);
+			r = f - (gamma*dt)*ft - 2*k1;
+		}
+		multiplyInto(k2, this->iteration, r);
+		this->numevaluations++;
+		y += dt*(1.5*k1 + 0.5*k2);
+		t += dt;
+		ode.stateUpdate(t, y);
+	}
+
+protected:
+	T k1, k2;
+	T ft; ///< time derivative of the state derivatives
+};
+
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef NUMERIX_MATRIXEXPONENTIAL_H
+#define NUMERIX_MATRIXEXPONENTIAL_H
+
+#include <Eigen/Core>
+#include <Eigen/LU>
+#include <math.h>
+
+namespace numerix {
+
+/// Compute the exponential \f$ e^a \f$ of the square matrix \a a into \a result, returns false if it can't be computed
+/**
+	Scaling and squaring with a (6,6) Padé approximant (Golub & Van Loan, Matrix Computations,
+	algorithm 11.3.1): \a a is scaled by \f$ 2^{-s} \f$ to a norm of at most 1/2, where the
+	approximant is accurate to double precision, and the result is squared \e s times.
+*/
+template <class M>
+bool matrixExponential(const M& a, M& result)
+{
+	typedef typename M::Scalar Scalar;
+	const int n = a.rows();
+	double norm = 0;
+	for (int i = 0; i < n; i++) {
+		double sum = 0;
+		for (int j = 0; j < n; j++)
+			sum += fabs(a(i,j));
+		if (sum > norm)
+			norm = sum;
+	}
+	if (!(norm < HUGE_VAL))
+		return false;
+	int squarings = 0;
+	if (norm > 0.5)
+		squarings = (int) ceil(log(norm / 0.5) / log(2.0));
+	const M x = a * Scalar(1.0 / pow(2.0, squarings));
+
+	const int q = 6;
+	double c = 0.5;
+	M power = x;
+	M numerator = M::identity(n, n) + Scalar(c)*x;
+	M denominator = M::identity(n, n) - Scalar(c)*x;
+	for (int k = 2; k <= q; k++) {
+		c *= double(q - k + 1) / (k * (2*q - k + 1));
+		power = x * power;
+		numerator += Scalar(c) * power;
+		if (k % 2 == 0)
+			denominator += Scalar(c) * power;
+		else
+			denominator -= Scalar(c) * power;
+	}
+	Eigen::Inverse<M, true> inverse(denominator);
+	if (!inverse.exists())
+		return false;
+	result = (M(inverse) * numerator).lazy();
+	for (int k = 0; k < squarings; k++)
+		result = result * result;
+	return true;
+}
+
+}
+
+#endif
@@ -1,8 +1,39 @@
 #ifndef NUMERIX_ODESOLVER_H
 #define NUMERIX_ODESOLVER_H
 
+#include <Eigen/Core>
+
 namespace numerix {
 
+/// Element \a i of a state vector
+template <class T>
+inline double stateElement(const T& v, const int i) { return v[i]; }
+template <class T>
+inline typename T::Scalar& stateElement(T& v, const int i) { return v[i]; }
+/// The state itself, for systems with a scalar state
+inline double stateElement(const double& v, const int i) { return v; }
+inline double& stateElement(double& v, const int i) { return v; }
+
+/// Type of the Jacobian matrix of a system with a state vector of type \a T
+template <class T>
+struct JacobianTraits
+{
+	typedef Eigen::Matrix<typename T::Scalar, T::RowsAtCompileTime, T::RowsAtCompileTime> Matrix;
+	static Matrix zero(const int n) { Matrix m(n, n); m.setZero(); return m; }
+	static Matrix identity(const int n) { return Matrix::identity(n, n); }
+	static typename T::Scalar& element(Matrix& m, const int i, const int j) { return m(i, j); }
+};
+
+/// A 1x1 Jacobian for systems with a scalar state
+template <>
+struct JacobianTraits<double>
+{
+	typedef double Matrix;
+	static Matrix zero(const int n) { return 0; }
+	static Matrix identity(const int n) { return 1; }
+	static double& element(Matrix& m, const int i, const int j) { return m; }
+};
+
 /// Interface for a dynamic system that can be solved using an ODESolver. 
 template <class T>
 class ODESystem
@@ -12,24 +43,41 @@ public:
 	virtual T stateInitials(const double t0) const = 0;
 	/// Compute state derivatives vector (\f$\dot y\f$)
 	virtual T stateDerivatives(const double t, const T& y) = 0;
+	/// Compute state derivatives vector into \a dydt, a vector of size() that solvers keep between steps
+	/** Defaults to assigning stateDerivatives(t, y). Systems with dynamically sized state vectors
+	 override this to evaluate in place, so that stepping them doesn't allocate. */
+	virtual void stateDerivatives(const double t, const T& y, T& dydt) { dydt = stateDerivatives(t, y); }
 	/// Return number of state variables
 	virtual int size() const = 0;
 	/// New state vector passed by the solver after each step
 	virtual void stateUpdate(const double t, const T& y) = 0;
+	/// Compute the Jacobian of the state derivatives with respect to the states (\f$\partial \dot y / \partial y\f$)
+	/** Returns false if not implemented (the default), in which case implicit solvers approximate it by finite differences. */
+	virtual bool stateJacobian(const double t, const T& y, typename JacobianTraits<T>::Matrix& jacobian) { return false; }
+	/// Return true if the state derivatives are affine in the states, with the Jacobian from stateJacobian()
+	/** Implicit solvers then solve each step with a single Newton iteration. */
+	virtual bool isLinear() const { return false; }
+	/// Return true if the state derivatives don't depend on time other than through the states
+	/** Rosenbrock solvers then don't need the time derivative. */
+	virtual bool isAutonomous() const { return false; }
 };
 
 /// Base class for a solver for ordinary differential equations.
 /**
 	Provides a numerical solution for systems of first-order differential equations
 	on the form \f$ \dot y = f(t,y) \f$. The template implementation allows the user to
-	specify a state vector of desired precision and type (e.g. \c float[],
-	\c std::vector<double>, \c Eigen::Vector4d, \c Eigen::MatrixXd(75,1)).
+	specify a state vector of desired precision and type (e.g. \c Eigen::Vector4d,
+	\c Eigen::VectorXd(75), \c double).
+
+	Solvers keep their stage vectors as members and combine them with expressions that Eigen
+	evaluates without temporaries, so stepping doesn't allocate memory once constructed.
 */
 template <class T>
 class ODESolver
 {
 public:
 	ODESolver(ODESystem<T>& odenew) : ode(odenew), t(0), y(odenew.size()) {}
+	virtual ~ODESolver() {}
 	/// Return a name that can be used to refer to this solver class
 	virtual const char* name()=0;
 	/// Initializes the solver
@@ -41,6 +89,9 @@ public:
 	}
 	/// Steps the solution the specified time
 	virtual void step(const double dt)=0;
+	/// Continue from the current state as if it were initial, e.g. when the system has changed other than through its states
+	/** Solvers that carry information between steps (see AdaptiveSolver) drop it here. */
+	virtual void restart() {}
 	ODESystem<T>& system() { return ode; }
 
 protected:
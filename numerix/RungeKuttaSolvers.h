@@ -11,15 +11,18 @@ template <class T>
 class EulerSolver : public ODESolver<T>
 {
 public:
-	EulerSolver(ODESystem<T>& ode) : ODESolver<T>(ode) {}
+	EulerSolver(ODESystem<T>& ode) : ODESolver<T>(ode), k1(ode.size()) {}
 	virtual const char* name() { return "Euler"; }
 	virtual void step(const double dt)
 	{
 		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
-		y = y + dt * ode.stateDerivatives(t, y);
+		ode.stateDerivatives(t, y, k1);
+		y += dt*k1;
 		t += dt;
 		ode.stateUpdate(t, y);
 	}
+protected:
+	T k1;
 };
 
 
@@ -28,20 +31,20 @@ template <class T>
 class HeunSolver : public ODESolver<T>
 {
 public:
-	HeunSolver(ODESystem<T>& ode) : ODESolver<T>(ode) {}
+	HeunSolver(ODESystem<T>& ode) : ODESolver<T>(ode), k1(ode.size()), k2(ode.size()), ystage(ode.size()) {}
 	virtual const char* name() { return "Heun"; }
 	virtual void step(const double dt)
 	{
 		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
-		T	k1(ode.size()), 
-			k2(ode.size()); 
-			
-		k1 = ode.stateDerivatives(t, y);
-		k2 = ode.stateDerivatives(t + 0.5*dt, y + 0.5*k1*dt);
-		y = y + k2*dt;
+		ode.stateDerivatives(t, y, k1);
+		ystage = y + (0.5*dt)*k1;
+		ode.stateDerivatives(t + 0.5*dt, ystage, k2);
+		y += dt*k2;
 		t += dt;
 		ode.stateUpdate(t, y);
 	}
+protected:
+	T k1, k2, ystage;
 };
 
 /// Third-order Runge-Kutta solver for systems of ordinary differential equations.
@@ -49,22 +52,22 @@ template <class T>
 class RK3Solver : public ODESolver<T>
 {
 public:
-	RK3Solver(ODESystem<T>& ode) : ODESolver<T>(ode) {}
+	RK3Solver(ODESystem<T>& ode) : ODESolver<T>(ode), k1(ode.size()), k2(ode.size()), k3(ode.size()), ystage(ode.size()) {}
 	virtual const char* name() { return "RK3"; }
 	virtual void step(const double dt)
 	{
 		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
-		T	k1(ode.size()), 
-			k2(ode.size()), 
-			k3(ode.size());
-				
-		k1 = ode.stateDerivatives(t, y);
-		k2 = ode.stateDerivatives(t + 0.5*dt, y + 0.5*k1*dt);
-		k3 = ode.stateDerivatives(t + dt, y - k1*dt + 2.0*k2*dt);
-		y = y + (k1 + 4.0*k2 + k3) / 6.0 * dt;
+		ode.stateDerivatives(t, y, k1);
+		ystage = y + (0.5*dt)*k1;
+		ode.stateDerivatives(t + 0.5*dt, ystage, k2);
+		ystage = y - dt*k1 + (2.0*dt)*k2;
+		ode.stateDerivatives(t + dt, ystage, k3);
+		y += (dt/6.0)*(k1 + 4.0*k2 + k3);
 		t += dt;
 		ode.stateUpdate(t, y);
 	}
+protected:
+	T k1, k2, k3, ystage;
 };
 
 /// Fourth-order Runge-Kutta solver for systems of ordinary differential equations.
@@ -72,40 +75,44 @@ template <class T>
 class RK4Solver : public ODESolver<T>
 {
 public:
-	RK4Solver(ODESystem<T>& ode) : ODESolver<T>(ode) {}
+	RK4Solver(ODESystem<T>& ode) : ODESolver<T>(ode), k1(ode.size()), k2(ode.size()), k3(ode.size()), k4(ode.size()), ystage(ode.size()) {}
 	virtual const char* name() { return "RK4"; }
 	virtual void step(const double dt)
 	{
 		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
-		/// \todo should these vectors be members instead to hinder allocation/deallocation every step? (same for Heun and RK3)
-		T	k1(ode.size()), 
-			k2(ode.size()), 
-			k3(ode.size()), 
-			k4(ode.size());
-			
-		k1 = ode.stateDerivatives(t, y);
-		k2 = ode.stateDerivatives(t + 0.5*dt, y + 0.5*k1*dt);
-		k3 = ode.stateDerivatives(t + 0.5*dt, y + 0.5*k2*dt);
-		k4 = ode.stateDerivatives(t + dt, y + k3*dt);
-		y = y + (k1 + 2.0*k2 + 2.0*k3 + k4) / 6.0 * dt;
+		ode.stateDerivatives(t, y, k1);
+		ystage = y + (0.5*dt)*k1;
+		ode.stateDerivatives(t + 0.5*dt, ystage, k2);
+		ystage = y + (0.5*dt)*k2;
+		ode.stateDerivatives(t + 0.5*dt, ystage, k3);
+		ystage = y + dt*k3;
+		ode.stateDerivatives(t + dt, ystage, k4);
+		y += (dt/6.0)*(k1 + 2.0*k2 + 2.0*k3 + k4);
 		t += dt;
 		ode.stateUpdate(t, y);
 	}
+protected:
+	T k1, k2, k3, k4, ystage;
 };
 
 template <class T>
 class MidpointSolver : public ODESolver<T>
 {
 public:
-	MidpointSolver(ODESystem<T>& ode) : ODESolver<T>(ode) {}
+	MidpointSolver(ODESystem<T>& ode) : ODESolver<T>(ode), k1(ode.size()), k2(ode.size()), ystage(ode.size()) {}
 	virtual const char* name() { return "Midpoint"; }
 	virtual void step(const double dt)
 	{
 		ODESystem<T>& ode = this->ode; T& y = this->y; double& t = this->t;
-		y = y + dt * ode.stateDerivatives(t + dt/2, y + dt/2*ode.stateDerivatives(t, y) );
+		ode.stateDerivatives(t, y, k1);
+		ystage = y + (dt/2)*k1;
+		ode.stateDerivatives(t + dt/2, ystage, k2);
+		y += dt*k2;
 		t += dt;
 		ode.stateUpdate(t, y);
 	}
+protected:
+	T k1, k2, ystage;
 };
 
 } // namespace sbxNumerics
@@ -2,9 +2,13 @@
 #define NUMERIX_SOLVERFACTORY_H
 
 #include "RungeKuttaSolvers.h"
+#include "AdaptiveRungeKuttaSolvers.h"
+#include "ImplicitSolvers.h"
+#include <string>
 
 namespace numerix {
 
+/// Creates solvers by name, which is also the lower case name() of each solver
 template <class T>
 class SolverFactory
 {
@@ -20,6 +24,16 @@ public:
 			return new RK4Solver<T>(system);
 		else if (name == "midpoint")
 			return new MidpointSolver<T>(system);
+		else if (name == "dopri5" || name == "dormandprince")
+			return new DormandPrinceSolver<T>(system);
+		else if (name == "bs23" || name == "bogackishampine")
+			return new BogackiShampineSolver<T>(system);
+		else if (name == "backwardeuler")
+			return new BackwardEulerSolver<T>(system);
+		else if (name == "bdf2")
+			return new BDF2Solver<T>(system);
+		else if (name == "ros2" || name == "rosenbrockw")
+			return new RosenbrockWSolver<T>(system);
 		return NULL;
 	}
 };
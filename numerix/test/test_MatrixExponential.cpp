@@ -0,0 +1,62 @@
+#include <UnitTest++/UnitTest++.h>
+#include <numerix/MatrixExponential.h>
+#include <Eigen/Core>
+#include <math.h>
+
+using namespace numerix;
+using namespace Eigen;
+
+TEST(MatrixExponentialDiagonal)
+{
+	Matrix3d a, e;
+	a.setZero();
+	a(0,0) = 0;
+	a(1,1) = -2.5;
+	a(2,2) = 40; // needs scaling and squaring
+	CHECK(matrixExponential(a, e));
+	CHECK_CLOSE(1, e(0,0), 1e-14);
+	CHECK_CLOSE(1, exp(-2.5) / e(1,1), 1e-13);
+	CHECK_CLOSE(1, exp(40.0) / e(2,2), 1e-12);
+	CHECK_CLOSE(0, e(0,1), 1e-14);
+	CHECK_CLOSE(0, e(2,1), 1e-14);
+}
+
+TEST(MatrixExponentialRotation)
+{
+	// The exponential of a skew symmetric matrix is a rotation
+	const double angles[] = {0.1, 1, 10, 100};
+	for (int i = 0; i < 4; i++) {
+		Matrix2d a, e;
+		a << 0, -angles[i],
+			angles[i], 0;
+		CHECK(matrixExponential(a, e));
+		CHECK_CLOSE(cos(angles[i]), e(0,0), 1e-10);
+		CHECK_CLOSE(-sin(angles[i]), e(0,1), 1e-10);
+		CHECK_CLOSE(sin(angles[i]), e(1,0), 1e-10);
+		CHECK_CLOSE(cos(angles[i]), e(1,1), 1e-10);
+	}
+}
+
+TEST(MatrixExponentialNilpotent)
+{
+	// The series of a nilpotent matrix ends, e^a = I + a + a^2/2
+	Matrix3d a, e;
+	a << 0, 3, 1,
+		0, 0, 2,
+		0, 0, 0;
+	CHECK(matrixExponential(a, e));
+	CHECK_CLOSE(1, e(0,0), 1e-14);
+	CHECK_CLOSE(3, e(0,1), 1e-13);
+	CHECK_CLOSE(1 + 3*2/2.0, e(0,2), 1e-13);
+	CHECK_CLOSE(2, e(1,2), 1e-13);
+	CHECK_CLOSE(0, e(1,0), 1e-14);
+	CHECK_CLOSE(1, e(2,2), 1e-14);
+}
+
+TEST(MatrixExponentialNotFinite)
+{
+	Matrix2d a, e;
+	a.setZero();
+	a(0,1) = HUGE_VAL;
+	CHECK(!matrixExponential(a, e));
+}
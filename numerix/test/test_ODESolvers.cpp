@@ -1,9 +1,14 @@
 #include <UnitTest++/UnitTest++.h>
 #include <numerix/RungeKuttaSolvers.h>
+#include <numerix/AdaptiveRungeKuttaSolvers.h>
+#include <numerix/ImplicitSolvers.h>
+#include <numerix/SolverFactory.h>
 #include <sbx/Timer.h>
 #include <sbx/Log.h>
 #include <math.h>
+#include <stdlib.h>
 #include <iostream>
+#include <new>
 #include <map>
 #include <string>
 #include <vector>
@@ -13,6 +18,24 @@ using namespace sbx;
 using namespace numerix;
 using namespace Eigen;
 
+// Count heap allocations while counting is enabled, for checking that solvers don't allocate while stepping
+static bool count_allocations = false;
+static unsigned long num_allocations = 0;
+
+void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+	if (count_allocations)
+		num_allocations++;
+	void* ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](std::size_t size) throw(std::bad_alloc) { return operator new(size); }
+void operator delete(void* ptr) throw() { free(ptr); }
+void operator delete[](void* ptr) throw() { free(ptr); }
+
 template <class T>
 class TestODESystem : public ODESystem<T> {
 public:
@@ -129,3 +152,280 @@ TEST(SolverBenchmark)
 	dout(1) << "double\n";
 	benchmarkSolvers( 1.0, sysd, 10000 );
 }
+
+
+/// Counts evaluations of a TestODESystem
+template <class T>
+class CountingSystem : public TestODESystem<T> {
+public:
+	CountingSystem(int sz) : TestODESystem<T>(sz), evaluations(0) {}
+	virtual T stateDerivatives(const double t, const T& states) {
+		evaluations++;
+		return TestODESystem<T>::stateDerivatives(t, states);
+	}
+	unsigned long evaluations;
+};
+
+TEST(AdaptiveSolverTest)
+{
+	typedef Matrix<double, 4, 1> Vector;
+	CountingSystem<Vector> ode(4);
+	DormandPrinceSolver<Vector> dopri(ode);
+	BogackiShampineSolver<Vector> bs(ode);
+	AdaptiveSolver<Vector>* solvers[] = { &dopri, &bs };
+	const unsigned int stages[] = { 6, 3 };
+	for (int i = 0; i < 2; i++) {
+		AdaptiveSolver<Vector>& solver = *solvers[i];
+		for (int dense = 0; dense < 2; dense++) {
+			solver.setDenseOutput(dense == 1);
+			solver.setTolerances(1e-8, 1e-10);
+			ode.evaluations = 0;
+			solver.init();
+			for (int j = 0; j < 10; j++)
+				solver.step(0.1);
+			// Last stateUpdate() is at the time of the last step, also when dense output overshoots it
+			CHECK_CLOSE(1.0, ode.t, 1e-12);
+			CHECK(ode.error() < 1e-6);
+			CHECK(solver.getNumSteps() > 0);
+			// FSAL: stages per attempted step, one for the initial derivative and one for the initial step size
+			CHECK_EQUAL(stages[i]*(solver.getNumSteps() + solver.getNumRejectedSteps()) + 2, solver.getNumEvaluations());
+			CHECK_EQUAL(ode.evaluations, solver.getNumEvaluations());
+			dout(1) << "  " << solver.name() << (dense ? " dense" : "") << ": err = " << ode.error() << ", "
+				<< solver.getNumSteps() << " steps, " << solver.getNumRejectedSteps() << " rejected, "
+				<< solver.getNumEvaluations() << " evaluations\n";
+		}
+		
+		// Looser tolerances take fewer steps
+		unsigned long tightsteps = solver.getNumSteps();
+		solver.setTolerances(1e-4, 1e-6);
+		solver.init();
+		for (int j = 0; j < 10; j++)
+			solver.step(0.1);
+		CHECK(solver.getNumSteps() < tightsteps);
+		CHECK(ode.error() < 1e-2);
+		
+		// Restarting continues from the last output without the stale derivative
+		unsigned long evaluations = solver.getNumEvaluations();
+		unsigned long attempts = solver.getNumSteps() + solver.getNumRejectedSteps();
+		solver.restart();
+		solver.step(0.1);
+		CHECK_CLOSE(1.1, ode.t, 1e-12);
+		attempts = solver.getNumSteps() + solver.getNumRejectedSteps() - attempts;
+		CHECK_EQUAL(evaluations + 1 + stages[i]*attempts, solver.getNumEvaluations());
+		CHECK(ode.error() < 1e-2);
+	}
+	
+	SingleSystem<double> sysd;
+	ODESolver<double>* solver = SolverFactory<double>::create("dopri5", sysd);
+	CHECK(solver != NULL);
+	solver->init();
+	for (int j = 0; j < 10; j++)
+		solver->step(0.1);
+	CHECK(sysd.error() < 1e-5);
+	delete solver;
+}
+
+TEST(AdaptiveSolverBenchmark)
+{
+	// Evaluations and time for a given accuracy on y(10), compared to RK4 at the largest step giving the same error
+	typedef Matrix<double, 4, 1> Vector;
+	const double tfinal = 10, dt = 0.5;
+	const double tolerances[] = { 1e-4, 1e-6, 1e-8 };
+	for (int i = 0; i < 3; i++) {
+		CountingSystem<Vector> ode(4);
+		ODESolver<Vector>* solvers[] = { new BogackiShampineSolver<Vector>(ode), new DormandPrinceSolver<Vector>(ode) };
+		dout(1) << "tolerance " << tolerances[i] << "\n";
+		double error = 0;
+		for (int s = 0; s < 2; s++) {
+			AdaptiveSolver<Vector>* adaptive = dynamic_cast<AdaptiveSolver<Vector>*>(solvers[s]);
+			adaptive->setTolerances(tolerances[i], tolerances[i]*1e-3);
+			Timer timer;
+			ode.evaluations = 0;
+			adaptive->init();
+			for (int j = 0; j < tfinal/dt + 0.5; j++)
+				adaptive->step(dt);
+			double relative = ode.error() / fabs(ode.value());
+			dout(1) << "  " << adaptive->name() << ": rel. err = " << relative << ", " << ode.evaluations
+				<< " evaluations, tsolve = " << timer.time_s() << " seconds\n";
+			error = relative;
+			delete solvers[s];
+		}
+		// RK4 with substeps of the output step, refined until as accurate as Dormand-Prince
+		for (int substeps = 1; substeps <= 256; substeps *= 2) {
+			RK4Solver<Vector> rk4(ode);
+			Timer timer;
+			ode.evaluations = 0;
+			rk4.init();
+			for (int j = 0; j < (tfinal/dt + 0.5)*substeps; j++)
+				rk4.step(dt/substeps);
+			double relative = ode.error() / fabs(ode.value());
+			if (relative <= error || substeps == 256) {
+				dout(1) << "  RK4 (dt = " << dt/substeps << "): rel. err = " << relative << ", " << ode.evaluations
+					<< " evaluations, tsolve = " << timer.time_s() << " seconds\n";
+				break;
+			}
+		}
+	}
+}
+
+/// Stiff test system y_i' = lambda_i (y_i - sin t) + cos t, with solution y_i = sin t for any lambda_i
+template <class T>
+class StiffSystem : public ODESystem<T> {
+public:
+	StiffSystem(const bool jacobian) : analytic(jacobian), y(2), t(0) { lambda[0] = -1; lambda[1] = -10000; }
+	virtual T stateInitials(const double t0) const { T y0(2); y0.setZero(); return y0; }
+	virtual T stateDerivatives(const double t, const T& states) {
+		T ydot(2);
+		for (int i = 0; i < 2; i++)
+			ydot[i] = lambda[i]*(states[i] - sin(t)) + cos(t);
+		return ydot;
+	}
+	virtual int size() const { return 2; }
+	virtual void stateUpdate(const double t, const T& states) { this->t = t; y = states; }
+	virtual bool stateJacobian(const double t, const T& states, typename JacobianTraits<T>::Matrix& jacobian) {
+		if (!analytic)
+			return false;
+		jacobian.setZero();
+		jacobian(0,0) = lambda[0];
+		jacobian(1,1) = lambda[1];
+		return true;
+	}
+	virtual bool isLinear() const { return analytic; }
+	double error() { return std::max(fabs(y[0] - sin(t)), fabs(y[1] - sin(t))); }
+	bool analytic;
+	double lambda[2];
+	T y;
+	double t;
+};
+
+TEST(ImplicitSolverTest)
+{
+	typedef Matrix<double, 2, 1> Vector;
+	for (int analytic = 0; analytic < 2; analytic++) {
+		StiffSystem<Vector> ode(analytic == 1);
+		BackwardEulerSolver<Vector> euler(ode);
+		BDF2Solver<Vector> bdf2(ode);
+		RosenbrockWSolver<Vector> ros2(ode);
+		ImplicitSolver<Vector>* solvers[] = { &euler, &bdf2, &ros2 };
+		const double tolerances[] = { 1e-2, 1e-4, 1e-4 };
+		for (int i = 0; i < 3; i++) {
+			ImplicitSolver<Vector>& solver = *solvers[i];
+			solver.init();
+			for (int j = 0; j < 100; j++)
+				solver.step(0.01);
+			CHECK_CLOSE(1.0, ode.t, 1e-12);
+			CHECK(ode.error() < tolerances[i]);
+			CHECK_EQUAL(analytic == 1, solver.isJacobianAnalytic());
+			// Reused for 20 steps
+			CHECK_EQUAL(5u, solver.getNumJacobians());
+			CHECK_EQUAL(0u, solver.getNumConvergenceFailures());
+			if (analytic) {
+				// Factorized once per step size (the first BDF2 step is a backward Euler step)
+				CHECK_EQUAL(i == 1 ? 2u : 1u, solver.getNumFactorizations());
+				if (i < 2)
+					CHECK_EQUAL(100u, solver.getNumNewtonIterations());
+			}
+			dout(1) << "  " << solver.name() << (analytic ? " analytic" : " finite differences") << ": err = " << ode.error()
+				<< ", " << solver.getNumEvaluations() << " evaluations, " << solver.getNumFactorizations() << " factorizations, "
+				<< solver.getNumNewtonIterations() << " Newton iterations\n";
+		}
+	}
+	
+	// Explicit solvers are unstable at this step size
+	StiffSystem<Vector> ode(true);
+	RK4Solver<Vector> rk4(ode);
+	rk4.init();
+	for (int j = 0; j < 100; j++)
+		rk4.step(0.01);
+	CHECK(!(fabs(ode.y[1] - sin(ode.t)) < 1));
+	
+	// Scalar states
+	SingleSystem<double> sysd;
+	const char* names[] = { "backwardeuler", "bdf2", "ros2" };
+	for (int i = 0; i < 3; i++) {
+		ODESolver<double>* solver = SolverFactory<double>::create(names[i], sysd);
+		CHECK(solver != NULL);
+		solver->init();
+		for (int j = 0; j < 1000; j++)
+			solver->step(0.001);
+		CHECK(sysd.error() < 1e-2);
+		delete solver;
+	}
+}
+
+TEST(ImplicitSolverBenchmark)
+{
+	// Implicit solvers at a frame rate of 100 Hz against RK4 substepping 100 times to stay stable
+	typedef Matrix<double, 2, 1> Vector;
+	StiffSystem<Vector> ode(true);
+	const double dt = 0.01, tfinal = 10;
+	ODESolver<Vector>* solvers[] = { new BackwardEulerSolver<Vector>(ode), new BDF2Solver<Vector>(ode), new RosenbrockWSolver<Vector>(ode) };
+	for (int i = 0; i < 3; i++) {
+		Timer timer;
+		solvers[i]->init();
+		for (int j = 0; j < tfinal/dt + 0.5; j++)
+			solvers[i]->step(dt);
+		dout(1) << "  " << solvers[i]->name() << " (dt = " << dt << "): err = " << ode.error() << ", tsolve = " << timer.time_s() << " seconds\n";
+		delete solvers[i];
+	}
+	RK4Solver<Vector> rk4(ode);
+	Timer timer;
+	rk4.init();
+	for (int j = 0; j < tfinal/dt + 0.5; j++)
+		for (int k = 0; k < 100; k++)
+			rk4.step(dt/100);
+	dout(1) << "  RK4 (dt = " << dt/100 << "): err = " << ode.error() << ", tsolve = " << timer.time_s() << " seconds\n";
+}
+
+/// TestODESystem evaluating derivatives in place
+template <class T>
+class InPlaceSystem : public TestODESystem<T> {
+public:
+	InPlaceSystem(int sz) : TestODESystem<T>(sz) {}
+	using TestODESystem<T>::stateDerivatives;
+	virtual void stateDerivatives(const double t, const T& states, T& dydt) {
+		this->stateUpdate(t, states);
+		for (int i = 0; i < states.rows(); i++)
+			dydt[i] = states[i] + t + 1;
+	}
+};
+
+TEST(SolverAllocations)
+{
+	// long double isn't vectorized, so dynamic Eigen vectors of it are allocated with new[]
+	typedef Matrix<long double, Dynamic, 1> Vector;
+	num_allocations = 0;
+	count_allocations = true;
+	{
+		Vector v(8);
+	}
+	count_allocations = false;
+	CHECK(num_allocations > 0);
+	InPlaceSystem<Vector> ode(8);
+	std::vector< ODESolver<Vector>* > solvers;
+	solvers.push_back(new EulerSolver<Vector>(ode));
+	solvers.push_back(new HeunSolver<Vector>(ode));
+	solvers.push_back(new MidpointSolver<Vector>(ode));
+	solvers.push_back(new RK3Solver<Vector>(ode));
+	solvers.push_back(new RK4Solver<Vector>(ode));
+	solvers.push_back(new DormandPrinceSolver<Vector>(ode));
+	solvers.push_back(new BogackiShampineSolver<Vector>(ode));
+	DormandPrinceSolver<Vector>* clamped = new DormandPrinceSolver<Vector>(ode);
+	clamped->setDenseOutput(false);
+	solvers.push_back(clamped);
+	for (unsigned int i = 0; i < solvers.size(); i++) {
+		solvers[i]->init();
+		for (int j = 0; j < 10; j++)
+			solvers[i]->step(0.01);
+		num_allocations = 0;
+		count_allocations = true;
+		for (int j = 0; j < 100; j++)
+			solvers[i]->step(0.01);
+		count_allocations = false;
+		CHECK_EQUAL(0u, num_allocations);
+		CHECK(ode.error() < 0.1);
+		if (num_allocations)
+			dout(1) << "  " << solvers[i]->name() << ": " << num_allocations << " allocations in 100 steps\n";
+		delete solvers[i];
+	}
+}
@@ -1,5 +1,6 @@
 #include "BlackBox.h"
 #include <sstream>
+#include <OpenThreads/ScopedLock>
 
 #define MAX_PACKET_SIZE 4096
 
@@ -427,6 +428,17 @@ namespace sbx
 		}
 	}
 	
+	void BlackBox::relocateVariables(const std::map<const void*, const void*>& moved)
+	{
+		if (moved.empty()) return;
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(relocatemutex);
+		for (std::vector<LogVariable>::iterator i = variables.begin(); i < variables.end(); i++) {
+			std::map<const void*, const void*>::const_iterator it = moved.find(i->value_ptr);
+			if (it != moved.end())
+				i->value_ptr = it->second;
+		}
+	}
+	
 	void BlackBox::unregisterGroup(const void* ptr)
 	{
 		if (!ptr) return;
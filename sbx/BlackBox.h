@@ -9,6 +9,7 @@
 #include <deque>
 #include <exception>
 #include <map>
+#include <OpenThreads/Mutex>
 
 #ifdef HAVE_PRACTICAL_SOCKETS
 #include "PracticalSockets/PracticalSocket.h"
@@ -47,6 +48,8 @@ namespace sbx
 		virtual void fetch();
 		virtual void write(int numentries=0)=0;
 		void setHeader(const std::string& hdr) { header = hdr; }
+		/// Get the indices of the variables subscribed to, see BlackBox::getVariable()
+		const std::vector<unsigned int>& getSubscriptions() const { return varindices; }
 	protected:
 		unsigned int logcount;
 		std::vector<unsigned int> varindices;
@@ -150,6 +153,8 @@ namespace sbx
 		void removeHandler(BlackBoxDataHandler* log);
 		const LogVariable& getVariable(unsigned int index) { return variables[index]; }
 		unsigned int getNumVariables() { return variables.size(); }
+		unsigned int getNumHandlers() { return logs.size(); }
+		BlackBoxDataHandler* getHandler(unsigned int index) { return logs[index]; }
 		void registerVariable(const std::string& name, const void* ptr, LogVariable::VariableType type);
 		void registerFloat(const std::string& name, const float* ptr) { registerVariable(name,(const void*) ptr,LogVariable::FLOAT); }
 		void registerDouble(const std::string& name, const double* ptr) { registerVariable(name,(const void*) ptr,LogVariable::DOUBLE); }
@@ -160,6 +165,10 @@ namespace sbx
 		void setGroupName(const void *ptr, const std::string& name);
 		const std::string& getGroupName(const void* ptr) { return groupnames[ptr]; }
 		void unregisterVariable(const void* ptr); // TODO make one with name as parameter (that can handle 'group.name')
+		/// Point the variables registered at the keys of \a moved at the mapped values instead, e.g. when values are moved in memory
+		/** Thread safe, since the signal buses of different simulations (e.g. members of an Ensemble)
+		 are bound and unbound on their own threads. */
+		void relocateVariables(const std::map<const void*, const void*>& moved);
 		void unregisterGroup(const void *ptr);
 		void unregisterGroup(const std::string& name) { unregisterGroup(findGroupPtr(name)); }
 		void fetch();
@@ -176,6 +185,7 @@ namespace sbx
 		static BlackBox* instance_ptr;
 		const void* curgroup;
 		std::map<const void*,std::string> groupnames;
+		OpenThreads::Mutex relocatemutex;
 	};
 }
 
@@ -0,0 +1,242 @@
+#include "DependencyGraph.h"
+#include "Group.h"
+#include "Log.h"
+
+namespace sbx
+{
+
+	DependencyGraph::DependencyGraph(Group& nroot)
+	:	root(nroot),
+		nummodels(0),
+		tree_valid(false),
+		updating(false),
+		numupdates(0),
+		numrecomputed(0)
+	{
+	}
+
+	DependencyGraph::~DependencyGraph()
+	{
+		clear();
+	}
+
+	DependencyGraph::Node* DependencyGraph::getNode(Model& model)
+	{
+		if (model.graph == this)
+			return &nodes[model.graph_node];
+		if (model.graph)
+			return NULL;
+		model.graph = this;
+		model.graph_node = nodes.size();
+		nodes.push_back(Node(&model));
+		nodes.back().endpoint = model.isEndPoint();
+		nummodels++;
+		markDirty(model.graph_node);
+		return &nodes.back();
+	}
+
+	void DependencyGraph::updateAdjacency(Node& node)
+	{
+		if (node.adjacency_valid)
+			return;
+		node.providers.clear();
+		node.dependants.clear();
+		node.model->collectDataProviders(node.providers);
+		node.model->collectDataDependants(node.dependants);
+		node.adjacency_valid = true;
+	}
+
+	void DependencyGraph::markDirty(const unsigned int index)
+	{
+		if (nodes[index].dirty)
+			return;
+		nodes[index].dirty = true;
+		dirty.push_back(index);
+	}
+
+	ModelOrderList& DependencyGraph::getDataProviders(Model& model)
+	{
+		Node* node = getNode(model);
+		if (!node)
+			return model.getDataProviders();
+		updateAdjacency(*node);
+		return node->providers;
+	}
+
+	ModelOrderList& DependencyGraph::getDataDependants(Model& model)
+	{
+		Node* node = getNode(model);
+		if (!node)
+			return model.getDataDependants();
+		updateAdjacency(*node);
+		return node->dependants;
+	}
+
+	bool DependencyGraph::hasEndPointDependants(Model& model)
+	{
+		Node* node = getNode(model);
+		if (!node)
+			return model.hasEndPointDependants();
+		if (updating)
+			return node->endpoint_dependants; // asked by another graph while updating this one
+		if (!tree_valid || !dirty.empty())
+			updateReachability();
+		return nodes[model.graph_node].endpoint_dependants;
+	}
+
+	void DependencyGraph::invalidate(Model& model)
+	{
+		if (model.graph != this)
+			return;
+		nodes[model.graph_node].adjacency_valid = false;
+		markDirty(model.graph_node);
+	}
+
+	void DependencyGraph::sampleEndPoints()
+	{
+		for (unsigned int i = 0; i < nodes.size(); i++) {
+			Node& node = nodes[i];
+			if (!node.model)
+				continue;
+			bool endpoint = node.model->isEndPoint();
+			if (endpoint != node.endpoint || node.foreign_dependants) {
+				node.endpoint = endpoint;
+				markDirty(i);
+			}
+		}
+	}
+
+	/** The models upstream of \a model may no longer have endpoint dependants. The providers aren't
+	 collected again, since \a model may be half destroyed, but providers connected or disconnected
+	 since they were collected have been marked dirty themselves. */
+	void DependencyGraph::remove(Model& model)
+	{
+		if (model.graph != this)
+			return;
+		Node& node = nodes[model.graph_node];
+		for (ModelOrderList::iterator p = node.providers.begin(); p != node.providers.end(); p++)
+			if (p->valid() && (*p)->graph == this)
+				markDirty((*p)->graph_node);
+		node.model = NULL;
+		node.providers.clear();
+		node.dependants.clear();
+		model.graph = NULL;
+		nummodels--;
+	}
+
+	void DependencyGraph::clear()
+	{
+		for (std::deque<Node>::iterator i = nodes.begin(); i != nodes.end(); i++)
+			if (i->model)
+				i->model->graph = NULL;
+		nodes.clear();
+		dirty.clear();
+		nummodels = 0;
+		tree_valid = false;
+	}
+
+	void DependencyGraph::addTree(Model& model)
+	{
+		getNode(model);
+		if (Group* group = model.asGroup())
+			for (unsigned int i = 0; i < group->getNumChildren(); i++)
+				addTree(*group->getChild(i));
+	}
+
+	/** A model has endpoint dependants if one of its dependants is an endpoint or has endpoint
+	 dependants. Only the changed models, and the models upstream of them (through their providers,
+	 which include all models they are dependants of), are recomputed. Starting from those with
+	 endpoints among their dependants, or dependants that weren't recomputed and have endpoint
+	 dependants, this is propagated backwards along the dependant lists, so each connection is
+	 followed once, also in cyclic graphs. Dependants outside of any tree are added to the graph on
+	 the way.
+	 */
+	void DependencyGraph::updateReachability()
+	{
+		updating = true;
+		if (!tree_valid) {
+			addTree(root);
+			tree_valid = true;
+		}
+		std::vector<unsigned int> affected;
+		for (unsigned int i = 0; i < dirty.size(); i++) {
+			Node& node = nodes[dirty[i]];
+			node.dirty = false;
+			if (node.model && !node.affected) {
+				node.affected = true;
+				affected.push_back(dirty[i]);
+			}
+		}
+		dirty.clear();
+		// Close over the providers, nodes added on the way are appended and handled later in this loop
+		for (unsigned int a = 0; a < affected.size(); a++) {
+			Node& node = nodes[affected[a]];
+			updateAdjacency(node);
+			for (ModelOrderList::iterator d = node.dependants.begin(); d != node.dependants.end(); d++) {
+				Model* dependant = d->get();
+				if (dependant && !dependant->graph && !dependant->getRoot()) {
+					Node* added = getNode(*dependant);
+					added->dirty = false;
+					added->affected = true;
+					affected.push_back(dependant->graph_node);
+				}
+			}
+			for (ModelOrderList::iterator p = node.providers.begin(); p != node.providers.end(); p++) {
+				Model* provider = p->get();
+				if (provider && provider->graph == this && !nodes[provider->graph_node].affected) {
+					nodes[provider->graph_node].affected = true;
+					affected.push_back(provider->graph_node);
+				}
+			}
+		}
+		dirty.clear(); // nodes added above are already affected
+		// Reverse the dependant lists within the affected nodes, and seed with the ones that have endpoint dependants
+		std::vector<unsigned int> queue;
+		std::vector< std::vector<unsigned int> > providers(nodes.size());
+		for (unsigned int a = 0; a < affected.size(); a++) {
+			nodes[affected[a]].endpoint_dependants = false;
+			nodes[affected[a]].foreign_dependants = false;
+		}
+		for (unsigned int a = 0; a < affected.size(); a++) {
+			unsigned int i = affected[a];
+			Node& node = nodes[i];
+			for (ModelOrderList::iterator d = node.dependants.begin(); d != node.dependants.end(); d++) {
+				Model* dependant = d->get();
+				if (!dependant)
+					continue;
+				bool reaches;
+				if (dependant->graph == this) {
+					Node& other = nodes[dependant->graph_node];
+					if (other.affected)
+						providers[dependant->graph_node].push_back(i);
+					reaches = other.endpoint || (!other.affected && other.endpoint_dependants);
+				} else {
+					node.foreign_dependants = true;
+					reaches = dependant->isEndPoint() || dependant->hasEndPointDependants();
+				}
+				if (reaches && !node.endpoint_dependants) {
+					node.endpoint_dependants = true;
+					queue.push_back(i);
+				}
+			}
+		}
+		// Propagate to the models these depend on, through any number of dependants
+		while (queue.size() > 0) {
+			unsigned int i = queue.back();
+			queue.pop_back();
+			for (std::vector<unsigned int>::iterator p = providers[i].begin(); p != providers[i].end(); p++) {
+				if (!nodes[*p].endpoint_dependants) {
+					nodes[*p].endpoint_dependants = true;
+					queue.push_back(*p);
+				}
+			}
+		}
+		for (unsigned int a = 0; a < affected.size(); a++)
+			nodes[affected[a]].affected = false;
+		updating = false;
+		numupdates++;
+		numrecomputed += affected.size();
+		dout(5) << "dependency graph of " << root.getName() << " updated, " << affected.size() << " of " << nummodels << " models\n";
+	}
+
+}
@@ -0,0 +1,92 @@
+#ifndef SBX_DEPENDENCYGRAPH_H
+#define SBX_DEPENDENCYGRAPH_H
+
+#include "Export.h"
+#include "Model.h"
+#include <vector>
+#include <deque>
+
+namespace sbx
+{
+
+	class Group;
+
+	/// Data dependencies between the models of a tree, owned by the root Group
+	/** Keeps the data providers and dependants of each model (see Model::getDataProviders()), and
+	 which models have endpoint dependants (see Model::hasEndPointDependants()), so that traversals
+	 look them up rather than walking the port connections again on every visit.
+
+	 The providers and dependants of a model are recomputed when its ports are connected or
+	 disconnected. Endpoint reachability is only recomputed for the models it may have changed for,
+	 i.e. the changed models and the models upstream of them, on the first query after the change.
+	 Models are added when children are added to the tree, and leave the graph when they are moved
+	 to another parent (see Model::setParent()). Models outside of any tree that depend on models in
+	 the tree are added as well, until they are added to a group.
+
+	 Changes to Model::isEndPoint() are picked up by sampleEndPoints(), which DEPENDENT traversals
+	 call once per visit (see ModelVisitor::visit() and UpdateVisitor::compile()).
+	 */
+	class SIMBLOX_API DependencyGraph
+	{
+	public:
+		DependencyGraph(Group& root);
+		~DependencyGraph();
+
+		ModelOrderList& getDataProviders(Model& model);
+		ModelOrderList& getDataDependants(Model& model);
+		bool hasEndPointDependants(Model& model);
+
+		/// Mark the providers and dependants of \a model out of date, e.g. when its ports are (dis)connected
+		void invalidate(Model& model);
+		/// Look up which models are endpoints, and recompute reachability upstream of those that changed
+		/** Models depending on models outside the graph are recomputed too, since those aren't tracked. */
+		void sampleEndPoints();
+		/// Add the models of the tree that aren't in the graph yet on the next query, e.g. when children are added
+		void invalidateTree() { tree_valid = false; }
+		/// Forget about \a model, e.g. when it is deleted or moved to another tree
+		void remove(Model& model);
+		/// Forget about all models
+		void clear();
+
+		/// Get the number of models in the graph
+		unsigned int getNumModels() const { return nummodels; }
+		/// Get the number of times endpoint reachability has been updated
+		unsigned long getNumUpdates() const { return numupdates; }
+		/// Get the number of models endpoint reachability has been recomputed for, over all updates
+		unsigned long getNumRecomputed() const { return numrecomputed; }
+
+	protected:
+		struct Node {
+			Node(Model* nmodel) : model(nmodel), adjacency_valid(false), endpoint(false), endpoint_dependants(false),
+				foreign_dependants(false), dirty(false), affected(false) {}
+			Model* model; ///< NULL if removed
+			ModelOrderList providers, dependants;
+			bool adjacency_valid;
+			bool endpoint; ///< Model::isEndPoint() when last sampled
+			bool endpoint_dependants;
+			bool foreign_dependants; ///< has dependants outside the graph
+			bool dirty; ///< in \c dirty
+			bool affected; ///< being recomputed by updateReachability()
+		};
+
+		/// Get the node of \a model, adding it if needed
+		/** \return NULL if the model belongs to another graph */
+		Node* getNode(Model& model);
+		void updateAdjacency(Node& node);
+		/// Recompute reachability for the node at \a index and the ones upstream of it on the next query
+		void markDirty(const unsigned int index);
+		/// Add all models under \a model
+		void addTree(Model& model);
+		void updateReachability();
+
+		Group& root;
+		std::deque<Node> nodes; ///< a deque, so that lists returned to callers stay put as models are added
+		std::vector<unsigned int> dirty; ///< nodes changed since reachability was last updated
+		unsigned int nummodels;
+		bool tree_valid, updating;
+		unsigned long numupdates, numrecomputed;
+	};
+
+}
+
+#endif
@@ -0,0 +1,335 @@
+#include "Ensemble.h"
+#include "ModelVisitor.h"
+#include "Ports.h"
+#include "TaskThread.h"
+#include "XMLParser.h"
+#include "Timer.h"
+#include "Log.h"
+#include <OpenThreads/Thread>
+#include <math.h>
+
+namespace sbx
+{
+
+	/// Reads the value of a port as a double, for recording
+	class EnsembleProbe
+	{
+	public:
+		virtual ~EnsembleProbe() {}
+		virtual double get() = 0;
+		/// Create a probe for a port, returns NULL if the port type isn't numeric
+		static EnsembleProbe* create(Port* port);
+	};
+
+	template <typename T, class P>
+	class PortProbe : public EnsembleProbe
+	{
+	public:
+		PortProbe(P* nport) : port(nport) {}
+		virtual double get() { return (double) port->get(); }
+		P* port;
+	};
+
+	template <typename T>
+	static EnsembleProbe* createPortProbe(Port* port)
+	{
+		if (OutPort<T>* out = dynamic_cast<OutPort<T>*>(port))
+			return new PortProbe< T, OutPort<T> >(out);
+		if (InPort<T>* in = dynamic_cast<InPort<T>*>(port))
+			return new PortProbe< T, InPort<T> >(in);
+		return NULL;
+	}
+
+	EnsembleProbe* EnsembleProbe::create(Port* port)
+	{
+		EnsembleProbe* probe = createPortProbe<double>(port);
+		if (!probe)
+			probe = createPortProbe<float>(port);
+		if (!probe)
+			probe = createPortProbe<int>(port);
+		if (!probe)
+			probe = createPortProbe<bool>(port);
+		return probe;
+	}
+
+	/// Deterministic random number generator (SplitMix64), with a separate sequence for each member
+	class EnsembleRandom
+	{
+	public:
+		EnsembleRandom(const unsigned long seed, const unsigned int member)
+		: state(seed) { state = next() ^ member; }
+		unsigned long long next()
+		{
+			unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			return z ^ (z >> 31);
+		}
+		/// Uniformly distributed in [0,1)
+		double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+		/// Normally distributed with zero mean and unit variance (Box-Muller)
+		double normal()
+		{
+			double u1 = 1.0 - uniform(), u2 = uniform();
+			return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+		}
+	protected:
+		unsigned long long state;
+	};
+
+	class MemberTask : public Task
+	{
+	public:
+		MemberTask(Ensemble& nensemble, const unsigned int nmember) : ensemble(nensemble), member(nmember) {}
+		virtual void perform() { ensemble.runMember(member); }
+		Ensemble& ensemble;
+		unsigned int member;
+	};
+
+	Ensemble::Ensemble(Group* nroot, const unsigned int nsize)
+	:	root(nroot),
+		size(nsize),
+		numthreads(0),
+		seed(1),
+		endtime(0),
+		timestep(0),
+		runtime(0)
+	{
+	}
+
+	Ensemble::~Ensemble()
+	{
+		clear();
+	}
+
+	void Ensemble::addRecord(const std::string& port, const unsigned int interval)
+	{
+		records.push_back(port);
+		intervals.push_back(interval > 0 ? interval : 1);
+		clear();
+	}
+
+	/** Members are cloned from the root group (see Group::Group(const Group&)) and configured here,
+	 serially, so that models may use global state when configuring. Perturbed values are drawn from
+	 a random sequence of each member's own, and so don't depend on the number of members or threads.
+	 \throw ModelException on unknown models or ports, or ports that can't be recorded
+	 */
+	void Ensemble::setup()
+	{
+		clear();
+		if (!root.valid())
+			throw ModelException("Ensemble has no root group");
+		for (unsigned int i = 0; i < size; i++) {
+			smrt::ref_ptr<Group> copy = (Group*) root->clone();
+			EnsembleRandom random(seed, i);
+			values.push_back(std::vector<double>());
+			for (std::vector<Perturbation>::iterator p = perturbations.begin(); p != perturbations.end(); p++) {
+				FindVisitor fv;
+				Model* model = fv.findModel(*copy, p->model);
+				if (!model)
+					throw ModelException("Unknown model '" + p->model + "' in ensemble perturbation");
+				double value;
+				if (p->distribution == Perturbation::NORMAL)
+					value = p->a + p->b * random.normal();
+				else
+					value = p->a + (p->b - p->a) * random.uniform();
+				model->setParameter(p->parameter, value, p->unit);
+				values.back().push_back(value);
+			}
+			probes.push_back(std::vector<EnsembleProbe*>());
+			for (std::vector<std::string>::iterator r = records.begin(); r != records.end(); r++) {
+				FindVisitor fv;
+				Port* port = fv.findPort(*copy, *r);
+				if (!port)
+					throw ModelException("Unknown port '" + *r + "' in ensemble record");
+				EnsembleProbe* probe = EnsembleProbe::create(port);
+				if (!probe)
+					throw ModelException("Port '" + *r + "' in ensemble record is not of a numeric type");
+				probes.back().push_back(probe);
+			}
+			results.push_back(std::vector< std::vector<double> >(records.size()));
+			errors.push_back("");
+
+			Simulation* sim = new Simulation(copy.get(), true);
+			sim->setTraversalMode(DEPENDENT);
+			sim->setRealTime(false);
+			sim->setContinuousDisplay(false); // members would all display at once
+			sim->setEndTime(endtime);
+			if (timestep > 0)
+				sim->setTimeStep(timestep);
+			sim->configure();
+			members.push_back(sim);
+		}
+		dout(3) << "Ensemble of " << members.size() << " members set up\n";
+	}
+
+	void Ensemble::clear()
+	{
+		for (unsigned int i = 0; i < probes.size(); i++)
+			for (unsigned int j = 0; j < probes[i].size(); j++)
+				delete probes[i][j];
+		probes.clear();
+		members.clear();
+		values.clear();
+		results.clear();
+		errors.clear();
+	}
+
+	/** \throw ModelException if no end time is set */
+	unsigned int Ensemble::run()
+	{
+		if (endtime <= 0)
+			throw ModelException("Ensemble needs an end time");
+		if (members.size() != size)
+			setup();
+		unsigned int num = numthreads;
+		if (num == 0)
+			num = OpenThreads::GetNumberOfProcessors();
+		if (num > members.size())
+			num = members.size();
+		if (num == 0)
+			num = 1;
+		Timer timer;
+		// Members are initialized one at a time, like they are configured by setup(), since models
+		// may use global state (e.g. the BlackBox) when initialized
+		for (unsigned int i = 0; i < members.size(); i++) {
+			errors[i] = "";
+			try {
+				members[i]->init();
+			} catch (std::exception& e) {
+				errors[i] = e.what();
+			} catch (...) {
+				errors[i] = "unknown exception";
+			}
+		}
+		{
+			TaskThreadPool pool(num);
+			pool.start();
+			for (unsigned int i = 0; i < members.size(); i++)
+				if (errors[i].empty())
+					pool.schedule(new MemberTask(*this, i));
+			pool.wait();
+		}
+		runtime = timer.time_s();
+		unsigned int failed = 0;
+		for (unsigned int i = 0; i < errors.size(); i++) {
+			if (errors[i].length() > 0) {
+				dout(ERROR) << "Ensemble member " << i << " failed: " << errors[i] << "\n";
+				failed++;
+			}
+		}
+		dout(3) << "Ensemble of " << members.size() << " members run on " << num << " threads in " << runtime << " seconds\n";
+		return failed;
+	}
+
+	void Ensemble::runMember(const unsigned int index)
+	{
+		try {
+			Simulation& sim = *members[index];
+			std::vector< std::vector<double> >& result = results[index];
+			std::vector<EnsembleProbe*>& probe = probes[index];
+			unsigned long numsteps = (unsigned long) ceil(endtime / sim.getTimeStep());
+			for (unsigned int r = 0; r < result.size(); r++) {
+				result[r].clear();
+				result[r].reserve(numsteps / intervals[r] + 1);
+			}
+			unsigned long step = 0;
+			while (!sim.isDone()) {
+				sim.step();
+				step++;
+				for (unsigned int r = 0; r < result.size(); r++)
+					if (step % intervals[r] == 0)
+						result[r].push_back(probe[r]->get());
+			}
+		} catch (std::exception& e) {
+			errors[index] = e.what();
+		} catch (...) {
+			errors[index] = "unknown exception";
+		}
+	}
+
+	void Ensemble::writeResults(std::ostream& out)
+	{
+		out << "member";
+		for (std::vector<Perturbation>::iterator p = perturbations.begin(); p != perturbations.end(); p++)
+			out << "," << p->model << "." << p->parameter;
+		for (std::vector<std::string>::iterator r = records.begin(); r != records.end(); r++)
+			out << "," << *r;
+		out << "\n";
+		for (unsigned int i = 0; i < members.size(); i++) {
+			out << i;
+			for (unsigned int p = 0; p < values[i].size(); p++)
+				out << "," << values[i][p];
+			for (unsigned int r = 0; r < results[i].size(); r++) {
+				out << ",";
+				if (results[i][r].size() > 0)
+					out << results[i][r].back();
+			}
+			out << "\n";
+		}
+	}
+
+	void Ensemble::parseXML(const TiXmlElement *element)
+	{
+		size = XMLParser::parseIntAttribute(element, "size", true, size);
+		numthreads = XMLParser::parseIntAttribute(element, "threads", true, numthreads);
+		seed = XMLParser::parseIntAttribute(element, "seed", true, seed);
+		for (const TiXmlElement* elem = element->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
+			std::string name = elem->Value();
+			if (name == "perturb") {
+				Perturbation p;
+				p.model = XMLParser::parseStringAttribute(elem, "model");
+				p.parameter = XMLParser::parseStringAttribute(elem, "parameter");
+				p.unit = XMLParser::parseStringAttribute(elem, "unit", true, "");
+				std::string distribution = XMLParser::parseStringAttribute(elem, "distribution", true, "uniform");
+				if (distribution == "uniform") {
+					p.distribution = Perturbation::UNIFORM;
+					p.a = XMLParser::parseDoubleAttribute(elem, "min");
+					p.b = XMLParser::parseDoubleAttribute(elem, "max");
+				} else if (distribution == "normal") {
+					p.distribution = Perturbation::NORMAL;
+					p.a = XMLParser::parseDoubleAttribute(elem, "mean");
+					p.b = XMLParser::parseDoubleAttribute(elem, "deviation");
+				} else
+					throw ParseException("Unknown distribution '" + distribution + "' in ensemble perturbation", elem);
+				addPerturbation(p);
+			} else if (name == "record") {
+				addRecord(XMLParser::parseStringAttribute(elem, "port"), XMLParser::parseIntAttribute(elem, "interval", true, 1));
+			} else
+				throw ParseException("Unknown element '" + name + "' in Ensemble", elem);
+		}
+	}
+
+	void Ensemble::writeXML(TiXmlElement *element)
+	{
+		element->SetAttribute("size", size);
+		if (numthreads > 0)
+			element->SetAttribute("threads", numthreads);
+		element->SetAttribute("seed", (int) seed);
+		for (std::vector<Perturbation>::iterator p = perturbations.begin(); p != perturbations.end(); p++) {
+			TiXmlElement* elem = new TiXmlElement("perturb");
+			elem->SetAttribute("model", p->model.c_str());
+			elem->SetAttribute("parameter", p->parameter.c_str());
+			if (p->unit.length() > 0)
+				elem->SetAttribute("unit", p->unit.c_str());
+			if (p->distribution == Perturbation::NORMAL) {
+				elem->SetAttribute("distribution", "normal");
+				elem->SetDoubleAttribute("mean", p->a);
+				elem->SetDoubleAttribute("deviation", p->b);
+			} else {
+				elem->SetAttribute("distribution", "uniform");
+				elem->SetDoubleAttribute("min", p->a);
+				elem->SetDoubleAttribute("max", p->b);
+			}
+			element->LinkEndChild(elem);
+		}
+		for (unsigned int i = 0; i < records.size(); i++) {
+			TiXmlElement* elem = new TiXmlElement("record");
+			elem->SetAttribute("port", records[i].c_str());
+			if (intervals[i] > 1)
+				elem->SetAttribute("interval", intervals[i]);
+			element->LinkEndChild(elem);
+		}
+	}
+
+}
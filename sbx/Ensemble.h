@@ -0,0 +1,117 @@
+#ifndef ENSEMBLE_H_
+#define ENSEMBLE_H_
+
+#include "Export.h"
+#include "Group.h"
+#include "Simulation.h"
+#include <smrt/Referenced.h>
+#include <smrt/ref_ptr.h>
+#include <string>
+#include <vector>
+#include <ostream>
+
+class TiXmlElement;
+
+namespace sbx
+{
+
+	/// A parameter perturbation applied to the members of an Ensemble
+	struct SIMBLOX_API Perturbation
+	{
+		enum Distribution { UNIFORM, NORMAL };
+
+		Perturbation(const std::string& nmodel = "", const std::string& nparameter = "", const Distribution ndistribution = UNIFORM,
+					 const double na = 0, const double nb = 0, const std::string& nunit = "")
+		: model(nmodel), parameter(nparameter), unit(nunit), distribution(ndistribution), a(na), b(nb) {}
+
+		std::string model; ///< model name or path, see FindVisitor::findModel()
+		std::string parameter;
+		std::string unit;
+		Distribution distribution;
+		double a; ///< minimum value (UNIFORM) or mean (NORMAL)
+		double b; ///< maximum value (UNIFORM) or standard deviation (NORMAL)
+	};
+
+	class EnsembleProbe;
+
+	/// Runs a number of independent, perturbed copies of a model tree in parallel (e.g. Monte Carlo runs)
+	/** Each member is a standalone Simulation of a clone of the root group, with parameters perturbed
+	 according to the added \link Perturbation Perturbations \endlink. Members are run to the end time
+	 concurrently on a thread pool, and the values of recorded ports are gathered into per-member
+	 buffers. Members are run in DEPENDENT traversal mode, since they are parallelized as a whole.
+	 */
+	class SIMBLOX_API Ensemble : public smrt::Referenced
+	{
+	public:
+		Ensemble(Group* root = NULL, const unsigned int size = 0);
+		virtual ~Ensemble();
+
+		void setRoot(Group* group) { root = group; clear(); }
+		Group* getRoot() { return root.get(); }
+		void setSize(const unsigned int value) { size = value; clear(); }
+		unsigned int getSize() const { return size; }
+		/// Set number of threads used to run members, 0 means one per processor
+		void setNumThreads(const unsigned int value) { numthreads = value; }
+		unsigned int getNumThreads() const { return numthreads; }
+		/// Set the random seed for perturbations, each member gets a sequence of its own
+		void setSeed(const unsigned long value) { seed = value; clear(); }
+		unsigned long getSeed() const { return seed; }
+		void setEndTime(const double time) { endtime = time; }
+		double getEndTime() const { return endtime; }
+		/// Set time step of the members, 0 means determined by the models (see Simulation::init())
+		void setTimeStep(const double dt) { timestep = dt; }
+		double getTimeStep() const { return timestep; }
+
+		void addPerturbation(const Perturbation& perturbation) { perturbations.push_back(perturbation); clear(); }
+		unsigned int getNumPerturbations() const { return perturbations.size(); }
+		const Perturbation& getPerturbation(const unsigned int index) const { return perturbations[index]; }
+		/// Record the value of a port (e.g. "model.port") every \a interval steps
+		void addRecord(const std::string& port, const unsigned int interval = 1);
+		unsigned int getNumRecords() const { return records.size(); }
+		const std::string& getRecordName(const unsigned int index) const { return records[index]; }
+
+		/// Clone and perturb the members (done by run() if needed)
+		void setup();
+		/// Remove all members
+		void clear();
+		/// Run all members to the end time, returns the number of members that failed
+		unsigned int run();
+		/// Run a single member, initialized by run(), to the end time (called from the task threads)
+		void runMember(const unsigned int index);
+
+		unsigned int getNumMembers() const { return members.size(); }
+		Simulation& getMember(const unsigned int index) { return *members[index]; }
+		/// Get the value a perturbed parameter was set to for a member
+		double getPerturbedValue(const unsigned int member, const unsigned int perturbation) const { return values[member][perturbation]; }
+		/// Get the recorded values of a port for a member
+		const std::vector<double>& getResult(const unsigned int member, const unsigned int record) const { return results[member][record]; }
+		/// Returns an error message if running a member failed, empty otherwise
+		const std::string& getError(const unsigned int member) const { return errors[member]; }
+		/// Get the wall clock time of the last run() in seconds
+		double getRunTime() const { return runtime; }
+
+		/// Write perturbed values and final recorded values of all members as comma separated values
+		void writeResults(std::ostream& out);
+
+		virtual void parseXML(const TiXmlElement *element);
+		virtual void writeXML(TiXmlElement *element);
+
+	protected:
+		smrt::ref_ptr<Group> root;
+		unsigned int size, numthreads;
+		unsigned long seed;
+		double endtime, timestep, runtime;
+		std::vector<Perturbation> perturbations;
+		std::vector<std::string> records;
+		std::vector<unsigned int> intervals;
+
+		std::vector< smrt::ref_ptr<Simulation> > members;
+		std::vector< std::vector<double> > values;
+		std::vector< std::vector<EnsembleProbe*> > probes;
+		std::vector< std::vector< std::vector<double> > > results;
+		std::vector<std::string> errors;
+	};
+
+}
+
+#endif
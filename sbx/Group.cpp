@@ -1,4 +1,5 @@
 #include "Group.h"
+#include "DependencyGraph.h"
 #include "Ports.h"
 #include "Log.h"
 #include "ModelFactory.h"
@@ -10,9 +11,31 @@ namespace sbx
 	
 	REGISTER_Object(sbx, Group);
 	
-	Group::Group(const std::string& name) : Model(name) { }
+	Group::Group(const std::string& name) : Model(name), dependencygraph(NULL) { }
 	
-	Group::Group(const Group& source) : Model(source)
+	typedef std::map<const Port*, Port*> PortMap;
+	
+	/// Map the ports owned by \a source and its descendants to the corresponding ports of \a copy
+	static void mapCopiedPorts(Model& source, Model& copy, PortMap& portmap)
+	{
+		for (unsigned int i = 0; i < source.getNumPorts(); i++) {
+			Port* port = source.getPort(i);
+			if (port->getOwner() != &source)
+				continue;
+			Port* copyport = copy.getPort(source.getPortName(port));
+			if (copyport)
+				portmap[port] = copyport;
+		}
+		Group* group = source.asGroup();
+		Group* copygroup = copy.asGroup();
+		if (group && copygroup && group->getNumChildren() == copygroup->getNumChildren())
+			for (unsigned int i = 0; i < group->getNumChildren(); i++)
+				mapCopiedPorts(*group->getChild(i), *copygroup->getChild(i), portmap);
+	}
+	
+	/** Children are cloned, and connections between them (and their descendants) are reproduced, as
+	 are exported child ports. Connections to models outside the group are not. */
+	Group::Group(const Group& source) : Model(source), dependencygraph(NULL)
 	{
 		for(ChildList::const_iterator itr=source.children.begin();
 			itr!=source.children.end();
@@ -21,11 +44,30 @@ namespace sbx
 			Model* child = (Model*) (*itr)->clone();
 			if (child) addChild(child);
 		}
+		Group& src = const_cast<Group&>(source);
+		PortMap portmap;
+		for (unsigned int i = 0; i < getNumChildren(); i++)
+			mapCopiedPorts(*src.getChild(i), *getChild(i), portmap);
+		for (PortMap::iterator i = portmap.begin(); i != portmap.end(); i++) {
+			Port* port = const_cast<Port*>(i->first);
+			if (!port->isInput() || !port->isConnected() || i->second->isConnected())
+				continue;
+			PortMap::iterator other = portmap.find(port->getOtherEnd());
+			if (other != portmap.end())
+				i->second->connect(other->second);
+		}
+		for (unsigned int i = 0; i < src.getNumPorts(); i++) {
+			Port* port = src.getPort(i);
+			PortMap::iterator copyport = portmap.find(port);
+			if (port->getOwner() != &source && copyport != portmap.end())
+				exportChildPort(copyport->second, src.getPortName(port));
+		}
 	}
 	
 	Group::~Group()
 	{
 		clear();
+		delete dependencygraph;
 	}
 	
 	void Group::parseXML(const TiXmlElement* element)
@@ -185,7 +227,8 @@ namespace sbx
 	
 	void Group::accept(ModelVisitor& visitor)
 	{
-		visitor.apply(*this);
+		if (visitor.isRequired(*this))
+			visitor.apply(*this);
 	}
 	
 	void Group::traverse(ModelVisitor& visitor)
@@ -210,10 +253,20 @@ namespace sbx
 		if (child->getParent() && child->getParent() != this)
 			child->getParent()->removeChild(child);
 		child->setParent(this);
+		// A group added to another one is no longer a root
+		if (Group* group = child->asGroup()) {
+			delete group->dependencygraph;
+			group->dependencygraph = NULL;
+		}
+		invalidateDependencyGraph();
+		touchTopology();
 	}
 	
 	void Group::removeChildren(const unsigned int index, const unsigned int num)
 	{
+		touchTopology();
+		for (unsigned int i = index; i < index+num && i < children.size(); i++)
+			releaseChild(children[i].get());
 		children.erase(children.begin()+index, children.begin()+index+num);
 	}
 	
@@ -221,6 +274,8 @@ namespace sbx
 	{
 		for (ChildList::iterator i = children.begin(); i != children.end(); i++) {
 			if (*i == child) {
+				touchTopology();
+				releaseChild(child);
 				children.erase(i);
 				return;
 			}
@@ -229,16 +284,38 @@ namespace sbx
 	
 	void Group::clear()
 	{
+		touchTopology();
+		for (ChildList::iterator i = children.begin(); i != children.end(); i++)
+			releaseChild(i->get());
 		children.clear();
 	}
 	
+	void Group::releaseChild(Model* child)
+	{
+		if (child->getParent() == this)
+			child->setParent(NULL);
+	}
+	
+	DependencyGraph* Group::getOwnedDependencyGraph()
+	{
+		if (!dependencygraph)
+			dependencygraph = new DependencyGraph(*this);
+		return dependencygraph;
+	}
+	
+	void Group::invalidateDependencyGraph()
+	{
+		Group* root = getRoot();
+		if (root->dependencygraph)
+			root->dependencygraph->invalidateTree();
+	}
+	
 	/// \throw ModelException if \a port does not belong to a child model
 	void Group::exportChildPort(Port *port, const std::string& name)
 	{
 		//if (port->getOwner()->getParent() != this)
 		//	throw ModelException("Attempt to export port from non-child", this);
-		ports[name] = port;
-		port_descriptions[port] = port->getOwner()->getPortDescription(port);
+		insertPort(name, *port, port->getOwner()->getPortDescription(port));
 		dout(4) << "   exported port " << port->getOwner()->getName() << "."
 		<< port->getOwner()->getPortName(port)
 		<< " as " << name << "\n";
@@ -246,12 +323,7 @@ namespace sbx
 	
 	void Group::unexportChildPort(Port *port)
 	{
-		for (PortList::iterator it = ports.begin(); it != ports.end(); it++) {
-			if (it->second == port) {
-				ports.erase(it);
-				return;
-			}
-		}
+		unregisterPort(*port);
 	}
 	
 }
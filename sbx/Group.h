@@ -45,13 +45,21 @@ public:
 	void exportChildPort(Port *port, const std::string& name);
 	/// Remove a child's port from this group's port map
 	void unexportChildPort(Port *port);
+	/// Get the dependency graph owned by this group, used by the models under it while it is the root
+	/** \see Model::getDependencyGraph() */
+	DependencyGraph* getOwnedDependencyGraph();
 	
 protected:
 
 	virtual ~Group();
+	/// Tell the dependency graph of the root that children were added, see DependencyGraph::invalidateTree()
+	void invalidateDependencyGraph();
+	/// Release \a child after removing it
+	void releaseChild(Model* child);
 
 	typedef std::vector< smrt::ref_ptr<sbx::Model> > ChildList;
 	ChildList children;
+	DependencyGraph* dependencygraph;
 };
 
 }
@@ -1,11 +1,13 @@
 #include "Model.h"
 #include "Ports.h"
 #include "Group.h"
+#include "DependencyGraph.h"
 #include "BlackBox.h"
 #include "XMLParser.h"
 #include "Log.h"
 #include "ModelVisitor.h"
 #include <numerix/misc.h>
+#include <algorithm>
 
 namespace sbx
 {
@@ -14,8 +16,15 @@ namespace sbx
 		Object(name),
 		parent(NULL),
 		warnflag(false),
-		errflag(false)
-	{
+		errflag(false),
+		pinned(false),
+		numinputs(0),
+		dependencies_valid(false),
+		graph(NULL),
+		graph_node(0),
+		topology_revision(++last_topology_revision)
+	{
+		std::fill(visit_marks, visit_marks+NUM_VISIT_MARKS, 0);
 		// Register blackbox variables
 		BlackBox::instance().beginGroup(this,"Model");
 		BlackBox::instance().registerBool("errflag",&errflag);
@@ -31,13 +40,24 @@ namespace sbx
 		warnstr(source.warnstr),
 		errflag(source.errflag),
 		errstr(source.errstr),
-		update_frequency(source.update_frequency)
+		update_frequency(source.update_frequency),
+		pinned(source.pinned),
+		numinputs(0),
+		dependencies_valid(false),
+		graph(NULL),
+		graph_node(0),
+		topology_revision(++last_topology_revision)
 	{
+		std::fill(visit_marks, visit_marks+NUM_VISIT_MARKS, 0);
 	}
 	
 	Model::~Model()
 	{
 		//std::cout << "delete " << getName() << "\n";
+		if (graph)
+			graph->remove(*this);
+		for (PortList::iterator i = ports.begin(); i != ports.end(); i++)
+			delete *i;
 	}
 	
 	/** This method can be used to display data, typically by endpoint models, e.g. a plotter or
@@ -60,6 +80,8 @@ namespace sbx
 			setUpdateFrequency(atoi(element->Attribute("frequency")));
 			dout(3) << "  frequency " << update_frequency << "\n";
 		}
+		if (element->Attribute("pinned"))
+			setPinned(XMLParser::parseBooleanAttribute(element, "pinned"));
 		if (supportsDynamicInputs()) {
 			int inputs = XMLParser::parseInt(element, "numinputs", "", true, 0);
 			for (int i = 0; i < inputs; i++)
@@ -72,7 +94,7 @@ namespace sbx
 		}
 		
 		for (ParameterList::iterator i = parameters.begin(); i != parameters.end(); i++) {
-			Parameter& param = i->second;
+			Parameter& param = *i;
 			try {
 				switch (param.type) {
 					case Parameter::BOOLEAN:
@@ -118,12 +140,14 @@ namespace sbx
 		element->SetAttribute("name",getName());
 		if (update_frequency)
 			element->SetAttribute("frequency", update_frequency);
+		if (pinned)
+			element->SetAttribute("pinned", "true");
 		if (supportsDynamicInputs())
 			XMLParser::setInt(element, "numinputs", getNumInputs());
 		if (supportsDynamicOutputs())
 			XMLParser::setInt(element, "numoutputs", getNumOutputs());
 		for (ParameterList::iterator i = parameters.begin(); i != parameters.end(); i++) {
-			Parameter& param = i->second;
+			Parameter& param = *i;
 			switch (param.type) {
 				case Parameter::BOOLEAN:
 					XMLParser::setBoolean(element, param.name, *((bool*)param.ptr));
@@ -168,49 +192,85 @@ namespace sbx
 	
 	ModelOrderList& Model::getDataProviders()
 	{
-		if (traversalProviders.size() > 0)
-			return traversalProviders;
+		if (DependencyGraph* dependencies = getDependencyGraph())
+			return dependencies->getDataProviders(*this);
+		if (!dependencies_valid) {
+			traversalProviders.clear();
+			traversalDependants.clear();
+			collectDataProviders(traversalProviders);
+			collectDataDependants(traversalDependants);
+			dependencies_valid = true;
+		}
+		return traversalProviders;
+	}
+	
+	ModelOrderList& Model::getDataDependants()
+	{
+		if (DependencyGraph* dependencies = getDependencyGraph())
+			return dependencies->getDataDependants(*this);
+		getDataProviders();
+		return traversalDependants;
+	}
+	
+	void Model::collectDataProviders(ModelOrderList& providers)
+	{
 		std::map<Model*,bool> handled;
-		for (PortList::iterator i = ports.begin(); i != ports.end(); i++) {
-			Port* port = i->second;
-			if (port && port->isInput() && port->isConnected()) {
+		for (unsigned int i = 0; i < numinputs; i++) {
+			Port* port = ports[i]->port;
+			if (port->isConnected()) {
 				InputPort* inp = (InputPort*) port;
 				Model* provider = inp->getOtherEnd()->getOwner();
 				if (provider && !handled[provider]) {
-					traversalProviders.push_back(provider);
+					providers.push_back(provider);
 					handled[provider] = true;
 				}
 			}
 		}
-		return traversalProviders;
 	}
 	
-	ModelOrderList& Model::getDataDependants()
+	void Model::collectDataDependants(ModelOrderList& dependants)
 	{
-		if (traversalDependants.size() > 0)
-			return traversalDependants;
 		std::map<Model*,bool> handled;
-		for (PortList::iterator i = ports.begin(); i != ports.end(); i++) {
-			Port* port = i->second;
-			if (port && port->isOutput() && port->isConnected()) {
+		for (unsigned int i = numinputs; i < ports.size(); i++) {
+			Port* port = ports[i]->port;
+			if (port->isConnected()) {
 				OutputPort* outp = (OutputPort*) port;
 				for (int j = 0; j < outp->getNumConnections(); j++) {
 					Model* dependant = outp->getOtherEnd(j)->getOwner();
 					if (dependant && !handled[dependant]) {
-						traversalDependants.push_back(dependant);
+						dependants.push_back(dependant);
 						handled[dependant] = true;
 					}
 				}
 			}
 		}
-		return traversalDependants;
+	}
+	
+	/** Models in a group use the graph of the root group, which is created when first needed. A
+	 model keeps using the graph it is in until it is given another parent (see setParent()), or the
+	 graph is cleared. */
+	DependencyGraph* Model::getDependencyGraph()
+	{
+		if (graph)
+			return graph;
+		Group* root = getRoot();
+		if (!root)
+			return NULL;
+		return root->getOwnedDependencyGraph();
+	}
+	
+	void Model::invalidateDependencies()
+	{
+		dependencies_valid = false;
+		if (graph)
+			graph->invalidate(*this);
 	}
 	
 	const bool Model::dependsOn(Model* other)
 	{
-		for (PortList::iterator i = ports.begin(); i != ports.end(); i++) {
-			Port* port = i->second;
-			if (port->isInput() && port->isConnected()) {
+		for (unsigned int i = 0; i < numinputs; i++) {
+			Port* port = ports[i]->port;
+			if (port->isConnected()) {
 				InputPort* inp = (InputPort*) port;
 				if (inp->getOtherEnd()->getOwner() == other)
 					return true;
@@ -223,9 +283,9 @@ namespace sbx
 	{
 		bool depends = false;
 		bool all_loose = true;
-		for (PortList::iterator i = ports.begin(); i != ports.end(); i++) {
-			Port* port = i->second;
-			if (port->isInput() && port->isConnected()) {
+		for (unsigned int i = 0; i < numinputs; i++) {
+			Port* port = ports[i]->port;
+			if (port->isConnected()) {
 				InputPort* inp = (InputPort*) port;
 				if (inp->getOtherEnd()->getOwner() == other) {
 					depends = true;
@@ -239,9 +299,9 @@ namespace sbx
 	
 	const bool Model::dependsStronglyOn(Model* other)
 	{
-		for (PortList::iterator i = ports.begin(); i != ports.end(); i++) {
-			Port* port = i->second;
-			if (port->isInput() && port->isConnected()) {
+		for (unsigned int i = 0; i < numinputs; i++) {
+			Port* port = ports[i]->port;
+			if (port->isConnected()) {
 				InputPort* inp = (InputPort*) port;
 				if (inp->getOtherEnd()->getOwner() == other && !inp->isLoose())
 					return true;
@@ -252,9 +312,9 @@ namespace sbx
 	
 	const bool Model::providesFor(Model* other)
 	{
-		for (PortList::iterator i = ports.begin(); i != ports.end(); i++) {
-			Port* port = i->second;
-			if (port->isOutput() && port->isConnected()) {
+		for (unsigned int i = numinputs; i < ports.size(); i++) {
+			Port* port = ports[i]->port;
+			if (port->isConnected()) {
 				OutputPort* outp = (OutputPort*) port;
 				for (int j = 0; j < outp->getNumConnections(); j++) {
 					if (outp->getOtherEnd(j)->getOwner() == other)
@@ -267,9 +327,9 @@ namespace sbx
 	
 	const bool Model::hasDataProviders()
 	{
-		for (PortList::iterator i = ports.begin(); i != ports.end(); i++) {
-			Port* port = i->second;
-			if (port->isInput() && port->isConnected())
+		for (unsigned int i = 0; i < numinputs; i++) {
+			Port* port = ports[i]->port;
+			if (port->isConnected())
 				return true;
 		}
 		return false;
@@ -277,16 +337,20 @@ namespace sbx
 	
 	const bool Model::hasDataDependants()
 	{
-		for (PortList::iterator i = ports.begin(); i != ports.end(); i++) {
-			Port* port = i->second;
-			if (port->isOutput() && port->isConnected())
+		for (unsigned int i = numinputs; i < ports.size(); i++) {
+			Port* port = ports[i]->port;
+			if (port->isConnected())
 				return true;
 		}
 		return false;
 	}
 	
+	/** Looked up in the dependency graph, see getDependencyGraph(). Outside groups, the dependants
+	 are searched recursively on each call. */
 	const bool Model::hasEndPointDependants()
 	{
+		if (DependencyGraph* dependencies = getDependencyGraph())
+			return dependencies->hasEndPointDependants(*this);
 		ModelOrderList& dependants = getDataDependants();
 		for (ModelOrderList::iterator i = dependants.begin(); i != dependants.end(); i++) {
 			if ((*i)->isEndPoint())
@@ -299,7 +363,7 @@ namespace sbx
 	
 	void Model::accept(ModelVisitor& visitor)
 	{
-		if (visitor.getTraversalMode() != DEPENDENT || isEndPoint() || hasEndPointDependants())
+		if (visitor.isRequired(*this))
 			visitor.apply(*this);
 		else if (visitor.getVisitCount() == 0)
 			dout(5) << "skip " << getName() << "\n";
@@ -357,120 +421,107 @@ namespace sbx
 			throw ModelException(ss.str(), this);
 		}
 		update_frequency = freq;
+		touchTopology();
 	}
 	
 	Port* Model::getPort(const std::string& name)
 	{
-		PortList::iterator it = ports.find(name);
-		if (it != ports.end())
-			return it->second;
-		return NULL;
+		int index = port_index.find(name, ports);
+		return index >= 0 ? ports[index]->port : NULL;
 	}
 	
 	const Port* Model::getPort(const std::string& name) const
 	{ 
-		PortList::const_iterator it = ports.find(name);
-		if (it != ports.end())
-			return it->second;
-		return NULL;
+		int index = port_index.find(name, ports);
+		return index >= 0 ? ports[index]->port : NULL;
 	}
 	
 	Port* Model::getPort(const unsigned int index)
 	{
 		if (index >= ports.size())
 			return NULL;
-		Port* port;
-		PortList::iterator i = ports.begin();;
-		for (unsigned int count = 0; count < index; count++)
-			i++;
-		port = i->second;
-		return port;
+		return ports[index]->port;
 	}
 	
 	/// \throw ModelException if \a port is not owned by this model
 	unsigned int Model::getPortIndex(const Port *port)
 	{
-		PortList::iterator i = ports.begin();;
-		for (unsigned int count = 0; count < ports.size(); count++) {
-			if (i->second == port)
-				return count;
-			i++;
-		}
+		for (unsigned int i = 0; i < ports.size(); i++)
+			if (ports[i]->port == port)
+				return i;
 		throw ModelException("Specified port is not owned by this model", this);
 	}
 	
-	unsigned int Model::getNumInputs() const
-	{
-		unsigned int count = 0;
-		for (PortList::const_iterator i = ports.begin(); i != ports.end(); i++)
-			if (i->second->isInput())
-				count++;
-		return count;
-	}
-	
-	unsigned int Model::getNumOutputs() const
-	{
-		unsigned int count = 0;
-		for (PortList::const_iterator i = ports.begin(); i != ports.end(); i++)
-			if (i->second->isOutput())
-				count++;
-		return count;
-	}
-	
 	/// \throw ModelException if \a index is out of bounds
 	std::string Model::getPortName(const unsigned int index) const
 	{
 		if (index >= ports.size())
 			throw ModelException("Invalid port index", this);
-		PortList::const_iterator i = ports.begin();;
-		for (unsigned int count = 0; count < index; count++)
-			i++;
-		return i->first;
+		return ports[index]->name;
 	}
 	
 	/// \throw ModelException if \a port is not owned by this model
 	std::string Model::getPortName(const Port *port) const
 	{
 		for (PortList::const_iterator i = ports.begin(); i != ports.end(); i++)
-			if (i->second == port)
-				return i->first;
+			if ((*i)->port == port)
+				return (*i)->name;
 		throw ModelException("Specified port is not owned by this model", this);
 	}
 	
 	/// \throw ModelException if \a port is not owned by this model
 	std::string Model::getPortDescription(const Port *port) const
 	{
-		PortDescriptionList::const_iterator it = port_descriptions.find(port);
-		if (it == port_descriptions.end())
-			throw ModelException("Specified port is not owned by this model", this);
-		return it->second;
+		for (PortList::const_iterator i = ports.begin(); i != ports.end(); i++)
+			if ((*i)->port == port)
+				return (*i)->description;
+		throw ModelException("Specified port is not owned by this model", this);
 	}
 	
 	bool Model::ownsPort(const Port *port) const
 	{
 		for (PortList::const_iterator i = ports.begin(); i != ports.end(); i++)
-			if (i->second == port)
+			if ((*i)->port == port)
 				return true;
 		return false;
 	}
 	
+	/** Dependencies have already been invalidated when this is called, see invalidateDependencies(). */
 	void Model::onPortConnect(Port *port, Port *otherend)
 	{
-		traversalProviders.clear();
-		traversalDependants.clear();
 	}
 	
 	void Model::onPortDisconnect(Port *port, Port *otherend)
 	{
-		traversalProviders.clear();
-		traversalDependants.clear();
 	}
 	
+	OpenThreads::Atomic Model::last_topology_revision;
+	
+	void Model::touchTopology()
+	{
+		unsigned int revision = ++last_topology_revision;
+		for (Model* model = this; model; model = model->parent)
+			model->topology_revision.exchange(revision);
+	}
+	
+	/** The model and the models under it leave the dependency graph they are in, since they may be
+	 moved to another tree. */
 	void Model::setParent(Group *newparent)
 	{
+		if (newparent != parent)
+			leaveDependencyGraph();
 		parent = newparent;
 	}
 	
+	void Model::leaveDependencyGraph()
+	{
+		if (graph)
+			graph->remove(*this);
+		if (Group* group = asGroup())
+			for (unsigned int i = 0; i < group->getNumChildren(); i++)
+				group->getChild(i)->leaveDependencyGraph();
+	}
+	
 	Group* Model::getRoot()
 	{
 		if (!parent)
@@ -502,79 +553,93 @@ namespace sbx
 	{
 		if (index >= parameters.size())
 			throw ModelException("Invalid parameter index");
-		ParameterList::const_iterator i = parameters.begin();
-		for (unsigned int count = 0; count < index; count++)
-			i++;
-		return i->first;
+		return parameters[index].name;
 	}
 	
 	const Model::Parameter& Model::getParameterSpec(const std::string& name) const
 	{
-		ParameterList::const_iterator it = parameters.find(name);
-		if (it == parameters.end())
+		int index = parameter_index.find(name, parameters);
+		if (index < 0)
 			throw ModelException("Unknown parameter '" + name + "'");
-		return it->second;
+		return parameters[index];
 	}
 	
 	const Model::Parameter& Model::getParameterSpec(const unsigned int index) const
 	{
-		return getParameterSpec(getParameterName(index));
+		if (index >= parameters.size())
+			throw ModelException("Invalid parameter index");
+		return parameters[index];
+	}
+	
+	Model::Parameter& Model::getParameterEntry(const std::string& name)
+	{
+		int index = parameter_index.find(name, parameters);
+		if (index < 0)
+			throw ModelException("Unknown parameter '" + name + "'", this);
+		return parameters[index];
 	}
 	
 	void Model::getParameter(const std::string& name, bool& b)
 	{
-		if (parameters[name].type != Parameter::BOOLEAN)
+		Parameter& param = getParameterEntry(name);
+		if (param.type != Parameter::BOOLEAN)
 			throw ModelException(std::string("Parameter '") + name + "' is not a boolean", this);
-		b = *((bool*)parameters[name].ptr);
+		b = *((bool*)param.ptr);
 	}
 	
 	void Model::getParameter(const std::string& name, int& i, const std::string& unit)
 	{
-		if (parameters[name].type != Parameter::INTEGER)
+		Parameter& param = getParameterEntry(name);
+		if (param.type != Parameter::INTEGER)
 			throw ModelException(std::string("Parameter '") + name + "' is not a int", this);
-		i = *((int*)parameters[name].ptr);
+		i = *((int*)param.ptr);
 		if (unit.length() > 0)
-			i = (int)round(units::convert(i,parameters[name].unit,unit));
+			i = (int)round(units::convert(i,param.unit,unit));
 	}
 	
 	void Model::getParameter(const std::string& name, unsigned int& i, const std::string& unit)
 	{
-		if (parameters[name].type != Parameter::UINTEGER)
+		Parameter& param = getParameterEntry(name);
+		if (param.type != Parameter::UINTEGER)
 			throw ModelException(std::string("Parameter '") + name + "' is not an unsigned int", this);
-		i = *((unsigned int*)parameters[name].ptr);
+		i = *((unsigned int*)param.ptr);
 		if (unit.length() > 0)
-			i = (unsigned int)round(units::convert(i,parameters[name].unit,unit));
+			i = (unsigned int)round(units::convert(i,param.unit,unit));
 	}
 	
 	void Model::getParameter(const std::string& name, float& f, const std::string& unit)
 	{
-		if (parameters[name].type != Parameter::FLOAT)
+		Parameter& param = getParameterEntry(name);
+		if (param.type != Parameter::FLOAT)
 			throw ModelException(std::string("Parameter '") + name + "' is not a float", this);
-		f = *((float*)parameters[name].ptr);
+		f = *((float*)param.ptr);
 		if (unit.length() > 0)
-			f = (float)units::convert(f,parameters[name].unit,unit);
+			f = (float)units::convert(f,param.unit,unit);
 	}
 	
 	void Model::getParameter(const std::string& name, double& d, const std::string& unit)
 	{
-		if (parameters[name].type != Parameter::DOUBLE)
+		Parameter& param = getParameterEntry(name);
+		if (param.type != Parameter::DOUBLE)
 			throw ModelException(std::string("Parameter '") + name + "' is not a double", this);
-		d = *((double*)parameters[name].ptr);
+		d = *((double*)param.ptr);
 		if (unit.length() > 0)
-			d = units::convert(d,parameters[name].unit,unit);
+			d = units::convert(d,param.unit,unit);
 	}
 	
 	void Model::getParameter(const std::string& name, std::string& s)
 	{
-		if (parameters[name].type != Parameter::STRING)
+		Parameter& param = getParameterEntry(name);
+		if (param.type != Parameter::STRING)
 			throw ModelException(std::string("Parameter '") + name + "' is not a string", this);
-		s = *((std::string*)parameters[name].ptr);
+		s = *((std::string*)param.ptr);
 	}
 	
 	std::string Model::getParameter(const std::string& name)
 	{
+		Parameter& param = getParameterEntry(name);
 		std::stringstream ss;
-		switch (parameters[name].type) {
+		switch (param.type) {
 			case Parameter::BOOLEAN: {
 				bool b;
 				getParameter(name,b);
@@ -617,37 +682,39 @@ namespace sbx
 	
 	void Model::setParameter(const std::string& name, const double value, const std::string& unit)
 	{
+		Parameter& param = getParameterEntry(name);
 		double d = value;
-		if (parameters[name].unit.length() > 0 && unit.length() > 0) {
-			d = units::convert(value, unit, parameters[name].unit);		
+		if (param.unit.length() > 0 && unit.length() > 0) {
+			d = units::convert(value, unit, param.unit);		
 		}
-		switch (parameters[name].type) {
+		switch (param.type) {
 			case Parameter::BOOLEAN:
-				*((bool*)parameters[name].ptr) = (bool) d;
+				*((bool*)param.ptr) = (bool) d;
 				break;
 			case Parameter::INTEGER:
-				*((int*)parameters[name].ptr) = (int) round(d);
+				*((int*)param.ptr) = (int) round(d);
 				break;
 			case Parameter::UINTEGER:
-				*((unsigned int*)parameters[name].ptr) = (unsigned int) round(d);
+				*((unsigned int*)param.ptr) = (unsigned int) round(d);
 				break;
 			case Parameter::FLOAT:
-				*((float*)parameters[name].ptr) = (float) d;
+				*((float*)param.ptr) = (float) d;
 				break;
 			case Parameter::DOUBLE:
-				*((double*)parameters[name].ptr) = d;
+				*((double*)param.ptr) = d;
 				break;
 			case Parameter::STRING:
 				std::stringstream ss;
 				ss << d;
-				*((std::string*)parameters[name].ptr) = ss.str();
+				*((std::string*)param.ptr) = ss.str();
 				break;
 		}
 	}
 	
 	void Model::setParameter(const std::string& name, const std::string& value, const std::string& unit)
 	{
-		switch (parameters[name].type) {
+		Parameter& param = getParameterEntry(name);
+		switch (param.type) {
 			case Parameter::BOOLEAN:
 			case Parameter::INTEGER:
 			case Parameter::UINTEGER:
@@ -656,24 +723,84 @@ namespace sbx
 				setParameter(name, atof(value.c_str()), unit);
 				break;
 			case Parameter::STRING:
-				*((std::string*)parameters[name].ptr) = value;
+				*((std::string*)param.ptr) = value;
+				break;
+		}
+	}
+	
+	/// \throw ModelException if there is no parameter \a name, or units::UnitsException if \a unit doesn't convert to its unit
+	ParameterHandle Model::getParameterHandle(const std::string& name, const std::string& unit)
+	{
+		Parameter& param = getParameterEntry(name);
+		double scale = 1;
+		if (param.unit.length() > 0 && unit.length() > 0)
+			scale = units::convert(1.0, unit, param.unit);
+		return ParameterHandle(this, param, scale);
+	}
+	
+	void ParameterHandle::set(const double value) const
+	{
+		double d = value*scale;
+		switch (type) {
+			case Model::Parameter::BOOLEAN:
+				*((bool*)ptr) = (bool) d;
+				break;
+			case Model::Parameter::INTEGER:
+				*((int*)ptr) = (int) round(d);
+				break;
+			case Model::Parameter::UINTEGER:
+				*((unsigned int*)ptr) = (unsigned int) round(d);
 				break;
+			case Model::Parameter::FLOAT:
+				*((float*)ptr) = (float) d;
+				break;
+			case Model::Parameter::DOUBLE:
+				*((double*)ptr) = d;
+				break;
+			case Model::Parameter::STRING:
+				std::stringstream ss;
+				ss << d;
+				*((std::string*)ptr) = ss.str();
+				break;
+		}
+	}
+	
+	double ParameterHandle::get() const
+	{
+		switch (type) {
+			case Model::Parameter::BOOLEAN:
+				return *((bool*)ptr);
+			case Model::Parameter::INTEGER:
+				return *((int*)ptr)/scale;
+			case Model::Parameter::UINTEGER:
+				return *((unsigned int*)ptr)/scale;
+			case Model::Parameter::FLOAT:
+				return *((float*)ptr)/scale;
+			case Model::Parameter::DOUBLE:
+				return *((double*)ptr)/scale;
+			default:
+				throw ModelException("Parameter handle of a string parameter can't be read as a number", model);
 		}
 	}
 	
+	void ParameterSet::apply() const
+	{
+		for (std::vector<Change>::const_iterator i = changes.begin(); i != changes.end(); i++)
+			i->first.set(i->second);
+	}
+	
 	void Model::registerPort(Port& port, const std::string& name, const std::string& unit, const std::string& description)
 	{ 
 		port.setOwner(this); 
 		port.setUnit(unit);
-		ports[name] = &port;
-		port_descriptions[&port] = description;
+		insertPort(name, port, description);
 	}
 	
 	void Model::unregisterPort(Port& port)
 	{
-		for (PortList::iterator it = ports.begin(); it != ports.end(); it++) {
-			if (it->second == &port) {
-				ports.erase(it);
+		for (unsigned int i = 0; i < ports.size(); i++) {
+			if (ports[i]->port == &port) {
+				erasePort(i);
 				return;
 			}
 		}
@@ -686,8 +813,7 @@ namespace sbx
 			throw ModelException("Invalid copy port");
 		port.setOwner(this);
 		port.setUnit(srcport->getUnit());
-		ports[name] = &port;
-		port_descriptions[&port] = source.getPortDescription(srcport);
+		insertPort(name, port, source.getPortDescription(srcport));
 	}
 	
 	void Model::registerParameter(void* ptr, Parameter::Type type, const std::string& name, const std::string& unit, const std::string& description)
@@ -698,14 +824,58 @@ namespace sbx
 		param.name = name;
 		param.unit = unit;
 		param.description = description;
-		parameters[name] = param;
+		insertParameter(param);
 	}
 	
 	void Model::copyParameter(const Model& source, const std::string& name, void* ptr)
 	{
 		Parameter param = source.getParameterSpec(name);
 		param.ptr = ptr;
-		parameters[name] = param;
+		insertParameter(param);
+	}
+	
+	/** Inputs are kept before outputs, so that dependency queries only look at one of the ranges.
+	 Both ranges are binary searched and only entry pointers are shifted, while the name index is
+	 rebuilt on the next lookup, so that adding many ports in a row (e.g. to a ModelArray) stays fast. */
+	void Model::insertPort(const std::string& name, Port& port, const std::string& description)
+	{
+		PortList::iterator inputs = ports.begin() + numinputs;
+		PortList::iterator existing = port_index.lowerBound(ports.begin(), inputs, name);
+		if (existing == inputs || (*existing)->name != name)
+			existing = port_index.lowerBound(inputs, ports.end(), name);
+		if (existing != ports.end() && (*existing)->name == name)
+			erasePort(existing - ports.begin());
+		PortEntry* entry = new PortEntry;
+		entry->name = name;
+		entry->description = description;
+		entry->port = &port;
+		bool input = port.isInput();
+		PortList::iterator first = ports.begin() + (input ? 0 : numinputs);
+		PortList::iterator last = input ? ports.begin() + numinputs : ports.end();
+		ports.insert(port_index.lowerBound(first, last, name), entry);
+		if (input)
+			numinputs++;
+		port_index.invalidate();
+	}
+	
+	void Model::erasePort(const unsigned int index)
+	{
+		if (index < numinputs)
+			numinputs--;
+		delete ports[index];
+		ports.erase(ports.begin() + index);
+		port_index.invalidate();
+	}
+	
+	void Model::insertParameter(const Parameter& param)
+	{
+		ParameterList::iterator pos = parameter_index.lowerBound(parameters.begin(), parameters.end(), param.name);
+		if (pos != parameters.end() && pos->name == param.name) {
+			*pos = param;
+			return;
+		}
+		parameters.insert(pos, param);
+		parameter_index.invalidate();
 	}
 	
 } // namespace sbx
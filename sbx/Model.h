@@ -2,11 +2,13 @@
 #define MODEL_H
 
 #include "Object.h"
+#include "NameIndex.h"
 #include <string>
 #include <sstream>
 #include <vector>
 #include <map>
 #include <smrt/observer_ptr.h>
+#include <OpenThreads/Atomic>
 
 #define META_Model(library, name, desc) \
 META_Object(library, name); \
@@ -21,10 +23,15 @@ namespace sbx
 	class ModelVisitor;
 	class Group;
 	class Port;
+	class DependencyGraph;
+	class ParameterHandle;
 	
 	enum DisplayMode { DISPLAY_INITIAL, DISPLAY_CONTINUOUS, DISPLAY_FINAL, DISPLAY_USER };
 	
 	typedef std::vector< smrt::observer_ptr<Model> > ModelOrderList;
+	
+	/// Number of visitors that can mark models as visited at the same time, see ModelVisitor::isVisited()
+	#define NUM_VISIT_MARKS 16
 
 	/// Base class for all models in a simulation.
 	class SIMBLOX_API Model : public Object
@@ -98,10 +105,21 @@ namespace sbx
 		const bool hasDataDependants();
 		/// Returns true if this model provides for other models, and somewhere down that line is a data endpoint
 		const bool hasEndPointDependants();
+		/// Get the dependency graph these queries are answered from, i.e. the one of the root group (NULL outside groups)
+		DependencyGraph* getDependencyGraph();
+		/// Mark the data providers and dependants out of date, called when a port is (dis)connected
+		void invalidateDependencies();
 		
 		/// An endpoint model is considered to always have data dependants (e.g. it displays something to the user),
 		/// so it doesn't get skipped in the update traversal even though it has no output ports
 		virtual const bool isEndPoint() { return false; }
+		/// A pure model's outputs only depend on its inputs and the time step, so that updating it again
+		/// with unchanged inputs has no effect (see UpdateVisitor::setChangePropagation())
+		virtual const bool isPure() { return false; }
+		/// Keep a pinned model, and the models it reads from, in the update schedule even if nothing needs its outputs
+		/** Pinning a group pins all models in it, see UpdateVisitor::prune(). */
+		void setPinned(const bool value) { pinned = value; }
+		bool isPinned() const { return pinned; }
 		
 		/// Accept a model visitor, can be overloaded to modify visitor pattern behavior
 		virtual void accept(ModelVisitor& visitor);
@@ -128,14 +146,15 @@ namespace sbx
 		
 		Port* getPort(const std::string& name);
 		const Port* getPort(const std::string& name) const;
+		/// Get a port by index, inputs come first (see getNumInputs()), each sorted by name
 		Port* getPort(const unsigned int index);
 		unsigned int getPortIndex(const Port *port);
 		/// Get the total number of ports this model has
 		unsigned int getNumPorts() const { return ports.size(); }
-		/// Get the number of ports that are inputs
-		unsigned int getNumInputs() const;
-		/// Get the number of ports that are outputs
-		unsigned int getNumOutputs() const;
+		/// Get the number of ports that are inputs, which have indices 0 to getNumInputs()-1
+		unsigned int getNumInputs() const { return numinputs; }
+		/// Get the number of ports that are outputs, which have indices getNumInputs() to getNumPorts()-1
+		unsigned int getNumOutputs() const { return ports.size() - numinputs; }
 		/// Get the name of a port
 		std::string getPortName(const unsigned int index) const;
 		/// Get the name of a port
@@ -147,6 +166,17 @@ namespace sbx
 		virtual void onPortConnect(Port *port, Port *otherend);
 		virtual void onPortDisconnect(Port *port, Port *otherend);
 		
+		/// Get a counter that changes whenever the topology of this model or of any model below it
+		/// changes, i.e. when ports are connected or disconnected, children are added to or removed
+		/// from a group, or an update frequency is changed. Used to tell when a compiled update
+		/// schedule of a tree is out of date.
+		/** Each tree has its own revision, so that changes to one tree (e.g. a member of an Ensemble)
+		 don't invalidate what was compiled for the others. Revisions are handed out from a process-wide
+		 counter, so two models only have the same revision if one is above the other. */
+		unsigned long getTopologyRevision() const { return (unsigned int) topology_revision; }
+		/// Change the topology revision of this model and of all groups above it, see getTopologyRevision()
+		void touchTopology();
+		
 		Group* getParent() { return parent; }
 		const Group* getParent() const { return parent; }
 		void setParent(Group* parent);
@@ -157,6 +187,7 @@ namespace sbx
 		
 		// Parameter getters and setters
 		unsigned int getNumParameters() const { return parameters.size(); }
+		/// Get the name of a parameter, by index in name order
 		std::string getParameterName(const unsigned int index) const;
 		const Parameter& getParameterSpec(const std::string& name) const;
 		const Parameter& getParameterSpec(const unsigned int index) const;
@@ -169,6 +200,8 @@ namespace sbx
 		std::string getParameter(const std::string& name);
 		void setParameter(const std::string& name, const double value, const std::string& unit = "");
 		void setParameter(const std::string& name, const std::string& value, const std::string& unit = "");
+		/// Resolve a parameter once, for repeated access in \a unit (the parameter's own unit if empty)
+		ParameterHandle getParameterHandle(const std::string& name, const std::string& unit = "");
 		
 	protected:
 		virtual ~Model(); // protected destructor - using smart pointer
@@ -178,20 +211,110 @@ namespace sbx
 		void copyPort(const Model& source, const std::string& name, Port& port);
 		void registerParameter(void* ptr, Parameter::Type type, const std::string& name, const std::string& unit = "", const std::string& description = "");
 		void copyParameter(const Model& source, const std::string& name, void *ptr);
+		/// Add the owners of ports connected to inputs of this model to \a providers, once each
+		void collectDataProviders(ModelOrderList& providers);
+		/// Add the owners of ports connected to outputs of this model to \a dependants, once each
+		void collectDataDependants(ModelOrderList& dependants);
 	private:
 		bool warnflag, errflag;
 		std::string warnstr, errstr;
 		int update_frequency;
-		typedef std::map<std::string, Port*> PortList;
-		PortList ports;
-		typedef std::map<const Port*, std::string> PortDescriptionList;
-		PortDescriptionList port_descriptions;
-		typedef std::map<std::string, Parameter> ParameterList;
-		ParameterList parameters;
+		bool pinned;
+		struct PortEntry {
+			std::string name, description;
+			Port* port;
+		};
+		typedef std::vector<PortEntry*> PortList;
+		PortList ports; ///< inputs first, then outputs, each sorted by name, owned by the model
+		unsigned int numinputs;
+		NameIndex<PortEntry*> port_index;
+		typedef std::vector<Parameter> ParameterList;
+		ParameterList parameters; ///< sorted by name
+		NameIndex<Parameter> parameter_index;
+		/// Add \a port as \a name, replacing the port of that name if there is one
+		void insertPort(const std::string& name, Port& port, const std::string& description);
+		void erasePort(const unsigned int index);
+		/// Add \a param, replacing the parameter of that name if there is one
+		void insertParameter(const Parameter& param);
+		/// Remove this model and the models under it from the dependency graph they are in
+		void leaveDependencyGraph();
+		/// \throw ModelException if there is no parameter named \a name
+		Parameter& getParameterEntry(const std::string& name);
 		Group* parent;
+		/// Providers and dependants of models outside groups, see getDependencyGraph()
 		ModelOrderList traversalDependants, traversalProviders;
+		bool dependencies_valid;
+		DependencyGraph* graph; ///< graph this model is in, if any
+		unsigned int graph_node; ///< index in \c graph
+		unsigned long visit_marks[NUM_VISIT_MARKS]; ///< traversal in which each visitor slot last visited this model
+		OpenThreads::Atomic topology_revision;
+		static OpenThreads::Atomic last_topology_revision; ///< the revision handed out last
 		
 		friend class Group;
+		friend class DependencyGraph;
+		friend class ModelVisitor;
+	};
+	
+	/// A model parameter resolved once, for fast repeated access, see Model::getParameterHandle()
+	/** Keeps a typed pointer to the parameter and the scale factor from the unit of the handle to
+	 the unit of the parameter, so that get() and set() don't look up names or parse units. Like
+	 a Port pointer, a handle must not be used after its model has been deleted.
+	 */
+	class SIMBLOX_API ParameterHandle
+	{
+	public:
+		ParameterHandle() : model(NULL), ptr(NULL), type(Model::Parameter::DOUBLE), scale(1) {}
+		
+		bool valid() const { return ptr != NULL; }
+		Model* getModel() const { return model; }
+		Model::Parameter::Type getType() const { return type; }
+		/// Get the factor converting values in the unit of the handle to the unit of the parameter
+		double getScale() const { return scale; }
+		
+		/// Set the parameter to \a value, in the unit of the handle
+		void set(const double value) const;
+		/// Get the value of a numeric parameter, in the unit of the handle
+		/** \throw ModelException for STRING parameters */
+		double get() const;
+		
+	protected:
+		ParameterHandle(Model* nmodel, const Model::Parameter& param, const double nscale)
+		: model(nmodel), ptr(param.ptr), type(param.type), scale(nscale) {}
+		
+		Model* model;
+		void* ptr;
+		Model::Parameter::Type type;
+		double scale;
+		
+		friend class Model;
+	};
+	
+	/// Parameter changes that are applied together
+	/** The set is filled by the thread making the changes, without any locking, and is then applied
+	 at once, e.g. between two steps by Simulation::applyParameterSet().
+	 */
+	class SIMBLOX_API ParameterSet
+	{
+	public:
+		/// Add a change of the parameter of \a handle to \a value, in the unit of the handle
+		void add(const ParameterHandle& handle, const double value) { changes.push_back(Change(handle, value)); }
+		/// Add a change of a parameter by name, see Model::getParameterHandle()
+		void add(Model& model, const std::string& name, const double value, const std::string& unit = "")
+		{
+			add(model.getParameterHandle(name, unit), value);
+		}
+		/// Add the changes of \a set after those of this set
+		void add(const ParameterSet& set) { changes.insert(changes.end(), set.changes.begin(), set.changes.end()); }
+		/// Set all parameters, in the order the changes were added
+		void apply() const;
+		void clear() { changes.clear(); }
+		void swap(ParameterSet& other) { changes.swap(other.changes); }
+		unsigned int size() const { return changes.size(); }
+		bool empty() const { return changes.empty(); }
+		
+	protected:
+		typedef std::pair<ParameterHandle, double> Change;
+		std::vector<Change> changes;
 	};
 	
 	class SIMBLOX_API ModelException : public std::exception {
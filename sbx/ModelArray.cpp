@@ -0,0 +1,274 @@
+#include "ModelArray.h"
+#include "ModelFactory.h"
+#include "XMLParser.h"
+#include "Log.h"
+#include <sstream>
+
+namespace sbx
+{
+
+	REGISTER_Object(sbx, ModelArray);
+
+	ModelArray::ModelArray(const std::string& name)
+	:	Model(name),
+		kernel(NULL),
+		size(0),
+		batched(false),
+		bound(false)
+	{
+		registerParameter(&modelname, Parameter::STRING, "model", "", "Model class of the elements, e.g. op_Multiply");
+		registerParameter(&size, Parameter::UINTEGER, "size", "", "Number of elements");
+	}
+
+	/** Elements are cloned with their parameters. */
+	ModelArray::ModelArray(const ModelArray& source)
+	:	Model(source),
+		kernel(NULL),
+		modelname(source.modelname),
+		size(0),
+		batched(false),
+		bound(false)
+	{
+		copyParameter(source, "model", &modelname);
+		copyParameter(source, "size", &size);
+		if (source.prototype.valid()) {
+			prototype = (Model*) source.prototype->clone();
+			kernel = dynamic_cast<BatchModel*>(prototype.get());
+		}
+		for (unsigned int i = 0; i < source.elements.size(); i++) {
+			Model* element = (Model*) source.elements[i]->clone();
+			elements.push_back(element);
+			registerElement(*element);
+		}
+		size = elements.size();
+	}
+
+	ModelArray::~ModelArray()
+	{
+		bindOutputs(false);
+		while (!elements.empty()) {
+			releaseElement(*elements.back());
+			elements.pop_back();
+		}
+	}
+
+	/** The parameters of the array element, other than those of the array itself, are parsed by the
+	 prototype, so they apply to all elements. Then \c element children are parsed by the elements
+	 with the given \c index.
+	 \throw ParseException for unknown models or element indices out of range */
+	void ModelArray::parseXML(const TiXmlElement* element)
+	{
+		Model::parseXML(element);
+		if (!modelname.empty() || !prototype.valid()) {
+			Model* model = ModelFactory::instance().create(modelname);
+			if (!model)
+				throw ParseException("Unknown model '" + modelname + "' in model array '" + getName() + "'", element);
+			model->parseXML(element);
+			model->setName(model->className());
+			setPrototype(model);
+		}
+		for (const TiXmlElement* elem = element->FirstChildElement("element"); elem; elem = elem->NextSiblingElement("element")) {
+			int index = XMLParser::parseIntAttribute(elem, "index");
+			if (index < 0 || index >= (int) elements.size())
+				throw ParseException("Element index out of range in model array '" + getName() + "'", elem);
+			elements[index]->parseXML(elem);
+		}
+	}
+
+	void ModelArray::writeXML(TiXmlElement* element)
+	{
+		if (prototype.valid())
+			prototype->writeXML(element);
+		Model::writeXML(element);
+		for (unsigned int i = 0; i < elements.size(); i++) {
+			TiXmlElement* elem = new TiXmlElement("element");
+			elem->SetAttribute("index", i);
+			elements[i]->writeXML(elem);
+			elem->RemoveAttribute("name");
+			element->LinkEndChild(elem);
+		}
+	}
+
+	void ModelArray::configure()
+	{
+		for (unsigned int i = 0; i < elements.size(); i++)
+			elements[i]->configure();
+	}
+
+	/** Elements are initialized with their outputs unbound, and their values are then copied into the
+	 output columns. Unconnected inputs are set to their default values, and if one has none the
+	 elements are updated one by one instead, so that reading it throws as usual.
+	 \throw ModelException if the elements don't all have the same ports */
+	void ModelArray::init()
+	{
+		bindOutputs(false);
+		batched = false;
+		for (unsigned int i = 0; i < elements.size(); i++)
+			elements[i]->init();
+		columns.clear();
+		inports.clear();
+		outports.clear();
+		if (!kernel || elements.empty())
+			return;
+		Model& first = *elements[0];
+		unsigned int numports = first.getNumPorts();
+		columns.resize(numports);
+		inports.resize(numports);
+		outports.resize(numports);
+		for (unsigned int p = 0; p < numports; p++) {
+			columns[p].name = first.getPortName(p);
+			for (unsigned int i = 0; i < elements.size(); i++) {
+				if (elements[i]->getNumPorts() != numports || elements[i]->getNumInputs() != first.getNumInputs())
+					throw ModelException("Elements of a model array must have the same ports", this);
+				Port* port = elements[i]->getPort(p);
+				if (p < first.getNumInputs()) {
+					if (InPort<double>* in = dynamic_cast<InPort<double>*>(port))
+						inports[p].push_back(in);
+				} else if (OutPort<double>* out = dynamic_cast<OutPort<double>*>(port))
+					outports[p].push_back(out);
+			}
+			if (!inports[p].empty() || !outports[p].empty())
+				columns[p].values.assign(elements.size(), 0);
+			for (unsigned int i = 0; i < inports[p].size(); i++) {
+				InPort<double>* in = inports[p][i];
+				if (in->isConnected())
+					continue;
+				// Unconnected inputs keep their default value, without one they can't be read at all
+				if (!in->isValid()) {
+					columns.clear();
+					inports.clear();
+					outports.clear();
+					return;
+				}
+				columns[p].values[i] = in->get();
+			}
+			for (unsigned int i = 0; i < outports[p].size(); i++)
+				columns[p].values[i] = outports[p][i]->get();
+		}
+		column_index.rebuild(columns);
+		kernel->initBatch(*this);
+		bindOutputs(kernel->usesPortColumns());
+		batched = true;
+	}
+
+	void ModelArray::update(const double dt)
+	{
+		if (!batched) {
+			for (unsigned int i = 0; i < elements.size(); i++)
+				elements[i]->update(dt);
+			return;
+		}
+		for (unsigned int p = 0; bound && p < inports.size(); p++) {
+			const std::vector< InPort<double>* >& ports = inports[p];
+			if (ports.empty())
+				continue;
+			double* values = &columns[p].values[0];
+			for (unsigned int i = 0; i < ports.size(); i++)
+				if (ports[i]->isConnected())
+					values[i] = ports[i]->get();
+		}
+		kernel->updateBatch(*this, dt, 0, elements.size());
+	}
+
+	void ModelArray::display(const DisplayMode mode)
+	{
+		for (unsigned int i = 0; i < elements.size(); i++)
+			elements[i]->display(mode);
+	}
+
+	const int ModelArray::getMinimumUpdateFrequency()
+	{
+		return prototype.valid() ? prototype->getMinimumUpdateFrequency() : 0;
+	}
+
+	const bool ModelArray::isEndPoint()
+	{
+		return prototype.valid() && prototype->isEndPoint();
+	}
+
+	void ModelArray::setPrototype(Model* model)
+	{
+		smrt::ref_ptr<Model> keep = model;
+		unsigned int num = size;
+		setSize(0);
+		prototype = model;
+		kernel = dynamic_cast<BatchModel*>(model);
+		if (model)
+			modelname = std::string(model->libraryName()) + "_" + model->className();
+		setSize(num);
+	}
+
+	/// \throw ModelException if elements are added without a prototype
+	void ModelArray::setSize(const unsigned int num)
+	{
+		bindOutputs(false);
+		batched = false;
+		columns.clear();
+		inports.clear();
+		outports.clear();
+		while (elements.size() > num) {
+			releaseElement(*elements.back());
+			elements.pop_back();
+		}
+		if (num > elements.size() && !prototype.valid())
+			throw ModelException("Model array has no prototype to clone elements from", this);
+		while (elements.size() < num) {
+			Model* element = (Model*) prototype->clone();
+			std::stringstream ss;
+			ss << prototype->getName() << elements.size();
+			element->setName(ss.str());
+			elements.push_back(element);
+			registerElement(*element);
+		}
+		size = num;
+		touchTopology();
+	}
+
+	double* ModelArray::getColumn(const std::string& name)
+	{
+		int index = column_index.find(name, columns);
+		if (index < 0 || columns[index].values.size() != elements.size())
+			throw ModelException("No column '" + name + "' in model array", this);
+		return columns[index].values.empty() ? NULL : &columns[index].values[0];
+	}
+
+	/** Pointers to other columns may move when a column is added. */
+	double* ModelArray::addColumn(const std::string& name)
+	{
+		int index = column_index.find(name, columns);
+		if (index < 0) {
+			Column column;
+			column.name = name;
+			columns.push_back(column);
+			column_index.rebuild(columns);
+			index = columns.size()-1;
+		}
+		columns[index].values.resize(elements.size(), 0);
+		return columns[index].values.empty() ? NULL : &columns[index].values[0];
+	}
+
+	void ModelArray::registerElement(Model& element)
+	{
+		for (unsigned int p = 0; p < element.getNumPorts(); p++) {
+			Port* port = element.getPort(p);
+			registerPort(*port, element.getName() + "." + element.getPortName(p), port->getUnit(), element.getPortDescription(port));
+		}
+	}
+
+	void ModelArray::releaseElement(Model& element)
+	{
+		for (unsigned int p = 0; p < element.getNumPorts(); p++)
+			unregisterPort(*element.getPort(p));
+	}
+
+	void ModelArray::bindOutputs(const bool bind)
+	{
+		if (bind == bound)
+			return;
+		for (unsigned int p = 0; p < outports.size(); p++)
+			for (unsigned int i = 0; i < outports[p].size(); i++)
+				outports[p][i]->setPtr(bind ? &columns[p].values[i] : NULL);
+		bound = bind;
+	}
+
+}
@@ -0,0 +1,113 @@
+#ifndef SBX_MODELARRAY_H
+#define SBX_MODELARRAY_H
+
+#include "Export.h"
+#include "Model.h"
+#include "Ports.h"
+#include "NameIndex.h"
+#include <smrt/ref_ptr.h>
+#include <vector>
+
+namespace sbx
+{
+
+	class ModelArray;
+
+	/// Interface of models that a ModelArray can update all at once, see ModelArray
+	class SIMBLOX_API BatchModel
+	{
+	public:
+		virtual ~BatchModel() {}
+		/// Set up state columns (see ModelArray::addColumn()), after all elements have been initialized
+		virtual void initBatch(ModelArray& array) {}
+		/// Update elements \a first to \a first+count-1, reading and writing the columns of \a array
+		virtual void updateBatch(ModelArray& array, const double dt, const unsigned int first, const unsigned int count) = 0;
+		/// Does updateBatch() read and write the port columns? Otherwise the elements transfer their own port values, and the columns aren't kept up to date
+		virtual bool usesPortColumns() const { return true; }
+	};
+
+	/// A number of instances of one model class, updated as one model
+	/** The elements are clones of a prototype model, named after it with the element index appended.
+	 Their ports are taken over by the array, as "<element>.<port>" (e.g. "Multiply3.c"), so that
+	 connections to them make models depend on the array, which is scheduled and updated as a whole.
+
+	 If the model class implements BatchModel, the values of its double ports are stored structure
+	 of arrays, one column per port with one value per element. Before each update the connected
+	 inputs are gathered into their columns (the others hold their default values), and
+	 BatchModel::updateBatch() computes the output columns in loops the compiler can vectorize,
+	 which the output ports read directly (see OutPort::setPtr()), unless the elements transfer
+	 their own port values (see BatchModel::usesPortColumns()). Kernels can keep state in columns
+	 of their own. Other model classes are updated element by element.
+
+	 In XML the model class and number of elements are given as parameters. Other parameters apply to
+	 all elements, and \c element children set parameters of single elements:
+	 \verbatim
+	 <sbx_ModelArray name="gains">
+	   <model value="op_Multiply"/>
+	   <size value="100"/>
+	   <element index="3"> ... </element>
+	 </sbx_ModelArray>
+	 \endverbatim
+	 */
+	class SIMBLOX_API ModelArray : public Model
+	{
+	public:
+		ModelArray(const std::string& name = "ModelArray");
+		ModelArray(const ModelArray& source);
+		META_Model(sbx, ModelArray, "Array of identical models, updated in batches");
+
+		virtual void parseXML(const TiXmlElement* element);
+		virtual void writeXML(TiXmlElement* element);
+		virtual void configure();
+		virtual void init();
+		virtual void update(const double dt);
+		virtual void display(const DisplayMode mode = DISPLAY_USER);
+		virtual const int getMinimumUpdateFrequency();
+		virtual const bool isEndPoint();
+
+		/// Set the model the elements are cloned from, replacing all elements
+		void setPrototype(Model* model);
+		Model* getPrototype() { return prototype.get(); }
+		/// Set the number of elements, cloning the prototype for new ones
+		void setSize(const unsigned int size);
+		unsigned int getSize() const { return elements.size(); }
+		Model* getElement(const unsigned int index) { return elements[index].get(); }
+		/// Is the array updated by the BatchModel kernel of the prototype?
+		bool isBatched() const { return kernel != NULL; }
+
+		/// Get the values of a port (by the element's port name) or state column, one per element
+		/** Columns are set up by init() and stay put until the next init().
+		 \throw ModelException if there is no such column */
+		double* getColumn(const std::string& name);
+		/// Add a state column of zeros, or get it if it exists, see BatchModel::initBatch()
+		double* addColumn(const std::string& name);
+
+	protected:
+		virtual ~ModelArray();
+
+		struct Column {
+			std::string name;
+			std::vector<double> values;
+		};
+		/// Take over the ports of \a element
+		void registerElement(Model& element);
+		void releaseElement(Model& element);
+		/// Point the double output ports of all elements into their columns, or back at their own values
+		void bindOutputs(const bool bind);
+
+		smrt::ref_ptr<Model> prototype;
+		std::vector< smrt::ref_ptr<Model> > elements;
+		BatchModel* kernel;
+		std::vector<Column> columns; ///< one per port of an element (inputs first), then state columns
+		NameIndex<Column> column_index;
+		std::vector< std::vector< InPort<double>* > > inports; ///< double input ports by port index, then element
+		std::vector< std::vector< OutPort<double>* > > outports; ///< double output ports by port index, then element
+		std::string modelname;
+		unsigned int size;
+		bool batched; ///< initialized for updates by the kernel
+		bool bound;
+	};
+
+}
+
+#endif
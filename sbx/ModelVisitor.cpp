@@ -1,30 +1,118 @@
 #include "ModelVisitor.h"
 #include "Model.h"
 #include "Group.h"
+#include "DependencyGraph.h"
+#include "Ports.h"
 #include "Log.h"
 #include "Timer.h"
+#include "OperatorModels.h"
+#include "BlackBox.h"
+#include "TinyXML/tinyxml.h"
 #include <numerix/misc.h>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
 #include <math.h>
+#include <algorithm>
 
 namespace sbx
 {
 	
+	namespace {
+		/// Which visit mark slots of models are in use, and the last epoch of each
+		struct VisitSlots {
+			VisitSlots() { std::fill(used, used+NUM_VISIT_MARKS, false); std::fill(epochs, epochs+NUM_VISIT_MARKS, 0); }
+			OpenThreads::Mutex mutex;
+			bool used[NUM_VISIT_MARKS];
+			unsigned long epochs[NUM_VISIT_MARKS];
+		};
+		
+		VisitSlots& getVisitSlots()
+		{
+			static VisitSlots slots;
+			return slots;
+		}
+	}
+	
 	ModelVisitor::ModelVisitor()
-	:	traversalmode(DEPENDENT),
-	visitcount(0)
-	{ 
+	:	visitslot(-1),
+		visitepoch(0),
+		visitdepth(0),
+		traversalmode(DEPENDENT),
+		visitcount(0)
+	{
 	}
 	
-	void ModelVisitor::visit(Model& model)
+	/** The copy is not in a traversal, whether or not \a source is. */
+	ModelVisitor::ModelVisitor(const ModelVisitor& source)
+	:	visitslot(-1),
+		visitepoch(0),
+		visitdepth(0),
+		traversalmode(source.traversalmode),
+		visitcount(source.visitcount)
 	{
-		if (traversalmode == PARALLEL) {
-			if (!pool) {
-				pool = new TaskThreadPool(NUM_VISITOR_TASKTHREADS);
-				pool->start();
-			}
-			pool->setInhibit(true);
+	}
+	
+	ModelVisitor::~ModelVisitor()
+	{
+		if (visitdepth > 0) {
+			visitdepth = 1;
+			endTraversal();
+		}
+	}
+	
+	ModelVisitor& ModelVisitor::operator=(const ModelVisitor& source)
+	{
+		traversalmode = source.traversalmode;
+		visitcount = source.visitcount;
+		return *this;
+	}
+	
+	/** The outermost traversal takes a free slot. Each traversal, including nested ones on the
+	 same visitor, starts a new epoch of the slot, so marks left by earlier traversals (also of other
+	 visitors that had the slot) are never current. Without a free slot, the visitor falls back to
+	 clearing its VisitedMap.
+	 */
+	void ModelVisitor::beginTraversal()
+	{
+		VisitSlots& slots = getVisitSlots();
+		if (visitdepth++ == 0) {
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(slots.mutex);
+			for (int i = 0; i < NUM_VISIT_MARKS && visitslot < 0; i++)
+				if (!slots.used[i]) {
+					slots.used[i] = true;
+					visitslot = i;
+				}
+			if (visitslot < 0)
+				dout(4) << "All " << NUM_VISIT_MARKS << " visit mark slots are taken, using a map\n";
+		}
+		if (visitslot >= 0)
+			visitepoch = ++slots.epochs[visitslot];
+		else
+			visited.clear();
+	}
+	
+	void ModelVisitor::endTraversal()
+	{
+		if (visitdepth == 0 || --visitdepth > 0)
+			return;
+		if (visitslot >= 0) {
+			VisitSlots& slots = getVisitSlots();
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(slots.mutex);
+			slots.used[visitslot] = false;
+			visitslot = -1;
 		}
 		visited.clear();
+	}
+	
+	/** DEPENDENT traversals sample which models are endpoints once per visit, see DependencyGraph. */
+	void ModelVisitor::visit(Model& model)
+	{
+		if (traversalmode == DEPENDENT)
+			invalidateEndPoints(model);
+		if (traversalmode == PARALLEL)
+			getPool()->setInhibit(true);
+		TraversalScope scope(*this);
 		model.accept(*this);
 		if (traversalmode == PARALLEL) {
 			pool->setInhibit(false);
@@ -35,11 +123,16 @@ namespace sbx
 	
 	void ModelVisitor::apply(Group& group)
 	{
-		if (visited[&group])
+		if (isVisited(group))
 			return;
 		group.traverse(*this);
 		apply((Model&)group);
-		visited[&group] = true;
+		setVisited(group);
+	}
+	
+	bool ModelVisitor::isRequired(Model& model)
+	{
+		return traversalmode != DEPENDENT || model.asGroup() || model.isEndPoint() || model.hasEndPointDependants();
 	}
 	
 	void ModelVisitor::reset()
@@ -47,6 +140,26 @@ namespace sbx
 		visitcount = 0;
 	}
 	
+	void ModelVisitor::invalidateEndPoints(Model& model)
+	{
+		if (DependencyGraph* dependencies = model.getDependencyGraph())
+			dependencies->sampleEndPoints();
+	}
+	
+	TaskThreadPool* ModelVisitor::getPool()
+	{
+		if (!pool) {
+			int numthreads = NUM_VISITOR_TASKTHREADS;
+			if (numthreads <= 0)
+				numthreads = OpenThreads::GetNumberOfProcessors();
+			if (numthreads <= 0)
+				numthreads = 1;
+			pool = new TaskThreadPool(numthreads);
+			pool->start();
+		}
+		return pool;
+	}
+	
 	TaskThreadPool* ModelVisitor::pool = NULL;
 	
 	ConfigureVisitor::ConfigureVisitor()
@@ -57,9 +170,9 @@ namespace sbx
 	
 	void ConfigureVisitor::apply(Model& model)
 	{
-		if (!visited[&model])
+		if (!isVisited(model))
 			model.configure();
-		visited[&model] = true;
+		setVisited(model);
 	}
 	
 	class InitTask : public Task {
@@ -84,7 +197,7 @@ namespace sbx
 	
 	void InitVisitor::apply(Model& model)
 	{
-		if (visited[&model])
+		if (isVisited(model))
 			return;
 		if (traversalmode == DEPENDENT)
 			model.traverse(*this);
@@ -99,24 +212,24 @@ namespace sbx
 		dout(4) << "\n";
 
 		if (traversalmode == PARALLEL)
-			pool->schedule(new InitTask(model));
+			getPool()->schedule(new InitTask(model));
 		else
 			model.init();
-		visited[&model] = true;
+		setVisited(model);
 		if (dostats)
 			stats[&model] += timer.time_s();
 	}
 	
 	void InitVisitor::apply(Group& group)
 	{
-		if (visited[&group])
+		if (isVisited(group))
 			return;
 		Timer timer;
 		dout(4) << "init traverse " << group.getName() << "\n";
 		group.traverse(*this);
 		dout(4) << "init " << group.getName() << "\n";
 		group.init();
-		visited[&group] = true;
+		setVisited(group);
 		if (dostats)
 			stats[&group] += timer.time_s();
 	}
@@ -136,94 +249,865 @@ namespace sbx
 		double dt;
 	};
 	
+	class ScheduleTask : public Task {
+	public:
+		ScheduleTask(const ScheduleEntry& nentry, const unsigned int& nnumupdates) : entry(nentry), numupdates(nnumupdates) {}
+		virtual void perform()
+		{
+			for (unsigned int r = 0; r < numupdates; r++)
+				entry.model->update(entry.dt);
+		}
+		const ScheduleEntry& entry;
+		const unsigned int& numupdates;
+	};
+	
+	class RateGroupTask : public Task {
+	public:
+		RateGroupTask(const UpdateSchedule& nschedule, const RateGroup& ngroup) : schedule(nschedule), group(ngroup), numupdates(0) {}
+		virtual void perform()
+		{
+			for (std::vector<unsigned int>::const_iterator i = group.entries.begin(); i != group.entries.end(); i++)
+				for (unsigned int r = 0; r < numupdates; r++)
+					schedule[*i].model->update(group.dt);
+		}
+		const UpdateSchedule& schedule;
+		const RateGroup& group;
+		unsigned int numupdates;
+	};
+	
+	/// Longest hyperperiod (in simulation steps) for which the rate group updates are tabulated
+	static const unsigned int MAX_TABULATED_HYPERPERIOD = 10000;
+	
+	static unsigned long gcd(unsigned long a, unsigned long b)
+	{
+		while (b) {
+			unsigned long t = a % b;
+			a = b;
+			b = t;
+		}
+		return a;
+	}
+	
 	UpdateVisitor::UpdateVisitor(const double dt)
 	:	ModelVisitor(),
-		dostats(false)
+		dostats(false),
+		schedule_root(NULL),
+		schedule_revision(0),
+		schedule_mode(DEPENDENT),
+		useschedule(true),
+		compiled(false),
+		compiling(false),
+		background(false),
+		hyperperiod(1),
+		backgroundthreads_enabled(true),
+		modeltasks_revision(0),
+		delay(DELAY_NONE),
+		delay_root(NULL),
+		delay_revision(0),
+		changepropagation(false),
+		executed(0),
+		skipped(0),
+		fusion(false),
+		numfused(0),
+		numpruned(0)
 	{
 		frequency = (int) round(1.0/dt);
 	}
 	
+	UpdateVisitor::~UpdateVisitor()
+	{
+		clearBackground();
+		clearDelayedPorts();
+	}
+	
+	/** When using a compiled schedule (the default, see useSchedule()), the schedule is (re)compiled
+	 here if the topology of the models has changed since it was last compiled. Statistics still walk
+	 the model tree on each visit.
+	 */
 	void UpdateVisitor::visit(Model& model)
 	{
 		Timer timer;
 		stats.clear();
-		ModelVisitor::visit(model);
+		if (modeltasks_revision != model.getTopologyRevision()) {
+			modeltasks.clear();
+			modeltasks_revision = model.getTopologyRevision();
+		}
+		if (delay != DELAY_NONE) {
+			if (delay_root != &model || delay_revision != model.getTopologyRevision()) {
+				waitBackground();
+				clearDelayedPorts();
+				collectDelayedPorts(model);
+				delay_root = &model;
+				delay_revision = model.getTopologyRevision();
+			}
+			for (std::vector<OutputPort*>::iterator i = committedports.begin(); i != committedports.end(); i++)
+				(*i)->commit();
+		}
+		if (useschedule && !dostats) {
+			if (!isCompiled(model))
+				compile(model);
+			runSchedule();
+			visitcount++;
+		} else
+			ModelVisitor::visit(model);
 		totaltime += timer.time_s();
 	}
 	
 	void UpdateVisitor::setTimeStep(const double dt)
 	{
 		frequency = (int) round(1.0/dt);
+		invalidate();
+	}
+	
+	/** The compiled schedule is a flat list of the updates that a traversal of \a root would perform,
+	 in the same order. Models skipped by a DEPENDENT traversal (i.e. without endpoint dependants) are
+	 left out, so changes to Model::isEndPoint() are picked up only when the schedule is recompiled.
+	 
+	 In PARALLEL traversal mode the schedule is compiled in DEPENDENT order and then grouped into
+	 levels by computeLevels(), so that a parallel step gives the same results as a DEPENDENT one.
+	 Entries are also grouped by update frequency into rate groups, see computeRateGroups().
+	 */
+	void UpdateVisitor::compile(Model& root)
+	{
+		clearBackground();
+		schedule.clear();
+		levels.clear();
+		rategroups.clear();
+		scheduletasks.clear();
+		TraversalScope scope(*this);
+		TraversalMode mode = traversalmode;
+		if (mode == PARALLEL)
+			traversalmode = DEPENDENT;
+		compiling = true;
+		invalidateEndPoints(root);
+		try {
+			root.accept(*this);
+		} catch (...) {
+			compiling = false;
+			compiled = false;
+			traversalmode = mode;
+			throw;
+		}
+		compiling = false;
+		traversalmode = mode;
+		fusedmodels.clear();
+		numfused = 0;
+		if (fusion)
+			fuseOperators(root);
+		computeRateGroups();
+		collectBackgroundPorts(root);
+		changetrackers.clear();
+		if (changepropagation)
+			computeChangeTrackers();
+		if (traversalmode == PARALLEL) {
+			computeLevels();
+			for (UpdateSchedule::iterator i = schedule.begin(); i != schedule.end(); i++)
+				scheduletasks.push_back(new ScheduleTask(*i, numupdates[i->group]));
+		}
+		schedule_root = &root;
+		schedule_revision = root.getTopologyRevision();
+		schedule_mode = traversalmode;
+		compiled = true;
+		dout(4) << "compiled update schedule for " << root.getName() << ", " << schedule.size() << " entries in "
+			<< rategroups.size() << " rate groups, hyperperiod " << hyperperiod;
+		if (traversalmode == PARALLEL)
+			dout(4) << ", " << levels.size() << " levels";
+		if (numfused > 0)
+			dout(4) << ", " << numfused << " models fused";
+		dout(4) << "\n";
+	}
+	
+	/** A rate group updated at \e f Hz, with the simulation at \e F Hz, is updated f/F times per step.
+	 Fractions are accumulated from step to step (see getNumUpdates()), so the update pattern repeats
+	 after F/gcd(f,F) steps, which is the period of the rate group. The updates of all rate groups are
+	 tabulated over the hyperperiod, i.e. the least common multiple of the periods, unless it is longer
+	 than MAX_TABULATED_HYPERPERIOD steps.
+	 */
+	void UpdateVisitor::computeRateGroups()
+	{
+		for (unsigned int i = 0; i < schedule.size(); i++)
+			rategroups[schedule[i].group].entries.push_back(i);
+		unsigned long long period = 1;
+		for (RateGroups::iterator g = rategroups.begin(); g != rategroups.end(); g++) {
+			if (period <= MAX_TABULATED_HYPERPERIOD)
+				period = period / gcd(period, g->period) * g->period;
+			if (background && g->frequency < frequency) {
+				g->background = true;
+				if (backgroundthreads_enabled) {
+					backgroundthreads.push_back(new TaskThread);
+					backgroundthreads.back()->start();
+				} else
+					backgroundthreads.push_back(NULL);
+				backgroundtasks.push_back(new RateGroupTask(schedule, *g));
+			} else {
+				backgroundthreads.push_back(NULL);
+				backgroundtasks.push_back(NULL);
+			}
+		}
+		numupdates.assign(rategroups.size(), 0);
+		updatetable.clear();
+		if (period > MAX_TABULATED_HYPERPERIOD) {
+			hyperperiod = 0;
+			return;
+		}
+		hyperperiod = period;
+		updatetable.reserve(hyperperiod*rategroups.size());
+		for (unsigned int step = 0; step < hyperperiod; step++)
+			for (RateGroups::iterator g = rategroups.begin(); g != rategroups.end(); g++)
+				updatetable.push_back(getNumUpdates(g->frequency, step));
+	}
+	
+	/** Runs of at least two operators (not counting Constants) are fused. A run only spans entries of
+	 one rate group, and nothing else is updated between its models, so evaluating them in order
+	 within one update gives the same values. */
+	void UpdateVisitor::fuseOperators(Model& root)
+	{
+		UpdateSchedule fused;
+		for (unsigned int i = 0; i < schedule.size(); ) {
+			unsigned int g = schedule[i].group;
+			unsigned int end = i, numoperators = 0;
+			if (rategroups[g].frequency <= frequency) {
+				for (; end < schedule.size() && schedule[end].group == g && op::FusedOperators::isFusible(*schedule[end].model); end++)
+					if (!dynamic_cast<op::Constant*>(schedule[end].model))
+						numoperators++;
+			}
+			if (numoperators < 2) {
+				fused.push_back(schedule[i++]);
+				continue;
+			}
+			smrt::ref_ptr<op::FusedOperators> model = new op::FusedOperators;
+			for (unsigned int j = i; j < end; j++)
+				model->addModel(*schedule[j].model);
+			model->compile(root, *this);
+			fusedmodels.push_back(model.get());
+			fused.push_back(ScheduleEntry(model.get(), g, schedule[i].dt));
+			numfused += end-i;
+			i = end;
+		}
+		schedule.swap(fused);
+	}
+	
+	namespace {
+		/// Add \a model and all models under it to \a models, parents before their children
+		void collectModels(Model& model, std::vector<Model*>& models)
+		{
+			models.push_back(&model);
+			if (Group* group = model.asGroup())
+				for (unsigned int i = 0; i < group->getNumChildren(); i++)
+					collectModels(*group->getChild(i), models);
+		}
+		
+		bool isPinnedTree(Model& model)
+		{
+			for (Model* m = &model; m; m = m->getParent())
+				if (m->isPinned())
+					return true;
+			return false;
+		}
+		
+		/// Returns true if a variable registered for \a model, or an output of it, is in \a logged
+		bool isLogged(Model& model, const std::set<const void*>& logged)
+		{
+			if (logged.count(&model))
+				return true;
+			for (unsigned int p = model.getNumInputs(); p < model.getNumPorts(); p++) {
+				OutPort<double>* out = dynamic_cast<OutPort<double>*>(model.getPort(p));
+				if (out && out->getOwner() == &model && logged.count(&out->getRef()))
+					return true;
+			}
+			return false;
+		}
+	}
+	
+	/** The models needed are found by a backward search along the data providers from the models
+	 needed for their own sake, so each connection is followed once. */
+	void UpdateVisitor::prune(Model& root)
+	{
+		clearPruning();
+		std::vector<Model*> models;
+		collectModels(root, models);
+		std::map<const Model*, unsigned int> index;
+		for (unsigned int i = 0; i < models.size(); i++)
+			index[models[i]] = i;
+		
+		std::set<const void*> logged;
+		BlackBox& blackbox = BlackBox::instance();
+		for (unsigned int h = 0; h < blackbox.getNumHandlers(); h++) {
+			const std::vector<unsigned int>& subscriptions = blackbox.getHandler(h)->getSubscriptions();
+			for (unsigned int v = 0; v < subscriptions.size(); v++) {
+				logged.insert(blackbox.getVariable(subscriptions[v]).group_ptr);
+				logged.insert(blackbox.getVariable(subscriptions[v]).value_ptr);
+			}
+		}
+		
+		// NULL for models not needed (yet)
+		std::vector<const char*> reasons(models.size(), (const char*) NULL);
+		std::vector<unsigned int> queue;
+		for (unsigned int i = 0; i < models.size(); i++) {
+			Model& model = *models[i];
+			if (model.isEndPoint())
+				reasons[i] = "endpoint";
+			else if (isPinnedTree(model))
+				reasons[i] = "pinned";
+			else if (isLogged(model, logged))
+				reasons[i] = "logged";
+			if (reasons[i])
+				queue.push_back(i);
+		}
+		while (queue.size() > 0) {
+			unsigned int i = queue.back();
+			queue.pop_back();
+			ModelOrderList& providers = models[i]->getDataProviders();
+			for (ModelOrderList::iterator p = providers.begin(); p != providers.end(); p++) {
+				std::map<const Model*, unsigned int>::iterator it = index.find(p->get());
+				if (it != index.end() && !reasons[it->second]) {
+					reasons[it->second] = "provider";
+					queue.push_back(it->second);
+				}
+			}
+		}
+		for (unsigned int i = 0; i < models.size(); i++) {
+			if (!reasons[i])
+				continue;
+			for (Group* parent = models[i]->getParent(); parent; parent = parent->getParent()) {
+				std::map<const Model*, unsigned int>::iterator it = index.find(parent);
+				if (it == index.end() || reasons[it->second])
+					break;
+				reasons[it->second] = "parent";
+			}
+		}
+		
+		for (unsigned int i = 0; i < models.size(); i++) {
+			PruningEntry entry;
+			entry.model = models[i];
+			entry.pruned = (reasons[i] == NULL);
+			if (!entry.pruned)
+				entry.reason = reasons[i];
+			else if (models[i]->asGroup())
+				entry.reason = "empty";
+			else if (models[i]->hasDataDependants())
+				entry.reason = "unused";
+			else
+				entry.reason = "unread";
+			if (entry.pruned)
+				numpruned++;
+			pruning_index[models[i]] = pruning.size();
+			pruning.push_back(entry);
+		}
+		invalidate();
+		dout(2) << "Pruned " << numpruned << " of " << models.size() << " models\n";
+	}
+	
+	void UpdateVisitor::clearPruning()
+	{
+		if (pruning.empty())
+			return;
+		pruning.clear();
+		pruning_index.clear();
+		numpruned = 0;
+		invalidate();
+	}
+	
+	bool UpdateVisitor::isPruned(const Model& model) const
+	{
+		std::map<const Model*, unsigned int>::const_iterator it = pruning_index.find(&model);
+		return it != pruning_index.end() && pruning[it->second].pruned;
+	}
+	
+	void UpdateVisitor::writePruningReport(TiXmlElement* element) const
+	{
+		element->SetAttribute("models", pruning.size());
+		element->SetAttribute("pruned", numpruned);
+		for (std::vector<PruningEntry>::const_iterator i = pruning.begin(); i != pruning.end(); i++) {
+			TiXmlElement* model = new TiXmlElement("model");
+			model->SetAttribute("path", i->model->getPath());
+			model->SetAttribute("class", std::string(i->model->libraryName()) + "_" + i->model->className());
+			model->SetAttribute("status", i->pruned ? "pruned" : "kept");
+			model->SetAttribute("reason", i->reason);
+			element->LinkEndChild(model);
+		}
+	}
+	
+	/** Models seen by prune() are required if they weren't pruned, in any traversal mode. */
+	bool UpdateVisitor::isRequired(Model& model)
+	{
+		std::map<const Model*, unsigned int>::const_iterator it = pruning_index.find(&model);
+		if (it == pruning_index.end())
+			return ModelVisitor::isRequired(model);
+		return !pruning[it->second].pruned;
+	}
+	
+	/** Every port connection between two scheduled models orders them the way they appear in the
+	 schedule: a model reading from a model earlier in the schedule waits for it to finish, and a model
+	 reading from one later in the schedule (e.g. through a "loose" input, using data from the previous
+	 step) has to finish before that one starts. Delayed inputs (see setConnectionDelay()) don't order
+	 anything, since they read values committed before the step. A group is updated after all its
+	 scheduled descendants.
+	 */
+	void UpdateVisitor::computeLevels()
+	{
+		// The models of each entry, i.e. the models a fused entry was made of
+		std::vector< std::vector<Model*> > entrymodels(schedule.size());
+		std::map<const Model*, unsigned int> index;
+		for (unsigned int i = 0; i < schedule.size(); i++) {
+			if (op::FusedOperators* fused = dynamic_cast<op::FusedOperators*>(schedule[i].model))
+				for (unsigned int m = 0; m < fused->getNumModels(); m++)
+					entrymodels[i].push_back(fused->getModel(m));
+			else
+				entrymodels[i].push_back(schedule[i].model);
+			for (std::vector<Model*>::iterator m = entrymodels[i].begin(); m != entrymodels[i].end(); m++)
+				index[*m] = i;
+		}
+		std::vector< std::vector<unsigned int> > after(schedule.size());
+		for (unsigned int i = 0; i < schedule.size(); i++) {
+			for (std::vector<Model*>::iterator m = entrymodels[i].begin(); m != entrymodels[i].end(); m++) {
+				Model* model = *m;
+				for (unsigned int p = 0; p < model->getNumInputs(); p++) {
+					Port* port = model->getPort(p);
+					if (port->getOwner() != model || isDelayed(*static_cast<InputPort*>(port)))
+						continue;
+					// Follow input-to-input connections, depending on every model along the way
+					for (Port* other = port->getOtherEnd(); other; ) {
+						std::map<const Model*, unsigned int>::iterator it = index.find(other->getOwner());
+						if (it != index.end() && it->second != i) {
+							if (it->second < i)
+								after[i].push_back(it->second);
+							else
+								after[it->second].push_back(i);
+						}
+						if (other->isInput() && other->isConnected())
+							other = other->getOtherEnd();
+						else
+							other = NULL;
+					}
+				}
+				for (Group* parent = model->getParent(); parent; parent = parent->getParent()) {
+					std::map<const Model*, unsigned int>::iterator it = index.find(parent);
+					if (it != index.end() && it->second > i)
+						after[it->second].push_back(i);
+				}
+			}
+		}
+		// Dependencies always point to earlier entries, so levels can be assigned in schedule order
+		std::vector<unsigned int> level(schedule.size(), 0);
+		for (unsigned int i = 0; i < schedule.size(); i++) {
+			for (std::vector<unsigned int>::iterator j = after[i].begin(); j != after[i].end(); j++)
+				if (level[*j]+1 > level[i])
+					level[i] = level[*j]+1;
+			if (level[i] >= levels.size())
+				levels.resize(level[i]+1);
+			levels[level[i]].push_back(i);
+		}
+	}
+	
+	/** Models with delayed inputs (see setConnectionDelay(), and inputs reading background rate
+	 groups), or inputs connected to output ports with value pointers, are always updated, since the values they read change without a new version.
+	 Unconnected inputs read default values, which are considered constant.
+	 */
+	void UpdateVisitor::computeChangeTrackers()
+	{
+		changetrackers.assign(schedule.size(), ChangeTracker());
+		unsigned int numpure = 0;
+		for (unsigned int i = 0; i < schedule.size(); i++) {
+			Model* model = schedule[i].model;
+			if (!model->isPure() || model->asGroup())
+				continue;
+			ChangeTracker& tracker = changetrackers[i];
+			tracker.pure = true;
+			for (unsigned int p = 0; p < model->getNumInputs() && tracker.pure; p++) {
+				InputPort* port = dynamic_cast<InputPort*>(model->getPort(p));
+				if (!port || port->getOwner() != model)
+					continue;
+				const OutputPort* source = port->getSource();
+				if (isDelayed(*port) || port->isDelayed() || (source && !source->isVersioned()))
+					tracker.pure = false;
+				else if (source)
+					tracker.sources.push_back(source);
+			}
+			if (tracker.pure) {
+				tracker.versions.assign(tracker.sources.size(), 0);
+				numpure++;
+			} else
+				tracker.sources.clear();
+		}
+		dout(4) << numpure << " of " << schedule.size() << " schedule entries tracked for changes\n";
+	}
+	
+	/** The versions are compared, and remembered, just before the update, so an input changed later
+	 in the same step (e.g. through a "loose" input) is picked up on the next step. */
+	bool UpdateVisitor::isUnchanged(const unsigned int index)
+	{
+		ChangeTracker& tracker = changetrackers[index];
+		if (!tracker.pure)
+			return false;
+		bool unchanged = tracker.primed;
+		for (unsigned int i = 0; i < tracker.sources.size(); i++) {
+			unsigned long version = tracker.sources[i]->getVersion();
+			if (version != tracker.versions[i]) {
+				tracker.versions[i] = version;
+				unchanged = false;
+			}
+		}
+		tracker.primed = true;
+		return unchanged;
+	}
+	
+	bool UpdateVisitor::isCompiled(const Model& root) const
+	{
+		return (compiled && schedule_root == &root && schedule_revision == root.getTopologyRevision() && schedule_mode == traversalmode);
+	}
+	
+	int UpdateVisitor::getUpdateFrequency(Model& model) const
+	{
+		// Model update frequency == 0 means the model doesn't specify what frequency it should be updated at
+		if (model.getUpdateFrequency() <= 0)
+			return frequency;
+		return model.getUpdateFrequency();
+	}
+	
+	unsigned int UpdateVisitor::getRateGroup(const int freq)
+	{
+		for (unsigned int i = 0; i < rategroups.size(); i++)
+			if (rategroups[i].frequency == freq)
+				return i;
+		rategroups.push_back(RateGroup(freq, frequency / gcd(freq, frequency)));
+		return rategroups.size()-1;
+	}
+	
+	/** The number of updates is the number of whole update periods (1/\a freq) completed during the
+	 step, counting from the start of the simulation. E.g. a 20 Hz model in a 30 Hz simulation is updated
+	 on two out of three steps, and a 75 Hz model is updated two and three times on alternate steps.
+	 */
+	unsigned int UpdateVisitor::getNumUpdates(const int freq, const unsigned long step) const
+	{
+		unsigned long long n = step;
+		return (unsigned int) ((n+1)*freq/frequency - n*freq/frequency);
 	}
 	
 	void UpdateVisitor::apply(Model& model)
 	{
-		if (visited[&model])
+		if (isVisited(model))
 			return;
 		if (traversalmode == DEPENDENT)
 			model.traverse(*this);
 		Timer timer;
-		if (model.getUpdateFrequency() == 0 || model.getUpdateFrequency() == frequency) {
-			//if (!visitcount)
-			//	dout(4) << "update " << model.getName() << " at " << frequency << " Hz\n";
-			// Model update frequency == 0 means the model doesn't specify what frequency it should be updated at
-			update(model, 1.0/frequency);
-		} else if (model.getUpdateFrequency() > frequency) {
-			// Check if things are even...
-			double fratio = (double) model.getUpdateFrequency() / frequency;
-			int iratio = (int)round(fratio);
-			if (fratio != iratio) {
-				/// \todo Be more forgiving about update frequencies...
-				std::stringstream ss;
-				ss << "Uneven update frequencies - model wants " << model.getUpdateFrequency() << " Hz, simulation is at " << frequency << " Hz";
-				throw ModelException(ss.str(), &model);
-			}
-			//if (!visitcount)
-			//	dout(4) << "update " << model.getName() << " at " << (int) frequency*fratio << " Hz\n";
-			// Model wants higher frequency - run repeated updates
-			for (int i = 0; i < iratio; i++) {
-				update(model, 1.0/(frequency*iratio));
-			}
-		} else {
-			double fratio = (double) frequency / model.getUpdateFrequency();
-			int iratio = (int)round(fratio);
-			//if (!visitcount)
-			//	dout(4) << "update " << model.getName() << " at " << (int) frequency/fratio << " Hz\n";
-			// Model wants lower frequency - only update when needed
-			if (iratio == 1 || (visitcount+1) % iratio == 0)
-				update(model, 1.0/(frequency/iratio));
-		}
-		visited[&model] = true;
+		int freq = getUpdateFrequency(model);
+		if (compiling)
+			schedule.push_back(ScheduleEntry(&model, getRateGroup(freq), 1.0/freq));
+		else {
+			unsigned int num = getNumUpdates(freq, visitcount);
+			for (unsigned int i = 0; i < num; i++)
+				update(model, 1.0/freq);
+		}
+		setVisited(model);
 		if (dostats)
 			stats[&model] += timer.time_s();
 	}
 	
 	void UpdateVisitor::apply(Group& group)
 	{
-		if (visited[&group])
+		if (isVisited(group))
 			return;
 		Timer timer;
 		group.traverse(*this);
-		/// \todo frequency dependant update in Group just as in Model
-		update(group, 1.0/frequency);
-		visited[&group] = true;
+		int freq = getUpdateFrequency(group);
+		if (compiling)
+			schedule.push_back(ScheduleEntry(&group, getRateGroup(freq), 1.0/freq));
+		else {
+			unsigned int num = getNumUpdates(freq, visitcount);
+			for (unsigned int i = 0; i < num; i++)
+				update(group, 1.0/freq);
+		}
+		setVisited(group);
 		if (dostats)
 			stats[&group] += timer.time_s();
 	}
 	
+	void UpdateVisitor::runSchedule()
+	{
+		for (unsigned int g = 0; g < rategroups.size(); g++) {
+			if (hyperperiod > 0)
+				numupdates[g] = updatetable[(visitcount % hyperperiod)*rategroups.size() + g];
+			else
+				numupdates[g] = getNumUpdates(rategroups[g].frequency, visitcount);
+		}
+		runBackground();
+		if (traversalmode == PARALLEL) {
+			// Run the levels one after another, the entries of each level in parallel
+			TaskThreadPool* pool = getPool();
+			for (ScheduleLevels::iterator l = levels.begin(); l != levels.end(); l++) {
+				if (l->size() == 1) {
+					unsigned int g = schedule[l->front()].group;
+					if (rategroups[g].background || numupdates[g] == 0)
+						continue;
+					if (changepropagation && isUnchanged(l->front()))
+						skipped += numupdates[g];
+					else {
+						executed += numupdates[g];
+						scheduletasks[l->front()]->perform();
+					}
+					continue;
+				}
+				for (std::vector<unsigned int>::iterator i = l->begin(); i != l->end(); i++) {
+					unsigned int g = schedule[*i].group;
+					if (rategroups[g].background || numupdates[g] == 0)
+						continue;
+					if (changepropagation && isUnchanged(*i))
+						skipped += numupdates[g];
+					else {
+						executed += numupdates[g];
+						pool->schedule(*scheduletasks[*i]);
+					}
+				}
+				pool->wait();
+			}
+			return;
+		}
+		for (unsigned int i = 0; i < schedule.size(); i++) {
+			const ScheduleEntry& entry = schedule[i];
+			unsigned int num = numupdates[entry.group];
+			if (rategroups[entry.group].background || num == 0)
+				continue;
+			if (changepropagation && isUnchanged(i)) {
+				skipped += num;
+				continue;
+			}
+			executed += num;
+			for (unsigned int r = 0; r < num; r++)
+				entry.model->update(entry.dt);
+		}
+	}
+	
+	/** A background rate group is started at the beginning of each step it is due, after waiting for
+	 its previous updates to finish. Its models are thus updated concurrently with the faster rate
+	 groups, but never with themselves, and a step that starts a background rate group doesn't start
+	 until its previous updates are done.
+	 
+	 Data is handed over at these frame boundaries only (see collectBackgroundPorts()): the outputs of
+	 the previous updates are published, then the inputs of the rate group are sampled. All rate groups
+	 due are waited for before any is published, and all are published before any is sampled, so a
+	 rate group reads the outputs of another one from that one's previous start, whichever is done
+	 first. Results thus don't depend on thread timing, and are the same without background threads.
+	 */
+	void UpdateVisitor::runBackground()
+	{
+		bool due = false;
+		for (unsigned int g = 0; g < rategroups.size(); g++) {
+			if (!rategroups[g].background || numupdates[g] == 0)
+				continue;
+			if (backgroundthreads[g])
+				backgroundthreads[g]->wait();
+			due = true;
+		}
+		if (!due)
+			return;
+		for (unsigned int g = 0; g < rategroups.size(); g++)
+			if (rategroups[g].background && numupdates[g] > 0)
+				for (std::vector<OutputPort*>::iterator i = stagedports[g].begin(); i != stagedports[g].end(); i++)
+					(*i)->publish();
+		for (unsigned int g = 0; g < rategroups.size(); g++)
+			if (rategroups[g].background && numupdates[g] > 0)
+				for (std::vector<InputPort*>::iterator i = sampledports[g].begin(); i != sampledports[g].end(); i++)
+					(*i)->sample();
+		for (unsigned int g = 0; g < rategroups.size(); g++) {
+			if (!rategroups[g].background || numupdates[g] == 0)
+				continue;
+			static_cast<RateGroupTask*>(backgroundtasks[g].get())->numupdates = numupdates[g];
+			if (backgroundthreads[g])
+				backgroundthreads[g]->schedule(*backgroundtasks[g]);
+			else
+				backgroundtasks[g]->perform();
+		}
+	}
+	
+	/** Inputs of background rate groups reading outputs of other rate groups are sampled, and inputs
+	 of other rate groups reading outputs of background rate groups read the committed copy, which is
+	 staged, i.e. only updated when the background rate group is published, starting with the current
+	 value. Models not in the schedule count as updated in the foreground.
+	 */
+	void UpdateVisitor::collectBackgroundPorts(Model& root)
+	{
+		sampledports.assign(rategroups.size(), std::vector<InputPort*>());
+		stagedports.assign(rategroups.size(), std::vector<OutputPort*>());
+		bool any = false;
+		for (RateGroups::iterator g = rategroups.begin(); g != rategroups.end(); g++)
+			any = any || g->background;
+		if (!any)
+			return;
+		// The rate group of each scheduled model, including the models of fused entries
+		std::map<const Model*, unsigned int> groups;
+		for (unsigned int i = 0; i < schedule.size(); i++) {
+			if (op::FusedOperators* fused = dynamic_cast<op::FusedOperators*>(schedule[i].model))
+				for (unsigned int m = 0; m < fused->getNumModels(); m++)
+					groups[fused->getModel(m)] = schedule[i].group;
+			else
+				groups[schedule[i].model] = schedule[i].group;
+		}
+		unsigned int numsampled = 0, numhandoff = 0;
+		std::vector<Model*> models(1, &root);
+		while (!models.empty()) {
+			Model* model = models.back();
+			models.pop_back();
+			if (Group* group = model->asGroup())
+				for (unsigned int i = 0; i < group->getNumChildren(); i++)
+					models.push_back(group->getChild(i));
+			std::map<const Model*, unsigned int>::iterator it = groups.find(model);
+			int g = (it != groups.end()) ? (int) it->second : -1;
+			bool added = false;
+			for (unsigned int p = 0; p < model->getNumInputs(); p++) {
+				InputPort* port = dynamic_cast<InputPort*>(model->getPort(p));
+				if (!port || port->getOwner() != model)
+					continue;
+				const OutputPort* source = port->getSource();
+				if (!source)
+					continue;
+				it = groups.find(source->getOwner());
+				int sourcegroup = (it != groups.end()) ? (int) it->second : -1;
+				if (sourcegroup == g)
+					continue;
+				if (sourcegroup >= 0 && rategroups[sourcegroup].background) {
+					OutputPort* out = port->setDelayed(true);
+					out->setStaged(true);
+					handoffports.push_back(port);
+					std::vector<OutputPort*>& staged = stagedports[sourcegroup];
+					if (std::find(staged.begin(), staged.end(), out) == staged.end()) {
+						out->publish();
+						staged.push_back(out);
+						backgroundmodels.push_back(out->getOwner());
+					}
+					numhandoff++;
+					added = true;
+				}
+				if (g >= 0 && rategroups[g].background) {
+					port->setSampled(true);
+					sampledports[g].push_back(port);
+					numsampled++;
+					added = true;
+				}
+			}
+			if (added)
+				backgroundmodels.push_back(model);
+		}
+		dout(4) << numsampled << " inputs sampled by and " << numhandoff << " inputs reading from background rate groups\n";
+	}
+	
+	void UpdateVisitor::waitBackground()
+	{
+		for (unsigned int g = 0; g < backgroundthreads.size(); g++)
+			if (backgroundthreads[g])
+				backgroundthreads[g]->wait();
+	}
+	
+	/** Delayed inputs read the value their output port had when it was committed, at the start of
+	 each visit, so models reading each other through them give the same results whatever order they
+	 are updated in. With DELAY_ALL in PARALLEL traversal mode, all models of a schedule level are then
+	 independent (a Jacobi rather than Gauss-Seidel step), and only groups wait for their children.
+	 Delays take effect on the next visit. Outputs of background rate groups are staged rather than
+	 committed on each visit, see runBackground().
+	 */
+	void UpdateVisitor::setConnectionDelay(const ConnectionDelay value)
+	{
+		if (value == delay)
+			return;
+		waitBackground();
+		clearDelayedPorts();
+		delay = value;
+		invalidate();
+	}
+	
+	bool UpdateVisitor::isDelayed(InputPort& port) const
+	{
+		return delay == DELAY_ALL || (delay == DELAY_LOOSE && port.isLoose());
+	}
+	
+	void UpdateVisitor::collectDelayedPorts(Model& model)
+	{
+		bool added = false;
+		for (unsigned int i = 0; i < model.getNumInputs(); i++) {
+			InputPort* port = dynamic_cast<InputPort*>(model.getPort(i));
+			if (!port || port->getOwner() != &model || !isDelayed(*port))
+				continue;
+			OutputPort* out = port->setDelayed(true);
+			if (!out)
+				continue;
+			delayedports.push_back(port);
+			if (std::find(committedports.begin(), committedports.end(), out) == committedports.end()) {
+				committedports.push_back(out);
+				delayedmodels.push_back(out->getOwner());
+			}
+			if (!added) {
+				delayedmodels.push_back(&model);
+				added = true;
+			}
+		}
+		if (Group* group = model.asGroup())
+			for (unsigned int i = 0; i < group->getNumChildren(); i++)
+				collectDelayedPorts(*group->getChild(i));
+	}
+	
+	void UpdateVisitor::clearDelayedPorts()
+	{
+		for (std::vector<InputPort*>::iterator i = delayedports.begin(); i != delayedports.end(); i++)
+			(*i)->setDelayed(false);
+		for (std::vector<OutputPort*>::iterator i = committedports.begin(); i != committedports.end(); i++)
+			(*i)->setCommitted(false);
+		delayedports.clear();
+		committedports.clear();
+		delayedmodels.clear();
+		delay_root = NULL;
+	}
+	
+	/** Inputs and outputs also delayed by setConnectionDelay() stay delayed and committed. */
+	void UpdateVisitor::clearBackground()
+	{
+		waitBackground();
+		for (std::vector<InputPort*>::iterator i = handoffports.begin(); i != handoffports.end(); i++)
+			(*i)->setDelayed(std::find(delayedports.begin(), delayedports.end(), *i) != delayedports.end());
+		for (unsigned int g = 0; g < stagedports.size(); g++)
+			for (std::vector<OutputPort*>::iterator i = stagedports[g].begin(); i != stagedports[g].end(); i++) {
+				(*i)->setStaged(false);
+				if (std::find(committedports.begin(), committedports.end(), *i) == committedports.end())
+					(*i)->setCommitted(false);
+				else
+					(*i)->publish();
+			}
+		for (unsigned int g = 0; g < sampledports.size(); g++)
+			for (std::vector<InputPort*>::iterator i = sampledports[g].begin(); i != sampledports[g].end(); i++)
+				(*i)->setSampled(false);
+		handoffports.clear();
+		stagedports.clear();
+		sampledports.clear();
+		backgroundmodels.clear();
+		for (unsigned int g = 0; g < backgroundthreads.size(); g++)
+			delete backgroundthreads[g];
+		backgroundthreads.clear();
+		backgroundtasks.clear();
+	}
+	
+	/** In PARALLEL traversal mode, one task per model is kept and rescheduled on every visit
+	 (until the model topology changes), rather than allocating new tasks. */
 	void UpdateVisitor::update(Model& model, const double dt)
 	{
-		if (traversalmode == PARALLEL)
-			pool->schedule(new UpdateTask(model, dt));
-		else
+		if (traversalmode == PARALLEL) {
+			smrt::ref_ptr<Task>& task = modeltasks[&model];
+			if (!task.valid())
+				task = new UpdateTask(model, dt);
+			else
+				static_cast<UpdateTask*>(task.get())->dt = dt;
+			getPool()->schedule(*task);
+		} else
 			model.update(dt);
 	}
 	
 	void UpdateVisitor::reset()
 	{
+		waitBackground();
 		ModelVisitor::reset();
 		stats.clear();
 		totaltime = 0;
+		executed = 0;
+		skipped = 0;
+		invalidate();
 	}
 	
 	class DisplayTask : public Task {
@@ -234,14 +1118,51 @@ namespace sbx
 		DisplayMode mode;
 	};
 	
+	/// Runs a continuous display pass on the pipeline thread of a DisplayVisitor
+	class DisplayPipelineTask : public Task {
+	public:
+		DisplayPipelineTask(DisplayVisitor& nvisitor) : visitor(nvisitor), root(NULL) {}
+		virtual void perform()
+		{
+			try {
+				visitor.mode = DISPLAY_CONTINUOUS;
+				visitor.UpdateVisitor::visit(*root);
+			} catch (std::exception& e) {
+				error = e.what();
+			} catch (...) {
+				error = "unknown exception";
+			}
+		}
+		DisplayVisitor& visitor;
+		Model* root;
+		std::string error;
+	};
+	
 	DisplayVisitor::DisplayVisitor()
-	:	UpdateVisitor()
+	:	UpdateVisitor(),
+	pipelined(false),
+	pipelinethread(NULL),
+	snapshot_root(NULL),
+	snapshot_revision(0)
 	{
 		traversalmode = SEQUENTIAL;
+		useschedule = false;
+	}
+	
+	DisplayVisitor::~DisplayVisitor()
+	{
+		setPipelined(false);
 	}
 	
+	/** In pipelined mode (see setPipelined()), DISPLAY_CONTINUOUS visits return right away, and
+	 other visits first wait for the running display pass to finish. */
 	void DisplayVisitor::visit(Model& model, const DisplayMode newmode)
 	{
+		if (pipelined && newmode == DISPLAY_CONTINUOUS) {
+			runPipelined(model);
+			return;
+		}
+		waitPipeline();
 		mode = newmode;
 		UpdateVisitor::visit(model);
 	}
@@ -260,12 +1181,108 @@ namespace sbx
 	
 	void DisplayVisitor::update(Model& model, const double dt)
 	{
-		if (traversalmode == PARALLEL)
-			pool->schedule(new DisplayTask(model, mode));
-		else
+		if (traversalmode == PARALLEL) {
+			smrt::ref_ptr<Task>& task = modeltasks[&model];
+			if (!task.valid())
+				task = new DisplayTask(model, mode);
+			else
+				static_cast<DisplayTask*>(task.get())->mode = mode;
+			getPool()->schedule(*task);
+		} else
 			model.display(mode);
 	}
 	
+	/** A pipelined display pass of step \e n runs on a thread of its own while step \e n+1 is updated,
+	 so that display costs are taken off the stepping latency. The inputs of endpoint models are
+	 snapshotted into a double buffer after each update, and read from the snapshot by the display
+	 thread, while models updated on other threads still see live values. Note that display() and
+	 update() of the same model can then run at the same time, so display() shouldn't touch state
+	 that update() changes other than through input ports.
+	 */
+	void DisplayVisitor::setPipelined(const bool value)
+	{
+		if (value == pipelined)
+			return;
+		if (value) {
+			pipelinethread = new TaskThread;
+			pipelinethread->start();
+			pipelinetask = new DisplayPipelineTask(*this);
+			snapshotreader.thread = pipelinethread;
+		} else {
+			pipelinethread->wait();
+			clearSnapshotPorts();
+			delete pipelinethread;
+			pipelinethread = NULL;
+			pipelinetask = NULL;
+			snapshotreader.thread = NULL;
+		}
+		pipelined = value;
+	}
+	
+	void DisplayVisitor::waitPipeline()
+	{
+		if (!pipelinethread)
+			return;
+		pipelinethread->wait();
+		DisplayPipelineTask* task = static_cast<DisplayPipelineTask*>(pipelinetask.get());
+		if (task->error.length() > 0) {
+			std::string error = task->error;
+			task->error = "";
+			throw ModelException("Pipelined display failed: " + error);
+		}
+	}
+	
+	void DisplayVisitor::runPipelined(Model& root)
+	{
+		if (snapshot_root != &root || snapshot_revision != root.getTopologyRevision()) {
+			waitPipeline();
+			clearSnapshotPorts();
+			collectSnapshotPorts(root);
+			snapshot_root = &root;
+			snapshot_revision = root.getTopologyRevision();
+		}
+		// Fill the buffer the running display pass isn't reading, then hand it over
+		unsigned int buffer = 1 - snapshotreader.buffer;
+		for (std::vector<InputPort*>::iterator i = snapshotports.begin(); i != snapshotports.end(); i++)
+			(*i)->takeSnapshot(buffer);
+		waitPipeline();
+		snapshotreader.buffer = buffer;
+		static_cast<DisplayPipelineTask*>(pipelinetask.get())->root = &root;
+		pipelinethread->schedule(*pipelinetask);
+	}
+	
+	void DisplayVisitor::collectSnapshotPorts(Model& model)
+	{
+		if (model.isEndPoint()) {
+			snapshotmodels.push_back(&model);
+			for (unsigned int i = 0; i < model.getNumInputs(); i++) {
+				InputPort* port = dynamic_cast<InputPort*>(model.getPort(i));
+				if (port) {
+					port->setSnapshot(&snapshotreader);
+					snapshotports.push_back(port);
+				}
+			}
+		}
+		if (Group* group = model.asGroup())
+			for (unsigned int i = 0; i < group->getNumChildren(); i++)
+				collectSnapshotPorts(*group->getChild(i));
+	}
+	
+	void DisplayVisitor::clearSnapshotPorts()
+	{
+		for (std::vector<InputPort*>::iterator i = snapshotports.begin(); i != snapshotports.end(); i++)
+			(*i)->setSnapshot(NULL);
+		snapshotports.clear();
+		snapshotmodels.clear();
+		snapshot_root = NULL;
+	}
+	
+	void DisplayVisitor::reset()
+	{
+		waitPipeline();
+		UpdateVisitor::reset();
+	}
+	
 	FindVisitor::FindVisitor()
 	:	ModelVisitor(),
 	modelname(""),
@@ -323,7 +1340,7 @@ namespace sbx
 	
 	Model* FindVisitor::findModel(Group& root, const std::string& name)
 	{
-		visited.clear();
+		TraversalScope scope(*this);
 		modelname = name;
 		modelptr = NULL;
 		if (name[0] == '/')
@@ -334,7 +1351,7 @@ namespace sbx
 	
 	Port* FindVisitor::findPort(Group& root, const std::string& name)
 	{
-		visited.clear();
+		TraversalScope scope(*this);
 		modelname = "";
 		portname = "";
 		modelptr = 0;
@@ -373,7 +1390,7 @@ namespace sbx
 					portptr = model.getPort(portname);
 			}
 		}
-		visited[&model] = true;
+		setVisited(model);
 	}	
 	
 	CallbackVisitor::CallbackVisitor(VisitorCallback *callback)
@@ -390,7 +1407,7 @@ namespace sbx
 	{
 		if (callback)
 			callback->apply(model);
-		visited[&model] = true;
+		setVisited(model);
 	}
 	
 	void CallbackVisitor::apply(Group& group)
@@ -400,7 +1417,7 @@ namespace sbx
 		group.traverse(*this);
 		if (callback)
 			callback->apply(group);
-		visited[&group] = true;
+		setVisited(group);
 	}
 	
 } // namespace sbx
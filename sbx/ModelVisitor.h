@@ -4,27 +4,50 @@
 #include "Export.h"
 #include "Model.h"
 #include "Group.h"
+#include "Ports.h"
 #include "TaskThread.h"
 #include <map>
+#include <set>
+#include <vector>
 
 namespace sbx
 {
 	
-	#define NUM_VISITOR_TASKTHREADS 4
+	/// Number of task threads used for PARALLEL traversal, 0 means one per processor
+	#define NUM_VISITOR_TASKTHREADS 0
 	
 	enum TraversalMode { SEQUENTIAL, DEPENDENT, PARALLEL };
 	
+	/// Which input ports read the value their output port had at the start of the step, see UpdateVisitor::setConnectionDelay()
+	enum ConnectionDelay {
+		DELAY_NONE, ///< all inputs read current values
+		DELAY_LOOSE, ///< "loose" inputs (see InputPort::setLoose()) read previous step values
+		DELAY_ALL ///< all inputs read previous step values
+	};
+	
 	typedef std::map<const Model*, bool> VisitedMap;
 	
+	/// Base class for traversals of a model tree
+	/** Each model is applied once per visit(). Which models have been visited is stamped into the
+	 models themselves: a traversal takes one of the NUM_VISIT_MARKS slots each model has, and marks
+	 models with a new epoch of that slot rather than clearing a map, so marking and testing a model
+	 take constant time. Traversals started while all slots are in use fall back to a VisitedMap.
+	 */
 	class SIMBLOX_API ModelVisitor
 	{
 	public:
 		ModelVisitor();
-		virtual ~ModelVisitor() {}
+		ModelVisitor(const ModelVisitor& source);
+		virtual ~ModelVisitor();
+		ModelVisitor& operator=(const ModelVisitor& source);
 		virtual void visit(Model& model);
 		
 		virtual void apply(Model& model)=0;
 		virtual void apply(Group& group);
+		/// Returns true if \a model is applied when it accepts this visitor, see Model::accept()
+		/** In DEPENDENT traversal mode, models without endpoint dependants are skipped. Groups are
+		 always applied. */
+		virtual bool isRequired(Model& model);
 		
 		void setTraversalMode(TraversalMode mode) { traversalmode = mode; }
 		TraversalMode getTraversalMode() const { return traversalmode; }
@@ -33,7 +56,43 @@ namespace sbx
 		unsigned long getVisitCount() const { return visitcount; }
 		
 	protected:
-		VisitedMap visited;	
+		/// Get the task thread pool used for PARALLEL traversal, creating and starting it if needed
+		static TaskThreadPool* getPool();
+		/// Make the dependency graph of \a model look up which models are endpoints again, see DependencyGraph::sampleEndPoints()
+		static void invalidateEndPoints(Model& model);
+		
+		/// Marks the traversal of a visitor for its lifetime, see beginTraversal()
+		class TraversalScope {
+		public:
+			TraversalScope(ModelVisitor& nvisitor) : visitor(nvisitor) { visitor.beginTraversal(); }
+			~TraversalScope() { visitor.endTraversal(); }
+		private:
+			ModelVisitor& visitor;
+		};
+		
+		/// Start a traversal, in which no model has been visited yet
+		void beginTraversal();
+		void endTraversal();
+		/// Has \a model been visited in the current traversal?
+		bool isVisited(const Model& model) const
+		{
+			if (visitslot >= 0)
+				return model.visit_marks[visitslot] == visitepoch;
+			VisitedMap::const_iterator i = visited.find(&model);
+			return i != visited.end() && i->second;
+		}
+		void setVisited(Model& model)
+		{
+			if (visitslot >= 0)
+				model.visit_marks[visitslot] = visitepoch;
+			else
+				visited[&model] = true;
+		}
+		
+		int visitslot; ///< index into the visit marks of models, -1 if not traversing or all are in use
+		unsigned long visitepoch; ///< visit mark of models visited in the current traversal
+		unsigned int visitdepth; ///< number of nested traversals
+		VisitedMap visited; ///< visited models if there is no slot
 		TraversalMode traversalmode;
 		unsigned long visitcount;
 		static TaskThreadPool *pool;
@@ -72,10 +131,50 @@ namespace sbx
 		double totaltime;
 	};
 	
+	/// An entry in a compiled update schedule, see UpdateVisitor::compile()
+	struct SIMBLOX_API ScheduleEntry
+	{
+		ScheduleEntry(Model* nmodel, const unsigned int ngroup, const double ndt)
+		: model(nmodel), group(ngroup), dt(ndt) {}
+		Model* model;
+		unsigned int group; ///< index of the RateGroup the model belongs to
+		double dt; ///< time step passed to Model::update()
+	};
+	
+	typedef std::vector<ScheduleEntry> UpdateSchedule;
+	/// Indices into an UpdateSchedule, grouped into levels that can be updated in parallel
+	typedef std::vector< std::vector<unsigned int> > ScheduleLevels;
+	
+	/// Schedule entries updated at the same frequency
+	struct SIMBLOX_API RateGroup
+	{
+		RateGroup(const int nfrequency, const unsigned int nperiod)
+		: frequency(nfrequency), dt(1.0/nfrequency), period(nperiod), background(false) {}
+		int frequency; ///< update frequency in Hz
+		double dt; ///< time step passed to Model::update()
+		unsigned int period; ///< number of simulation steps after which the update pattern repeats
+		bool background; ///< updated on a background thread, see UpdateVisitor::setBackgroundRateGroups()
+		std::vector<unsigned int> entries; ///< indices into the UpdateSchedule, in schedule order
+	};
+	
+	typedef std::vector<RateGroup> RateGroups;
+	
+	/// The outputs a pure schedule entry reads, and their versions when it was last updated
+	/** See UpdateVisitor::setChangePropagation() */
+	struct SIMBLOX_API ChangeTracker
+	{
+		ChangeTracker() : pure(false), primed(false) {}
+		bool pure; ///< a pure model whose inputs all have versioned outputs, which can be skipped
+		bool primed; ///< updated since the schedule was compiled
+		std::vector<const OutputPort*> sources;
+		std::vector<unsigned long> versions;
+	};
+	
 	class SIMBLOX_API UpdateVisitor : public ModelVisitor
 	{
 	public:
 		UpdateVisitor(const double dt = 1.0/30);
+		virtual ~UpdateVisitor();
 		virtual void visit(Model& model);
 		virtual void apply(Model& model);
 		virtual void apply(Group& group);
@@ -84,27 +183,224 @@ namespace sbx
 		void setTimeStep(const double dt);
 		double getTimeStep() const { return 1.0/frequency; }
 		
+		/// Flatten the update traversal of \a root into a schedule, which is then run by subsequent visits
+		void compile(Model& root);
+		/// Discard the compiled schedule, it will be recompiled on the next visit
+		void invalidate() { compiled = false; }
+		/// Returns true if a schedule compiled for \a root is up to date with its topology
+		bool isCompiled(const Model& root) const;
+		/// Set wether to use a compiled schedule instead of traversing the model tree on each visit
+		void useSchedule(const bool value = true) { useschedule = value; invalidate(); }
+		bool usingSchedule() const { return useschedule; }
+		const UpdateSchedule& getSchedule() const { return schedule; }
+		/// Get the parallel levels of the compiled schedule (only computed in PARALLEL traversal mode)
+		const ScheduleLevels& getScheduleLevels() const { return levels; }
+		/// Get the rate groups of the compiled schedule
+		const RateGroups& getRateGroups() const { return rategroups; }
+		/// Get the number of simulation steps after which the update pattern of all rate groups repeats
+		unsigned int getHyperperiod() const { return hyperperiod; }
+		/// Get the number of times a model updated at \a freq Hz is updated on a simulation step
+		unsigned int getNumUpdates(const int freq, const unsigned long step) const;
+		
+		/// Set wether to update rate groups slower than the simulation on background threads
+		/** A background rate group reads the outputs of other rate groups as sampled when it is started,
+		 and its outputs read by other rate groups are published when it is started again, so results
+		 don't depend on thread timing. See runBackground(). */
+		void setBackgroundRateGroups(const bool value) { background = value; invalidate(); }
+		bool getBackgroundRateGroups() const { return background; }
+		/// Set wether background rate groups get threads of their own (the default)
+		/** Otherwise they are updated on the simulation thread when started, with the same sampling and
+		 publishing, which reproduces a threaded run exactly, e.g. for debugging. */
+		void setBackgroundThreads(const bool value) { backgroundthreads_enabled = value; invalidate(); }
+		bool getBackgroundThreads() const { return backgroundthreads_enabled; }
+		/// Wait until all background rate groups have finished their updates
+		/** Their outputs are still only published when they are started again. */
+		void waitBackground();
+		
+		/// Set which inputs read the value committed at the start of the step rather than the current value
+		void setConnectionDelay(const ConnectionDelay value);
+		ConnectionDelay getConnectionDelay() const { return delay; }
+		/// Returns true if \a port reads previous step values with the current connection delay
+		bool isDelayed(InputPort& port) const;
+		/// Get the output ports committed at the start of each step
+		const std::vector<OutputPort*>& getCommittedPorts() const { return committedports; }
+		
+		/// Set wether pure models are skipped when their inputs haven't changed since their last update
+		/** Changes are told from the versions of the connected output ports (see Model::isPure() and
+		 OutputPort::getVersion()). Only applies to updates run from a compiled schedule, and not to
+		 background rate groups. */
+		void setChangePropagation(const bool value) { changepropagation = value; invalidate(); }
+		bool getChangePropagation() const { return changepropagation; }
+		/// Set wether runs of operator models in the compiled schedule are evaluated as one model each
+		/** Consecutive schedule entries of op::Add, Subtract, Multiply, Divide and Constant models in the
+		 same rate group are replaced by an op::FusedOperators entry, which keeps the values of all
+		 ports read by other models, group ports and the BlackBox. Rate groups updated more than once
+		 per step are left alone. */
+		void setOperatorFusion(const bool value) { fusion = value; invalidate(); }
+		bool getOperatorFusion() const { return fusion; }
+		/// Get the number of models fused into other schedule entries by the last compile()
+		unsigned int getNumFusedModels() const { return numfused; }
+		
+		/// Leave the models under \a root that nothing needs out of the update schedule, until clearPruning()
+		/** Needed are endpoints (see Model::isEndPoint()), pinned models (see Model::setPinned()),
+		 models with variables or double outputs subscribed to by a BlackBox data handler, the models
+		 these read from, directly or through other models, and the groups containing any of them.
+		 Unlike DEPENDENT traversal, this applies in every traversal mode, and is decided once rather
+		 than on each compile(): models connected later are scheduled as usual, but pruned models stay
+		 out of the schedule until pruned again. Pruned models are still initialized. */
+		void prune(Model& root);
+		void clearPruning();
+		/// Returns true if \a model was left out of the schedule by prune()
+		bool isPruned(const Model& model) const;
+		unsigned int getNumPrunedModels() const { return numpruned; }
+		/// Write a \c model element for each model seen by prune(), telling wether it was pruned and why
+		/** The \c reason attribute of models kept is \c endpoint, \c pinned, \c logged, \c provider
+		 (read by a model kept) or \c parent (of a model kept), and of models pruned \c unread (no
+		 outputs connected), \c unused (read only by models pruned) or \c empty (a group of models
+		 pruned). */
+		void writePruningReport(TiXmlElement* element) const;
+		virtual bool isRequired(Model& model);
+		
+		/// Get the number of model updates run from the compiled schedule since reset()
+		unsigned long getExecutedUpdates() const { return executed; }
+		/// Get the number of model updates skipped by change propagation since reset()
+		unsigned long getSkippedUpdates() const { return skipped; }
+		
 		virtual void reset();
 		void doStatistics(const bool value = true) { dostats = value; }
 		const VisitorTimeMap& getStatistics() const { return stats; }
 		//double getStatistics(const Model* model) const { return stats[model]; }
 		double getTotalTime() const { return totaltime; }
 	protected:
+		/// Get the frequency a model is updated at, i.e. the simulation frequency if it doesn't specify one
+		int getUpdateFrequency(Model& model) const;
+		/// Get the index of the rate group for \a freq Hz, adding one if needed
+		unsigned int getRateGroup(const int freq);
+		/// Group the compiled schedule into rate groups and tabulate their updates over the hyperperiod
+		void computeRateGroups();
+		/// Group the compiled schedule into levels, where each entry only depends on entries in previous levels
+		void computeLevels();
+		/// Find the outputs read by the pure models of the compiled schedule
+		void computeChangeTrackers();
+		/// Replace runs of operator models in the compiled schedule with fused models, see setOperatorFusion()
+		void fuseOperators(Model& root);
+		/// Returns true if schedule entry \a index can be skipped, remembering the versions of its inputs otherwise
+		bool isUnchanged(const unsigned int index);
+		virtual void runSchedule();
+		/// Start updates of background rate groups due on this step
+		void runBackground();
+		/// Sample the inputs and stage the outputs that background rate groups exchange with other rate groups
+		void collectBackgroundPorts(Model& root);
+		void clearBackground();
+		/// Make the inputs of all models under \a model delayed as set by setConnectionDelay()
+		void collectDelayedPorts(Model& model);
+		void clearDelayedPorts();
+		
 		int frequency;
 		bool dostats;
 		VisitorTimeMap stats;
 		double totaltime;
+		
+		UpdateSchedule schedule;
+		ScheduleLevels levels;
+		const Model* schedule_root;
+		unsigned long schedule_revision;
+		TraversalMode schedule_mode;
+		bool useschedule, compiled, compiling, background;
+		
+		RateGroups rategroups;
+		unsigned int hyperperiod;
+		/// Number of updates of each rate group on each step of the hyperperiod (empty if too long to tabulate)
+		std::vector<unsigned int> updatetable;
+		/// Number of updates of each rate group on the current step
+		std::vector<unsigned int> numupdates;
+		/// One thread and task per background rate group (NULL for others)
+		std::vector<TaskThread*> backgroundthreads;
+		std::vector< smrt::ref_ptr<Task> > backgroundtasks;
+		bool backgroundthreads_enabled;
+		/// Per rate group, the inputs of its models sampled when it is started, if in the background
+		std::vector< std::vector<InputPort*> > sampledports;
+		/// Per rate group, the outputs of its models published when it is started, if in the background
+		std::vector< std::vector<OutputPort*> > stagedports;
+		/// Inputs of other rate groups reading the published outputs of background rate groups
+		std::vector<InputPort*> handoffports;
+		/// Owners of the sampled, staged and handoff ports, kept alive until the ports are cleared
+		std::vector< smrt::ref_ptr<Model> > backgroundmodels;
+		
+		/// One reusable task per schedule entry, so that a PARALLEL step doesn't allocate
+		std::vector< smrt::ref_ptr<Task> > scheduletasks;
+		/// Reusable tasks for PARALLEL traversals without a compiled schedule, see update()
+		std::map< const Model*, smrt::ref_ptr<Task> > modeltasks;
+		unsigned long modeltasks_revision;
+		
+		ConnectionDelay delay;
+		std::vector<InputPort*> delayedports;
+		std::vector<OutputPort*> committedports;
+		/// Owners of the delayed and committed ports, kept alive until the ports are cleared
+		std::vector< smrt::ref_ptr<Model> > delayedmodels;
+		const Model* delay_root;
+		unsigned long delay_revision;
+		
+		bool changepropagation;
+		/// One per schedule entry when using change propagation
+		std::vector<ChangeTracker> changetrackers;
+		unsigned long executed, skipped;
+		
+		bool fusion;
+		/// The fused models of the compiled schedule
+		std::vector< smrt::ref_ptr<Model> > fusedmodels;
+		unsigned int numfused;
+		
+		/// Why prune() kept or pruned a model
+		struct PruningEntry {
+			smrt::ref_ptr<Model> model;
+			bool pruned;
+			const char* reason;
+		};
+		std::vector<PruningEntry> pruning;
+		/// Index into \c pruning of each model seen by prune()
+		std::map<const Model*, unsigned int> pruning_index;
+		unsigned int numpruned;
 	};
 	
 	class SIMBLOX_API DisplayVisitor : public UpdateVisitor
 	{
 	public:
 		DisplayVisitor();
+		virtual ~DisplayVisitor();
 		virtual void visit(Model& model, const DisplayMode mode = DISPLAY_USER);
 		virtual void apply(Model& model);
 		virtual void update(Model& model, const double dt);
+		
+		/// Set wether DISPLAY_CONTINUOUS visits run on a separate thread, concurrently with the next update
+		void setPipelined(const bool value);
+		bool isPipelined() const { return pipelined; }
+		/// Wait until a pipelined display pass has finished
+		/** \throw ModelException if the display pass threw an exception */
+		void waitPipeline();
+		/// Get the input ports snapshotted for pipelined display passes
+		const std::vector<InputPort*>& getSnapshotPorts() const { return snapshotports; }
+		
+		virtual void reset();
 	protected:
+		/// Snapshot the inputs of endpoint models and start a display pass on the pipeline thread
+		void runPipelined(Model& root);
+		/// Collect the inputs of all endpoint models under \a model into snapshotports
+		void collectSnapshotPorts(Model& model);
+		void clearSnapshotPorts();
+		
 		DisplayMode mode;
+		bool pipelined;
+		TaskThread* pipelinethread;
+		smrt::ref_ptr<Task> pipelinetask;
+		SnapshotReader snapshotreader;
+		std::vector<InputPort*> snapshotports;
+		/// Owners of the snapshotted ports, kept alive until the ports are cleared
+		std::vector< smrt::ref_ptr<Model> > snapshotmodels;
+		const Model* snapshot_root;
+		unsigned long snapshot_revision;
+		
+		friend class DisplayPipelineTask;
 	};
 	
 	class SIMBLOX_API FindVisitor : public ModelVisitor
@@ -0,0 +1,98 @@
+#ifndef SBX_NAMEINDEX_H
+#define SBX_NAMEINDEX_H
+
+#include <string>
+#include <vector>
+#include <iterator>
+
+namespace sbx
+{
+
+	/// Get the name of an entry of a NameIndex
+	template<class T>
+	inline const std::string& entryName(const T& entry) { return entry.name; }
+	/// Get the name of an entry of a NameIndex held by pointer
+	template<class T>
+	inline const std::string& entryName(T* const& entry) { return entry->name; }
+
+	/// Hash table from the names of the entries of a vector to their indices
+	/** The entries, of any type with a \c name member or pointers to such, are kept by the owner of
+	 the index (e.g. the ports of a Model), which calls invalidate() whenever they are added, removed
+	 or reordered. The index is then rebuilt on the next lookup, so that adding n entries in a row
+	 costs O(n) rather than O(n^2). Open addressing with linear probing in a table that is at most
+	 half full, so that a lookup compares against about one name on average.
+	 */
+	template<class T>
+	class NameIndex
+	{
+	public:
+		NameIndex() : dirty(false) {}
+
+		/// Index all of \a entries
+		void rebuild(const std::vector<T>& entries) const
+		{
+			dirty = false;
+			unsigned int size = 8;
+			while (size < 2*entries.size())
+				size *= 2;
+			table.assign(size, -1);
+			for (unsigned int i = 0; i < entries.size(); i++) {
+				unsigned int slot = hash(entryName(entries[i])) & (size-1);
+				while (table[slot] >= 0)
+					slot = (slot+1) & (size-1);
+				table[slot] = i;
+			}
+		}
+
+		/// Get the index of the entry named \a name in \a entries, or -1 if there is none
+		int find(const std::string& name, const std::vector<T>& entries) const
+		{
+			if (dirty)
+				rebuild(entries);
+			if (table.empty())
+				return -1;
+			unsigned int mask = table.size()-1;
+			for (unsigned int slot = hash(name) & mask; table[slot] >= 0; slot = (slot+1) & mask)
+				if (entryName(entries[table[slot]]) == name)
+					return table[slot];
+			return -1;
+		}
+
+		/// Mark the index as out of date, it is rebuilt by the next find()
+		/** Not thread safe: entries are added and removed while setting up, not while other threads
+		 look them up. */
+		void invalidate() { dirty = true; }
+
+		/// Get the first of the entries in [\a first, \a last), sorted by name, not ordered before \a name
+		template<class Iterator>
+		static Iterator lowerBound(Iterator first, Iterator last, const std::string& name)
+		{
+			typename std::iterator_traits<Iterator>::difference_type count = last - first;
+			while (count > 0) {
+				Iterator middle = first + count/2;
+				if (entryName(*middle) < name) {
+					first = middle + 1;
+					count -= count/2 + 1;
+				} else
+					count /= 2;
+			}
+			return first;
+		}
+
+		/// FNV-1a hash of \a name
+		static unsigned int hash(const std::string& name)
+		{
+			unsigned int h = 2166136261u;
+			for (std::string::const_iterator c = name.begin(); c != name.end(); c++)
+				h = (h ^ (unsigned char) *c) * 16777619u;
+			return h;
+		}
+
+	protected:
+		mutable std::vector<int> table; ///< entry indices, -1 for empty slots
+		mutable bool dirty; ///< entries changed since the table was built
+	};
+
+}
+
+#endif
@@ -1,7 +1,53 @@
 #include "OperatorModels.h"
 #include "ModelFactory.h"
+#include "ModelVisitor.h"
+#include "BlackBox.h"
+#include "Log.h"
+#include <map>
+#include <set>
+#include <typeinfo>
 
 namespace op {
+
+	namespace {
+		/// Apply \a Op to the "a" and "b" columns of elements first to first+count-1 of \a array, into "c"
+		template<class Op>
+		void applyColumns(sbx::ModelArray& array, const unsigned int first, const unsigned int count)
+		{
+			const double* a = array.getColumn("a") + first;
+			const double* b = array.getColumn("b") + first;
+			double* c = array.getColumn("c") + first;
+			for (unsigned int i = 0; i < count; i++)
+				c[i] = Op::apply(a[i], b[i]);
+		}
+		struct AddOp { static double apply(const double a, const double b) { return a + b; } };
+		struct SubtractOp { static double apply(const double a, const double b) { return a - b; } };
+		struct MultiplyOp { static double apply(const double a, const double b) { return a * b; } };
+		struct DivideOp { static double apply(const double a, const double b) { return a / b; } };
+		
+		/// Collect the inputs of the models under \a model that are connected to another input
+		void collectRelays(sbx::Model& model, std::vector<sbx::InputPort*>& relays)
+		{
+			for (unsigned int p = 0; p < model.getNumInputs(); p++) {
+				sbx::InputPort* port = dynamic_cast<sbx::InputPort*>(model.getPort(p));
+				if (port && port->getOwner() == &model && port->isConnected() && port->getOtherEnd()->isInput())
+					relays.push_back(port);
+			}
+			if (sbx::Group* group = model.asGroup())
+				for (unsigned int i = 0; i < group->getNumChildren(); i++)
+					collectRelays(*group->getChild(i), relays);
+		}
+		
+		/// Returns true if a Group above \a model exports \a port
+		bool isExported(sbx::Model& model, sbx::Port* port)
+		{
+			for (sbx::Group* group = model.getParent(); group; group = group->getParent())
+				for (unsigned int p = 0; p < group->getNumPorts(); p++)
+					if (group->getPort(p) == port)
+						return true;
+			return false;
+		}
+	}
 	
 	REGISTER_Object(op, Constant);
 	REGISTER_Object(op, Add);
@@ -13,14 +59,189 @@ namespace op {
 
 	void Add::init() { c = *a + *b; }
 	void Add::update(const double dt) { c = *a + *b; }
+	void Add::updateBatch(sbx::ModelArray& array, const double dt, const unsigned int first, const unsigned int count) { applyColumns<AddOp>(array, first, count); }
 
 	void Subtract::init() { c = *a - *b; }
 	void Subtract::update(const double dt) { c = *a - *b; }
+	void Subtract::updateBatch(sbx::ModelArray& array, const double dt, const unsigned int first, const unsigned int count) { applyColumns<SubtractOp>(array, first, count); }
 	
 	void Multiply::init() { c = *a * *b; }
 	void Multiply::update(const double dt) { c = *a * *b; }
+	void Multiply::updateBatch(sbx::ModelArray& array, const double dt, const unsigned int first, const unsigned int count) { applyColumns<MultiplyOp>(array, first, count); }
 	
 	void Divide::init() { c = *a / *b; }
 	void Divide::update(const double dt) { c = *a / *b; }
+	void Divide::updateBatch(sbx::ModelArray& array, const double dt, const unsigned int first, const unsigned int count) { applyColumns<DivideOp>(array, first, count); }
+	
+	
+	/** Only these exact classes, since subclasses may update differently. */
+	bool FusedOperators::isFusible(sbx::Model& model)
+	{
+		const std::type_info& type = typeid(model);
+		return type == typeid(Add) || type == typeid(Subtract) || type == typeid(Multiply) || type == typeid(Divide) || type == typeid(Constant);
+	}
+	
+	/** Register \e i holds the output of model \e i, followed by registers for Constants outside the
+	 chain and for loaded inputs. Delayed inputs are loaded from their ports, so that they read the
+	 committed value, and the outputs they read are stored. */
+	void FusedOperators::compile(sbx::Model& root, const sbx::UpdateVisitor& visitor)
+	{
+		registers.clear();
+		program.clear();
+		foldprogram.clear();
+		constants.clear();
+		loads.clear();
+		stores.clear();
+		numoperations = 0;
+		numfolded = 0;
+		
+		std::map<const sbx::Port*, unsigned int> outputs;
+		std::vector<sbx::OutPort<double>*> outports(models.size(), NULL);
+		for (unsigned int i = 0; i < models.size(); i++) {
+			outports[i] = dynamic_cast<sbx::OutPort<double>*>(models[i]->getPort(typeid(*models[i]) == typeid(Constant) ? "out" : "c"));
+			if (!outports[i])
+				throw sbx::ModelException("Operator model without a double output", models[i]);
+			outputs[outports[i]] = i;
+			registers.push_back(outports[i]->get());
+		}
+		
+		// Operands: registers of operators in the chain, folded constants or loaded inputs
+		std::vector<unsigned int> operands(2*models.size(), 0);
+		std::vector<int> operandloads(2*models.size(), -1);
+		std::vector<bool> operandconstant(2*models.size(), false);
+		std::set<const sbx::Port*> internal;
+		for (unsigned int i = 0; i < models.size(); i++) {
+			if (typeid(*models[i]) == typeid(Constant)) {
+				ConstantSource source = { outports[i], i, 0 };
+				constants.push_back(source);
+				continue;
+			}
+			for (unsigned int k = 0; k < 2; k++) {
+				sbx::InPort<double>* in = dynamic_cast<sbx::InPort<double>*>(models[i]->getPort(k == 0 ? "a" : "b"));
+				if (!in)
+					throw sbx::ModelException("Operator model without double inputs", models[i]);
+				sbx::OutPort<double>* source = NULL;
+				if (in->isConnected() && !visitor.isDelayed(*in))
+					source = dynamic_cast<sbx::OutPort<double>*>(in->getOtherEnd());
+				std::map<const sbx::Port*, unsigned int>::iterator reg = source ? outputs.find(source) : outputs.end();
+				if (reg != outputs.end()) {
+					operands[2*i+k] = reg->second;
+					internal.insert(in);
+				} else if (source && source->getOwner() && typeid(*source->getOwner()) == typeid(Constant) && source->isVersioned()) {
+					unsigned int c = 0;
+					while (c < constants.size() && constants[c].port != source)
+						c++;
+					if (c == constants.size()) {
+						ConstantSource constantsource = { source, (unsigned int) registers.size(), 0 };
+						constants.push_back(constantsource);
+						registers.push_back(0);
+					}
+					operands[2*i+k] = constants[c].reg;
+					operandconstant[2*i+k] = true;
+				} else {
+					operands[2*i+k] = registers.size();
+					operandloads[2*i+k] = loads.size();
+					registers.push_back(0);
+					loads.push_back(in);
+				}
+			}
+		}
+		
+		// Operators read before their turn (by earlier operators or themselves) hold the value of the
+		// previous update until then, so they aren't folded
+		std::vector<bool> early(models.size(), false), constant(models.size(), false);
+		for (unsigned int i = 0; i < models.size(); i++)
+			constant[i] = (typeid(*models[i]) == typeid(Constant));
+		for (unsigned int i = 0; i < 2*models.size(); i++) {
+			unsigned int reg = operands[i];
+			if (typeid(*models[i/2]) != typeid(Constant) && operandloads[i] < 0 && !operandconstant[i] && reg >= i/2 && typeid(*models[reg]) != typeid(Constant))
+				early[reg] = true;
+		}
+		for (unsigned int i = 0; i < models.size(); i++) {
+			if (constant[i])
+				continue;
+			constant[i] = !early[i];
+			for (unsigned int k = 0; k < 2; k++) {
+				unsigned int reg = operands[2*i+k];
+				if (operandloads[2*i+k] >= 0 || (!operandconstant[2*i+k] && !constant[reg]))
+					constant[i] = false;
+			}
+		}
+		
+		std::vector<sbx::InputPort*> relays;
+		collectRelays(root, relays);
+		std::set<const void*> logged;
+		sbx::BlackBox& blackbox = sbx::BlackBox::instance();
+		for (unsigned int i = 0; i < blackbox.getNumVariables(); i++)
+			if (blackbox.getVariable(i).enabled)
+				logged.insert(blackbox.getVariable(i).value_ptr);
+		for (unsigned int i = 0; i < models.size(); i++) {
+			const std::type_info& type = typeid(*models[i]);
+			if (type == typeid(Constant))
+				continue;
+			std::vector<Instruction>& instructions = constant[i] ? foldprogram : program;
+			for (unsigned int k = 0; k < 2; k++)
+				if (operandloads[2*i+k] >= 0)
+					instructions.push_back(Instruction(LOAD, operands[2*i+k], operandloads[2*i+k]));
+			Opcode op = (type == typeid(Add) ? ADD : type == typeid(Subtract) ? SUBTRACT : type == typeid(Multiply) ? MULTIPLY : DIVIDE);
+			instructions.push_back(Instruction(op, i, operands[2*i], operands[2*i+1]));
+			if (constant[i])
+				numfolded++;
+			else
+				numoperations++;
+			
+			// Store outputs read by anything other than the chain
+			sbx::OutPort<double>* out = outports[i];
+			bool observed = logged.count(&out->getRef()) || isExported(*models[i], out);
+			for (unsigned int c = 0; c < out->getNumConnections() && !observed; c++)
+				if (internal.find(out->getOtherEnd(c)) == internal.end())
+					observed = true;
+			for (unsigned int r = 0; r < relays.size() && !observed; r++)
+				if (relays[r]->getSource() == out)
+					observed = true;
+			if (observed) {
+				instructions.push_back(Instruction(STORE, i, stores.size()));
+				stores.push_back(out);
+			}
+		}
+		fold();
+		sbx::dout(4) << "fused " << models.size() << " operator models, " << numoperations << " operations, "
+			<< numfolded << " folded, " << loads.size() << " loads, " << stores.size() << " stores\n";
+	}
+	
+	void FusedOperators::fold()
+	{
+		for (std::vector<ConstantSource>::iterator i = constants.begin(); i != constants.end(); i++) {
+			registers[i->reg] = i->port->get();
+			i->version = i->port->getVersion();
+		}
+		run(foldprogram);
+	}
+	
+	void FusedOperators::run(const std::vector<Instruction>& instructions)
+	{
+		double* r = &registers[0];
+		for (std::vector<Instruction>::const_iterator i = instructions.begin(); i != instructions.end(); i++) {
+			switch (i->op) {
+				case ADD: r[i->dst] = r[i->a] + r[i->b]; break;
+				case SUBTRACT: r[i->dst] = r[i->a] - r[i->b]; break;
+				case MULTIPLY: r[i->dst] = r[i->a] * r[i->b]; break;
+				case DIVIDE: r[i->dst] = r[i->a] / r[i->b]; break;
+				case LOAD: r[i->dst] = loads[i->a]->get(); break;
+				case STORE: stores[i->a]->set(r[i->dst]); break;
+			}
+		}
+	}
+	
+	void FusedOperators::update(const double dt)
+	{
+		for (std::vector<ConstantSource>::const_iterator i = constants.begin(); i != constants.end(); i++) {
+			if (i->port->getVersion() != i->version) {
+				fold();
+				break;
+			}
+		}
+		run(program);
+	}
 	
 } // namespace
@@ -3,6 +3,12 @@
 
 #include "Model.h"
 #include "Ports.h"
+#include "ModelArray.h"
+#include <vector>
+
+namespace sbx {
+	class UpdateVisitor;
+}
 
 namespace op {
 	
@@ -11,12 +17,13 @@ namespace op {
 	public:
 		Constant(const std::string& name = "Constant") : sbx::Model(name)
 			{ registerPort(out,"out"); registerParameter(&value, Parameter::DOUBLE, "value"); }
-		Constant(const Constant& source) : sbx::Model(source)
+		Constant(const Constant& source) : sbx::Model(source), value(source.value)
 			{ copyPort(source, "out", out); copyParameter(source, "value", &value); }
 		
 		META_Model(op, Constant, "Constant output");
 		
 		virtual void init();
+		virtual const bool isPure() { return true; }
 
 		void set(const double newvalue) { value = newvalue; out = value; }
 		double get() const { return value; }
@@ -26,7 +33,7 @@ namespace op {
 		sbx::OutPort<double> out;
 	};
 
-	class SIMBLOX_API Add : public sbx::Model
+	class SIMBLOX_API Add : public sbx::Model, public sbx::BatchModel
 	{
 	public:
 		Add(const std::string& name = "Add") : sbx::Model(name)
@@ -38,13 +45,15 @@ namespace op {
 		
 		virtual void init();
 		virtual void update(const double dt);
+		virtual const bool isPure() { return true; }
+		virtual void updateBatch(sbx::ModelArray& array, const double dt, const unsigned int first, const unsigned int count);
 		
 	private:
 		sbx::InPort<double> a,b;
 		sbx::OutPort<double> c;
 	};
 	
-	class SIMBLOX_API Subtract : public sbx::Model
+	class SIMBLOX_API Subtract : public sbx::Model, public sbx::BatchModel
 	{
 	public:
 		Subtract(const std::string& name = "Subtract") : sbx::Model(name)
@@ -56,13 +65,15 @@ namespace op {
 		
 		virtual void init();
 		virtual void update(const double dt);
+		virtual const bool isPure() { return true; }
+		virtual void updateBatch(sbx::ModelArray& array, const double dt, const unsigned int first, const unsigned int count);
 		
 	private:
 		sbx::InPort<double> a,b;
 		sbx::OutPort<double> c;
 	};
 	
-	class SIMBLOX_API Multiply : public sbx::Model
+	class SIMBLOX_API Multiply : public sbx::Model, public sbx::BatchModel
 	{
 	public:
 		Multiply(const std::string& name = "Multiply") : sbx::Model(name)
@@ -74,13 +85,15 @@ namespace op {
 		
 		virtual void init();
 		virtual void update(const double dt);
+		virtual const bool isPure() { return true; }
+		virtual void updateBatch(sbx::ModelArray& array, const double dt, const unsigned int first, const unsigned int count);
 		
 	private:
 		sbx::InPort<double> a,b;
 		sbx::OutPort<double> c;
 	};
 	
-	class SIMBLOX_API Divide : public sbx::Model
+	class SIMBLOX_API Divide : public sbx::Model, public sbx::BatchModel
 	{
 	public:
 		Divide(const std::string& name = "Divide") : sbx::Model(name)
@@ -92,12 +105,82 @@ namespace op {
 		
 		virtual void init();
 		virtual void update(const double dt);
+		virtual const bool isPure() { return true; }
+		virtual void updateBatch(sbx::ModelArray& array, const double dt, const unsigned int first, const unsigned int count);
 		
 	private:
 		sbx::InPort<double> a,b;
 		sbx::OutPort<double> c;
 	};
 	
+	/// A chain of operator models evaluated as one, see sbx::UpdateVisitor::setOperatorFusion()
+	/** Built from Add, Subtract, Multiply, Divide and Constant models updated one after another, each
+	 operator becoming an instruction on a file of registers. An input connected to an operator of the
+	 chain reads its register, one connected to a Constant reads a folded constant, and others are
+	 loaded from their ports when the operator's turn comes, so the values are the same as when the
+	 models are updated in order. Operators with only constant operands are evaluated when folding,
+	 which is redone when the output of a Constant changes version.
+	 
+	 Outputs are only written to their ports if something other than the chain reads them, through a
+	 connection, a group port or the BlackBox. The ports of the other operators keep their values from
+	 the last init(), and the models are not updated.
+	 */
+	class SIMBLOX_API FusedOperators : public sbx::Model
+	{
+	public:
+		FusedOperators(const std::string& name = "FusedOperators") : sbx::Model(name), numoperations(0), numfolded(0) {}
+		
+		META_Model(op, FusedOperators, "Chain of operator models evaluated as one");
+		
+		virtual void update(const double dt);
+		
+		/// Returns true if \a model is an operator or constant that can be fused
+		static bool isFusible(sbx::Model& model);
+		/// Add an operator or constant, in update order
+		void addModel(sbx::Model& model) { models.push_back(&model); }
+		/// Build the instructions for the models added
+		/** Ports under \a root are searched for readers of the operator outputs, and \a visitor tells
+		 which inputs read delayed values (see sbx::UpdateVisitor::isDelayed()). */
+		void compile(sbx::Model& root, const sbx::UpdateVisitor& visitor);
+		
+		unsigned int getNumModels() const { return models.size(); }
+		sbx::Model* getModel(const unsigned int index) { return models[index]; }
+		/// Get the number of operators evaluated on each update
+		unsigned int getNumOperations() const { return numoperations; }
+		/// Get the number of operators evaluated when folding constants
+		unsigned int getNumFolded() const { return numfolded; }
+		/// Get the number of outputs written to their ports
+		unsigned int getNumStores() const { return stores.size(); }
+		
+	protected:
+		enum Opcode { ADD, SUBTRACT, MULTIPLY, DIVIDE, LOAD, STORE };
+		/// \c r[dst] = \c r[a] op \c r[b], or \c r[dst] = \c loads[a], or \c stores[a] = \c r[dst]
+		struct Instruction {
+			Instruction(const Opcode nop, const unsigned int ndst, const unsigned int na = 0, const unsigned int nb = 0)
+			: op(nop), dst(ndst), a(na), b(nb) {}
+			Opcode op;
+			unsigned int dst, a, b;
+		};
+		/// Output port of a Constant, and the register its value is folded into
+		struct ConstantSource {
+			sbx::OutPort<double>* port;
+			unsigned int reg;
+			unsigned long version;
+		};
+		
+		/// Read the constants and evaluate the constant operators
+		void fold();
+		void run(const std::vector<Instruction>& instructions);
+		
+		std::vector<sbx::Model*> models;
+		std::vector<double> registers;
+		std::vector<Instruction> program, foldprogram;
+		std::vector<ConstantSource> constants;
+		std::vector<sbx::InPort<double>*> loads;
+		std::vector<sbx::OutPort<double>*> stores;
+		unsigned int numoperations, numfolded;
+	};
+	
 }
 
 #endif
@@ -18,14 +18,26 @@ namespace sbx
 	
 	void Port::notifyOwnerConnect(Port *otherend)
 	{
-		if (owner.valid())
+		touchTopology();
+		if (owner.valid()) {
+			owner->invalidateDependencies();
 			owner->onPortConnect(this, otherend);
+		}
 	}
 	
 	void Port::notifyOwnerDisconnect(Port *otherend)
 	{
-		if (owner.valid())
+		touchTopology();
+		if (owner.valid()) {
+			owner->invalidateDependencies();
 			owner->onPortDisconnect(this, otherend);
+		}
+	}
+	
+	void Port::touchTopology()
+	{
+		if (owner.valid())
+			owner->touchTopology();
 	}
 	
 	PortException::PortException(const std::string& message, const Port *port1, const Port *port2)
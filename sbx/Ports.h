@@ -17,9 +17,10 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <cstring>
 #include <smrt/observer_ptr.h>
-#include <OpenThreads/Mutex>
-#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Atomic>
+#include <OpenThreads/Thread>
 
 namespace sbx
 {
@@ -27,10 +28,20 @@ namespace sbx
 	// Some forward declarations
 	class Model;
 	class Port;
+	class OutputPort;
 	template <typename T> class InPort;
 	template <typename T> class OutPort;
 	template <typename T> class InUnitPort;
 	template <typename T> class OutUnitPort;
+	class SignalBus;
+	
+	/// Remove a port from the signal bus it is bound to, called when the port is destroyed
+	SIMBLOX_API void detachSignalBus(SignalBus* bus, Port* port);
+	
+	/// Read a signal bus slot, scaled by a unit conversion factor (only double ports are put on a bus)
+	template <typename T>
+	inline const T readBusSlot(const T* slot, const double scale) { return *slot; }
+	inline const double readBusSlot(const double* slot, const double scale) { return scale * *slot; }
 	
 	class SIMBLOX_API PortException : public std::exception {
 	public:
@@ -45,12 +56,255 @@ namespace sbx
 	};
 	
 	
+	/// Synchronization of port values between threads, see OutPort
+	/** Port values are always synchronized, unless left out at build time by defining
+	 SBX_SINGLE_THREADED_PORTS. That is only safe for applications that never read ports from more
+	 than one thread, i.e. only run SEQUENTIAL or DEPENDENT traversals, without background rate groups,
+	 pipelined display or ensembles. There is no switch at run time, since any simulation in the process
+	 may be running on other threads.
+	 */
+	class SIMBLOX_API PortSync
+	{
+	public:
+		/// Returns true if port values are synchronized between threads
+#ifdef SBX_SINGLE_THREADED_PORTS
+		static bool isEnabled() { return false; }
+#else
+		static bool isEnabled() { return true; }
+#endif
+		/// Orders reads before and after the barrier
+		static inline void readBarrier()
+		{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+			__asm__ __volatile__("" ::: "memory"); // loads aren't reordered with other loads on x86
+#elif defined(__GNUC__)
+			__sync_synchronize();
+#elif defined(_MSC_VER)
+			_ReadWriteBarrier();
+#endif
+		}
+		/// Orders writes before and after the barrier
+		static inline void writeBarrier() { readBarrier(); } // stores aren't reordered with other stores on x86 either
+		/// Orders all reads and writes before and after the barrier
+		static inline void fullBarrier()
+		{
+#if defined(__GNUC__)
+			__sync_synchronize();
+#elif defined(_MSC_VER)
+			MemoryBarrier();
+#endif
+		}
+	};
+	
+	/// Tells wether values of type \a T can be copied byte by byte, and so be published by OutPort without a lock
+	/** Specialize with SBX_TRIVIAL_PORT_VALUE() for plain structs used as port values. */
+	template <typename T>
+	struct PortValueTraits { enum { trivial = false }; };
+	
+	#define SBX_TRIVIAL_PORT_VALUE(type) \
+		template <> struct PortValueTraits<type> { enum { trivial = true }; };
+	
+	SBX_TRIVIAL_PORT_VALUE(bool)
+	SBX_TRIVIAL_PORT_VALUE(char)
+	SBX_TRIVIAL_PORT_VALUE(signed char)
+	SBX_TRIVIAL_PORT_VALUE(unsigned char)
+	SBX_TRIVIAL_PORT_VALUE(short)
+	SBX_TRIVIAL_PORT_VALUE(unsigned short)
+	SBX_TRIVIAL_PORT_VALUE(int)
+	SBX_TRIVIAL_PORT_VALUE(unsigned int)
+	SBX_TRIVIAL_PORT_VALUE(long)
+	SBX_TRIVIAL_PORT_VALUE(unsigned long)
+	SBX_TRIVIAL_PORT_VALUE(float)
+	SBX_TRIVIAL_PORT_VALUE(double)
+	
+	/// Tells wether a new port value differs from the current one, see OutputPort::getVersion()
+	/** Values that can't be compared byte by byte are always considered changed. */
+	template <typename T, bool trivial = PortValueTraits<T>::trivial>
+	struct PortValueChange
+	{
+		static bool changed(const T& current, const T& newvalue) { return true; }
+	};
+	
+	template <typename T>
+	struct PortValueChange<T, true>
+	{
+		static bool changed(const T& current, const T& newvalue) { return memcmp(&current, &newvalue, sizeof(T)) != 0; }
+	};
+	
+	/// Value of an output port, published by one writer thread to any number of reader threads
+	/** Trivially copyable values are published with a sequence lock: the writer makes the sequence
+	 number odd while writing, and readers retry until they have copied the value with the same, even,
+	 sequence number before and after. Readers never block the writer. */
+	template <typename T, bool trivial = PortValueTraits<T>::trivial>
+	class PortValue
+	{
+	public:
+		PortValue() : value(), sequence(0) {}
+		PortValue(const PortValue& source) : value(source.get()), sequence(0) {}
+		
+		const T get() const
+		{
+			if (!PortSync::isEnabled())
+				return value;
+			while (true) {
+				unsigned int seq = sequence;
+				PortSync::readBarrier();
+				T copy = value;
+				PortSync::readBarrier();
+				if (!(seq & 1) && seq == sequence)
+					return copy;
+			}
+		}
+		
+		void set(const T& newvalue)
+		{
+			if (!PortSync::isEnabled()) {
+				value = newvalue;
+				return;
+			}
+			sequence = sequence + 1;
+			PortSync::writeBarrier();
+			value = newvalue;
+			PortSync::writeBarrier();
+			sequence = sequence + 1;
+		}
+		
+		/// Get a reference to the value, which readers on other threads may see half written
+		const T& ref() const { return value; }
+		
+		/// Get the value to write in place, must be followed by endSet()
+		T& beginSet()
+		{
+			if (PortSync::isEnabled()) {
+				sequence = sequence + 1;
+				PortSync::writeBarrier();
+			}
+			return value;
+		}
+		
+		/// Publish the value written after beginSet()
+		void endSet()
+		{
+			if (PortSync::isEnabled()) {
+				PortSync::writeBarrier();
+				sequence = sequence + 1;
+			}
+		}
+		
+	protected:
+		T value;
+		volatile unsigned int sequence;
+	};
+	
+	/// Value of an output port of a type that can't be copied byte by byte (e.g. a std::vector)
+	/** The value is double buffered. The writer fills the buffer readers aren't directed to, and then
+	 directs them to it. Readers pin the buffer they copy from, and the writer only waits for readers
+	 that still copy from the buffer it is about to overwrite, i.e. the value from two sets ago. */
+	template <typename T>
+	class PortValue<T, false>
+	{
+	public:
+		PortValue() : front(0) {}
+		PortValue(const PortValue& source) : front(0) { values[0] = source.get(); }
+		
+		const T get() const
+		{
+			if (!PortSync::isEnabled())
+				return values[front];
+			unsigned int i;
+			while (true) {
+				i = front;
+				++readers[i];
+				if (front == i)
+					break;
+				--readers[i];
+			}
+			T copy = values[i];
+			--readers[i];
+			return copy;
+		}
+		
+		void set(const T& newvalue)
+		{
+			if (!PortSync::isEnabled()) {
+				values[front] = newvalue;
+				return;
+			}
+			unsigned int back = 1 - front;
+			while (readers[back] != 0)
+				OpenThreads::Thread::YieldCurrentThread();
+			values[back] = newvalue;
+			PortSync::writeBarrier();
+			front = back;
+			PortSync::fullBarrier();
+		}
+		
+		/// Get a reference to the current value, without copying it
+		/** The referenced value doesn't change until the value has been set twice more (or, without
+		 synchronization, once more), so a reader on another thread can use it until the writer's next
+		 step. */
+		const T& ref() const { return values[front]; }
+		
+		/// Get the buffer to write the next value into in place, must be followed by endSet()
+		/** The buffer holds an older value (or, without synchronization, the current value) that has to
+		 be overwritten completely. Its storage is reused, so e.g. a std::vector or Eigen matrix of the
+		 same size as before isn't reallocated. */
+		T& beginSet()
+		{
+			if (!PortSync::isEnabled())
+				return values[front];
+			unsigned int back = 1 - front;
+			while (readers[back] != 0)
+				OpenThreads::Thread::YieldCurrentThread();
+			return values[back];
+		}
+		
+		/// Direct readers to the buffer written after beginSet()
+		void endSet()
+		{
+			if (!PortSync::isEnabled())
+				return;
+			PortSync::writeBarrier();
+			front = 1 - front;
+			PortSync::fullBarrier();
+		}
+		
+	protected:
+		T values[2];
+		volatile unsigned int front;
+		mutable OpenThreads::Atomic readers[2];
+	};
+	
+	/// Reference to the value of a port, and the unit conversion factor still to be applied to it
+	/** Returned by InPort::ref() so that consumers of large values (e.g. vectors) can read them
+	 without a copy, and fold the scaling into their own computations rather than scaling a copy. */
+	template <typename T>
+	struct PortRef
+	{
+		PortRef(const T& nvalue, const double nscale = 1) : value(&nvalue), scale(nscale) {}
+		
+		const T& operator*() const { return *value; }
+		const T* operator->() const { return value; }
+		/// Returns true if the value has to be multiplied by \c scale
+		bool isScaled() const { return scale != 1; }
+		/// Get a scaled copy of the value, as InPort::get() does
+		const T get() const
+		{
+			if (isScaled())
+				return scale * *value;
+			return *value;
+		}
+		
+		const T* value;
+		double scale;
+	};
+	
 	/// Base class for input/output ports.
 	class SIMBLOX_API Port
 	{
 	public:
 		
-		Port() : owner(NULL) { }
+		Port() : owner(NULL), bus(NULL) { }
 		
 		/// Connect this port to another port
 		/** \throw PortException when an illegal connection is attempted */
@@ -89,14 +343,28 @@ namespace sbx
 
 		void notifyOwnerConnect(Port *otherend);
 		void notifyOwnerDisconnect(Port *otherend);
+		/// Tell the tree of the owner that the way this port is read has changed, see Model::touchTopology()
+		void touchTopology();
 		
 		std::string unit;
 		smrt::observer_ptr<Model> owner;
 		bool input;
+		SignalBus* bus; ///< the signal bus this port is bound to, if any
 		
 		friend class Model;
 	};
 	
+	/// Tells snapshotted input ports which thread reads snapshots, and from which buffer
+	/** See InputPort::setSnapshot() and DisplayVisitor::setPipelined() */
+	struct SIMBLOX_API SnapshotReader
+	{
+		SnapshotReader() : thread(NULL), buffer(0) {}
+		/// Returns true if called from the thread that reads snapshots
+		bool isReading() const { return thread && OpenThreads::Thread::CurrentThread() == thread; }
+		OpenThreads::Thread* thread;
+		unsigned int buffer; ///< snapshot buffer read by \c thread, 0 or 1
+	};
+	
 	/// Input port interface.
 	class InputPort : public Port
 		{
@@ -120,6 +388,34 @@ namespace sbx
 			 */
 			void setLoose(const bool loose) { this->loose = loose; }
 			const bool isLoose() { return loose; }
+			
+			/// Keep double buffered snapshots of the value, which get() returns on the \a reader thread
+			/** Lets another thread read the value of a previous step while the current step is updated.
+			 Pass NULL to stop snapshotting. */
+			virtual void setSnapshot(const SnapshotReader* reader)=0;
+			/// Copy the current value into a snapshot buffer (0 or 1), unless the port has no valid data
+			virtual void takeSnapshot(const unsigned int buffer)=0;
+			
+			/// Get the output port the value is read from, following input to input connections
+			/** \return NULL if not connected to an output port */
+			virtual const OutputPort* getSource() const=0;
+			
+			/// Read the value committed by the connected output port rather than its current value
+			/** Lets the port read the value of the previous step, whatever the update order, see
+			 OutputPort::commit() and UpdateVisitor::setConnectionDelay(). Input to input connections
+			 are followed to the output port.
+			 \return the output port, which has to be committed on every step, or NULL if there is none */
+			virtual OutputPort* setDelayed(const bool value)=0;
+			virtual bool isDelayed() const=0;
+			
+			/// Read a sample of the value taken by sample() rather than the current value
+			/** Lets a model updated on another thread read the value as it was when the model was started,
+			 see UpdateVisitor::setBackgroundRateGroups(). Samples are taken of what get() would return,
+			 i.e. of the committed value of delayed ports. */
+			virtual void setSampled(const bool value)=0;
+			/// Copy the value into the sample read after setSampled(), unless the port has no valid data
+			virtual void sample()=0;
+			virtual bool isSampled() const=0;
 		protected:
 			bool loose; // TODO find a better name
 		};
@@ -132,8 +428,20 @@ namespace sbx
 			InPort() :
 			connection_out(NULL),
 			connection_in(NULL),
-			useDefault(false) { }
-			~InPort() { disconnect(); }
+			useDefault(false),
+			snapshot_reader(NULL),
+			bus_ptr(NULL),
+			bus_scale(1),
+			delayed_ptr(NULL),
+			delayed_scale(1),
+			delayed_scaler(NULL),
+			sampled_ptr(NULL) { }
+			~InPort()
+			{
+				if (bus)
+					detachSignalBus(bus, this);
+				disconnect();
+			}
 			
 			virtual void connect(Port* otherend)
 			{
@@ -205,11 +513,97 @@ namespace sbx
 			/// Set a default value which will be returned by get() when not connected
 			void setDefault(const T& value) { useDefault = true; default_value = value; }
 			
+			virtual void setSnapshot(const SnapshotReader* reader)
+			{
+				snapshot_reader = reader;
+				if (reader)
+					snapshots.resize(2);
+				else
+					snapshots.clear();
+			}
+			
+			virtual void takeSnapshot(const unsigned int buffer)
+			{
+				if (snapshot_reader && isValid())
+					snapshots[buffer] = get();
+			}
+			
+			virtual OutputPort* setDelayed(const bool value)
+			{
+				delayed_ptr = NULL;
+				delayed_scale = 1;
+				delayed_scaler = NULL;
+				if (!value)
+					return NULL;
+				// Follow input to input connections to the output port, multiplying unit conversion factors
+				double scale = 1;
+				const InPort<T>* scaler = NULL;
+				const InPort<T>* in = this;
+				for (unsigned int hops = 0; in && !in->connection_out && hops < 1000; hops++) {
+					if (const InUnitPort<T>* unitin = dynamic_cast<const InUnitPort<T>*>(in)) {
+						scale *= unitin->unitScaleFactor;
+						scaler = unitin;
+					}
+					in = in->connection_in;
+				}
+				if (!in || !in->connection_out)
+					return NULL;
+				if (const InUnitPort<T>* unitin = dynamic_cast<const InUnitPort<T>*>(in)) {
+					scale *= unitin->unitScaleFactor;
+					scaler = unitin;
+				}
+				OutPort<T>* out = in->connection_out;
+				out->setCommitted(true);
+				delayed_ptr = &out->committed[0];
+				delayed_scale = scale;
+				if (scale != 1)
+					delayed_scaler = scaler;
+				return out;
+			}
+			virtual bool isDelayed() const { return delayed_ptr != NULL; }
+			
+			virtual void setSampled(const bool value)
+			{
+				sampled_ptr = NULL;
+				if (!value) {
+					sampled.clear();
+					return;
+				}
+				if (sampled.empty())
+					sampled.push_back(T());
+				sample();
+			}
+			virtual void sample()
+			{
+				if (sampled.empty() || !isValid())
+					return;
+				sampled_ptr = NULL;
+				sampled[0] = get();
+				sampled_ptr = &sampled[0];
+			}
+			virtual bool isSampled() const { return sampled_ptr != NULL; }
+			
+			virtual const OutputPort* getSource() const
+			{
+				const InPort<T>* in = this;
+				for (unsigned int hops = 0; in && !in->connection_out && hops < 1000; hops++)
+					in = in->connection_in;
+				return in ? in->connection_out : NULL;
+			}
+			
 			/// Get the value
 			/** \return the value of the connected port or, if unconnected and a default value is set,
-			 the default value.
-			 \see setDefault(), operator*() */
+			 the default value. On the thread reading snapshots, the snapshotted value.
+			 \see setDefault(), setSnapshot(), operator*() */
 			virtual const T get() const {
+				if (readingSnapshot())
+					return snapshots[snapshot_reader->buffer];
+				if (sampled_ptr)
+					return *sampled_ptr;
+				if (delayed_ptr)
+					return delayed_scaler ? delayed_scaler->scaleValue(*delayed_ptr, delayed_scale) : *delayed_ptr;
+				if (bus_ptr)
+					return readBusSlot(bus_ptr, bus_scale);
 				if (connection_out)
 					return connection_out->get();
 				else if (connection_in)
@@ -222,13 +616,53 @@ namespace sbx
 				}
 			}
 			
+			/// Get a reference to the value, without copying it
+			/** \return the value get() would return, with any unit conversion left to the caller, see PortRef.
+			 The reference stays valid as long as the connections don't change, and the value doesn't
+			 change until the producer's next step (see PortValue::ref()).
+			 \throw PortException if unconnected and no default value is set */
+			virtual PortRef<T> ref() const {
+				if (readingSnapshot())
+					return PortRef<T>(snapshots[snapshot_reader->buffer]);
+				if (sampled_ptr)
+					return PortRef<T>(*sampled_ptr);
+				if (delayed_ptr)
+					return PortRef<T>(*delayed_ptr, delayed_scale);
+				if (bus_ptr)
+					return PortRef<T>(*bus_ptr, bus_scale);
+				if (connection_out)
+					return PortRef<T>(connection_out->getRef());
+				else if (connection_in)
+					return connection_in->ref();
+				else {
+					if (useDefault)
+						return PortRef<T>(default_value);
+					else
+						throw PortException("Access to unconnected port",this);
+				}
+			}
+			
 			/// Operator for convenience, same as get()
-			const T operator*() const { return get(); }
+			/** When bound to a signal bus, reads the bus slot directly rather than calling get(). */
+			const T operator*() const
+			{
+				if (bus_ptr && !snapshot_reader && !delayed_ptr && !sampled_ptr)
+					return readBusSlot(bus_ptr, bus_scale);
+				return get();
+			}
 			/// Simply throws an exception, provided for "safety"...
 			/** \throw PortException when used */
 			void operator=(const T& value) { throw PortException("Attempt to assign value of InPort",this); }
 			
 		protected:
+			/// Multiply a value by a unit conversion factor, which only unit ports can have (see InUnitPort)
+			/** Virtual so that it is only instantiated for types that unit ports are used with. */
+			virtual const T scaleValue(const T& value, const double scale) const { return value; }
+			/// Returns true if get() is called from the thread reading snapshots
+			bool readingSnapshot() const { return snapshot_reader && snapshot_reader->isReading(); }
+			/// Returns true if get() reads a value that unit conversion has already been applied to
+			bool readingScaled() const { return bus_ptr || delayed_ptr || sampled_ptr || readingSnapshot(); }
+			
 			virtual void doConnect(OutPort<T>* otherend)
 			{
 				connection_out = otherend;
@@ -249,18 +683,41 @@ namespace sbx
 					notifyOwnerDisconnect(connection_out);
 					connection_out->notifyOwnerDisconnect(this);
 					connection_out = NULL;
+					dropCachedPointers();
 				} else if (otherend == connection_in) {
 					notifyOwnerDisconnect(connection_in);
 					connection_in->notifyOwnerDisconnect(this);
 					connection_in = NULL;
+					dropCachedPointers();
 				}
 			}
 			
+			/// Forget pointers into the storage of the former connection
+			void dropCachedPointers()
+			{
+				if (bus)
+					detachSignalBus(bus, this);
+				bus_ptr = NULL;
+				bus_scale = 1;
+				delayed_ptr = NULL;
+				sampled_ptr = NULL;
+			}
+			
 			OutPort<T>* connection_out;
 			InPort<T>* connection_in;
 			friend class OutPort<T>;
 			bool useDefault;
 			T default_value;
+			const SnapshotReader* snapshot_reader;
+			std::vector<T> snapshots;
+			const T* bus_ptr; ///< value of the connected output port on a signal bus, see SignalBus
+			double bus_scale; ///< unit conversion factor applied to \c bus_ptr, including the one of an InUnitPort
+			const T* delayed_ptr; ///< value committed by the connected output port, see setDelayed()
+			double delayed_scale; ///< unit conversion factor applied to \c delayed_ptr
+			const InPort<T>* delayed_scaler; ///< unit port applying \c delayed_scale, NULL if it is 1
+			std::vector<T> sampled; ///< value taken by sample(), already scaled
+			const T* sampled_ptr; ///< the sampled value, if read instead of the current one, see setSampled()
+			friend class SignalBus;
 		};
 	
 	/// Type specific implementation of an input port with on-the-fly unit conversion.
@@ -286,7 +743,7 @@ namespace sbx
 				((OutUnitPort<T>*)this->connection_out)->doConnect(this);
 			} else if (dynamic_cast<InUnitPort<T>*>(otherend)) {
 				doConnect((InUnitPort<T>*)otherend);
-				((InUnitPort<T>*)this->connection_in)->doConnect(this);
+				//((InUnitPort<T>*)this->connection_in)->doConnect(this);
 			} else if (InPort<T>::canConnect(otherend)) {
 				unitScaleFactor = 1;
 				return InPort<T>::connect(otherend);
@@ -304,9 +761,21 @@ namespace sbx
 		}
 		
 		virtual const T get() const {
+			// Snapshots, signal bus and delayed values are already scaled
+			if (this->readingScaled())
+				return InPort<T>::get();
 			return unitScaleFactor*InPort<T>::get();
 		}
 		
+		virtual const T scaleValue(const T& value, const double scale) const { return scale*value; }
+		
+		virtual PortRef<T> ref() const {
+			PortRef<T> result = InPort<T>::ref();
+			if (!this->readingScaled())
+				result.scale *= unitScaleFactor;
+			return result;
+		}
+		
 		virtual void setUnit(const std::string& unit) { this->unit = unit; }
 		void operator=(const T& value) { throw PortException("Attempt to assign value of InUnitPort",this); }
 		
@@ -326,14 +795,16 @@ namespace sbx
 		}
 		
 		double unitScaleFactor;
+		friend class InPort<T>;
 		friend class OutUnitPort<T>;
+		friend class SignalBus;
 	};
 	
 	/// Output port.
 	class OutputPort : public Port
 		{
 		public:
-			OutputPort() { input = false; }
+			OutputPort() : version(0), versioned(true), staged(false) { input = false; }
 			virtual void connect(Port* otherend)=0;
 			virtual bool canConnect(Port* otherend)=0;
 			virtual void disconnect(Port* otherend)=0;
@@ -343,6 +814,28 @@ namespace sbx
 			virtual bool isValid()=0;
 			virtual unsigned int getNumConnections()=0;
 			virtual Port* getOtherEnd(unsigned int index)=0;
+			
+			/// Keep a committed copy of the value, which delayed input ports read (see InputPort::setDelayed())
+			virtual void setCommitted(const bool value)=0;
+			/// Copy the current value into the committed copy, e.g. at the start of a step, unless staged
+			virtual void commit()=0;
+			/// Copy the current value into the committed copy, even if staged
+			virtual void publish()=0;
+			/// Set wether the committed copy is only updated by publish(), i.e. commit() leaves it alone
+			/** Used for outputs of background rate groups, which are published when the rate group is
+			 started again, see UpdateVisitor::setBackgroundRateGroups(). */
+			void setStaged(const bool value) { staged = value; }
+			bool isStaged() const { return staged; }
+			
+			/// Get a number that is incremented whenever a new value is set
+			/** Setting the same value again, as far as PortValueChange can tell, keeps the version. */
+			unsigned long getVersion() const { return version; }
+			/// Returns false if value changes can't be told from the version, i.e. if a value pointer is set
+			bool isVersioned() const { return versioned; }
+		protected:
+			unsigned long version;
+			bool versioned;
+			bool staged;
 		};
 	
 	/// Type specific implementation of an output port.
@@ -350,9 +843,14 @@ namespace sbx
 	class OutPort : public OutputPort
 		{
 		public:
-			OutPort() : value_ptr(NULL) { }
-			OutPort(const OutPort& source) : value(source.value), value_ptr(NULL), mutex() { }
-			~OutPort() { disconnect(); }
+			OutPort() : value_ptr(NULL), bus_slot(NULL) { }
+			OutPort(const OutPort& source) : value(source.value), value_ptr(NULL), bus_slot(NULL) { }
+			~OutPort()
+			{
+				if (bus)
+					detachSignalBus(bus, this);
+				disconnect();
+			}
 			
 			virtual void connect(Port* otherend)
 			{
@@ -402,26 +900,96 @@ namespace sbx
 			virtual unsigned int getNumConnections() { return connections.size(); }
 			virtual Port* getOtherEnd(unsigned int index) { return connections[index]; }
 
-			virtual const T& get() const
+			/// Get a copy of the value, see PortValue for how it is synchronized with set()
+			/** A value pointer set with setPtr(), or a signal bus slot, is read as is, without synchronization. */
+			virtual const T get() const
 			{
-				OpenThreads::ScopedLock<OpenThreads::Mutex> lock((OpenThreads::Mutex&)mutex);
 				if (value_ptr)
 					return *value_ptr;
+				else if (bus_slot)
+					return *bus_slot;
 				else
-					return value;
+					return value.get();
 			}
 
-			const T& operator*() const { return get(); }
+			const T operator*() const { return get(); }
+			
+			/// Get a reference to the value, without copying it
+			/** Follows a value pointer set with setPtr() like get() does. Only use it on the thread
+			 setting the value, or see PortValue::ref() for how long it stays unchanged. The address
+			 changes when bound to a signal bus, see SignalBus. */
+			const T& getRef() const
+			{
+				if (value_ptr)
+					return *value_ptr;
+				else if (bus_slot)
+					return *bus_slot;
+				else
+					return value.ref();
+			}
+			
+			/// Get the value to write in place, e.g. to fill a large value without a temporary
+			/** The value may be an older one, and has to be written completely before endSet() publishes
+			 it. Like set(), writes the port's own value even if a value pointer is set. */
+			T& beginSet()
+			{
+				if (bus_slot)
+					return *bus_slot;
+				return value.beginSet();
+			}
+			void endSet()
+			{
+				version++;
+				if (!bus_slot)
+					value.endSet();
+			}
+			
 			virtual void set(const T& value)
 			{
-				OpenThreads::ScopedLock<OpenThreads::Mutex> lock(mutex);
-				this->value = value;
+				if (bus_slot) {
+					if (PortValueChange<T>::changed(*bus_slot, value))
+						version++;
+					*bus_slot = value;
+				} else {
+					if (PortValueChange<T>::changed(this->value.ref(), value))
+						version++;
+					this->value.set(value);
+				}
+			}
+			void operator=(const T& value)
+			{
+				if (bus_slot) {
+					if (PortValueChange<T>::changed(*bus_slot, value))
+						version++;
+					*bus_slot = value;
+				} else
+					set(value);
 			}
-			void operator=(const T& value) { set(value); }
 			void setPtr(T* value_ptr)
 			{ 
-				OpenThreads::ScopedLock<OpenThreads::Mutex> lock(mutex);
 				this->value_ptr = value_ptr;
+				versioned = (value_ptr == NULL);
+				if (bus)
+					touchTopology(); // connected inputs read the pointer directly
+			}
+			
+			/** The committed copy is kept until disabled, so that delayed inputs can keep pointing at it. */
+			virtual void setCommitted(const bool value)
+			{
+				if (!value)
+					committed.clear();
+				else if (committed.empty())
+					committed.push_back(get());
+			}
+			virtual void commit()
+			{
+				if (!staged)
+					publish();
+			}
+			virtual void publish()
+			{
+				if (!committed.empty())
+					committed[0] = get();
 			}
 		protected:
 			virtual void doConnect(InPort<T>* otherend)
@@ -442,10 +1010,12 @@ namespace sbx
 			
 			typedef std::vector<InPort<T>*> ConnectionList;
 			ConnectionList connections;
-			T value;
+			PortValue<T> value;
 			T* value_ptr;
-			OpenThreads::Mutex mutex;
+			T* bus_slot; ///< slot holding the value on a signal bus, see SignalBus
+			std::vector<T> committed; ///< value read by delayed inputs, see commit()
 			friend class InPort<T>;
+			friend class SignalBus;
 		};
 	
 	/// Type specific implementation of an output port with on-the-fly unit conversion.
@@ -458,7 +1028,7 @@ namespace sbx
 		}
 		
 		virtual void setUnit(const std::string& unit) { this->unit = unit; }
-		void operator=(const T& value) { set(value); }
+		void operator=(const T& value) { OutPort<T>::operator=(value); }
 	protected:
 		friend class InUnitPort<T>;
 	};
@@ -484,7 +1054,12 @@ namespace sbx
  ports have units specified, and a unitScaleFactor is stored for subsequent access.
  
  An output port can be connected to <b>one or more</b> input ports. A value pointer is set using setPtr(). If no pointer
- is set, the output port can store a value (using operator=() or set()).
+ is set, the output port can store a value (using operator=() or set()). Stored values are published to other threads
+ without locks (see PortValue and PortSync).
+ 
+ Large values (e.g. vectors) can be read without a copy using InPort::ref(), which refers to the
+ producer's value (or to the value pointer set with setPtr()) and leaves the unit conversion factor
+ to the consumer, and written in place using OutPort::beginSet() and endSet().
  
  The actual implementation of ports is implemented using templates, so that any data (e.g. strings and
  vectors) can be passed between models. However, the user is advised to stick to ports of template type
@@ -0,0 +1,183 @@
+#include "SignalBus.h"
+#include "Group.h"
+#include "BlackBox.h"
+#include "Log.h"
+
+namespace sbx
+{
+
+	void detachSignalBus(SignalBus* bus, Port* port)
+	{
+		bus->detach(port);
+	}
+
+	SignalBus::SignalBus()
+	:	root(NULL),
+		revision(0),
+		slots(NULL),
+		numslots(0)
+	{
+	}
+
+	SignalBus::~SignalBus()
+	{
+		unbind();
+	}
+
+	bool SignalBus::isBoundTo(const Model& model) const
+	{
+		return root == &model && revision == model.getTopologyRevision();
+	}
+
+	void SignalBus::bind(Model& model, const ModelGroups& groups)
+	{
+		unbind();
+
+		// Lay out the slots, each group starting on a cache line
+		const unsigned int line = SIGNALBUS_CACHE_LINE / sizeof(double);
+		std::set<const Port*> added;
+		std::vector<unsigned int> offsets;
+		unsigned int offset = 0;
+		for (ModelGroups::const_iterator g = groups.begin(); g != groups.end(); g++) {
+			unsigned int first = outputs.size();
+			for (std::vector<Model*>::const_iterator m = g->begin(); m != g->end(); m++)
+				collectOutputs(**m, outputs, added);
+			for (unsigned int i = first; i < outputs.size(); i++)
+				offsets.push_back(offset++);
+			offset = (offset + line - 1) / line * line;
+		}
+		unsigned int first = outputs.size();
+		collectTreeOutputs(model, outputs, added);
+		for (unsigned int i = first; i < outputs.size(); i++)
+			offsets.push_back(offset++);
+		numslots = offset;
+
+		storage.assign(numslots*sizeof(double) + SIGNALBUS_CACHE_LINE, 0);
+		size_t address = (size_t) &storage[0];
+		slots = (double*) ((address + SIGNALBUS_CACHE_LINE - 1) / SIGNALBUS_CACHE_LINE * SIGNALBUS_CACHE_LINE);
+		std::map<const void*, const void*> moved;
+		for (unsigned int i = 0; i < outputs.size(); i++) {
+			OutPort<double>* port = outputs[i];
+			slots[offsets[i]] = port->get();
+			port->bus_slot = &slots[offsets[i]];
+			port->bus = this;
+			moved[&port->value.ref()] = port->bus_slot;
+		}
+		BlackBox::instance().relocateVariables(moved);
+
+		added.clear();
+		bindInputs(model, added);
+		root = &model;
+		revision = model.getTopologyRevision();
+		dout(4) << "signal bus bound to " << model.getName() << ", " << outputs.size() << " outputs in "
+			<< numslots << " slots, " << inputs.size() << " inputs\n";
+	}
+
+	void SignalBus::unbind()
+	{
+		std::map<const void*, const void*> moved;
+		for (std::vector< OutPort<double>* >::iterator i = outputs.begin(); i != outputs.end(); i++) {
+			OutPort<double>* port = *i;
+			double value = *port->bus_slot;
+			moved[port->bus_slot] = &port->value.ref();
+			port->bus_slot = NULL;
+			port->bus = NULL;
+			port->value.set(value);
+		}
+		if (!moved.empty())
+			BlackBox::instance().relocateVariables(moved);
+		for (std::vector< InPort<double>* >::iterator i = inputs.begin(); i != inputs.end(); i++) {
+			(*i)->bus_ptr = NULL;
+			(*i)->bus_scale = 1;
+			(*i)->bus = NULL;
+		}
+		outputs.clear();
+		inputs.clear();
+		storage.clear();
+		slots = NULL;
+		numslots = 0;
+		root = NULL;
+	}
+
+	const double* SignalBus::getSlot(const OutPort<double>* port) const
+	{
+		if (port->bus != this)
+			return NULL;
+		return port->bus_slot;
+	}
+
+	void SignalBus::collectOutputs(Model& model, std::vector< OutPort<double>* >& ports, std::set<const Port*>& added)
+	{
+		for (unsigned int i = model.getNumInputs(); i < model.getNumPorts(); i++) {
+			OutPort<double>* port = dynamic_cast<OutPort<double>*>(model.getPort(i));
+			if (port && !port->value_ptr && !port->bus && added.insert(port).second)
+				ports.push_back(port);
+		}
+	}
+
+	void SignalBus::collectTreeOutputs(Model& model, std::vector< OutPort<double>* >& ports, std::set<const Port*>& added)
+	{
+		collectOutputs(model, ports, added);
+		if (Group* group = model.asGroup())
+			for (unsigned int i = 0; i < group->getNumChildren(); i++)
+				collectTreeOutputs(*group->getChild(i), ports, added);
+	}
+
+	/** Inputs connected to output ports outside the tree, or unconnected, are left to read through
+	 the port connections as usual. */
+	void SignalBus::bindInputs(Model& model, std::set<const Port*>& added)
+	{
+		for (unsigned int i = 0; i < model.getNumInputs(); i++) {
+			InPort<double>* port = dynamic_cast<InPort<double>*>(model.getPort(i));
+			if (!port || port->bus || !added.insert(port).second)
+				continue;
+			// Follow input to input connections to the output port, multiplying unit conversion factors
+			double scale = 1;
+			InPort<double>* in = port;
+			for (unsigned int hops = 0; in && !in->connection_out && hops <= inputs.size() + 1; hops++) {
+				if (InUnitPort<double>* unitin = dynamic_cast<InUnitPort<double>*>(in))
+					scale *= unitin->unitScaleFactor;
+				in = in->connection_in;
+			}
+			if (!in || !in->connection_out)
+				continue;
+			if (InUnitPort<double>* unitin = dynamic_cast<InUnitPort<double>*>(in))
+				scale *= unitin->unitScaleFactor;
+			OutPort<double>* out = in->connection_out;
+			const double* ptr = out->value_ptr;
+			if (!ptr) {
+				if (out->bus != this)
+					continue;
+				ptr = out->bus_slot;
+			}
+			port->bus_ptr = ptr;
+			port->bus_scale = scale;
+			port->bus = this;
+			inputs.push_back(port);
+		}
+		if (Group* group = model.asGroup())
+			for (unsigned int i = 0; i < group->getNumChildren(); i++)
+				bindInputs(*group->getChild(i), added);
+	}
+
+	void SignalBus::detach(Port* port)
+	{
+		for (unsigned int i = 0; i < outputs.size(); i++) {
+			if ((Port*) outputs[i] == port) {
+				outputs[i]->bus_slot = NULL;
+				outputs[i]->bus = NULL;
+				outputs.erase(outputs.begin()+i);
+				return;
+			}
+		}
+		for (unsigned int i = 0; i < inputs.size(); i++) {
+			if ((Port*) inputs[i] == port) {
+				inputs[i]->bus_ptr = NULL;
+				inputs[i]->bus = NULL;
+				inputs.erase(inputs.begin()+i);
+				return;
+			}
+		}
+	}
+
+}
@@ -0,0 +1,83 @@
+#ifndef SBX_SIGNALBUS_H
+#define SBX_SIGNALBUS_H
+
+#include "Export.h"
+#include "Model.h"
+#include "Ports.h"
+#include <vector>
+#include <set>
+
+namespace sbx
+{
+
+	/// Size in bytes of the cache lines signal bus slots are aligned to
+	#define SIGNALBUS_CACHE_LINE 64
+
+	/// Flat, cache aligned storage for the values of the double output ports of a model tree
+	/** When bound, every OutPort<double> (that doesn't have a value pointer, see OutPort::setPtr())
+	 stores its value in a slot of one array, and every InPort<double> connected to an output port in
+	 the tree, directly or through other input ports, keeps a pointer to the slot and the product of
+	 the unit conversion factors on the way. Reading such an input is then one load and one multiply,
+	 without virtual calls or forwarding through other ports.
+
+	 Slots are handed out to groups of models (e.g. the rate groups of a compiled update schedule)
+	 one group after another, each group starting on a cache line of its own, followed by the
+	 remaining models in tree order.
+
+	 Slot values aren't synchronized between threads (see PortSync), but aligned doubles are read
+	 and written as a whole on common platforms.
+
+	 While bound, OutPort::getRef() refers to the slot rather than the port's own value. BlackBox
+	 variables registered at either are moved along on bind() and unbind(), so they keep logging
+	 the current value, and lookups of logged outputs by address (e.g. for pruning and operator
+	 fusion) keep matching.
+	 */
+	class SIMBLOX_API SignalBus
+	{
+	public:
+		typedef std::vector< std::vector<Model*> > ModelGroups;
+
+		SignalBus();
+		~SignalBus();
+
+		/// Bind the double ports of all models under \a root, handing out slots to \a groups first
+		void bind(Model& root, const ModelGroups& groups = ModelGroups());
+		/// Move the values back into the ports and release them
+		void unbind();
+		bool isBound() const { return root != NULL; }
+		/// Returns true if bound to \a model and the model topology hasn't changed since
+		bool isBoundTo(const Model& model) const;
+
+		/// Get the number of output ports on the bus
+		unsigned int getNumOutputs() const { return outputs.size(); }
+		/// Get the number of input ports reading from the bus
+		unsigned int getNumInputs() const { return inputs.size(); }
+		/// Get the number of slots, including padding between groups
+		unsigned int getNumSlots() const { return numslots; }
+		const double* getSlots() const { return slots; }
+		/// Get the slot of an output port, NULL if it isn't on this bus
+		const double* getSlot(const OutPort<double>* port) const;
+
+	protected:
+		/// Add the double output ports of \a model to \a ports, unless already added
+		void collectOutputs(Model& model, std::vector< OutPort<double>* >& ports, std::set<const Port*>& added);
+		/// Add the double output ports of all models under \a model
+		void collectTreeOutputs(Model& model, std::vector< OutPort<double>* >& ports, std::set<const Port*>& added);
+		/// Point the double input ports of all models under \a model at their slots
+		void bindInputs(Model& model, std::set<const Port*>& added);
+		void detach(Port* port);
+
+		const Model* root;
+		unsigned long revision;
+		std::vector<char> storage;
+		double* slots;
+		unsigned int numslots;
+		std::vector< OutPort<double>* > outputs;
+		std::vector< InPort<double>* > inputs;
+
+		friend SIMBLOX_API void detachSignalBus(SignalBus* bus, Port* port);
+	};
+
+}
+
+#endif
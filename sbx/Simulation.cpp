@@ -12,11 +12,12 @@
 #include "PluginManager.h"
 #include "XMLParser.h"
 #include "Log.h"
+#include <OpenThreads/ScopedLock>
 
 namespace sbx
 {
 	
-	Simulation::Simulation(Group *newroot) :
+	Simulation::Simulation(Group *newroot, const bool nstandalone) :
 	time(0),
 	diff_time(0),
 	timestep(0),
@@ -31,9 +32,22 @@ namespace sbx
 	realtime(true),
 	rratio_num_steps(0),
 	average_rratio(0),
-	continuous_display(true)
+	overrun_policy(CATCH_UP),
+	spin_time(0),
+	deadline_misses(0),
+	skipped_frames(0),
+	jitter_histogram(20, 0),
+	jitter_binwidth(1e-4),
+	max_jitter(0),
+	continuous_display(true),
+	standalone(nstandalone),
+	use_signalbus(false),
+	pruning(false),
+	applied_parametersets(0)
 	{
 		root = newroot;
+		if (standalone)
+			return;
 		if (!instanceptr)
 			instanceptr = this;
 		else
@@ -42,6 +56,8 @@ namespace sbx
 	
 	Simulation::~Simulation()
 	{
+		displayvis.setPipelined(false);
+		signalbus.unbind();
 		if (instanceptr == this)
 			instanceptr = NULL;
 	}
@@ -58,6 +74,7 @@ namespace sbx
 	void Simulation::init()
 	{
 		// Reset visitor counters etc
+		clearRealTimeStatistics();
 		initvis.reset();
 		updatevis.reset();
 		displayvis.reset();
@@ -66,11 +83,17 @@ namespace sbx
 		if (!configured)
 			configure();
 		time = 0;
-		if (!multiple_instances)
+		if (!multiple_instances && !standalone)
 			PluginManager::instance().preInitialize();
 		
 		if (root.valid())
 			initvis.visit(*root);
+		if (root.valid() && pruning) {
+			updatevis.prune(*root);
+			if (!pruning_report.empty())
+				writePruningReport(pruning_report);
+		} else
+			updatevis.clearPruning();
 		maximum_timestep = 1.0/initvis.getMinimumUpdateFrequency();
 		
 		// Set time step based on model requested update frequencies
@@ -84,7 +107,7 @@ namespace sbx
 		} else
 			setTimeStep(timestep); // see setTimeStep() - this checks for max timestep / min freq
 		
-		if (!multiple_instances)
+		if (!multiple_instances && !standalone)
 			PluginManager::instance().postInitialize();
 		
 		dout(1) << "Simulation initialized - "
@@ -113,22 +136,27 @@ namespace sbx
 			rratio_count_steps = 0;
 		}
 		double step_start_time = timer.time_s();
+		if (posted_parametersets)
+			applyParameterSets();
 		if (paused) {
-			if (!multiple_instances)
+			if (!multiple_instances && !standalone)
 				PluginManager::instance().pauseUpdate(timestep);
 		} else {
-			if (!multiple_instances)
+			if (!multiple_instances && !standalone)
 				PluginManager::instance().preUpdate(timestep);
 			if (root.valid()) {
+				if (use_signalbus)
+					bindSignalBus();
 				updatevis.visit(*root);
 				if (continuous_display)
 					displayvis.visit(*root, DISPLAY_CONTINUOUS);
 			}
-			if (!multiple_instances)
+			if (!multiple_instances && !standalone)
 				PluginManager::instance().postUpdate(timestep);
 			time += timestep;
 			
 			if (endtime > 0 && time+timestep/2 >= endtime) {
+				updatevis.waitBackground();
 				if (root.valid())
 					displayvis.visit(*root, DISPLAY_FINAL);
 				dout(5) << "Simulation finished at t=" << time << " seconds\n";
@@ -151,6 +179,36 @@ namespace sbx
 		return step_time;
 	}
 	
+	/** This can be called from any thread, e.g. a GUI or a tuning script. The changes are copied,
+	 so \a set can be reused right away. Sets are applied in the order they were posted, by the next
+	 step(), before any model is updated, so that no step sees only part of a set. Posting takes a
+	 lock once per set, while a step only checks an atomic counter unless something was posted.
+	 */
+	void Simulation::applyParameterSet(const ParameterSet& set)
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(parameterset_mutex);
+		posted_parameters.add(set);
+		++posted_parametersets;
+	}
+	
+	/** Background rate groups and pipelined display passes still running from the previous step are
+	 waited for first, so that they don't see parameters change halfway. */
+	void Simulation::applyParameterSets()
+	{
+		unsigned int num;
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(parameterset_mutex);
+			posted_parameters.swap(applying_parameters);
+			num = posted_parametersets.exchange(0);
+		}
+		updatevis.waitBackground();
+		displayvis.waitPipeline();
+		applying_parameters.apply();
+		applying_parameters.clear();
+		applied_parametersets += num;
+		dout(5) << "applied " << num << " parameter sets at t=" << time << "\n";
+	}
+	
 	double Simulation::update(const double dt)
 	{
 		if (paused)
@@ -164,30 +222,125 @@ namespace sbx
 		return step_time;
 	}
 	
+	/** In realtime, step \e n ends at \e n time steps after the start of the run, regardless of how
+	 long the steps before it took, by sleeping until that absolute deadline. A step that doesn't
+	 finish by its deadline is a deadline miss, which is handled according to the overrun policy
+	 (see setOverrunPolicy()).
+	 */
 	void Simulation::run()
 	{
 		done = false;
 		if (!initialized)
 			init();
-		double makeup_time = 0;
+		double period = timestep / timer.getSecondsPerTick();
+		Timer_t start = timer.tick();
+		unsigned long frame = 0;
 		while (!done) {
-			double start_time = timer.time_s();
+			update(timestep);
 			
-			double step_time = update(timestep);
-			
-			// If realtime, pause until next timestep
 			if (realtime) {
-				while (step_time < timestep-makeup_time) {		
-					Timer::sleep(10);
-					step_time = timer.time_s()-start_time;
+				frame++;
+				Timer_t now = timer.tick();
+				Timer_t deadline = start + (Timer_t) (frame*period);
+				if (now > deadline) {
+					deadline_misses++;
+					if (overrun_policy == SKIP) {
+						unsigned long missed = (unsigned long) ((now-deadline) / period) + 1;
+						frame += missed;
+						skipped_frames += missed;
+					} else if (overrun_policy == SLIP) {
+						start = now;
+						frame = 0;
+					}
+					deadline = start + (Timer_t) (frame*period);
 				}
-				makeup_time += step_time-timestep;
+				waitUntil(deadline);
+				double jitter = timer.delta_s(deadline, timer.tick());
+				if (jitter > max_jitter)
+					max_jitter = jitter;
+				unsigned int bin = (unsigned int) (jitter / jitter_binwidth);
+				if (bin >= jitter_histogram.size())
+					bin = jitter_histogram.size()-1;
+				jitter_histogram[bin]++;
+			} else {
+				// Start a new frame schedule if switched to realtime
+				start = timer.tick();
+				frame = 0;
+			}
+			if (timestep / timer.getSecondsPerTick() != period) {
+				start += (Timer_t) (frame*period);
+				frame = 0;
+				period = timestep / timer.getSecondsPerTick();
 			}
 		}
 		//dout(DEBUG) << "Sim time " << time << ", real time " << timer.time_s()-start_realtime 
 		//			<< ", average realtime ratio " << (sum_rratio/steps) << "\n";
 	}
 	
+	void Simulation::waitUntil(const Timer_t tick)
+	{
+		Timer_t spin = (Timer_t) (spin_time / timer.getSecondsPerTick());
+		if (tick > spin)
+			timer.sleepUntil(tick - spin);
+		while (timer.tick() < tick) { }
+	}
+	
+	void Simulation::setSignalBus(const bool value)
+	{
+		use_signalbus = value;
+		if (!value) {
+			displayvis.waitPipeline();
+			signalbus.unbind();
+		}
+	}
+	
+	/** The outputs of each rate group of the compiled update schedule get contiguous slots. Only
+	 done when the model topology has changed, since the bus was bound. */
+	void Simulation::bindSignalBus()
+	{
+		if (signalbus.isBoundTo(*root))
+			return;
+		displayvis.waitPipeline();
+		SignalBus::ModelGroups groups;
+		if (updatevis.usingSchedule()) {
+			if (!updatevis.isCompiled(*root))
+				updatevis.compile(*root);
+			const UpdateSchedule& schedule = updatevis.getSchedule();
+			const RateGroups& rategroups = updatevis.getRateGroups();
+			for (RateGroups::const_iterator g = rategroups.begin(); g != rategroups.end(); g++) {
+				groups.push_back(std::vector<Model*>());
+				for (std::vector<unsigned int>::const_iterator i = g->entries.begin(); i != g->entries.end(); i++)
+					groups.back().push_back(schedule[*i].model);
+			}
+		}
+		signalbus.bind(*root, groups);
+	}
+	
+	/** \see UpdateVisitor::writePruningReport() */
+	void Simulation::writePruningReport(const std::string& filename)
+	{
+		TiXmlDocument doc;
+		TiXmlElement* element = new TiXmlElement("pruning");
+		updatevis.writePruningReport(element);
+		doc.LinkEndChild(element);
+		if (!doc.SaveFile(filename.c_str()))
+			dout(1) << "Failed to write pruning report '" << filename << "'\n";
+	}
+	
+	void Simulation::setJitterHistogram(const unsigned int bins, const double binwidth)
+	{
+		jitter_histogram.assign(bins > 0 ? bins : 1, 0);
+		jitter_binwidth = binwidth;
+	}
+	
+	void Simulation::clearRealTimeStatistics()
+	{
+		deadline_misses = 0;
+		skipped_frames = 0;
+		jitter_histogram.assign(jitter_histogram.size(), 0);
+		max_jitter = 0;
+	}
+	
 	void Simulation::parseXML(const TiXmlElement *element)
 	{
 		std::string str = XMLParser::parseString(element,"traversal",true,"");
@@ -202,6 +355,18 @@ namespace sbx
 				throw ParseException("Unknown traversal mode '" + str + "'", element);
 		}
 		realtime = XMLParser::parseBoolean(element,"realtime",true,realtime);
+		str = XMLParser::parseString(element,"overrun",true,"");
+		if (str.length() > 0) {
+			if (str == "catchup")
+				overrun_policy = CATCH_UP;
+			else if (str == "skip")
+				overrun_policy = SKIP;
+			else if (str == "slip")
+				overrun_policy = SLIP;
+			else
+				throw ParseException("Unknown overrun policy '" + str + "'", element);
+		}
+		spin_time = XMLParser::parseDouble(element,"realtime_spin","second",true,spin_time);
 		endtime = XMLParser::parseDouble(element,"endtime","second",true,endtime);
 		double step = XMLParser::parseDouble(element,"step","second",true,0);
 		int frequency = XMLParser::parseInt(element,"frequency","Hz",true,0);
@@ -213,6 +378,26 @@ namespace sbx
 			setFrequency(frequency);
 		paused = XMLParser::parseBoolean(element,"paused",true,paused);
 		continuous_display = XMLParser::parseBoolean(element, "continuous_display", true, continuous_display);
+		setSignalBus(XMLParser::parseBoolean(element, "signal_bus", true, use_signalbus));
+		setPipelinedDisplay(XMLParser::parseBoolean(element, "pipelined_display", true, getPipelinedDisplay()));
+		setCompiledSchedule(XMLParser::parseBoolean(element, "compiled_schedule", true, getCompiledSchedule()));
+		setBackgroundRateGroups(XMLParser::parseBoolean(element, "background_rate_groups", true, getBackgroundRateGroups()));
+		setBackgroundThreads(XMLParser::parseBoolean(element, "background_threads", true, getBackgroundThreads()));
+		setChangePropagation(XMLParser::parseBoolean(element, "change_propagation", true, getChangePropagation()));
+		setOperatorFusion(XMLParser::parseBoolean(element, "operator_fusion", true, getOperatorFusion()));
+		pruning = XMLParser::parseBoolean(element, "pruning", true, pruning);
+		pruning_report = XMLParser::parseString(element, "pruning_report", true, pruning_report);
+		str = XMLParser::parseString(element,"connection_delay",true,"");
+		if (str.length() > 0) {
+			if (str == "none")
+				setConnectionDelay(DELAY_NONE);
+			else if (str == "loose")
+				setConnectionDelay(DELAY_LOOSE);
+			else if (str == "all")
+				setConnectionDelay(DELAY_ALL);
+			else
+				throw ParseException("Unknown connection delay '" + str + "'", element);
+		}
 		
 		if (element->FirstChildElement("plugins")) {
 			std::string addpath = XMLParser::parseStringAttribute(element->FirstChildElement("plugins"), "path", true, "");
@@ -248,6 +433,12 @@ namespace sbx
 		}
 		XMLParser::setString(element, "traversal", str);
 		XMLParser::setBoolean(element, "realtime", realtime);
+		if (overrun_policy != CATCH_UP)
+			XMLParser::setString(element, "overrun", overrun_policy == SKIP ? "skip" : "slip");
+		if (spin_time > 0) {
+			XMLParser::setDouble(element, "realtime_spin", spin_time);
+			XMLParser::setString(element, "realtime_spin", "second", "unit");
+		}
 		if (endtime > 0) {
 			XMLParser::setDouble(element, "endtime", endtime);
 			XMLParser::setString(element, "endtime", "second", "unit");
@@ -259,6 +450,25 @@ namespace sbx
 		if (paused)
 			XMLParser::setBoolean(element, "paused", paused);
 		XMLParser::setBoolean(element, "continuous_display", continuous_display);
+		if (getPipelinedDisplay())
+			XMLParser::setBoolean(element, "pipelined_display", true);
+		if (use_signalbus)
+			XMLParser::setBoolean(element, "signal_bus", true);
+		XMLParser::setBoolean(element, "compiled_schedule", getCompiledSchedule());
+		if (getBackgroundRateGroups())
+			XMLParser::setBoolean(element, "background_rate_groups", true);
+		if (!getBackgroundThreads())
+			XMLParser::setBoolean(element, "background_threads", false);
+		if (getChangePropagation())
+			XMLParser::setBoolean(element, "change_propagation", true);
+		if (getOperatorFusion())
+			XMLParser::setBoolean(element, "operator_fusion", true);
+		if (pruning)
+			XMLParser::setBoolean(element, "pruning", true);
+		if (!pruning_report.empty())
+			XMLParser::setString(element, "pruning_report", pruning_report);
+		if (getConnectionDelay() != DELAY_NONE)
+			XMLParser::setString(element, "connection_delay", getConnectionDelay() == DELAY_LOOSE ? "loose" : "all");
 		if (PluginManager::instance().getNumPlugins() > 0) {
 			TiXmlElement *pluginselement = new TiXmlElement("plugins");
 			for (int i = 0; i < PluginManager::instance().getNumPlugins(); i++) {
@@ -300,6 +510,7 @@ namespace sbx
 	
 	void Simulation::display(const DisplayMode mode)
 	{
+		updatevis.waitBackground();
 		if (root.valid())
 			displayvis.visit(*root, mode);
 	}
@@ -13,19 +13,31 @@
 #include "Export.h"
 #include "Group.h"
 #include "ModelVisitor.h"
+#include "SignalBus.h"
 #include "Timer.h"
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Atomic>
 #include <numerix/misc.h>
 #include <math.h>
+#include <vector>
 
 class TiXmlElement;
 
 namespace sbx
 {
 	
+	/// What Simulation::run() does when a realtime step takes longer than its frame
+	enum OverrunPolicy {
+		CATCH_UP, ///< start the following steps right away until back on schedule
+		SKIP, ///< drop the frames that have passed, so that the simulation falls behind wall clock time
+		SLIP ///< restart the frame schedule at the end of the overrunning step
+	};
+	
 	class SIMBLOX_API Simulation : public smrt::Referenced
 	{
 	public:
-		Simulation(Group *root = NULL);
+		/// A \a standalone simulation doesn't register as the instance() and doesn't call plugins
+		Simulation(Group *root = NULL, const bool standalone = false);
 		virtual ~Simulation();
 		
 		virtual void configure();
@@ -49,7 +61,7 @@ namespace sbx
 		double getTimeStep() { return timestep; }
 		void setFrequency(const int freq) { setTimeStep(1.0/freq); }
 		int getFrequency() { return (int) round(1.0/getTimeStep()); }
-		void setRoot(Group *group) { root = group; }
+		void setRoot(Group *group) { displayvis.waitPipeline(); signalbus.unbind(); root = group; }
 		Group *getRoot() { return root.get(); }
 		double getRealTimeSinceStart() { return timer.time_s(); }
 		double getRealTimeRatio() { return realtime_ratio; }
@@ -57,6 +69,23 @@ namespace sbx
 		void setAverageRealTimeRatioSteps(unsigned long num) { rratio_num_steps = num; }
 		void clearAverageRealTimeRatio() { sum_rratio = 0; rratio_count_steps = 0; average_rratio = 0; }
 		
+		/// Set what run() does when a realtime step takes longer than the time step
+		void setOverrunPolicy(const OverrunPolicy policy) { overrun_policy = policy; }
+		OverrunPolicy getOverrunPolicy() { return overrun_policy; }
+		/// Set time to busy-wait rather than sleep before each realtime frame, for more precise frame starts
+		void setRealTimeSpin(const double seconds) { spin_time = seconds; }
+		double getRealTimeSpin() { return spin_time; }
+		/// Get number of realtime steps that finished after the end of their frame
+		unsigned long getDeadlineMisses() { return deadline_misses; }
+		/// Get number of frames dropped by the SKIP overrun policy
+		unsigned long getSkippedFrames() { return skipped_frames; }
+		/// Get histogram of how late realtime frames started, the last bin also counts everything beyond it
+		const std::vector<unsigned long>& getJitterHistogram() { return jitter_histogram; }
+		void setJitterHistogram(const unsigned int bins, const double binwidth);
+		double getJitterBinWidth() { return jitter_binwidth; }
+		double getMaxJitter() { return max_jitter; }
+		void clearRealTimeStatistics();
+		
 		bool isInitialized() { return initialized; }
 		void setDone(const bool val) { done = val; }
 		bool isDone() { return done; }
@@ -68,13 +97,62 @@ namespace sbx
 		const DisplayVisitor& getDisplayVisitor() const { return displayvis; }
 		void doStatistics(const bool value = true);
 		
+		/// Set wether to run updates from a compiled schedule rather than traversing the models each step
+		void setCompiledSchedule(const bool value) { updatevis.useSchedule(value); }
+		bool getCompiledSchedule() { return updatevis.usingSchedule(); }
+		/// Set wether to update models slower than the simulation on background threads, see UpdateVisitor::runBackground()
+		void setBackgroundRateGroups(const bool value) { updatevis.setBackgroundRateGroups(value); }
+		bool getBackgroundRateGroups() { return updatevis.getBackgroundRateGroups(); }
+		/// Set wether background rate groups get threads of their own, see UpdateVisitor::setBackgroundThreads()
+		void setBackgroundThreads(const bool value) { updatevis.setBackgroundThreads(value); }
+		bool getBackgroundThreads() { return updatevis.getBackgroundThreads(); }
+		/// Set which inputs read values from the previous step, see UpdateVisitor::setConnectionDelay()
+		void setConnectionDelay(const ConnectionDelay value) { updatevis.setConnectionDelay(value); }
+		ConnectionDelay getConnectionDelay() { return updatevis.getConnectionDelay(); }
+		/// Set wether pure models are skipped when their inputs are unchanged, see UpdateVisitor::setChangePropagation()
+		void setChangePropagation(const bool value) { updatevis.setChangePropagation(value); }
+		bool getChangePropagation() { return updatevis.getChangePropagation(); }
+		/// Set wether chains of operator models are evaluated as one model, see UpdateVisitor::setOperatorFusion()
+		void setOperatorFusion(const bool value) { updatevis.setOperatorFusion(value); }
+		bool getOperatorFusion() { return updatevis.getOperatorFusion(); }
+		/// Set wether init() prunes the models nothing needs from the update schedule, see UpdateVisitor::prune()
+		void setPruning(const bool value) { pruning = value; }
+		bool getPruning() { return pruning; }
+		/// Set a file for init() to write which models were pruned and why to, if pruning (none if empty)
+		void setPruningReport(const std::string& filename) { pruning_report = filename; }
+		const std::string& getPruningReport() { return pruning_report; }
+		/// Write which models were pruned and why to \a filename as XML
+		void writePruningReport(const std::string& filename);
+		
+		/// Set wether the values of double ports are kept on a signal bus, see SignalBus
+		void setSignalBus(const bool value);
+		bool getSignalBus() { return use_signalbus; }
+		const SignalBus& getBus() const { return signalbus; }
+		
 		void setContinuousDisplay(const bool value) { continuous_display = value; }
 		bool getContinuousDisplay() { return continuous_display; }
+		/// Set wether continuous display passes run concurrently with the next step, see DisplayVisitor::setPipelined()
+		void setPipelinedDisplay(const bool value) { displayvis.setPipelined(value); }
+		bool getPipelinedDisplay() { return displayvis.isPipelined(); }
 		void display(const DisplayMode mode);
 		
+		/// Apply the parameter changes of \a set at the start of the next step, see applyParameterSets()
+		void applyParameterSet(const ParameterSet& set);
+		/// Get the number of parameter sets applied so far
+		unsigned long getNumAppliedParameterSets() { return applied_parametersets; }
+		
+		bool isStandalone() { return standalone; }
+		
 		static Simulation *instance();
 		static void resetInstance(Simulation *instanceptr);
 	protected:
+		/// Wait until a timer tick, sleeping and then spinning for the last getRealTimeSpin() seconds
+		void waitUntil(const Timer_t tick);
+		/// (Re)bind the signal bus if the model topology has changed, laid out by rate group
+		void bindSignalBus();
+		/// Apply the parameter sets posted since the last step
+		void applyParameterSets();
+		
 		double time, diff_time, timestep, maximum_timestep;
 		smrt::ref_ptr<Group> root;
 		ConfigureVisitor configurevis;
@@ -88,7 +166,21 @@ namespace sbx
 		unsigned long rratio_count_steps, rratio_num_steps;
 		double endtime;
 		bool realtime;
+		OverrunPolicy overrun_policy;
+		double spin_time;
+		unsigned long deadline_misses, skipped_frames;
+		std::vector<unsigned long> jitter_histogram;
+		double jitter_binwidth, max_jitter;
 		bool continuous_display;
+		bool standalone;
+		bool use_signalbus;
+		SignalBus signalbus;
+		bool pruning;
+		std::string pruning_report;
+		OpenThreads::Mutex parameterset_mutex;
+		ParameterSet posted_parameters, applying_parameters;
+		OpenThreads::Atomic posted_parametersets;
+		unsigned long applied_parametersets;
 		
 		static bool multiple_instances;
 		static Simulation *instanceptr;
@@ -3,22 +3,41 @@
 
 #include "Model.h"
 #include "Ports.h"
+#include "ModelArray.h"
 #include "Export.h"
 #include <numerix/ODESolver.h>
+#include <numerix/SolverFactory.h>
+#include <numerix/BatchSolvers.h>
+#include <numerix/MatrixExponential.h>
 #include <Eigen/Core>
+#include <ctype.h>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace sbx {
 
+template <typename T, int _states, int _controls, int _outputs> class StateSpaceBatch;
+
 /// A generic state-space model
 template <typename T, int _states, int _controls, int _outputs>
-class StateSpaceModel : public Model, protected numerix::ODESystem< Eigen::Matrix<T, _states, 1> >
+class StateSpaceModel : public Model, public BatchModel, protected numerix::ODESystem< Eigen::Matrix<T, _states, 1> >
 {
 public:
+	typedef StateSpaceBatch<T, _states, _controls, _outputs> Batch;
+	
 	StateSpaceModel()
 	:	Model(),
+		t0(0),
 		solver(NULL),
-		t0(0)
+		relative_tolerance(1e-6),
+		absolute_tolerance(1e-9),
+		discrete(false),
+		discretization(NULL),
+		discretized_dt(0),
+		batch(NULL)
 	{
+		registerParameters();
 		A.setZero();
 		B.setZero();
 		C.setZero();
@@ -27,37 +46,58 @@ public:
 		states.setZero();
 		controls.setZero();
 		outputs.setZero();
+		previous_controls.setZero();
 	}
 	
 	StateSpaceModel(const StateSpaceModel& source)
 	:	Model(source),
-		solver(NULL),
-		t0(source.t0),
 		A(source.A),
 		B(source.B),
 		C(source.C),
 		D(source.D),
-		states0(source.states0),
 		states(source.states),
 		controls(source.controls),
-		outputs(source.outputs)
+		outputs(source.outputs),
+		states0(source.states0),
+		t0(source.t0),
+		solver(NULL),
+		solvername(source.solvername),
+		relative_tolerance(source.relative_tolerance),
+		absolute_tolerance(source.absolute_tolerance),
+		previous_controls(source.previous_controls),
+		discrete(false),
+		discretization(NULL),
+		discretized_dt(0),
+		batch(NULL)
 	{
-		/// \todo shallow copy solver
+		copyParameter(source, "solver", &solvername);
+		copyParameter(source, "relative_tolerance", &relative_tolerance);
+		copyParameter(source, "absolute_tolerance", &absolute_tolerance);
+		// A new solver of the same class, solver settings other than tolerances aren't copied
+		if (source.solver && solvername.empty())
+			solver = numerix::SolverFactory< Eigen::Matrix<T, _states, 1> >::create(lowerCase(source.solver->name()), *this);
 	}
 	
 	virtual ~StateSpaceModel()
 	{
 		if (solver)
 			delete solver;
+		if (batch)
+			delete batch;
 	}
 	
 	virtual void init()
 	{
-		if (!solver)
-			throw ModelException("No solver", this);
+		setupSolver();
 		setupInitials();
 		setupMatrices();
-		solver->init(t0);
+		discretizations.clear();
+		discretization = NULL;
+		if (discrete)
+			stateUpdate(t0, states0);
+		else
+			solver->init(t0);
+		previous_controls = controls;
 		transferOutputs();
 	}
 	
@@ -72,15 +112,167 @@ public:
 	
 	virtual void update(const double dt)
 	{
+		if (discrete) {
+			transferInputs();
+			const Discretization& zoh = discretize(dt);
+			const Eigen::Matrix<T, _states, 1> next = zoh.Ad*states + zoh.Bd*controls;
+			states = next;
+			outputs = C*states + D*controls;
+			transferOutputs();
+			return;
+		}
 		if (!solver)
 			throw ModelException("No solver", this);
 		transferInputs();
+		// Adaptive solvers may have stepped past the last update, assuming the previous controls
+		for (int i = 0; i < controls.rows(); i++) {
+			if (controls(i,0) != previous_controls(i,0)) {
+				solver->restart();
+				previous_controls = controls;
+				break;
+			}
+		}
 		solver->step(dt);
 		transferOutputs();
 	}
 	
+	/// Get the solver, see the "solver" parameter, NULL if the model is discretized
+	numerix::ODESolver< Eigen::Matrix<T, _states, 1> >* getSolver() { return solver; }
+	/// Get the number of step sizes with a cached discretization, see the "solver" parameter
+	unsigned int getNumDiscretizations() const { return discretizations.size(); }
+	
+	/// Integrate the elements of \a array as one batch, if they can be
+	/** This is called on the prototype of the array, see ModelArray. The elements are batched if they
+	 have the same matrices, initial time and solver, and the solver has a batch version (see
+	 numerix::BatchSolverFactory). Otherwise they are updated one by one. */
+	virtual void initBatch(ModelArray& array)
+	{
+		if (batch) {
+			delete batch;
+			batch = NULL;
+		}
+		std::vector<StateSpaceModel*> elements;
+		for (unsigned int i = 0; i < array.getSize(); i++) {
+			StateSpaceModel* element = dynamic_cast<StateSpaceModel*>(array.getElement(i));
+			if (!element || !element->solver || (i > 0 && !element->isBatchableWith(*elements[0])))
+				return;
+			elements.push_back(element);
+		}
+		if (elements.empty())
+			return;
+		batch = new Batch(elements, lowerCase(elements[0]->solver->name()));
+		if (!batch->getSolver()) {
+			delete batch;
+			batch = NULL;
+			return;
+		}
+		batch->init(elements[0]->t0);
+	}
+	
+	/** A batch is stepped as a whole, ModelArray updates all elements in one call. */
+	virtual void updateBatch(ModelArray& array, const double dt, const unsigned int first, const unsigned int count)
+	{
+		if (batch) {
+			batch->update(dt);
+			return;
+		}
+		for (unsigned int i = first; i < first + count; i++)
+			array.getElement(i)->update(dt);
+	}
+	
+	/** The elements transfer their inputs and outputs themselves. */
+	virtual bool usesPortColumns() const { return false; }
+	
+	/// Get the batch that this model (as the prototype of a ModelArray) integrates the elements as, if any
+	Batch* getBatch() { return batch; }
+	
 protected:
+	/// Can this model be integrated in a batch with \a other, see initBatch()
+	bool isBatchableWith(const StateSpaceModel& other) const
+	{
+		return A == other.A && B == other.B && C == other.C && D == other.D && t0 == other.t0
+			&& other.solver && std::string(solver->name()) == other.solver->name();
+	}
+	
+	static std::string lowerCase(const std::string& name)
+	{
+		std::string result = name;
+		for (unsigned int i = 0; i < result.size(); i++)
+			result[i] = tolower(result[i]);
+		return result;
+	}
+	
+	/// Create the solver named by the "solver" parameter, if any, and apply the tolerances to adaptive solvers
+	void setupSolver()
+	{
+		typedef Eigen::Matrix<T, _states, 1> Vector;
+		discrete = (solvername == "zoh");
+		if (discrete) {
+			if (solver)
+				delete solver;
+			solver = NULL;
+			createdsolver = solvername;
+			return;
+		}
+		if (!solvername.empty() && (!solver || solvername != createdsolver)) {
+			numerix::ODESolver<Vector>* named = numerix::SolverFactory<Vector>::create(solvername, *this);
+			if (!named)
+				throw ModelException("Unknown solver " + solvername, this);
+			if (solver)
+				delete solver;
+			solver = named;
+			createdsolver = solvername;
+		}
+		if (!solver)
+			throw ModelException("No solver", this);
+		if (numerix::AdaptiveSolver<Vector>* adaptive = dynamic_cast<numerix::AdaptiveSolver<Vector>*>(solver))
+			adaptive->setTolerances(relative_tolerance, absolute_tolerance);
+	}
+	
+	void registerParameters()
+	{
+		registerParameter(&solvername, Parameter::STRING, "solver", "", "Solver to use instead of the one of the model (euler/heun/rk3/rk4/midpoint/dopri5/bs23/backwardeuler/bdf2/ros2), or zoh for the exact discretization");
+		registerParameter(&relative_tolerance, Parameter::DOUBLE, "relative_tolerance", "", "Relative error tolerance of adaptive solvers");
+		registerParameter(&absolute_tolerance, Parameter::DOUBLE, "absolute_tolerance", "", "Absolute error tolerance of adaptive solvers");
+	}
 
+	/// Zero-order hold discretization for one step size, see discretize()
+	struct Discretization {
+		Eigen::Matrix<T, _states, _states> Ad;
+		Eigen::Matrix<T, _states, _controls> Bd;
+	};
+	
+	/// Get the zero-order hold discretization for steps of \a dt, computed on first use
+	/** \f$ A_d = e^{A T} \f$ and \f$ B_d = \int_0^T e^{A \tau} d\tau B \f$ are the blocks of the
+	 exponential of \f$ \left[ \begin{array}{cc} A & B \\ 0 & 0 \end{array} \right] T \f$.
+	 Discretizations are cached by step size, up to a limit so that varying step sizes don't
+	 fill the cache.
+	 \throw ModelException if the matrix exponential can't be computed */
+	const Discretization& discretize(const double dt)
+	{
+		if (discretization && dt == discretized_dt)
+			return *discretization;
+		typename std::map<double, Discretization>::iterator it = discretizations.find(dt);
+		if (it == discretizations.end()) {
+			if (discretizations.size() >= 16)
+				discretizations.clear();
+			typedef Eigen::Matrix<T, _states + _controls, _states + _controls> Augmented;
+			Augmented augmented, exponential;
+			augmented.setZero();
+			augmented.template block<_states, _states>(0, 0) = A * T(dt);
+			augmented.template block<_states, _controls>(0, _states) = B * T(dt);
+			if (!numerix::matrixExponential(augmented, exponential))
+				throw ModelException("Can't discretize the state-space model", this);
+			Discretization zoh;
+			zoh.Ad = exponential.template block<_states, _states>(0, 0);
+			zoh.Bd = exponential.template block<_states, _controls>(0, _states);
+			it = discretizations.insert(std::make_pair(dt, zoh)).first;
+		}
+		discretization = &it->second;
+		discretized_dt = dt;
+		return *discretization;
+	}
+	
 	virtual Eigen::Matrix<T, _states, 1> stateInitials(const double t0) const
 	{
 		return states0;
@@ -89,7 +281,19 @@ protected:
 	{
 		return A*y + B*controls;
 	}
+	virtual void stateDerivatives(const double t, const Eigen::Matrix<T, _states, 1>& y, Eigen::Matrix<T, _states, 1>& dydt)
+	{
+		dydt = A*y + B*controls;
+	}
 	virtual int size() const { return _states; }
+	virtual bool stateJacobian(const double t, const Eigen::Matrix<T, _states, 1>& y, Eigen::Matrix<T, _states, _states>& jacobian)
+	{
+		jacobian = A;
+		return true;
+	}
+	virtual bool isLinear() const { return true; }
+	/** Controls are held constant over each update. */
+	virtual bool isAutonomous() const { return true; }
 	virtual void stateUpdate(const double t, const Eigen::Matrix<T, _states, 1>& y)
 	{
 		states = y;
@@ -106,6 +310,124 @@ protected:
 	Eigen::Matrix<T, _states, 1> states0;
 	double t0;
 	numerix::ODESolver< Eigen::Matrix<T, _states, 1> >* solver;
+	std::string solvername, createdsolver;
+	double relative_tolerance, absolute_tolerance;
+	Eigen::Matrix<T, _controls, 1> previous_controls;
+	bool discrete; ///< "solver" is "zoh"
+	std::map<double, Discretization> discretizations;
+	Discretization* discretization; ///< the last one used
+	double discretized_dt;
+	Batch* batch;
+	
+	friend class StateSpaceBatch<T, _states, _controls, _outputs>;
+};
+
+/// The elements of a ModelArray of a StateSpaceModel class, integrated as one batch, see StateSpaceModel::initBatch()
+/**
+	The states of the elements are the rows of one block, so the state derivatives of all of them are
+	the matrix products \f$ \dot X = X A^T + U B^T \f$, and the outputs \f$ Y = X C^T + U D^T \f$.
+	Inputs and outputs are still transferred by each element.
+*/
+template <typename T, int _states, int _controls, int _outputs>
+class StateSpaceBatch : public numerix::BatchODESystem< Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> >
+{
+public:
+	typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Block;
+	typedef StateSpaceModel<T, _states, _controls, _outputs> Element;
+	
+	/// Integrate \a newelements, which have the same matrices, with the batch solver called \a solvername
+	StateSpaceBatch(const std::vector<Element*>& newelements, const std::string& solvername)
+	:	elements(newelements),
+		controls(elements.size(), _controls),
+		outputs(elements.size(), _outputs),
+		solver(NULL)
+	{
+		controls.setZero();
+		solver = numerix::BatchSolverFactory<Block>::create(solvername, *this);
+	}
+	
+	virtual ~StateSpaceBatch()
+	{
+		if (solver)
+			delete solver;
+	}
+	
+	/// Get the solver, NULL if there is no batch version of the solver of the elements
+	numerix::BatchSolver<Block>* getSolver() { return solver; }
+	
+	/// Initialize from the states and controls of the elements
+	void init(const double t0)
+	{
+		for (unsigned int i = 0; i < elements.size(); i++)
+			controls.row(i) = elements[i]->controls.transpose();
+		solver->init(t0);
+	}
+	
+	/// Update all elements
+	void update(const double dt)
+	{
+		for (unsigned int i = 0; i < elements.size(); i++) {
+			Element& element = *elements[i];
+			element.transferInputs();
+			for (int k = 0; k < _controls; k++)
+				controls(i,k) = element.controls(k,0);
+		}
+		solver->step(dt);
+	}
+	
+	virtual void stateInitials(const double t0, Block& y0)
+	{
+		for (unsigned int i = 0; i < elements.size(); i++)
+			y0.row(i) = elements[i]->states.transpose();
+	}
+	virtual void stateDerivatives(const double t, const Block& y, Block& dydt)
+	{
+		const Element& first = *elements[0];
+		multiplyColumns(first.A, y, first.B, controls, dydt);
+	}
+	virtual int size() const { return _states; }
+	virtual int batchSize() const { return elements.size(); }
+	virtual void stateUpdate(const double t, const Block& y)
+	{
+		const Element& first = *elements[0];
+		multiplyColumns(first.C, y, first.D, controls, outputs);
+		for (unsigned int i = 0; i < elements.size(); i++) {
+			Element& element = *elements[i];
+			for (int k = 0; k < _states; k++)
+				element.states(k,0) = y(i,k);
+			for (int k = 0; k < _outputs; k++)
+				element.outputs(k,0) = outputs(i,k);
+			element.transferOutputs();
+		}
+	}
+	
+protected:
+	/// Compute \f$ R = X M^T + U N^T \f$ in one pass down the columns
+	/** The columns of \a x, \a u and \a result are contiguous and the loops over the small matrices
+	 have fixed sizes, so the loops over elements are simple enough for the compiler to vectorize. */
+	template <class M, class N>
+	static void multiplyColumns(const M& m, const Block& x, const N& n, const Block& u, Block& result)
+	{
+		const int rows = x.rows();
+		const T* xdata = x.data();
+		const T* udata = u.data();
+		for (int j = 0; j < M::RowsAtCompileTime; j++) {
+			T* r = result.data() + j*rows;
+			for (int i = 0; i < rows; i++) {
+				T sum = 0;
+				for (int k = 0; k < M::ColsAtCompileTime; k++)
+					sum += m(j,k) * xdata[k*rows + i];
+				for (int k = 0; k < N::ColsAtCompileTime; k++)
+					sum += n(j,k) * udata[k*rows + i];
+				r[i] = sum;
+			}
+		}
+	}
+	
+	std::vector<Element*> elements;
+	Block controls; ///< one row per element
+	Block outputs;
+	numerix::BatchSolver<Block>* solver;
 };
 
 /** \class StateSpaceModel
@@ -116,7 +438,14 @@ protected:
 	
 	Users should derive from this class (using template arguments as appropriate to the model) and
 	implement transferInputs(), transferOutputs(), setupMatrices() and possibly setupInitials().
-	The constructor also needs to be overridden and used to setup ports and a solver.
+	The constructor also needs to be overridden and used to setup ports and a solver. The "solver"
+	parameter replaces that solver with one from numerix::SolverFactory, e.g. "dopri5" for an adaptive
+	one which takes as many internal steps per update as its tolerances require, or "ros2" for an
+	implicit one for stiff systems, which uses \c A as its Jacobian. With "zoh" the model is instead
+	stepped by the exact discretization for inputs held over each update, two matrix-vector products,
+	see discretize().
+	
+	A ModelArray of a StateSpaceModel class integrates its elements as one batch, see initBatch().
 	
 	\see test_StateSpaceModel.cpp for an example
 */
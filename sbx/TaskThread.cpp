@@ -1,174 +1,276 @@
 #include "TaskThread.h"
 #include "Log.h"
-#include <limits.h>
+#include <OpenThreads/ScopedLock>
 
 namespace sbx {
 	
+	void TaskSync::wakeAll()
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(mutex);
+		work.broadcast();
+	}
+	
+	/** Threads register as sleeping before checking for queued tasks, and the task is counted as queued
+	 before checking for sleeping threads, so either the thread sees the task or it gets signalled. */
+	void TaskSync::queuedTask()
+	{
+		if (sleeping > 0 && !inhibit) {
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(mutex);
+			work.signal();
+		}
+	}
+	
+	void TaskSync::finishedTask()
+	{
+		if (--pending == 0) {
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(mutex);
+			idle.broadcast();
+		}
+	}
+	
+	void TaskSync::wait()
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(mutex);
+		while (pending > 0)
+			idle.wait(&mutex);
+	}
+	
 	TaskThread::TaskThread()
-	: OpenThreads::Thread(), done(true), busy(false), inhibit(false), taskCount(0)
+	: OpenThreads::Thread(), pool(NULL), index(0), sync(new TaskSync), ownsync(true), head(0), numTasks(0), taskCount(0)
 	{
 	}
 	
-	TaskThread::TaskThread(const TaskThread& source)
-	: OpenThreads::Thread(), done(true), busy(false), inhibit(source.inhibit),
-	tasks(source.tasks), scheduleMutex(), doneMutex(), countMutex(), taskCount(0)
+	TaskThread::TaskThread(TaskThreadPool* npool, const unsigned int nindex)
+	: OpenThreads::Thread(), pool(npool), index(nindex), sync(&npool->sync), ownsync(false), head(0), numTasks(0), taskCount(0)
 	{
 	}
 	
-	TaskThread& TaskThread::operator=(const TaskThread& source)
+	TaskThread::~TaskThread()
 	{
-		done = true;
-		busy = false;
-		inhibit = source.inhibit;
-		tasks = source.tasks;
-		taskCount = 0;
-		return *this;
+		if (isRunning()) {
+			setDone();
+			join();
+		}
+		QueuedTask task;
+		while (pop(task)) {
+			if (task.owned)
+				task.task->unref();
+		}
+		if (ownsync)
+			delete sync;
 	}
 	
 	void TaskThread::run()
 	{
-		done = false;
-		while (!isDone()) {
-			smrt::ref_ptr<Task> task = NULL;
-			{
-				OpenThreads::ScopedLock<OpenThreads::Mutex> lock(inhibitMutex);
-				if (inhibit) {
-					OpenThreads::ReverseScopedLock<OpenThreads::Mutex> unlock(inhibitMutex);
-					OpenThreads::Thread::microSleep(10);
-					continue;
-				}
-			}				
-			{
-				OpenThreads::ScopedLock<OpenThreads::Mutex> lock(scheduleMutex);
-				if (tasks.size() == 0) {
-					OpenThreads::ReverseScopedLock<OpenThreads::Mutex> unlock(scheduleMutex);
-					if (busy) {
-						OpenThreads::ScopedLock<OpenThreads::Mutex> busylock(busyMutex);
-						busy = false;
-					}
-					OpenThreads::Thread::microSleep(10);
-					continue;
-				}
-				task = tasks[0].get();
-				tasks.erase(tasks.begin());
+		QueuedTask task;
+		while (true) {
+			if (next(task)) {
+				task.task->perform();
+				if (task.owned)
+					task.task->unref();
+				++taskCount;
+				sync->finishedTask();
+				continue;
 			}
-			if (task.valid()) {
-				OpenThreads::ScopedLock<OpenThreads::Mutex> tasklock(taskMutex);
-				task->perform();
-				OpenThreads::ScopedLock<OpenThreads::Mutex> countlock(countMutex);
-				taskCount++;
+			// Nothing to do, park until woken up by schedule(), setInhibit() or setDone()
+			++sync->sleeping;
+			bool quit;
+			{
+				OpenThreads::ScopedLock<OpenThreads::Mutex> lock(sync->mutex);
+				if (!sync->done && (sync->inhibit || sync->queued == 0))
+					sync->work.wait(&sync->mutex);
+				quit = sync->done;
 			}
+			--sync->sleeping;
+			if (quit)
+				break;
 		}
 	}
 	
 	void TaskThread::schedule(Task *task)
 	{
-		OpenThreads::ScopedLock<OpenThreads::Mutex> schedlock(scheduleMutex);
-		tasks.push_back(task);
-		OpenThreads::ScopedLock<OpenThreads::Mutex> busylock(busyMutex);
-		busy = true;
+		schedule(task, true);
+	}
+	
+	void TaskThread::schedule(Task& task)
+	{
+		schedule(&task, false);
+	}
+	
+	void TaskThread::schedule(Task* task, const bool owned)
+	{
+		if (owned)
+			task->ref();
+		QueuedTask queued;
+		queued.task = task;
+		queued.owned = owned;
+		++sync->pending;
+		++sync->queued;
+		push(queued);
+		sync->queuedTask();
 	}
 	
 	unsigned int TaskThread::getNumScheduled()
 	{
-		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(scheduleMutex);
-		return tasks.size();
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(queueMutex);
+		return numTasks;
 	}
 	
 	void TaskThread::wait()
 	{
-		while (true) {
-			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(busyMutex);
-			if (!busy)
-				break;
-			OpenThreads::ReverseScopedLock<OpenThreads::Mutex> unlock(busyMutex);
-			OpenThreads::Thread::microSleep(10);
-		}
-		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(taskMutex);
+		sync->wait();
 	}
 	
 	unsigned long TaskThread::getTaskCount()
 	{
-		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(countMutex);
 		return taskCount;
 	}
 	
 	void TaskThread::setDone()
 	{
-		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(doneMutex);
-		done = true;
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(sync->mutex);
+			sync->done.exchange(1);
+		}
+		sync->wakeAll();
 	}
 	
 	bool TaskThread::isDone()
 	{
-		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(doneMutex);
-		return done;
+		return sync->done;
 	}
 	
 	void TaskThread::setInhibit(const bool value)
 	{
-		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(inhibitMutex);
-		inhibit = value;
+		sync->inhibit.exchange(value);
+		if (!value)
+			sync->wakeAll();
+	}
+	
+	void TaskThread::push(const QueuedTask& task)
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(queueMutex);
+		if (numTasks == tasks.size()) {
+			// Full - grow the ring buffer, unwrapping the queued tasks to the start
+			std::vector<QueuedTask> grown(tasks.size() > 0 ? 2*tasks.size() : 16);
+			for (unsigned int i = 0; i < numTasks; i++)
+				grown[i] = tasks[(head+i) % tasks.size()];
+			tasks.swap(grown);
+			head = 0;
+		}
+		tasks[(head+numTasks) % tasks.size()] = task;
+		numTasks++;
+	}
+	
+	bool TaskThread::pop(QueuedTask& task)
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(queueMutex);
+		if (numTasks == 0)
+			return false;
+		numTasks--;
+		task = tasks[(head+numTasks) % tasks.size()];
+		--sync->queued;
+		return true;
+	}
+	
+	bool TaskThread::steal(QueuedTask& task)
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(queueMutex);
+		if (numTasks == 0)
+			return false;
+		task = tasks[head];
+		head = (head+1) % tasks.size();
+		numTasks--;
+		--sync->queued;
+		return true;
+	}
+	
+	bool TaskThread::next(QueuedTask& task)
+	{
+		if (sync->inhibit || sync->queued == 0)
+			return false;
+		if (pop(task))
+			return true;
+		if (pool) {
+			unsigned int num = pool->threads.size();
+			for (unsigned int i = 1; i < num; i++)
+				if (pool->threads[(index+i) % num]->steal(task))
+					return true;
+		}
+		return false;
 	}
 	
 	TaskThreadPool::TaskThreadPool(const unsigned int numThreads)
 	{
-		threads.resize(numThreads);
+		for (unsigned int i = 0; i < numThreads; i++)
+			threads.push_back(new TaskThread(this, i));
+	}
+	
+	TaskThreadPool::~TaskThreadPool()
+	{
+		waitDone();
+		for (size_t i = 0; i < threads.size(); i++)
+			delete threads[i];
 	}
 	
-	TaskThread& TaskThreadPool::getThread(const unsigned int index) { return threads[index]; }
+	TaskThread& TaskThreadPool::getThread(const unsigned int index) { return *threads[index]; }
 	
 	void TaskThreadPool::start()
 	{
 		for (size_t i = 0; i < threads.size(); i++)
-			threads[i].start();
+			threads[i]->start();
 	}
 	
 	void TaskThreadPool::schedule(Task *task)
 	{
-		unsigned int min = UINT_MAX, minindex = UINT_MAX;
-		for (size_t i = 0; i < threads.size(); i++) {
-			unsigned int num = threads[i].getNumScheduled();
-			if (min > num) {
-				min = num;
-				minindex = i;
-			}
-		}
-		threads[minindex].schedule(task);
+		nextThread().schedule(task);
+	}
+	
+	void TaskThreadPool::schedule(Task& task)
+	{
+		nextThread().schedule(task);
+	}
+	
+	/** Tasks scheduled from within a task (i.e. from one of the pool's threads) are queued on that
+	 thread, other tasks are distributed round-robin. Idle threads steal tasks from busy ones. */
+	TaskThread& TaskThreadPool::nextThread()
+	{
+		TaskThread* current = dynamic_cast<TaskThread*>(OpenThreads::Thread::CurrentThread());
+		if (current && current->pool == this)
+			return *current;
+		return *threads[++next % threads.size()];
 	}
 	
 	unsigned int TaskThreadPool::getNumScheduled()
 	{
-		unsigned int count = 0;
-		for (size_t i = 0; i < threads.size(); i++)
-			count += threads[i].getNumScheduled();
-		return count;
+		return sync.queued;
 	}
 	
 	void TaskThreadPool::wait()
 	{
-		for (size_t i = 0; i < threads.size(); i++)
-			threads[i].wait();
+		sync.wait();
 	}
 	
 	unsigned long TaskThreadPool::getTaskCount()
 	{
 		unsigned long count = 0;
 		for (size_t i = 0; i < threads.size(); i++)
-			count += threads[i].getTaskCount();
+			count += threads[i]->getTaskCount();
 		return count;
 	}
 	
 	void TaskThreadPool::setDone()
 	{
-		for (size_t i = 0; i < threads.size(); i++)
-			threads[i].setDone();
+		if (threads.size() > 0)
+			threads[0]->setDone();
 	}
 	
 	bool TaskThreadPool::isDone()
 	{
+		if (!sync.done)
+			return false;
 		for (size_t i = 0; i < threads.size(); i++)
-			if (!threads[i].isDone())
+			if (threads[i]->isRunning())
 				return false;
 		return true;
 	}
@@ -177,13 +279,14 @@ namespace sbx {
 	{
 		setDone();
 		for (size_t i = 0; i < threads.size(); i++)
-			while (threads[i].isRunning()) {}
+			if (threads[i]->isRunning())
+				threads[i]->join();
 	}
 	
 	void TaskThreadPool::setInhibit(const bool value)
 	{
-		for (size_t i = 0; i < threads.size(); i++)
-			threads[i].setInhibit(value);
+		if (threads.size() > 0)
+			threads[0]->setInhibit(value);
 	}
 	
 	
@@ -1,61 +1,123 @@
+#ifndef SBX_TASKTHREAD_H
+#define SBX_TASKTHREAD_H
+
 #include "Export.h"
 #include "Model.h"
 #include <smrt/Referenced.h>
 #include <smrt/ref_ptr.h>
 #include <OpenThreads/Thread>
 #include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
+#include <OpenThreads/Atomic>
+#include <vector>
 
 namespace sbx {
-	
+
+	class TaskThreadPool;
+
 	class SIMBLOX_API Task : public smrt::Referenced {
 	public:
 		virtual void perform() = 0;
 	};
-	
+
+	/// State shared by the threads of a TaskThreadPool (or owned by a single TaskThread)
+	class SIMBLOX_API TaskSync {
+	public:
+		TaskSync() : pending(0), queued(0), sleeping(0), done(0), inhibit(0) {}
+
+		/// Wake up all parked threads
+		void wakeAll();
+		/// Called when a task has been queued, wakes up a parked thread if needed
+		void queuedTask();
+		/// Called when a task has been performed, wakes up waiters if it was the last one
+		void finishedTask();
+		/// Block until there are no more pending tasks
+		void wait();
+
+		OpenThreads::Mutex mutex;
+		OpenThreads::Condition work, idle;
+		OpenThreads::Atomic pending; ///< tasks scheduled but not yet performed
+		OpenThreads::Atomic queued; ///< tasks scheduled but not yet picked up by a thread
+		OpenThreads::Atomic sleeping; ///< threads parked on the \c work condition
+		OpenThreads::Atomic done, inhibit;
+	};
+
 	class SIMBLOX_API TaskThread : public OpenThreads::Thread {
 	public:
 		TaskThread();
-		TaskThread(const TaskThread& source);
-		TaskThread& operator=(const TaskThread& source);
-		
+		virtual ~TaskThread();
+
 		virtual void run();
-		
+
 		/// Schedule a task to be performed by this thread
 		void schedule(Task *task);
+		/// Schedule a task owned by the caller, which has to keep it alive until it has been performed
+		/** The task is not reference counted and no memory is allocated (once the queue has grown large
+		 enough), so the same task object can be scheduled over and over again. */
+		void schedule(Task& task);
 		/// Get number of scheduled tasks
 		unsigned int getNumScheduled();
-		
+
 		/// Wait until all scheduled tasks have been performed
 		void wait();
 		/// Get number of tasks performed
 		unsigned long getTaskCount();
-		
+
 		/// Tells the thread to quit
 		void setDone();
 		bool isDone();
-		
+
 		void setInhibit(const bool value);
-		
+
 	private:
-		bool done, busy, inhibit;
-		std::vector< smrt::ref_ptr<Task> > tasks;
-		unsigned long taskCount;
-		OpenThreads::Mutex doneMutex, busyMutex, inhibitMutex, scheduleMutex, taskMutex, countMutex;
+		struct QueuedTask {
+			Task* task;
+			bool owned; ///< task was referenced when scheduled, and is unreferenced when performed
+		};
+
+		TaskThread(TaskThreadPool* pool, const unsigned int index);
+		TaskThread(const TaskThread&);
+		TaskThread& operator=(const TaskThread&);
+
+		void schedule(Task* task, const bool owned);
+		/// Push a task at the back of this thread's queue
+		void push(const QueuedTask& task);
+		/// Pop a task from the back of this thread's queue (most recently scheduled)
+		bool pop(QueuedTask& task);
+		/// Steal a task from the front of this thread's queue (least recently scheduled)
+		bool steal(QueuedTask& task);
+		/// Get the next task to perform, from this thread's queue or stolen from another thread in the pool
+		bool next(QueuedTask& task);
+
+		TaskThreadPool* pool;
+		unsigned int index;
+		TaskSync* sync;
+		bool ownsync;
+		/// Queued tasks, a ring buffer that only grows so that queueing doesn't allocate in steady state
+		std::vector<QueuedTask> tasks;
+		unsigned int head, numTasks;
+		OpenThreads::Mutex queueMutex;
+		OpenThreads::Atomic taskCount;
+
+		friend class TaskThreadPool;
 	};
-	
+
 	class SIMBLOX_API TaskThreadPool {
 	public:
 		TaskThreadPool(const unsigned int numThreads);
+		~TaskThreadPool();
 		TaskThread& getThread(const unsigned int index);
 		unsigned int getNumThreads() { return threads.size(); }
-		
+
 		void start();
-		
+
 		/// Schedule a task to be performed by a thread in this pool
 		void schedule(Task *task);
+		/// Schedule a task owned by the caller, see TaskThread::schedule(Task&)
+		void schedule(Task& task);
 		/// Get number of scheduled tasks
 		unsigned int getNumScheduled();
-		
+
 		/// Wait until all scheduled tasks have been performed
 		void wait();
 		/// Get number of tasks performed
@@ -67,11 +129,19 @@ namespace sbx {
 		bool isDone();
 		/// Wait until all threads have stopped
 		void waitDone();
-		
+
 		void setInhibit(const bool value);
-		
+
 	private:
-		std::vector<TaskThread> threads;
+		std::vector<TaskThread*> threads;
+		TaskThread& nextThread();
+
+		TaskSync sync;
+		OpenThreads::Atomic next;
+
+		friend class TaskThread;
 	};
 
 }
+
+#endif
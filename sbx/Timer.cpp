@@ -89,10 +89,50 @@ Timer* Timer::instance()
 			Sleep (0);
 	}
 
+	void Timer::sleepUntil(Timer_t t) const
+	{
+		Timer_t now = tick();
+		if (t > now)
+			sleep((unsigned long) delta_u(now, t));
+	}
+
 
 #else
 
     #include <sys/time.h>
+    #include <time.h>
+    #include <errno.h>
+
+    #if defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME) && !defined(__APPLE__)
+        #define SBX_MONOTONIC_TIMER
+    #endif
+
+    #ifdef SBX_MONOTONIC_TIMER
+
+    // Monotonic clock in nanoseconds, so that absolute deadlines can be slept until with clock_nanosleep()
+    Timer::Timer( void )
+    {
+        _secsPerTick = (1.0 / (double) 1000000000);
+
+        setStartTick();
+    }
+
+    Timer_t Timer::tick() const
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((sbx::Timer_t)ts.tv_sec)*1000000000+(sbx::Timer_t)ts.tv_nsec;
+    }
+
+	void Timer::sleepUntil(Timer_t t) const
+	{
+		struct timespec ts;
+		ts.tv_sec = t / 1000000000;
+		ts.tv_nsec = t % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+	}
+
+    #else
 
     Timer::Timer( void )
     {
@@ -108,6 +148,15 @@ Timer* Timer::instance()
         return ((sbx::Timer_t)tv.tv_sec)*1000000+(sbx::Timer_t)tv.tv_usec;
     }
 
+	void Timer::sleepUntil(Timer_t t) const
+	{
+		Timer_t now = tick();
+		if (t > now)
+			sleep((unsigned long) delta_u(now, t));
+	}
+
+    #endif
+
 	void Timer::sleep(unsigned long useconds)
 
 	{
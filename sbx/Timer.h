@@ -73,6 +73,9 @@ class SIMBLOX_API Timer {
         inline double getSecondsPerTick() const { return _secsPerTick; }
 
 		static void sleep(unsigned long useconds);
+		/** Sleep until the absolute timer tick \a t, i.e. without drift from the time spent before
+		 the call. Returns immediately if \a t has already passed.*/
+		void sleepUntil(Timer_t t) const;
 
     protected :
 
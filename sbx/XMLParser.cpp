@@ -3,6 +3,7 @@
 #include "ModelFactory.h"
 #include "Group.h"
 #include "Simulation.h"
+#include "Ensemble.h"
 #include "Log.h"
 
 #include <sstream>
@@ -74,6 +75,35 @@ namespace sbx
 		return sim;
 	}
 	
+	Ensemble* XMLParser::loadEnsemble(const std::string& filename)
+	{
+		if (!initialized)
+			init();
+		std::string fname = path.find(filename);
+		if (fname.length() == 0)
+			throw ParseException("File not found: " + filename);
+		filestack.push(fname);
+		TiXmlDocument doc(fname);
+		bool ok = doc.LoadFile();
+		if (!ok)
+			throw ParseException(doc.ErrorDesc(), &doc);
+		dout(1) << "Parsing ensemble from " << filename << "\n";
+		TiXmlHandle hDoc(&doc);
+		const TiXmlElement* pElem;
+		pElem=hDoc.FirstChildElement().Element();
+		if (!pElem->Value() || std::string(pElem->Value()) != "SimBlox")
+			throw ParseException("No top-level SimBlox element", &doc);
+		pElem = pElem->FirstChildElement("Ensemble");
+		if (!pElem) {
+			filestack.pop();
+			throw ParseNoElementException("No 'Ensemble' element", &doc);
+		}
+		Ensemble *ensemble = new Ensemble;
+		ensemble->parseXML(pElem);
+		filestack.pop();
+		return ensemble;
+	}
+	
 	const char* XMLParser::getCurrentFile()
 	{
 		if (filestack.empty())
@@ -15,6 +15,7 @@ namespace sbx
 	// Forward declarations
 	class Group;
 	class Simulation;
+	class Ensemble;
 	
 	/// XML parser for the SimBlox configuration and data specification XML files.
 	class SIMBLOX_API XMLParser
@@ -24,6 +25,7 @@ namespace sbx
 		void init();
 		Group* loadModels(const std::string& filename);
 		Simulation* loadSimulation(const std::string& filename);
+		Ensemble* loadEnsemble(const std::string& filename);
 		
 		FilePath& getPath() { return path; }
 		const char* getCurrentFile();
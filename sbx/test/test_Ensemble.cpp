@@ -0,0 +1,168 @@
+#include <UnitTest++/UnitTest++.h>
+#include <sbx/Ensemble.h>
+#include <sbx/Ports.h>
+#include <sbx/Log.h>
+#include <TinyXML/tinyxml.h>
+#include <math.h>
+#include <sstream>
+
+using namespace sbx;
+
+/// x' = -rate*x, Euler integrated
+class DecayModel : public Model {
+public:
+	DecayModel(const std::string& name = "DecayModel") : Model(name), rate(1), x0(1)
+	{
+		registerParameter(&rate, Parameter::DOUBLE, "rate", "", "Decay rate");
+		registerParameter(&x0, Parameter::DOUBLE, "x0", "", "Initial value");
+		registerPort(x, "x", "", "State");
+	}
+	DecayModel(const DecayModel& source) : Model(source), rate(source.rate), x0(source.x0)
+	{
+		copyParameter(source, "rate", &rate);
+		copyParameter(source, "x0", &x0);
+		copyPort(source, "x", x);
+	}
+	META_Object(test, DecayModel);
+	virtual const char* description() const { return "Exponential decay"; }
+	virtual void init() { x.set(x0); }
+	virtual void update(const double dt) { x.set(x.get() - rate*x.get()*dt); }
+	
+	double rate, x0;
+	OutPort<double> x;
+};
+
+class GainModel : public Model {
+public:
+	GainModel(const std::string& name = "GainModel") : Model(name), gain(1)
+	{
+		registerParameter(&gain, Parameter::DOUBLE, "gain", "", "Gain");
+		registerPort(in, "in", "", "Input");
+		registerPort(out, "out", "", "Output");
+	}
+	GainModel(const GainModel& source) : Model(source), gain(source.gain)
+	{
+		copyParameter(source, "gain", &gain);
+		copyPort(source, "in", in);
+		copyPort(source, "out", out);
+	}
+	META_Object(test, GainModel);
+	virtual const char* description() const { return "Gain"; }
+	virtual void init() { out.set(0); }
+	virtual void update(const double dt) { out.set(gain*in.get()); }
+	virtual const bool isEndPoint() { return true; }
+	
+	double gain;
+	InPort<double> in;
+	OutPort<double> out;
+};
+
+static Group* createEnsembleRoot()
+{
+	Group* root = new Group("root");
+	DecayModel* decay = new DecayModel("decay");
+	GainModel* gain = new GainModel("gain");
+	root->addChild(decay);
+	root->addChild(gain);
+	decay->getPort("x")->connect(gain->getPort("in"));
+	return root;
+}
+
+TEST(EnsembleRun) {
+	const unsigned int size = 40, steps = 100;
+	const double dt = 0.01;
+	smrt::ref_ptr<Group> root = createEnsembleRoot();
+	Ensemble ensemble(root.get(), size);
+	ensemble.setNumThreads(4);
+	ensemble.setEndTime(steps*dt);
+	ensemble.setTimeStep(dt);
+	ensemble.addPerturbation(Perturbation("decay", "rate", Perturbation::UNIFORM, 0.5, 1.5));
+	ensemble.addPerturbation(Perturbation("gain", "gain", Perturbation::NORMAL, 2, 0.1));
+	ensemble.addRecord("gain.out");
+	ensemble.addRecord("decay.x", 10);
+	CHECK_EQUAL(0, ensemble.run());
+	CHECK_EQUAL(size, ensemble.getNumMembers());
+	
+	for (unsigned int i = 0; i < size; i++) {
+		double rate = ensemble.getPerturbedValue(i, 0);
+		double gain = ensemble.getPerturbedValue(i, 1);
+		CHECK(rate >= 0.5 && rate < 1.5);
+		CHECK(gain > 1.5 && gain < 2.5);
+		CHECK(ensemble.getError(i).empty());
+		const std::vector<double>& out = ensemble.getResult(i, 0);
+		const std::vector<double>& x = ensemble.getResult(i, 1);
+		CHECK_EQUAL(steps, out.size());
+		CHECK_EQUAL(steps/10, x.size());
+		CHECK_CLOSE(pow(1-rate*dt, (double) steps), x.back(), 1e-9);
+		// The gain model reads the decay output of the same step (dependent traversal)
+		CHECK_CLOSE(gain*x.back(), out.back(), 1e-9);
+	}
+	// The prototype is untouched
+	CHECK_EQUAL(1, ((DecayModel*) root->getChild(0))->rate);
+	
+	// Perturbations only depend on the seed, and results don't depend on the number of threads
+	Ensemble ensemble1(root.get(), size);
+	ensemble1.setNumThreads(1);
+	ensemble1.setEndTime(steps*dt);
+	ensemble1.setTimeStep(dt);
+	ensemble1.addPerturbation(Perturbation("decay", "rate", Perturbation::UNIFORM, 0.5, 1.5));
+	ensemble1.addPerturbation(Perturbation("gain", "gain", Perturbation::NORMAL, 2, 0.1));
+	ensemble1.addRecord("gain.out");
+	CHECK_EQUAL(0, ensemble1.run());
+	for (unsigned int i = 0; i < size; i++)
+		CHECK_EQUAL(ensemble.getResult(i, 0).back(), ensemble1.getResult(i, 0).back());
+}
+
+TEST(EnsembleErrors) {
+	smrt::ref_ptr<Group> root = createEnsembleRoot();
+	Ensemble ensemble(root.get(), 2);
+	CHECK_THROW(ensemble.run(), ModelException); // no end time
+	ensemble.setEndTime(1);
+	ensemble.addPerturbation(Perturbation("nosuchmodel", "rate", Perturbation::UNIFORM, 0, 1));
+	CHECK_THROW(ensemble.run(), ModelException);
+}
+
+TEST(EnsembleXML) {
+	TiXmlDocument doc;
+	doc.Parse("<Ensemble size='8' seed='42' threads='2'>"
+			  "<perturb model='decay' parameter='rate' distribution='normal' mean='1' deviation='0.2'/>"
+			  "<record port='gain.out' interval='5'/>"
+			  "</Ensemble>");
+	Ensemble ensemble;
+	ensemble.parseXML(doc.FirstChildElement());
+	CHECK_EQUAL(8, ensemble.getSize());
+	CHECK_EQUAL(42, ensemble.getSeed());
+	CHECK_EQUAL(2, ensemble.getNumThreads());
+	CHECK_EQUAL(1, ensemble.getNumPerturbations());
+	CHECK(ensemble.getPerturbation(0).distribution == Perturbation::NORMAL);
+	CHECK_EQUAL(0.2, ensemble.getPerturbation(0).b);
+	CHECK_EQUAL(1, ensemble.getNumRecords());
+	CHECK_EQUAL("gain.out", ensemble.getRecordName(0));
+	
+	TiXmlElement element("Ensemble");
+	ensemble.writeXML(&element);
+	Ensemble copy;
+	copy.parseXML(&element);
+	CHECK_EQUAL(8, copy.getSize());
+	CHECK_EQUAL(1, copy.getNumPerturbations());
+	CHECK_EQUAL("decay", copy.getPerturbation(0).model);
+	CHECK_EQUAL(1, copy.getNumRecords());
+}
+
+TEST(EnsembleBenchmark) {
+	const unsigned int size = 64;
+	smrt::ref_ptr<Group> root = createEnsembleRoot();
+	Ensemble ensemble(root.get(), size);
+	ensemble.setEndTime(10);
+	ensemble.setTimeStep(0.001);
+	ensemble.addRecord("gain.out", 100);
+	double single = 0;
+	for (unsigned int threads = 1; threads <= 4; threads *= 2) {
+		ensemble.setNumThreads(threads);
+		CHECK_EQUAL(0, ensemble.run());
+		if (threads == 1)
+			single = ensemble.getRunTime();
+		dout(1) << "Ensemble of " << size << " members, " << threads << " threads: " << size/ensemble.getRunTime()
+			<< " members/s, speedup " << single/ensemble.getRunTime() << "\n";
+	}
+}
@@ -2,6 +2,12 @@
 #include <sbx/Model.h>
 #include <sbx/Ports.h>
 #include <sbx/XMLParser.h>
+#include <sbx/Group.h>
+#include <sbx/DependencyGraph.h>
+#include <sbx/Timer.h>
+#include <sbx/Log.h>
+#include <units/units.h>
+#include <sstream>
 
 using namespace sbx;
 
@@ -128,3 +134,205 @@ TEST(PortNotifications) {
 	CHECK_EQUAL(2, d1.getDisconnectCount());
 	CHECK_EQUAL(2, d2.getDisconnectCount());
 }
+
+class WideModel : public Model {
+public:
+	WideModel() : Model("WideModel")
+	{
+		// Registered outputs first and in reverse name order
+		for (int i = NUM-1; i >= 0; i--) {
+			registerPort(out[i], name("out", i));
+			registerPort(in[i], name("in", i));
+			registerParameter(&param[i], Parameter::DOUBLE, name("p", i), "m");
+		}
+	}
+	META_Object(test, WideModel);
+	virtual const char* description() const { return "wide"; }
+	static std::string name(const std::string& prefix, const int i)
+	{
+		std::stringstream ss;
+		ss << prefix << (i < 10 ? "0" : "") << i;
+		return ss.str();
+	}
+	void unregister(Port& port) { unregisterPort(port); }
+	void reregister(Port& port, const std::string& name) { registerPort(port, name); }
+	static const int NUM = 30;
+	InPort<double> in[NUM];
+	OutPort<double> out[NUM];
+	double param[NUM];
+};
+
+TEST(PortAndParameterIndex) {
+	WideModel wide;
+	CHECK_EQUAL(60u, wide.getNumPorts());
+	CHECK_EQUAL(30u, wide.getNumInputs());
+	CHECK_EQUAL(30u, wide.getNumOutputs());
+	// Inputs first, then outputs, each in name order
+	for (unsigned int i = 0; i < WideModel::NUM; i++) {
+		CHECK(wide.getPort(i) == &wide.in[i]);
+		CHECK(wide.getPort(WideModel::NUM + i) == &wide.out[i]);
+		CHECK_EQUAL(WideModel::name("out", i), wide.getPortName(WideModel::NUM + i));
+		CHECK_EQUAL(WideModel::NUM + i, wide.getPortIndex(&wide.out[i]));
+		CHECK(wide.getPort(WideModel::name("in", i)) == &wide.in[i]);
+		CHECK_EQUAL(WideModel::name("p", i), wide.getParameterName(i));
+		CHECK(wide.getParameterSpec(WideModel::name("p", i)).ptr == &wide.param[i]);
+	}
+	CHECK(wide.getPort("in30") == NULL);
+	CHECK(wide.getPort(60) == NULL);
+	CHECK_THROW(wide.getParameterSpec("p30"), ModelException);
+	double d;
+	CHECK_THROW(wide.getParameter("p30", d), ModelException);
+	
+	// Parameters by name
+	wide.setParameter("p07", 2.5, "ft");
+	CHECK_CLOSE(2.5*0.3048, wide.param[7], 1e-12);
+	wide.getParameter("p07", d, "ft");
+	CHECK_CLOSE(2.5, d, 1e-12);
+	
+	// Unregistering and replacing keep the ranges and the index consistent
+	wide.unregister(wide.in[3]);
+	CHECK_EQUAL(29u, wide.getNumInputs());
+	CHECK(wide.getPort("in03") == NULL);
+	CHECK(wide.getPort("in04") == &wide.in[4]);
+	CHECK(wide.getPort(3) == &wide.in[4]);
+	InPort<double> extra;
+	wide.reregister(extra, "out05");
+	CHECK_EQUAL(30u, wide.getNumInputs());
+	CHECK_EQUAL(29u, wide.getNumOutputs());
+	CHECK(wide.getPort("out05") == &extra);
+	CHECK(!wide.ownsPort(&wide.out[5]));
+	
+	// Dependency queries only look at the inputs or the outputs
+	DummyModel dummy;
+	CHECK(!wide.hasDataProviders());
+	wide.in[10].connect(dummy.getPort("out"));
+	CHECK(wide.hasDataProviders());
+	CHECK(!wide.hasDataDependants());
+	CHECK(wide.dependsOn(&dummy));
+	CHECK(dummy.providesFor(&wide));
+	wide.in[10].disconnect();
+}
+
+TEST(ParameterHandles) {
+	WideModel wide;
+	ParameterHandle handle = wide.getParameterHandle("p12", "ft");
+	CHECK(handle.valid());
+	CHECK(handle.getModel() == &wide);
+	CHECK_EQUAL(Model::Parameter::DOUBLE, handle.getType());
+	handle.set(10);
+	CHECK_CLOSE(3.048, wide.param[12], 1e-12);
+	CHECK_CLOSE(10, handle.get(), 1e-12);
+	CHECK_CLOSE(10, wide.getParameterHandle("p12").get()/0.3048, 1e-12);
+	CHECK(!ParameterHandle().valid());
+	CHECK_THROW(wide.getParameterHandle("p30"), ModelException);
+	CHECK_THROW(wide.getParameterHandle("p12", "kg"), units::UnitsException);
+	
+	// Compared to setting by name
+	const unsigned int num = 100000;
+	Timer timer;
+	for (unsigned int i = 0; i < num; i++)
+		wide.setParameter("p12", i, "ft");
+	double byname = timer.time_s();
+	timer.setStartTick();
+	for (unsigned int i = 0; i < num; i++)
+		handle.set(i);
+	double byhandle = timer.time_s();
+	CHECK_CLOSE((num-1)*0.3048, wide.param[12], 1e-9);
+	dout(1) << "Parameter set by name " << 1e9*byname/num << " ns, by handle " << 1e9*byhandle/num << " ns\n";
+}
+
+class LadderModel : public Model {
+public:
+	LadderModel(const std::string& name = "LadderModel", const bool nendpoint = false) : Model(name), endpoint(nendpoint)
+	{
+		registerPort(a,"a");
+		registerPort(b,"b");
+		registerPort(out,"out");
+	}
+	META_Object(test, LadderModel);
+	virtual const char* description() const { return "ladder"; }
+	virtual const bool isEndPoint() { return endpoint; }
+	InPort<double> a, b;
+	OutPort<double> out;
+	bool endpoint;
+};
+
+TEST(DependencyGraph) {
+	UNITTEST_TIME_CONSTRAINT(500);
+	// Each rung reads both models of the previous one, so there are 2^40 paths to the endpoint
+	const unsigned int rungs = 40;
+	smrt::ref_ptr<Group> grp = new Group;
+	std::vector<LadderModel*> models;
+	for (unsigned int i = 0; i < 2*rungs; i++) {
+		std::stringstream name;
+		name << "m" << i;
+		models.push_back(new LadderModel(name.str()));
+		grp->addChild(models.back());
+		if (i >= 2) {
+			models[i]->a.connect(&models[2*(i/2)-2]->out);
+			models[i]->b.connect(&models[2*(i/2)-1]->out);
+		}
+	}
+	smrt::ref_ptr<LadderModel> endpoint = new LadderModel("endpoint", true);
+	grp->addChild(endpoint.get());
+	endpoint->a.connect(&models.back()->out);
+	
+	DependencyGraph* graph = models[0]->getDependencyGraph();
+	CHECK(graph != NULL);
+	CHECK(graph == grp->getOwnedDependencyGraph());
+	CHECK(models[0]->hasEndPointDependants());
+	CHECK(models[1]->hasEndPointDependants());
+	CHECK(!endpoint->hasEndPointDependants());
+	CHECK_EQUAL(2*rungs+2, graph->getNumModels()); // including the group
+	CHECK_EQUAL(2u, models[2]->getDataProviders().size());
+	CHECK_EQUAL(2u, models[2]->getDataDependants().size());
+	
+	// Queries are answered from the graph until something changes
+	unsigned long updates = graph->getNumUpdates();
+	for (unsigned int i = 0; i < models.size(); i++)
+		models[i]->hasEndPointDependants();
+	CHECK_EQUAL(updates, graph->getNumUpdates());
+	
+	// Only the models upstream of a changed endpoint are recomputed
+	unsigned long recomputed = graph->getNumRecomputed();
+	models[4]->endpoint = true;
+	graph->sampleEndPoints();
+	CHECK(models[2]->hasEndPointDependants());
+	CHECK_EQUAL(recomputed+5, graph->getNumRecomputed()); // itself and the two rungs before it
+	models[4]->endpoint = false;
+	graph->sampleEndPoints();
+	CHECK(models[2]->hasEndPointDependants());
+	updates = graph->getNumUpdates();
+	
+	// Connections are picked up, also in cycles
+	endpoint->a.disconnect();
+	CHECK(!models[0]->hasEndPointDependants());
+	CHECK_EQUAL(updates+1, graph->getNumUpdates());
+	CHECK_EQUAL(0u, models.back()->getDataDependants().size());
+	models[0]->a.connect(&models.back()->out);
+	endpoint->a.connect(&models[0]->out);
+	CHECK(models.back()->hasEndPointDependants());
+	CHECK(models[2]->hasEndPointDependants());
+	
+	// Removed children leave the graph, the rest of it is kept
+	grp->removeChild(endpoint.get());
+	CHECK_EQUAL(2*rungs+1, graph->getNumModels());
+	CHECK(endpoint->getParent() == NULL);
+	CHECK(endpoint->getDependencyGraph() == NULL);
+	CHECK(models[2]->hasEndPointDependants()); // the endpoint is still connected
+	CHECK_EQUAL(2*rungs+2, graph->getNumModels()); // the endpoint is picked up as a dependant
+	
+	// Models picked up from outside leave the graph when added to a group
+	smrt::ref_ptr<Group> other = new Group("other");
+	other->addChild(endpoint.get());
+	CHECK_EQUAL(2*rungs+1, graph->getNumModels());
+	CHECK(endpoint->getDependencyGraph() == other->getOwnedDependencyGraph());
+	CHECK(models[2]->hasEndPointDependants()); // through the other graph
+	CHECK_EQUAL(2*rungs+1, graph->getNumModels());
+	
+	// Groups added to other groups stop using their own graphs
+	smrt::ref_ptr<Group> outer = new Group("outer");
+	outer->addChild(grp.get());
+	CHECK(models[0]->getDependencyGraph() == outer->getOwnedDependencyGraph());
+	CHECK(models[2]->hasEndPointDependants());
+}
@@ -0,0 +1,285 @@
+#include <UnitTest++/UnitTest++.h>
+#include <sbx/ModelArray.h>
+#include <sbx/Simulation.h>
+#include <sbx/OperatorModels.h>
+#include <sbx/UtilityModels.h>
+#include <sbx/Timer.h>
+#include <sbx/XMLParser.h>
+#include <sbx/Log.h>
+#include <TinyXML/tinyxml.h>
+#include <sstream>
+
+using namespace sbx;
+
+/// Integrates its input, with a batch kernel keeping the sum in a state column
+class Accumulator : public Model, public BatchModel {
+public:
+	Accumulator(const std::string& name = "Accumulator") : Model(name), sum(0) { registerPort(u,"u"); registerPort(y,"y"); }
+	Accumulator(const Accumulator& source) : Model(source), sum(0) { copyPort(source, "u", u); copyPort(source, "y", y); }
+	META_Object(test, Accumulator);
+	virtual const char* description() const { return "accumulator"; }
+	virtual void init() { sum = 0; y = 0; }
+	virtual void update(const double dt) { sum += *u * dt; y = sum; }
+	virtual void initBatch(ModelArray& array) { array.addColumn("sum"); }
+	virtual void updateBatch(ModelArray& array, const double dt, const unsigned int first, const unsigned int count)
+	{
+		double* sums = array.getColumn("sum") + first;
+		const double* us = array.getColumn("u") + first;
+		double* ys = array.getColumn("y") + first;
+		for (unsigned int i = 0; i < count; i++) {
+			sums[i] += us[i] * dt;
+			ys[i] = sums[i];
+		}
+	}
+	InPort<double> u;
+	OutPort<double> y;
+	double sum;
+};
+
+/// Constants 0..n-1 multiplied by the time, as an array or as separate models
+Group* createProducts(const unsigned int n, const bool array)
+{
+	Group* grp = new Group("products");
+	TimerModel* timer = new TimerModel("timer");
+	grp->addChild(timer);
+	ModelArray* gains = NULL;
+	if (array) {
+		gains = new ModelArray("gains");
+		gains->setPrototype(new op::Multiply);
+		gains->setSize(n);
+		grp->addChild(gains);
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		std::stringstream ss;
+		ss << i;
+		op::Constant* k = new op::Constant("k" + ss.str());
+		k->set(i);
+		grp->addChild(k);
+		Model* gain = array ? gains->getElement(i) : new op::Multiply("Multiply" + ss.str());
+		if (!array)
+			grp->addChild(gain);
+		gain->getPort("a")->connect(timer->getPort("t"));
+		gain->getPort("b")->connect(k->getPort("out"));
+	}
+	return grp;
+}
+
+TEST(ModelArray) {
+	const unsigned int n = 100;
+	smrt::ref_ptr<Group> separate = createProducts(n, false);
+	smrt::ref_ptr<Group> batched = createProducts(n, true);
+	ModelArray* gains = dynamic_cast<ModelArray*>(batched->getChild(1));
+	CHECK(gains != NULL);
+	CHECK(gains->isBatched());
+	CHECK_EQUAL(n, gains->getSize());
+	CHECK_EQUAL("Multiply7", gains->getElement(7)->getName());
+	CHECK_EQUAL(3*n, gains->getNumPorts());
+	CHECK_EQUAL(2*n, gains->getNumInputs());
+	// The array owns the ports of its elements, and is found as their model
+	CHECK(gains->getElement(7)->getPort("c")->getOwner() == gains);
+	FindVisitor fv;
+	CHECK(fv.findPort(*batched, "gains.Multiply7.c") == gains->getElement(7)->getPort("c"));
+
+	Simulation sim1(separate.get()), sim2(batched.get());
+	Simulation* sims[2] = { &sim1, &sim2 };
+	for (int s = 0; s < 2; s++) {
+		sims[s]->setRealTime(false);
+		sims[s]->setFrequency(10);
+		sims[s]->setTraversalMode(SEQUENTIAL);
+		sims[s]->init();
+		for (int i = 0; i < 20; i++)
+			sims[s]->step();
+	}
+	FindVisitor fv1, fv2;
+	for (unsigned int i = 0; i < n; i++) {
+		std::stringstream ss;
+		ss << "Multiply" << i << ".c";
+		OutPort<double>* c1 = dynamic_cast<OutPort<double>*>(fv1.findPort(*separate, ss.str()));
+		OutPort<double>* c2 = dynamic_cast<OutPort<double>*>(fv2.findPort(*batched, "gains." + ss.str()));
+		CHECK(c1 && c2);
+		if (c1 && c2)
+			CHECK_CLOSE(c1->get(), c2->get(), 1e-12);
+	}
+	CHECK_CLOSE(2.0*(n-1), dynamic_cast<OutPort<double>*>(gains->getElement(n-1)->getPort("c"))->get(), 1e-9);
+
+	// Columns are contiguous, and read by the output ports
+	const double* c = gains->getColumn("c");
+	const double* b = gains->getColumn("b");
+	for (unsigned int i = 0; i < n; i++) {
+		CHECK_EQUAL(i, b[i]);
+		CHECK_EQUAL(&c[i], &dynamic_cast<OutPort<double>*>(gains->getElement(i)->getPort("c"))->getRef());
+	}
+	CHECK_THROW(gains->getColumn("nosuchcolumn"), ModelException);
+
+	// Copies are batched alike
+	smrt::ref_ptr<Group> copy = new Group(*batched);
+	ModelArray* copygains = dynamic_cast<ModelArray*>(copy->getChild(1));
+	CHECK(copygains && copygains->isBatched());
+	CHECK_EQUAL(n, copygains->getSize());
+	Simulation sim3(copy.get());
+	sim3.setRealTime(false);
+	sim3.setFrequency(10);
+	sim3.setTraversalMode(SEQUENTIAL);
+	sim3.init();
+	for (int i = 0; i < 20; i++)
+		sim3.step();
+	CHECK_CLOSE(2.0*(n-1), copygains->getColumn("c")[n-1], 1e-9);
+}
+
+TEST(ModelArrayState) {
+	smrt::ref_ptr<Group> grp = new Group;
+	op::Constant* one = new op::Constant("one");
+	one->set(1);
+	grp->addChild(one);
+	ModelArray* array = new ModelArray("integrators");
+	array->setPrototype(new Accumulator);
+	array->setSize(10);
+	grp->addChild(array);
+	for (unsigned int i = 0; i < array->getSize(); i++) {
+		if (i % 2 == 0)
+			array->getElement(i)->getPort("u")->connect(one->getPort("out"));
+		else
+			dynamic_cast<Accumulator*>(array->getElement(i))->u.setDefault(0.5);
+	}
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setFrequency(10);
+	sim.setTraversalMode(SEQUENTIAL);
+	sim.init();
+	for (int i = 0; i < 10; i++)
+		sim.step();
+	const double* sums = array->getColumn("sum");
+	for (unsigned int i = 0; i < array->getSize(); i++) {
+		double expected = (i % 2 == 0) ? 1 : 0.5;
+		CHECK_CLOSE(expected, sums[i], 1e-9);
+		CHECK_CLOSE(expected, dynamic_cast<OutPort<double>*>(array->getElement(i)->getPort("y"))->get(), 1e-9);
+		// The elements' own state isn't used by the kernel
+		CHECK_EQUAL(0, dynamic_cast<Accumulator*>(array->getElement(i))->sum);
+	}
+
+	// Resizing clones the prototype, and init() lays out the columns again
+	array->setSize(12);
+	CHECK_EQUAL("Accumulator11", array->getElement(11)->getName());
+	CHECK_THROW(array->getColumn("sum"), ModelException);
+	dynamic_cast<Accumulator*>(array->getElement(10))->u.setDefault(0);
+	dynamic_cast<Accumulator*>(array->getElement(11))->u.setDefault(0);
+	sim.init();
+	CHECK_EQUAL(0, array->getColumn("sum")[11]);
+	smrt::ref_ptr<ModelArray> empty = new ModelArray;
+	CHECK_THROW(empty->setSize(1), ModelException);
+}
+
+TEST(ModelArrayDefaultInputs) {
+	smrt::ref_ptr<ModelArray> array = new ModelArray("integrators");
+	array->setPrototype(new Accumulator);
+	array->setSize(4);
+	smrt::ref_ptr<Accumulator> separate[4];
+	for (unsigned int i = 0; i < 4; i++) {
+		separate[i] = new Accumulator;
+		dynamic_cast<Accumulator*>(array->getElement(i))->u.setDefault(i);
+		separate[i]->u.setDefault(i);
+	}
+	array->init();
+	for (unsigned int i = 0; i < 4; i++)
+		separate[i]->init();
+	CHECK_EQUAL(2, array->getColumn("u")[2]);
+	for (int step = 0; step < 10; step++) {
+		array->update(0.1);
+		for (unsigned int i = 0; i < 4; i++)
+			separate[i]->update(0.1);
+	}
+	for (unsigned int i = 0; i < 4; i++) {
+		CHECK_CLOSE(1.0*i, separate[i]->y.get(), 1e-9);
+		CHECK_CLOSE(separate[i]->y.get(), dynamic_cast<Accumulator*>(array->getElement(i))->y.get(), 1e-12);
+	}
+
+	smrt::ref_ptr<ModelArray> nodefaults = new ModelArray("integrators");
+	nodefaults->setPrototype(new Accumulator);
+	nodefaults->setSize(4);
+	nodefaults->init();
+	CHECK_THROW(nodefaults->getColumn("u"), ModelException);
+	CHECK_THROW(nodefaults->update(0.1), PortException);
+}
+
+TEST(ModelArrayXML) {
+	TiXmlDocument doc;
+	doc.Parse("<sbx_Group name='root'>"
+			  "<sbx_TimerModel name='timer'/>"
+			  "<sbx_ModelArray name='consts'>"
+			  "<model value='op_Constant'/><size value='4'/><value value='2'/>"
+			  "<element index='3'><value value='7'/></element>"
+			  "</sbx_ModelArray>"
+			  "<sbx_ModelArray name='gains'><model value='op_Multiply'/><size value='4'/></sbx_ModelArray>"
+			  "<connect>"
+			  "gains.Multiply0.a timer.t  gains.Multiply0.b consts.Constant0.out "
+			  "gains.Multiply1.a timer.t  gains.Multiply1.b consts.Constant1.out "
+			  "gains.Multiply2.a timer.t  gains.Multiply2.b consts.Constant2.out "
+			  "gains.Multiply3.a timer.t  gains.Multiply3.b consts.Constant3.out"
+			  "</connect>"
+			  "</sbx_Group>");
+	smrt::ref_ptr<Group> grp = new Group;
+	grp->parseXML(doc.FirstChildElement());
+	CHECK_EQUAL(3u, grp->getNumChildren());
+	ModelArray* consts = dynamic_cast<ModelArray*>(grp->getChild(1));
+	ModelArray* gains = dynamic_cast<ModelArray*>(grp->getChild(2));
+	CHECK(consts && gains);
+	if (!consts || !gains)
+		return;
+	CHECK(!consts->isBatched());
+	CHECK(gains->isBatched());
+	CHECK_EQUAL(4u, consts->getSize());
+	CHECK_EQUAL(2, dynamic_cast<op::Constant*>(consts->getElement(0))->get());
+	CHECK_EQUAL(7, dynamic_cast<op::Constant*>(consts->getElement(3))->get());
+
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setFrequency(10);
+	sim.setTraversalMode(SEQUENTIAL);
+	sim.init();
+	for (int i = 0; i < 10; i++)
+		sim.step();
+	CHECK_CLOSE(2, gains->getColumn("c")[0], 1e-9);
+	CHECK_CLOSE(7, gains->getColumn("c")[3], 1e-9);
+
+	// Written and parsed back with the per-element parameters
+	TiXmlElement element("sbx_ModelArray");
+	consts->writeXML(&element);
+	smrt::ref_ptr<ModelArray> copy = new ModelArray;
+	copy->parseXML(&element);
+	CHECK_EQUAL("consts", copy->getName());
+	CHECK_EQUAL(4u, copy->getSize());
+	CHECK_EQUAL(2, dynamic_cast<op::Constant*>(copy->getElement(1))->get());
+	CHECK_EQUAL(7, dynamic_cast<op::Constant*>(copy->getElement(3))->get());
+
+	TiXmlDocument bad;
+	bad.Parse("<sbx_ModelArray name='bad'><model value='NoSuchModel'/><size value='4'/></sbx_ModelArray>");
+	smrt::ref_ptr<ModelArray> badarray = new ModelArray;
+	CHECK_THROW(badarray->parseXML(bad.FirstChildElement()), ParseException);
+}
+
+TEST(ModelArrayBenchmark) {
+	const unsigned int n = 1000, steps = 200;
+	double times[2];
+	for (int array = 0; array < 2; array++) {
+		smrt::ref_ptr<Group> grp = createProducts(n, array == 1);
+		Simulation sim(grp.get());
+		sim.setRealTime(false);
+		sim.setFrequency(100);
+		sim.init();
+		Timer timer;
+		for (unsigned int i = 0; i < steps; i++)
+			sim.step();
+		times[array] = timer.time_s();
+	}
+	dout(1) << n << " op::Multiply models " << steps/times[0] << " steps/s, as a model array " << steps/times[1] << " steps/s\n";
+	
+	// Growing an array registers all element ports on it, one after the other
+	smrt::ref_ptr<ModelArray> large = new ModelArray("large");
+	large->setPrototype(new op::Multiply("m"));
+	Timer timer;
+	large->setSize(8*n);
+	double resize = timer.time_s();
+	CHECK_EQUAL(3*8*n, large->getNumPorts());
+	CHECK(large->getPort("m7999.c") == large->getElement(7999)->getPort("c"));
+	dout(1) << "Model array resized to " << 8*n << " elements in " << resize << " s\n";
+}
@@ -1,5 +1,6 @@
 #include <UnitTest++/UnitTest++.h>
 #include <sbx/Model.h>
+#include <sbx/Group.h>
 #include <sbx/Ports.h>
 #include <sbx/XMLParser.h>
 
@@ -44,3 +45,34 @@ TEST(SimpleCopy) {
 		CHECK_EQUAL(source.getPortName(i), dest.getPortName(i));
 }
 
+
+TEST(GroupCopy) {
+	smrt::ref_ptr<Group> source = new Group("source");
+	smrt::ref_ptr<Group> sub = new Group("sub");
+	CopyModel *m1 = new CopyModel("m1"), *m2 = new CopyModel("m2"), *m3 = new CopyModel("m3");
+	source->addChild(m1);
+	source->addChild(sub.get());
+	sub->addChild(m2);
+	sub->addChild(m3);
+	m1->getPort("out1")->connect(m2->getPort("in1"));
+	m2->getPort("out1")->connect(m3->getPort("in1"));
+	m1->getPort("in2")->connect(m3->getPort("in1"));
+	sub->exportChildPort(m3->getPort("out1"), "out");
+	
+	smrt::ref_ptr<Group> dest = (Group*) source->clone();
+	CHECK_EQUAL(2, dest->getNumChildren());
+	Model* d1 = dest->getChild(0);
+	Group* dsub = dest->getChild(1)->asGroup();
+	CHECK(dsub != NULL);
+	Model* d2 = dsub->getChild(0);
+	Model* d3 = dsub->getChild(1);
+	CHECK(d1 != m1 && d2 != m2 && d3 != m3);
+	// Connections within and across groups, and exported ports, refer to the copies
+	CHECK(d2->getPort("in1")->isConnectedTo(d1->getPort("out1")));
+	CHECK(d3->getPort("in1")->isConnectedTo(d2->getPort("out1")));
+	CHECK(d1->getPort("in2")->isConnectedTo(d3->getPort("in1")));
+	CHECK(dsub->getPort("out") == d3->getPort("out1"));
+	// ...and the source is left as it was
+	CHECK_EQUAL(1, m1->getPort("out1")->getNumConnections());
+	CHECK(m2->getPort("in1")->isConnectedTo(m1->getPort("out1")));
+}
@@ -1,12 +1,24 @@
 #include <UnitTest++/UnitTest++.h>
 #include <sbx/Ports.h>
 #include <sbx/Model.h>
+#include <sbx/Timer.h>
+#include <sbx/Log.h>
+#include <OpenThreads/Thread>
+#include <Eigen/Core>
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 
 using namespace sbx;
 
+struct PortPair { int a, b; };
+
+namespace sbx {
+	SBX_TRIVIAL_PORT_VALUE(PortPair)
+}
+
 TEST(Ports) {
 	InUnitPort<double> ind("m");
 	OutUnitPort <double> outd("ft");
@@ -63,3 +75,201 @@ TEST(Ports) {
 	CHECK_THROW(ind2.connect(&outd), units::UnitsException);
 	outd.connect(&ind2);
 }
+
+/// Sets a port to increasing values as fast as it can
+template <typename T>
+class PortWriter : public OpenThreads::Thread {
+public:
+	PortWriter(OutPort<T>& nport, const int nnum) : port(nport), num(nnum), done(false) {}
+	virtual void run()
+	{
+		for (int i = 1; i <= num; i++)
+			port = make(i);
+		done = true;
+	}
+	static T make(const int i);
+	OutPort<T>& port;
+	int num;
+	volatile bool done;
+};
+
+template <> PortPair PortWriter<PortPair>::make(const int i) { PortPair p = { i, i }; return p; }
+template <> std::vector<int> PortWriter< std::vector<int> >::make(const int i) { return std::vector<int>(64, i); }
+
+static bool consistent(const PortPair& p, int& last)
+{
+	bool ok = (p.a == p.b && p.a >= last);
+	last = p.a;
+	return ok;
+}
+
+static bool consistent(const std::vector<int>& v, int& last)
+{
+	bool ok = (v.size() == 64 && v.front() >= last);
+	for (unsigned int i = 1; i < v.size(); i++)
+		ok = ok && (v[i] == v[0]);
+	last = v.front();
+	return ok;
+}
+
+/// Reads values published from another thread, which should never be torn or go back in time
+template <typename T>
+static void checkConcurrentPublication(const int num)
+{
+	OutPort<T> out;
+	InPort<T> in;
+	in.connect(&out);
+	out = PortWriter<T>::make(0);
+	PortWriter<T> writer(out, num);
+	writer.start();
+	int last = 0;
+	unsigned long inconsistent = 0;
+	while (!writer.done) {
+		if (!consistent(*in, last))
+			inconsistent++;
+	}
+	writer.join();
+	CHECK_EQUAL(0u, inconsistent);
+	CHECK(consistent(*in, last));
+	CHECK_EQUAL(num, last);
+}
+
+TEST(PortConcurrentPublication) {
+	checkConcurrentPublication<PortPair>(200000);
+	checkConcurrentPublication< std::vector<int> >(20000);
+}
+
+TEST(PortReferences) {
+	// Inputs refer to the producer's value, also through other inputs
+	OutPort< std::vector<double> > out;
+	InPort< std::vector<double> > in, piggyback;
+	in.connect(&out);
+	piggyback.connect(&in);
+	out = std::vector<double>(100, 1.0);
+	CHECK(&*in.ref() == &out.getRef());
+	CHECK(&*piggyback.ref() == &out.getRef());
+	CHECK(!in.ref().isScaled());
+	
+	// Values set in place alternate between the two buffers of the port, reusing their storage
+	std::vector<const double*> buffers;
+	for (int i = 0; i < 10; i++) {
+		std::vector<double>& value = out.beginSet();
+		value.assign(100, i);
+		out.endSet();
+		CHECK_EQUAL(i, (*in.ref())[99]);
+		if (std::find(buffers.begin(), buffers.end(), &(*in.ref())[0]) == buffers.end())
+			buffers.push_back(&(*in.ref())[0]);
+	}
+	CHECK(buffers.size() <= 2);
+	
+	// Value pointers are honoured
+	std::vector<double> external(3, 47.11);
+	out.setPtr(&external);
+	CHECK(&*in.ref() == &external);
+	out.setPtr(NULL);
+	
+	// Unit conversion is left to the consumer
+	typedef Eigen::Matrix<double,6,1> Vector6d;
+	OutUnitPort<Vector6d> position("ft");
+	InUnitPort<Vector6d> metres("m");
+	metres.connect(&position);
+	for (int i = 0; i < 10; i++) {
+		position.beginSet().setConstant(i);
+		position.endSet();
+	}
+	PortRef<Vector6d> ref = metres.ref();
+	CHECK(ref.isScaled());
+	CHECK_CLOSE(0.3048, ref.scale, 1e-9);
+	CHECK(&*ref == &position.getRef());
+	CHECK_EQUAL(9, (*ref)[5]);
+	CHECK_CLOSE(9*0.3048, ref.get()[5], 1e-9);
+	CHECK_CLOSE(9*0.3048, metres.get()[5], 1e-9);
+	
+	// Default values
+	InPort<std::string> unconnected;
+	CHECK_THROW(unconnected.ref(), PortException);
+	unconnected.setDefault("default");
+	CHECK_EQUAL("default", *unconnected.ref());
+}
+
+TEST(DelayedUnitPorts) {
+	// Delayed inputs read the committed value, converted like the current one, of any type
+	OutUnitPort<double> feet("ft");
+	InUnitPort<double> metres("m");
+	InUnitPort<double> centimetres("cm");
+	metres.connect(&feet);
+	centimetres.connect(&metres);
+	feet = 1;
+	CHECK(metres.setDelayed(true) == &feet);
+	centimetres.setDelayed(true);
+	feet = 2;
+	CHECK_CLOSE(0.3048, metres.get(), 1e-9);
+	CHECK_CLOSE(30.48, centimetres.get(), 1e-9);
+	CHECK_CLOSE(30.48, *centimetres, 1e-9);
+	
+	typedef Eigen::Matrix<double,6,1> Vector6d;
+	OutUnitPort<Vector6d> position("ft");
+	InUnitPort<Vector6d> vmetres("m");
+	InUnitPort<Vector6d> vcentimetres("cm");
+	vmetres.connect(&position);
+	vcentimetres.connect(&vmetres);
+	position.beginSet().setConstant(1);
+	position.endSet();
+	vmetres.setDelayed(true);
+	vcentimetres.setDelayed(true);
+	position.beginSet().setConstant(2);
+	position.endSet();
+	CHECK_CLOSE(0.3048, vmetres.get()[0], 1e-9);
+	CHECK_CLOSE(0.3048, (*vmetres)[5], 1e-9);
+	CHECK_CLOSE(0.3048, vmetres.ref().get()[0], 1e-9);
+	CHECK_CLOSE(30.48, vcentimetres.get()[0], 1e-9);
+	position.commit();
+	CHECK_CLOSE(2*0.3048, vmetres.get()[0], 1e-9);
+	vmetres.setDelayed(false);
+	position.beginSet().setConstant(3);
+	position.endSet();
+	CHECK_CLOSE(3*0.3048, vmetres.get()[0], 1e-9);
+}
+
+static volatile double sink;
+static void use(const double value) { sink = value; }
+static void use(const std::vector<double>& value) { sink = value[0]; }
+
+/// Time a plain copy of \a value, what a port set+get costs without synchronization
+template <typename T>
+static double benchmarkCopy(const T& value, const unsigned int num)
+{
+	T copy;
+	Timer timer;
+	for (unsigned int i = 0; i < num; i++) {
+		copy = value;
+		use(copy);
+	}
+	return timer.time_n() / num;
+}
+
+template <typename T>
+static double benchmarkPort(const T& value, const unsigned int num)
+{
+	OutPort<T> out;
+	InPort<T> in;
+	in.connect(&out);
+	Timer timer;
+	for (unsigned int i = 0; i < num; i++) {
+		out = value;
+		use(*in);
+	}
+	return timer.time_n() / num;
+}
+
+TEST(PortBenchmark) {
+	const unsigned int num = 1000000;
+	std::vector<double> vec(16, 1.0);
+	dout(1) << "Port set+get, ns: synchronized port / plain copy\n";
+	double synced = benchmarkPort(1.0, num);
+	double vsynced = benchmarkPort(vec, num/10);
+	double copied = benchmarkCopy(1.0, num);
+	double vcopied = benchmarkCopy(vec, num/10);
+	dout(1) << "  double: " << synced << " / " << copied << "\n";
+	dout(1) << "  vector<double>(16): " << vsynced << " / " << vcopied << "\n";
+}
@@ -0,0 +1,222 @@
+#include <UnitTest++/UnitTest++.h>
+#include <sbx/SignalBus.h>
+#include <sbx/Simulation.h>
+#include <sbx/OperatorModels.h>
+#include <sbx/BlackBox.h>
+#include <sbx/Log.h>
+#include <sstream>
+
+using namespace sbx;
+
+class BusSource : public Model {
+public:
+	BusSource(const std::string& name = "BusSource") : Model(name), out("ft") { registerPort(out,"out","ft","Counter"); }
+	META_Object(test, BusSource);
+	virtual void init() { out = 0; }
+	virtual void update(const double dt) { out = *out + 1; }
+	virtual const char* description() const { return "bussource"; }
+	OutUnitPort<double> out;
+};
+
+class BusSink : public Model {
+public:
+	BusSink(const std::string& name = "BusSink", const std::string& unit = "") : Model(name), in(unit), value(0) { registerPort(in,"in",unit,"Input"); }
+	META_Object(test, BusSink);
+	virtual void init() { value = 0; }
+	virtual void update(const double dt) { value = *in; }
+	virtual const char* description() const { return "bussink"; }
+	virtual const bool isEndPoint() { return true; }
+	InUnitPort<double> in;
+	double value;
+};
+
+TEST(SignalBus) {
+	smrt::ref_ptr<Group> grp = new Group;
+	smrt::ref_ptr<BusSource> source1 = new BusSource("source1");
+	smrt::ref_ptr<BusSource> source2 = new BusSource("source2");
+	smrt::ref_ptr<BusSource> source3 = new BusSource("source3");
+	smrt::ref_ptr<BusSink> sink = new BusSink("sink", "m");
+	smrt::ref_ptr<BusSink> relay = new BusSink("relay", "cm");
+	source1->setUpdateFrequency(10);
+	source2->setUpdateFrequency(10);
+	grp->addChild(source1.get());
+	grp->addChild(source2.get());
+	grp->addChild(source3.get());
+	grp->addChild(sink.get());
+	grp->addChild(relay.get());
+	sink->in.connect(&source1->out);
+	relay->in.connect(&sink->in); // reads through the sink's input
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setFrequency(20);
+	sim.setTraversalMode(SEQUENTIAL); // schedule all sources, whether connected or not
+
+	// Same values with and without the bus
+	double values[2][2];
+	for (int bus = 0; bus < 2; bus++) {
+		sim.setSignalBus(bus == 1);
+		sim.init();
+		for (int i = 0; i < 10; i++)
+			sim.step();
+		values[bus][0] = sink->value;
+		values[bus][1] = relay->value;
+	}
+	CHECK_CLOSE(5*0.3048, values[0][0], 1e-9);
+	CHECK_CLOSE(5*30.48, values[0][1], 1e-9);
+	CHECK_CLOSE(values[0][0], values[1][0], 1e-9);
+	CHECK_CLOSE(values[0][1], values[1][1], 1e-9);
+
+	// Outputs of a rate group are contiguous and start on a cache line
+	const SignalBus& bus = sim.getBus();
+	CHECK(bus.isBoundTo(*grp));
+	CHECK_EQUAL(3u, bus.getNumOutputs());
+	CHECK_EQUAL(2u, bus.getNumInputs());
+	const double* slot1 = bus.getSlot(&source1->out);
+	const double* slot2 = bus.getSlot(&source2->out);
+	CHECK(slot1 != NULL);
+	CHECK_EQUAL(0u, ((size_t) slot1) % SIGNALBUS_CACHE_LINE);
+	CHECK_EQUAL(1, slot2 - slot1);
+	CHECK_EQUAL(0u, ((size_t) bus.getSlot(&source3->out)) % SIGNALBUS_CACHE_LINE);
+	CHECK_EQUAL(5, *slot1);
+
+	// Topology changes rebind the bus
+	relay->in.connect(&source2->out);
+	sim.step();
+	CHECK(bus.isBoundTo(*grp));
+	CHECK_CLOSE(30.48*source2->out.get(), relay->value, 1e-9);
+
+	// Reconnected or disconnected inputs stop reading their old slot
+	sink->in.connect(&source3->out);
+	CHECK_CLOSE(0.3048*source3->out.get(), *sink->in, 1e-9);
+	CHECK_EQUAL(1u, bus.getNumInputs());
+	sink->in.disconnect();
+	CHECK_THROW(*sink->in, PortException);
+	sink->in.connect(&source1->out);
+	sim.step();
+	CHECK_EQUAL(2u, bus.getNumInputs());
+	CHECK_CLOSE(0.3048*source1->out.get(), *sink->in, 1e-9);
+
+	// Unbinding moves the values back into the ports
+	double value = source1->out.get();
+	sim.setSignalBus(false);
+	CHECK(!bus.isBound());
+	CHECK_EQUAL(value, source1->out.get());
+	CHECK_CLOSE(0.3048*value, *sink->in, 1e-9);
+
+	// Ports destroyed while bound leave the bus
+	sim.setSignalBus(true);
+	sim.step();
+	CHECK_EQUAL(2u, bus.getNumInputs());
+	grp->removeChild(relay.get());
+	relay = NULL;
+	CHECK_EQUAL(1u, bus.getNumInputs());
+}
+
+/// Subscribes to BlackBox variables without logging them anywhere
+class BusDataHandler : public BlackBoxDataHandler {
+public:
+	virtual void write(int numentries = 0) {}
+};
+
+TEST(SignalBusLogging) {
+	// "logged" is read by nothing but the BlackBox, "multiply" only by a fused operator
+	smrt::ref_ptr<Group> grp = new Group;
+	BusSource* source = new BusSource("source");
+	op::Constant* two = new op::Constant("two");
+	op::Add* logged = new op::Add("logged");
+	op::Multiply* multiply = new op::Multiply("multiply");
+	op::Add* add = new op::Add("add");
+	BusSink* sink = new BusSink("sink");
+	two->set(2);
+	grp->addChild(source);
+	grp->addChild(two);
+	grp->addChild(logged);
+	grp->addChild(multiply);
+	grp->addChild(add);
+	grp->addChild(sink);
+	logged->getPort("a")->connect(&source->out);
+	logged->getPort("b")->connect(&source->out);
+	multiply->getPort("a")->connect(&source->out);
+	multiply->getPort("b")->connect(two->getPort("out"));
+	add->getPort("a")->connect(multiply->getPort("c"));
+	add->getPort("b")->connect(two->getPort("out"));
+	sink->in.connect(add->getPort("c"));
+	
+	// Registered before the bus is bound
+	static const int tag = 0;
+	OutPort<double>* loggedout = dynamic_cast<OutPort<double>*>(logged->getPort("c"));
+	OutPort<double>* multiplied = dynamic_cast<OutPort<double>*>(multiply->getPort("c"));
+	BlackBox& blackbox = BlackBox::instance();
+	blackbox.beginGroup(&tag, "bustest");
+	blackbox.registerDouble("logged", &loggedout->getRef());
+	blackbox.registerDouble("multiplied", &multiplied->getRef());
+	blackbox.endGroup();
+	BusDataHandler handler;
+	handler.subscribeGroup("bustest");
+	blackbox.addHandler(&handler);
+	int loggedvar = blackbox.findVariableIndex("bustest.logged");
+	int multipliedvar = blackbox.findVariableIndex("bustest.multiplied");
+	CHECK(loggedvar >= 0 && multipliedvar >= 0);
+	
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setContinuousDisplay(false);
+	sim.setPruning(true);
+	sim.setOperatorFusion(true);
+	sim.setSignalBus(true);
+	const UpdateVisitor& updatevis = sim.getUpdateVisitor();
+	// The second run is initialized, and pruned, with the bus still bound
+	for (int run = 0; run < 3; run++) {
+		if (run == 2)
+			sim.setSignalBus(false);
+		sim.init();
+		for (int i = 0; i < 5; i++)
+			sim.step();
+		CHECK_EQUAL(run < 2, sim.getBus().isBound());
+		CHECK(!updatevis.isPruned(*logged));
+		CHECK(updatevis.getNumFusedModels() > 0);
+		CHECK_EQUAL(&loggedout->getRef(), blackbox.getVariable(loggedvar).value_ptr);
+		CHECK_EQUAL(&multiplied->getRef(), blackbox.getVariable(multipliedvar).value_ptr);
+		CHECK_EQUAL(10, *(const double*) blackbox.getVariable(loggedvar).value_ptr);
+		CHECK_EQUAL(10, *(const double*) blackbox.getVariable(multipliedvar).value_ptr);
+		CHECK_EQUAL(12, sink->value);
+	}
+	blackbox.removeHandler(&handler);
+	blackbox.unregisterGroup(&tag);
+}
+
+TEST(SignalBusBenchmark) {
+	const unsigned int num = 500, steps = 2000;
+	smrt::ref_ptr<Group> grp = new Group;
+	op::Constant* constant = new op::Constant;
+	constant->set(1);
+	grp->addChild(constant);
+	Model* last = constant;
+	for (unsigned int i = 0; i < num; i++) {
+		std::stringstream name;
+		name << "add" << i;
+		op::Add* add = new op::Add(name.str());
+		add->getPort("a")->connect(last->getPort(i == 0 ? "out" : "c"));
+		add->getPort("b")->connect(constant->getPort("out"));
+		grp->addChild(add);
+		last = add;
+	}
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setContinuousDisplay(false);
+	sim.setTraversalMode(SEQUENTIAL);
+	double rate[2], result[2];
+	for (int bus = 0; bus < 2; bus++) {
+		sim.setSignalBus(bus == 1);
+		sim.init();
+		sim.step();
+		Timer timer;
+		for (unsigned int i = 0; i < steps; i++)
+			sim.step();
+		rate[bus] = steps/timer.time_s();
+		result[bus] = dynamic_cast<OutPort<double>*>(last->getPort("c"))->get();
+	}
+	CHECK_EQUAL(num+1, result[0]);
+	CHECK_EQUAL(result[0], result[1]);
+	dout(1) << "Steps/second, " << num << " op::Add in a chain: " << rate[0] << ", signal bus " << rate[1] << "\n";
+}
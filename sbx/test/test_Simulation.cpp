@@ -1,10 +1,38 @@
 #include <UnitTest++/UnitTest++.h>
 #include <sbx/Simulation.h>
 #include <sbx/Ports.h>
+#include <sbx/OperatorModels.h>
+#include <sbx/BlackBox.h>
+#include <sbx/XMLParser.h>
+#include <sbx/Log.h>
+#include <OpenThreads/Atomic>
+#include <OpenThreads/Thread>
 #include <iostream>
+#include <sstream>
+#include <vector>
+#include <new>
+#include <cstdlib>
 
 using namespace sbx;
 
+// Count heap allocations (from all threads) while counting is enabled
+static bool count_allocations = false;
+static OpenThreads::Atomic num_allocations;
+
+void* operator new(size_t size) throw(std::bad_alloc)
+{
+	if (count_allocations)
+		++num_allocations;
+	void* ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size) throw(std::bad_alloc) { return operator new(size); }
+void operator delete(void* ptr) throw() { free(ptr); }
+void operator delete[](void* ptr) throw() { free(ptr); }
+
 class CounterModel : public Model {
 public:
 	CounterModel(const std::string& name = "CounterModel") 
@@ -244,3 +272,1010 @@ TEST(FindVisitorAndNamingStuff) {
 	CHECK_EQUAL(model->getPort("in"), finder.findPort(*root.get(), "grp/model.in"));
 	CHECK_EQUAL(model2->getPort("out"), finder.findPort(*root.get(), "/grp2/model.out"));
 }
+
+class SumModel : public Model {
+public:
+	SumModel(const std::string& name = "SumModel") : Model(name), endpoint(false), count(0)
+	{
+		registerPort(a,"a","","Input a");
+		registerPort(b,"b","","Input b");
+		registerPort(c,"c","","Output, 0.5*(a+b) + number of updates");
+		a.setDefault(0);
+		b.setDefault(0);
+	}
+	META_Object(test, SumModel);
+	virtual void init() { c = 0; count = 0; }
+	virtual void update(const double dt) { c = 0.5*(*a + *b) + ++count; }
+	virtual const char* description() const { return "summodel"; }
+	void setEndPoint(const bool val) { endpoint = val; }
+	virtual const bool isEndPoint() { return endpoint; }
+	double value() { return ((OutPort<double>*)getPort("c"))->get(); }
+protected:
+	InPort<double> a, b;
+	OutPort<double> c;
+	bool endpoint;
+	int count;
+};
+
+enum BenchGraph { CHAIN, FANOUT, RANDOMDAG };
+
+static Group* createBenchGraph(BenchGraph type, const unsigned int num)
+{
+	Group *grp = new Group;
+	std::vector<SumModel*> models;
+	for (unsigned int i = 0; i < num; i++) {
+		std::stringstream ss;
+		ss << "m" << i;
+		models.push_back(new SumModel(ss.str()));
+	}
+	// Add children in reverse order, so that DEPENDENT traversal has to reorder them
+	for (unsigned int i = num; i > 0; i--)
+		grp->addChild(models[i-1]);
+	unsigned int seed = 4711;
+	for (unsigned int i = 1; i < num; i++) {
+		switch (type) {
+			case CHAIN:
+				models[i-1]->getPort("c")->connect(models[i]->getPort("a"));
+				break;
+			case FANOUT:
+				models[0]->getPort("c")->connect(models[i]->getPort("a"));
+				models[i]->setEndPoint(true);
+				break;
+			case RANDOMDAG:
+				seed = seed*1103515245 + 12345;
+				models[(seed/65536) % i]->getPort("c")->connect(models[i]->getPort("a"));
+				seed = seed*1103515245 + 12345;
+				models[(seed/65536) % i]->getPort("c")->connect(models[i]->getPort("b"));
+				break;
+		}
+	}
+	for (unsigned int i = 0; i < num; i++)
+		if (!models[i]->hasDataDependants())
+			models[i]->setEndPoint(true);
+	return grp;
+}
+
+TEST(CompiledSchedule) {
+	smrt::ref_ptr<Group> grp = createBenchGraph(CHAIN, 5);
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.init();
+	sim.step();
+	// Chain of five models plus the group itself, in dependency order
+	const UpdateSchedule& schedule = sim.getUpdateVisitor().getSchedule();
+	CHECK(sim.getUpdateVisitor().isCompiled(*grp));
+	CHECK_EQUAL(6, schedule.size());
+	CHECK_EQUAL("m0", schedule[0].model->getName());
+	CHECK_EQUAL("m4", schedule[4].model->getName());
+	CHECK(schedule[5].model == grp.get());
+	CHECK_CLOSE(1.9375, ((SumModel*)schedule[4].model)->value(), 1e-9);
+	
+	// Topology changes invalidate the schedule, it is recompiled on the next step
+	smrt::ref_ptr<SumModel> extra = new SumModel("extra");
+	extra->setEndPoint(true);
+	grp->addChild(extra.get());
+	CHECK(!sim.getUpdateVisitor().isCompiled(*grp));
+	sim.step();
+	CHECK_EQUAL(7, schedule.size());
+	grp->getChild(0)->getPort("c")->connect(extra->getPort("a"));
+	CHECK(!sim.getUpdateVisitor().isCompiled(*grp));
+	sim.step();
+	CHECK_EQUAL(7, schedule.size());
+	CHECK_CLOSE(0.5*((SumModel*)grp->getChild(0))->value() + 2, extra->value(), 1e-9);
+	
+	// Changes to other trees leave it alone, changes deep down in this one don't
+	smrt::ref_ptr<Group> other = createBenchGraph(CHAIN, 2);
+	other->getChild(0)->getPort("c")->disconnect();
+	other->getChild(0)->setUpdateFrequency(10);
+	CHECK(sim.getUpdateVisitor().isCompiled(*grp));
+	smrt::ref_ptr<Group> sub = new Group("sub");
+	grp->addChild(sub.get());
+	sim.step();
+	CHECK(sim.getUpdateVisitor().isCompiled(*grp));
+	sub->addChild(new SumModel("deep"));
+	CHECK(!sim.getUpdateVisitor().isCompiled(*grp));
+}
+
+// Counts the models it applies, and nests traversals of the tree by new visitors, \a depth deep
+class NestingVisitor : public ModelVisitor {
+public:
+	NestingVisitor(const unsigned int ndepth = 0) : depth(ndepth), applied(0), nested(0) {}
+	virtual void apply(Model& model)
+	{
+		if (isVisited(model))
+			return;
+		model.traverse(*this);
+		applied++;
+		setVisited(model);
+		if (depth > 0 && model.getName() == "m0") {
+			NestingVisitor inner(depth-1);
+			inner.setTraversalMode(traversalmode);
+			inner.visit(*model.getParent());
+			nested += inner.applied + inner.nested;
+		}
+	}
+	unsigned int depth, applied, nested;
+};
+
+TEST(VisitMarks) {
+	smrt::ref_ptr<Group> grp = createBenchGraph(RANDOMDAG, 200);
+	// Each model once per visit, in both traversal modes
+	NestingVisitor visitor;
+	for (int mode = SEQUENTIAL; mode <= DEPENDENT; mode++) {
+		visitor.setTraversalMode((TraversalMode) mode);
+		visitor.applied = 0;
+		visitor.visit(*grp);
+		visitor.visit(*grp);
+		CHECK_EQUAL(402u, visitor.applied);
+	}
+	
+	// Nested traversals of the same models, more than there are visit mark slots
+	NestingVisitor outer(NUM_VISIT_MARKS+4);
+	outer.visit(*grp);
+	CHECK_EQUAL(201u, outer.applied);
+	CHECK_EQUAL((NUM_VISIT_MARKS+4)*201u, outer.nested);
+	
+	// Marking is allocation free
+	visitor.setTraversalMode(SEQUENTIAL);
+	visitor.applied = 0;
+	num_allocations.exchange(0);
+	count_allocations = true;
+	for (int i = 0; i < 10; i++)
+		visitor.visit(*grp);
+	count_allocations = false;
+	CHECK_EQUAL(0u, (unsigned int) num_allocations);
+	CHECK_EQUAL(2010u, visitor.applied);
+}
+
+TEST(ParallelSchedule) {
+	// Levels - a chain is sequential, a fan-out has all dependants in one level
+	smrt::ref_ptr<Group> chain = createBenchGraph(CHAIN, 5);
+	Simulation sim(chain.get());
+	sim.setTraversalMode(PARALLEL);
+	sim.init();
+	sim.step();
+	CHECK_EQUAL(6, sim.getUpdateVisitor().getScheduleLevels().size());
+	smrt::ref_ptr<Group> fanout = createBenchGraph(FANOUT, 20);
+	sim.setRoot(fanout.get());
+	sim.init();
+	sim.step();
+	const ScheduleLevels& levels = sim.getUpdateVisitor().getScheduleLevels();
+	CHECK_EQUAL(3, levels.size());
+	CHECK_EQUAL(1, levels[0].size());
+	CHECK_EQUAL(19, levels[1].size());
+	CHECK_EQUAL(1, levels[2].size());
+	
+	// Results should be identical to DEPENDENT traversal
+	for (int type = CHAIN; type <= RANDOMDAG; type++) {
+		smrt::ref_ptr<Group> grp = createBenchGraph((BenchGraph) type, 200);
+		sim.setRoot(grp.get());
+		sim.setTraversalMode(DEPENDENT);
+		sim.init();
+		for (int i = 0; i < 10; i++)
+			sim.step();
+		std::vector<double> values;
+		for (unsigned int i = 0; i < grp->getNumChildren(); i++)
+			values.push_back(((SumModel*)grp->getChild(i))->value());
+		sim.setTraversalMode(PARALLEL);
+		sim.init();
+		for (int i = 0; i < 10; i++)
+			sim.step();
+		for (unsigned int i = 0; i < grp->getNumChildren(); i++)
+			CHECK_EQUAL(values[i], ((SumModel*)grp->getChild(i))->value());
+	}
+}
+
+/// Two models reading each other through loose inputs, added in the given order
+static Group* createLooseLoop(const bool reversed)
+{
+	Group* grp = new Group;
+	SumModel* first = new SumModel("first");
+	SumModel* second = new SumModel("second");
+	grp->addChild(reversed ? second : first);
+	grp->addChild(reversed ? first : second);
+	first->getPort("a")->connect(second->getPort("c"));
+	((InputPort*) first->getPort("a"))->setLoose(true);
+	second->getPort("a")->connect(first->getPort("c"));
+	((InputPort*) second->getPort("a"))->setLoose(true);
+	first->setEndPoint(true);
+	second->setEndPoint(true);
+	return grp;
+}
+
+static std::vector<double> runSteps(Simulation& sim, Group* grp, const TraversalMode mode, const unsigned int steps)
+{
+	sim.setRoot(grp);
+	sim.setTraversalMode(mode);
+	sim.init();
+	for (unsigned int i = 0; i < steps; i++)
+		sim.step();
+	std::vector<double> values;
+	for (unsigned int i = 0; i < grp->getNumChildren(); i++)
+		values.push_back(((SumModel*)grp->getChild(i))->value());
+	return values;
+}
+
+TEST(DelayedConnections) {
+	Simulation sim;
+	sim.setRealTime(false);
+	sim.setContinuousDisplay(false);
+	
+	// Loose inputs read the previous step, whatever order the models are updated in
+	smrt::ref_ptr<Group> loop = createLooseLoop(false);
+	smrt::ref_ptr<Group> reversed = createLooseLoop(true);
+	std::vector<double> values = runSteps(sim, loop.get(), SEQUENTIAL, 10);
+	std::vector<double> reversedvalues = runSteps(sim, reversed.get(), SEQUENTIAL, 10);
+	CHECK(values[0] != reversedvalues[1]);
+	sim.setConnectionDelay(DELAY_LOOSE);
+	values = runSteps(sim, loop.get(), SEQUENTIAL, 10);
+	reversedvalues = runSteps(sim, reversed.get(), SEQUENTIAL, 10);
+	CHECK_EQUAL(values[0], reversedvalues[1]);
+	CHECK_EQUAL(values[1], reversedvalues[0]);
+	CHECK_EQUAL(2u, sim.getUpdateVisitor().getCommittedPorts().size());
+	
+	// With all inputs delayed, a chain advances one model per step
+	smrt::ref_ptr<Group> chain = createBenchGraph(CHAIN, 5);
+	sim.setConnectionDelay(DELAY_ALL);
+	values = runSteps(sim, chain.get(), DEPENDENT, 1);
+	for (unsigned int i = 0; i < values.size(); i++)
+		CHECK_EQUAL(1, values[i]);
+	CHECK_EQUAL(4u, sim.getUpdateVisitor().getCommittedPorts().size());
+	
+	// ...and all models are updated in parallel, with the same results in any traversal mode
+	for (int type = CHAIN; type <= RANDOMDAG; type++) {
+		smrt::ref_ptr<Group> grp = createBenchGraph((BenchGraph) type, 200);
+		values = runSteps(sim, grp.get(), SEQUENTIAL, 10);
+		std::vector<double> parallel = runSteps(sim, grp.get(), PARALLEL, 10);
+		CHECK_EQUAL(2u, sim.getUpdateVisitor().getScheduleLevels().size());
+		for (unsigned int i = 0; i < values.size(); i++)
+			CHECK_EQUAL(values[i], parallel[i]);
+	}
+	
+	// Back to current values
+	sim.setConnectionDelay(DELAY_NONE);
+	values = runSteps(sim, chain.get(), DEPENDENT, 1);
+	CHECK_CLOSE(1.9375, values[0], 1e-9); // children were added in reverse order
+	CHECK_EQUAL(0u, sim.getUpdateVisitor().getCommittedPorts().size());
+}
+
+/// Piecewise constant output, switching every five updates
+class ModeSource : public Model {
+public:
+	ModeSource(const std::string& name = "ModeSource") : Model(name), count(0) { registerPort(out,"out","","Mode"); }
+	META_Object(test, ModeSource);
+	virtual void init() { count = 0; out = 0; }
+	virtual void update(const double dt) { out = ++count / 5; }
+	virtual const char* description() const { return "modesource"; }
+	OutPort<double> out;
+	int count;
+};
+
+TEST(ChangePropagation) {
+	smrt::ref_ptr<Group> grp = new Group;
+	op::Constant* constant = new op::Constant;
+	constant->set(2);
+	ModeSource* mode = new ModeSource;
+	op::Add* add = new op::Add;
+	op::Multiply* multiply = new op::Multiply;
+	SumModel* sum = new SumModel;
+	sum->setEndPoint(true);
+	grp->addChild(constant);
+	grp->addChild(mode);
+	grp->addChild(add);
+	grp->addChild(multiply);
+	grp->addChild(sum);
+	add->getPort("a")->connect(constant->getPort("out"));
+	add->getPort("b")->connect(constant->getPort("out"));
+	multiply->getPort("a")->connect(add->getPort("c"));
+	multiply->getPort("b")->connect(mode->getPort("out"));
+	sum->getPort("a")->connect(multiply->getPort("c"));
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setContinuousDisplay(false);
+	
+	double values[2];
+	for (int changes = 0; changes < 2; changes++) {
+		sim.setChangePropagation(changes == 1);
+		sim.init();
+		for (int i = 0; i < 20; i++)
+			sim.step();
+		values[changes] = sum->value();
+	}
+	CHECK_EQUAL(values[0], values[1]);
+	// The constant and the adder are updated once, the multiplier when the mode switches (and once more at the start)
+	const UpdateVisitor& updatevis = sim.getUpdateVisitor();
+	CHECK_EQUAL(67u, updatevis.getExecutedUpdates());
+	CHECK_EQUAL(53u, updatevis.getSkippedUpdates());
+	
+	// Same in parallel
+	sim.setTraversalMode(PARALLEL);
+	sim.init();
+	for (int i = 0; i < 20; i++)
+		sim.step();
+	CHECK_EQUAL(values[0], sum->value());
+	CHECK_EQUAL(53u, updatevis.getSkippedUpdates());
+	
+	// Setting a new value is picked up
+	constant->set(3);
+	sim.step();
+	CHECK_EQUAL(54u, updatevis.getSkippedUpdates()); // only the constant itself
+	CHECK_CLOSE(0.5*(3+3)*4 + 21, sum->value(), 1e-9);
+}
+
+/// A chain of \a num operators, alternately multiplying by 0.5 and adding the mode of a ModeSource, read by an endpoint
+static Group* createOperatorChain(const unsigned int num)
+{
+	Group* grp = new Group;
+	ModeSource* mode = new ModeSource;
+	op::Constant* half = new op::Constant("half");
+	half->set(0.5);
+	grp->addChild(mode);
+	grp->addChild(half);
+	Port* out = mode->getPort("out");
+	for (unsigned int i = 0; i < num; i++) {
+		std::stringstream name;
+		name << "op" << i;
+		Model* model = (i % 2) ? (Model*) new op::Add(name.str()) : (Model*) new op::Multiply(name.str());
+		grp->addChild(model);
+		model->getPort("a")->connect(out);
+		model->getPort("b")->connect((i % 2) ? mode->getPort("out") : half->getPort("out"));
+		out = model->getPort("c");
+	}
+	SumModel* sum = new SumModel;
+	sum->setEndPoint(true);
+	grp->addChild(sum);
+	sum->getPort("a")->connect(out);
+	return grp;
+}
+
+/// ((mode + 2) * 3 - 2*3) / 2, with a sum reading the first and last result
+static Group* createOperatorGraph()
+{
+	Group* grp = new Group;
+	op::Constant* two = new op::Constant("two");
+	op::Constant* three = new op::Constant("three");
+	two->set(2);
+	three->set(3);
+	ModeSource* mode = new ModeSource;
+	op::Add* add = new op::Add;
+	op::Multiply* multiply = new op::Multiply;
+	op::Multiply* product = new op::Multiply("product");
+	op::Subtract* subtract = new op::Subtract;
+	op::Divide* divide = new op::Divide;
+	SumModel* sum = new SumModel;
+	sum->setEndPoint(true);
+	// In reverse order, so that SEQUENTIAL traversals read previous step values
+	grp->addChild(sum);
+	grp->addChild(divide);
+	grp->addChild(subtract);
+	grp->addChild(product);
+	grp->addChild(multiply);
+	grp->addChild(add);
+	grp->addChild(mode);
+	grp->addChild(two);
+	grp->addChild(three);
+	add->getPort("a")->connect(mode->getPort("out"));
+	add->getPort("b")->connect(two->getPort("out"));
+	multiply->getPort("a")->connect(add->getPort("c"));
+	multiply->getPort("b")->connect(three->getPort("out"));
+	product->getPort("a")->connect(two->getPort("out"));
+	product->getPort("b")->connect(three->getPort("out"));
+	subtract->getPort("a")->connect(multiply->getPort("c"));
+	subtract->getPort("b")->connect(product->getPort("c"));
+	divide->getPort("a")->connect(subtract->getPort("c"));
+	divide->getPort("b")->connect(two->getPort("out"));
+	sum->getPort("a")->connect(divide->getPort("c"));
+	sum->getPort("b")->connect(add->getPort("c"));
+	return grp;
+}
+
+TEST(OperatorFusion) {
+	const TraversalMode modes[] = { DEPENDENT, SEQUENTIAL, PARALLEL };
+	for (int m = 0; m < 3; m++) {
+		for (int delay = 0; delay < 2; delay++) {
+			double values[2][20];
+			for (int fusion = 0; fusion < 2; fusion++) {
+				smrt::ref_ptr<Group> grp = createOperatorGraph();
+				SumModel* sum = (SumModel*) grp->getChild(0);
+				op::Constant* three = (op::Constant*) grp->getChild(8);
+				Simulation sim(grp.get());
+				sim.setRealTime(false);
+				sim.setContinuousDisplay(false);
+				sim.setTraversalMode(modes[m]);
+				sim.setConnectionDelay(delay ? DELAY_ALL : DELAY_NONE);
+				sim.setOperatorFusion(fusion == 1);
+				sim.init();
+				for (int i = 0; i < 20; i++) {
+					if (i == 12)
+						three->set(4); // refolded
+					sim.step();
+					values[fusion][i] = sum->value();
+				}
+				if (fusion)
+					CHECK(sim.getUpdateVisitor().getNumFusedModels() >= 5);
+			}
+			for (int i = 0; i < 20; i++)
+				CHECK_EQUAL(values[0][i], values[1][i]);
+		}
+	}
+	
+	smrt::ref_ptr<Group> grp = createOperatorGraph();
+	op::Multiply* multiply = (op::Multiply*) grp->getChild(4);
+	ModeSource* mode = (ModeSource*) grp->getChild(6);
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setContinuousDisplay(false);
+	sim.setOperatorFusion(true);
+	const UpdateVisitor& updatevis = sim.getUpdateVisitor();
+	sim.init();
+	sim.step();
+	CHECK_EQUAL(7u, updatevis.getNumFusedModels());
+	CHECK_EQUAL(4u, updatevis.getSchedule().size()); // mode, fused operators, sum and the group
+	op::FusedOperators* fused = dynamic_cast<op::FusedOperators*>(updatevis.getSchedule()[1].model);
+	CHECK(fused != NULL);
+	if (!fused)
+		return;
+	CHECK_EQUAL(4u, fused->getNumOperations());
+	CHECK_EQUAL(1u, fused->getNumFolded());
+	CHECK_EQUAL(2u, fused->getNumStores()); // add and divide, read by the sum
+	
+	// Outputs logged by the BlackBox are written too
+	OutPort<double>* multiplied = dynamic_cast<OutPort<double>*>(multiply->getPort("c"));
+	BlackBox::instance().beginGroup(multiply, "multiply");
+	BlackBox::instance().registerDouble("c", &multiplied->getRef());
+	BlackBox::instance().endGroup();
+	multiply->touchTopology();
+	sim.step();
+	fused = dynamic_cast<op::FusedOperators*>(updatevis.getSchedule()[1].model);
+	CHECK_EQUAL(3u, fused->getNumStores());
+	CHECK_EQUAL((mode->out.get() + 2) * 3, multiplied->get());
+	BlackBox::instance().unregisterGroup(multiply);
+}
+
+/// Subscribes to BlackBox variables without logging them anywhere
+class NullDataHandler : public BlackBoxDataHandler {
+public:
+	virtual void write(int numentries = 0) {}
+};
+
+TEST(Pruning) {
+	const TraversalMode modes[] = { SEQUENTIAL, DEPENDENT, PARALLEL };
+	for (int m = 0; m < 3; m++) {
+		smrt::ref_ptr<Group> grp = new Group("root");
+		ModeSource* livemode = new ModeSource("livemode");
+		ModeSource* deadmode = new ModeSource("deadmode");
+		ModeSource* pinnedmode = new ModeSource("pinnedmode");
+		op::Constant* two = new op::Constant("two");
+		op::Add* logged = new op::Add("logged");
+		op::Multiply* multiply = new op::Multiply;
+		op::Subtract* subtract = new op::Subtract;
+		SumModel* sum = new SumModel;
+		sum->setEndPoint(true);
+		two->set(2);
+		pinnedmode->setPinned(true);
+		grp->addChild(livemode);
+		grp->addChild(deadmode);
+		grp->addChild(pinnedmode);
+		grp->addChild(two);
+		grp->addChild(logged);
+		grp->addChild(multiply);
+		grp->addChild(subtract);
+		grp->addChild(sum);
+		Group* unused = new Group("unused");
+		ModeSource* idle = new ModeSource("idle");
+		unused->addChild(idle);
+		unused->addChild(new op::Constant("k"));
+		grp->addChild(unused);
+		Group* pinned = new Group("pinned");
+		ModeSource* inner = new ModeSource("inner");
+		pinned->addChild(inner);
+		pinned->setPinned(true);
+		grp->addChild(pinned);
+		sum->getPort("a")->connect(livemode->getPort("out"));
+		sum->getPort("b")->connect(two->getPort("out"));
+		logged->getPort("a")->connect(livemode->getPort("out"));
+		logged->getPort("b")->connect(livemode->getPort("out"));
+		multiply->getPort("a")->connect(deadmode->getPort("out"));
+		multiply->getPort("b")->connect(two->getPort("out"));
+		subtract->getPort("a")->connect(multiply->getPort("c"));
+		subtract->getPort("b")->connect(two->getPort("out"));
+		
+		// The output of "logged" is subscribed to through its value
+		static const int tag = 0;
+		OutPort<double>* loggedout = dynamic_cast<OutPort<double>*>(logged->getPort("c"));
+		BlackBox::instance().beginGroup(&tag, "pruningtest");
+		BlackBox::instance().registerDouble("logged", &loggedout->getRef());
+		BlackBox::instance().endGroup();
+		NullDataHandler handler;
+		handler.subscribe("pruningtest.logged");
+		BlackBox::instance().addHandler(&handler);
+		
+		Simulation sim(grp.get());
+		sim.setRealTime(false);
+		sim.setContinuousDisplay(false);
+		sim.setTraversalMode(modes[m]);
+		sim.setPruning(true);
+		sim.init();
+		const UpdateVisitor& updatevis = sim.getUpdateVisitor();
+		CHECK_EQUAL(6u, updatevis.getNumPrunedModels());
+		CHECK(updatevis.isPruned(*deadmode));
+		CHECK(updatevis.isPruned(*unused));
+		CHECK(!updatevis.isPruned(*logged));
+		CHECK(!updatevis.isPruned(*two));
+		for (int i = 0; i < 10; i++)
+			sim.step();
+		CHECK_EQUAL(10, livemode->count);
+		CHECK_EQUAL(10, pinnedmode->count);
+		CHECK_EQUAL(10, inner->count);
+		CHECK_EQUAL(0, deadmode->count);
+		CHECK_EQUAL(0, idle->count);
+		CHECK_EQUAL(4, loggedout->get());
+		CHECK_EQUAL(0.5*(10/5 + 2) + 10, sum->value());
+		
+		TiXmlElement report("pruning");
+		updatevis.writePruningReport(&report);
+		std::map<std::string, std::string> reasons, statuses;
+		for (const TiXmlElement* model = report.FirstChildElement("model"); model; model = model->NextSiblingElement("model")) {
+			reasons[model->Attribute("path")] = model->Attribute("reason");
+			statuses[model->Attribute("path")] = model->Attribute("status");
+		}
+		CHECK_EQUAL(14u, reasons.size());
+		CHECK_EQUAL("6", std::string(report.Attribute("pruned")));
+		CHECK_EQUAL("endpoint", reasons[sum->getPath()]);
+		CHECK_EQUAL("provider", reasons[two->getPath()]);
+		CHECK_EQUAL("logged", reasons[logged->getPath()]);
+		CHECK_EQUAL("pinned", reasons[inner->getPath()]);
+		CHECK_EQUAL("parent", reasons[grp->getPath()]);
+		CHECK_EQUAL("unused", reasons[multiply->getPath()]);
+		CHECK_EQUAL("unread", reasons[subtract->getPath()]);
+		CHECK_EQUAL("empty", reasons[unused->getPath()]);
+		CHECK_EQUAL("pruned", statuses[deadmode->getPath()]);
+		CHECK_EQUAL("kept", statuses[pinnedmode->getPath()]);
+		
+		// Models connected after pruning are scheduled as usual, pruned ones stay out until pruned again
+		ModeSource* late = new ModeSource("late");
+		grp->addChild(late);
+		late->setPinned(true);
+		subtract->getPort("b")->disconnect();
+		subtract->getPort("b")->connect(late->getPort("out"));
+		sum->getPort("b")->disconnect();
+		sum->getPort("b")->connect(subtract->getPort("c"));
+		sim.step();
+		CHECK_EQUAL(0, deadmode->count);
+		CHECK_EQUAL(1, late->count);
+		sim.init();
+		CHECK_EQUAL(3u, updatevis.getNumPrunedModels()); // the unused group
+		sim.step();
+		CHECK_EQUAL(1, deadmode->count);
+		CHECK_EQUAL(1, late->count);
+		sim.setPruning(false);
+		sim.init();
+		CHECK_EQUAL(0u, updatevis.getNumPrunedModels());
+		
+		BlackBox::instance().removeHandler(&handler);
+		BlackBox::instance().unregisterGroup(&tag);
+	}
+	
+	// Pinning is read from and written to XML
+	TiXmlDocument doc;
+	doc.Parse("<test_ModeSource name='source' pinned='true'/>");
+	smrt::ref_ptr<ModeSource> source = new ModeSource;
+	CHECK(!source->isPinned());
+	source->parseXML(doc.FirstChildElement());
+	CHECK(source->isPinned());
+	TiXmlElement element("test_ModeSource");
+	source->writeXML(&element);
+	CHECK_EQUAL("true", std::string(element.Attribute("pinned")));
+}
+
+TEST(RateGroups) {
+	smrt::ref_ptr<Group> grp = new Group;
+	smrt::ref_ptr<CounterModel> c10 = new CounterModel("c10");
+	smrt::ref_ptr<CounterModel> c20 = new CounterModel("c20");
+	smrt::ref_ptr<CounterModel> c75 = new CounterModel("c75");
+	c10->setUpdateFrequency(10);
+	c20->setUpdateFrequency(20);
+	c75->setUpdateFrequency(75);
+	grp->addChild(c10.get());
+	grp->addChild(c20.get());
+	grp->addChild(c75.get());
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setFrequency(30);
+	sim.init();
+	sim.step();
+	// 10, 20 and 75 Hz plus the group at 30 Hz, with periods 3, 3, 2 and 1 steps
+	const UpdateVisitor& updatevis = sim.getUpdateVisitor();
+	CHECK_EQUAL(4, updatevis.getRateGroups().size());
+	CHECK_EQUAL(6, updatevis.getHyperperiod());
+	CHECK_EQUAL(0, updatevis.getNumUpdates(20, 0));
+	CHECK_EQUAL(1, updatevis.getNumUpdates(20, 1));
+	CHECK_EQUAL(1, updatevis.getNumUpdates(20, 2));
+	CHECK_EQUAL(2, updatevis.getNumUpdates(75, 0));
+	CHECK_EQUAL(3, updatevis.getNumUpdates(75, 1));
+	CHECK_EQUAL(0, c10->getCount());
+	CHECK_EQUAL(0, c20->getCount());
+	CHECK_EQUAL(2, c75->getCount());
+	
+	// Non-integer frequency ratios don't drift, with or without compiled schedule or background threads
+	for (int i = 0; i < 3; i++) {
+		sim.setCompiledSchedule(i != 1);
+		sim.setBackgroundRateGroups(i == 2);
+		sim.init();
+		for (int step = 0; step < 300; step++)
+			sim.step();
+		sim.display(DISPLAY_USER);
+		CHECK_EQUAL(100, c10->getCount());
+		CHECK_EQUAL(200, c20->getCount());
+		CHECK_EQUAL(750, c75->getCount());
+	}
+}
+
+/// Takes a varying time to update, so that background rate groups finish in varying order
+class JitterSumModel : public SumModel {
+public:
+	JitterSumModel(const std::string& name) : SumModel(name), seed(4711) {}
+	virtual void update(const double dt)
+	{
+		seed = seed*1103515245 + 12345;
+		Timer::sleep((seed/65536) % 3000);
+		SumModel::update(dt);
+	}
+	unsigned int seed;
+};
+
+static std::vector<double> runBackgroundSteps(Simulation& sim, SumModel& model, const bool threads)
+{
+	sim.setBackgroundThreads(threads);
+	sim.init();
+	std::vector<double> values;
+	for (int step = 0; step < 30; step++) {
+		sim.step();
+		values.push_back(model.value());
+	}
+	return values;
+}
+
+TEST(BackgroundRateGroupHandoff) {
+	// A 30 Hz source, read by 10 and 15 Hz models, which are read by a 30 Hz sink
+	smrt::ref_ptr<Group> grp = new Group;
+	smrt::ref_ptr<SumModel> source = new SumModel("source");
+	smrt::ref_ptr<SumModel> slow10 = new JitterSumModel("slow10");
+	smrt::ref_ptr<SumModel> slow15 = new JitterSumModel("slow15");
+	smrt::ref_ptr<SumModel> sink = new SumModel("sink");
+	slow10->setUpdateFrequency(10);
+	slow15->setUpdateFrequency(15);
+	sink->setEndPoint(true);
+	source->getPort("c")->connect(slow10->getPort("a"));
+	slow10->getPort("c")->connect(slow15->getPort("a"));
+	source->getPort("c")->connect(slow15->getPort("b"));
+	slow10->getPort("c")->connect(sink->getPort("a"));
+	slow15->getPort("c")->connect(sink->getPort("b"));
+	grp->addChild(source.get());
+	grp->addChild(slow10.get());
+	grp->addChild(slow15.get());
+	grp->addChild(sink.get());
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setContinuousDisplay(false);
+	sim.setFrequency(30);
+	std::vector<double> foreground = runBackgroundSteps(sim, *sink, true);
+	
+	// Background rate groups give the same results on their own threads as on the simulation thread
+	sim.setBackgroundRateGroups(true);
+	std::vector<double> inline_values = runBackgroundSteps(sim, *sink, false);
+	for (int run = 0; run < 3; run++) {
+		std::vector<double> threaded = runBackgroundSteps(sim, *sink, true);
+		for (unsigned int i = 0; i < threaded.size(); i++)
+			CHECK_EQUAL(inline_values[i], threaded[i]);
+	}
+	// Their outputs are published when they are started again, so the sink (adding one per update)
+	// sees the 15 Hz model started on step 1 only on step 3
+	CHECK_EQUAL(1, inline_values[1] - inline_values[0]);
+	CHECK_EQUAL(1, inline_values[2] - inline_values[1]);
+	CHECK(inline_values[3] - inline_values[2] > 1);
+	CHECK(foreground[1] - foreground[0] > 1);
+	
+	// Likewise with all connections delayed, which stay delayed after background rate groups are turned off
+	sim.setConnectionDelay(DELAY_ALL);
+	inline_values = runBackgroundSteps(sim, *sink, false);
+	std::vector<double> threaded = runBackgroundSteps(sim, *sink, true);
+	for (unsigned int i = 0; i < threaded.size(); i++)
+		CHECK_EQUAL(inline_values[i], threaded[i]);
+	sim.setBackgroundRateGroups(false);
+	std::vector<double> delayed = runBackgroundSteps(sim, *sink, true);
+	CHECK_EQUAL(3u, sim.getUpdateVisitor().getCommittedPorts().size());
+	sim.setConnectionDelay(DELAY_NONE);
+	std::vector<double> values = runBackgroundSteps(sim, *sink, true);
+	for (unsigned int i = 0; i < values.size(); i++)
+		CHECK_EQUAL(foreground[i], values[i]);
+	CHECK(delayed != foreground);
+}
+
+/// Takes longer than its time step on one step
+class OverrunModel : public Model {
+public:
+	OverrunModel(const unsigned int nslowstep = 10, const unsigned long nduration = 35000)
+		: Model("OverrunModel"), step(0), slowstep(nslowstep), duration(nduration) {}
+	META_Object(test, OverrunModel);
+	virtual void init() { step = 0; }
+	virtual void update(const double dt)
+	{
+		if (step++ == slowstep)
+			Timer::sleep(duration);
+	}
+	virtual const char* description() const { return "overrun"; }
+	virtual const bool isEndPoint() { return true; }
+protected:
+	unsigned int step, slowstep;
+	unsigned long duration;
+};
+
+static double runRealTime(Simulation& sim, const OverrunPolicy policy)
+{
+	sim.setOverrunPolicy(policy);
+	sim.init();
+	Timer timer;
+	sim.run();
+	return timer.time_s();
+}
+
+static unsigned long sumHistogram(Simulation& sim)
+{
+	unsigned long sum = 0;
+	for (unsigned int i = 0; i < sim.getJitterHistogram().size(); i++)
+		sum += sim.getJitterHistogram()[i];
+	return sum;
+}
+
+TEST(RealTimeExecutive) {
+	smrt::ref_ptr<Group> grp = new Group;
+	grp->addChild(new OverrunModel);
+	Simulation sim(grp.get());
+	sim.setContinuousDisplay(false);
+	sim.setFrequency(100);
+	sim.setEndTime(0.5);
+	sim.setRealTimeSpin(0.0005);
+	
+	// Catching up keeps the simulation on the wall clock, several steps are late
+	double runtime = runRealTime(sim, CATCH_UP);
+	CHECK_CLOSE(0.5, runtime, 0.02);
+	CHECK(sim.getDeadlineMisses() >= 3);
+	CHECK_EQUAL(0u, sim.getSkippedFrames());
+	CHECK_EQUAL(50u, sumHistogram(sim));
+	CHECK(sim.getMaxJitter() > 0.02);
+	// The late frames start beyond the last bin (2 ms)
+	CHECK(sim.getJitterHistogram().back() >= 3);
+	
+	// Skipping drops the frames spent in the slow step
+	runtime = runRealTime(sim, SKIP);
+	CHECK(sim.getDeadlineMisses() >= 1);
+	CHECK(sim.getSkippedFrames() >= 3);
+	CHECK_CLOSE(0.5 + 0.01*sim.getSkippedFrames(), runtime, 0.02);
+	CHECK_EQUAL(50u, sumHistogram(sim));
+	
+	// Slipping moves the following frames by the overrun
+	runtime = runRealTime(sim, SLIP);
+	CHECK(sim.getDeadlineMisses() >= 1);
+	CHECK_EQUAL(0u, sim.getSkippedFrames());
+	CHECK_CLOSE(0.525, runtime, 0.02);
+	
+	// Jitter beyond the last bin is counted in it
+	sim.setJitterHistogram(4, 1e-9);
+	runRealTime(sim, CATCH_UP);
+	CHECK_EQUAL(4u, sim.getJitterHistogram().size());
+	CHECK_EQUAL(50u, sumHistogram(sim));
+	CHECK(sim.getJitterHistogram()[3] > 0);
+}
+
+class StepSource : public Model {
+public:
+	StepSource() : Model("StepSource") { registerPort(out,"out","","Number of updates"); }
+	META_Object(test, StepSource);
+	virtual void init() { out = 0; }
+	virtual void update(const double dt) { out = *out + 1; }
+	virtual const char* description() const { return "stepsource"; }
+protected:
+	OutPort<double> out;
+};
+
+/// Records its input on update and continuous display, both of which are slow
+class DisplayRecorder : public Model {
+public:
+	DisplayRecorder() : Model("DisplayRecorder") { registerPort(in,"in","","Input"); }
+	META_Object(test, DisplayRecorder);
+	virtual void init() { updated.clear(); displayed.clear(); }
+	virtual void update(const double dt)
+	{
+		updated.push_back(*in);
+		Timer::sleep(5000);
+	}
+	virtual void display(const DisplayMode mode)
+	{
+		if (mode != DISPLAY_CONTINUOUS)
+			return;
+		displayed.push_back(*in);
+		Timer::sleep(5000);
+	}
+	virtual const char* description() const { return "displayrecorder"; }
+	virtual const bool isEndPoint() { return true; }
+	std::vector<double> updated, displayed;
+protected:
+	InPort<double> in;
+};
+
+TEST(PipelinedDisplay) {
+	smrt::ref_ptr<Group> grp = new Group;
+	smrt::ref_ptr<StepSource> source = new StepSource;
+	smrt::ref_ptr<DisplayRecorder> recorder = new DisplayRecorder;
+	grp->addChild(source.get());
+	grp->addChild(recorder.get());
+	recorder->getPort("in")->connect(source->getPort("out"));
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	const unsigned int steps = 20;
+	double steptime[2];
+	for (int pipelined = 0; pipelined < 2; pipelined++) {
+		sim.setPipelinedDisplay(pipelined == 1);
+		sim.init();
+		Timer timer;
+		for (unsigned int i = 0; i < steps; i++)
+			sim.step();
+		steptime[pipelined] = timer.time_s();
+		sim.display(DISPLAY_USER);
+		// Display passes see the values of their own step, updates see live values
+		CHECK_EQUAL(steps, recorder->displayed.size());
+		CHECK_EQUAL(steps, recorder->updated.size());
+		for (unsigned int i = 0; i < recorder->displayed.size(); i++) {
+			CHECK_EQUAL(i+1, recorder->displayed[i]);
+			CHECK_EQUAL(i+1, recorder->updated[i]);
+		}
+	}
+	CHECK_EQUAL(1u, sim.getDisplayVisitor().getSnapshotPorts().size());
+	// Updates and display passes overlap
+	CHECK(steptime[0] > steps*0.01);
+	CHECK(steptime[1] < steptime[0]*0.75);
+	dout(1) << "Stepping time with 5 ms updates and display passes, " << steps << " steps: " << steptime[0]
+		<< " s, pipelined " << steptime[1] << " s\n";
+	
+	sim.setPipelinedDisplay(false);
+	CHECK_EQUAL(0u, sim.getDisplayVisitor().getSnapshotPorts().size());
+}
+
+/// Checks on every update that its two parameters are equal
+class GainPair : public Model {
+public:
+	GainPair() : Model("GainPair"), a(0), b(0), updates(0), mismatches(0)
+	{
+		registerParameter(&a, Parameter::DOUBLE, "a", "m");
+		registerParameter(&b, Parameter::DOUBLE, "b", "m");
+	}
+	META_Object(test, GainPair);
+	virtual void update(const double dt)
+	{
+		updates++;
+		if (a != b)
+			mismatches++;
+	}
+	virtual const char* description() const { return "gainpair"; }
+	virtual const bool isEndPoint() { return true; }
+	double a, b;
+	unsigned int updates, mismatches;
+};
+
+/// Posts parameter sets changing both parameters of a GainPair, one parameter at a time
+class ParameterPoster : public OpenThreads::Thread {
+public:
+	ParameterPoster(Simulation& nsim, GainPair& model, const unsigned int nnum)
+	: sim(nsim), a(model.getParameterHandle("a", "ft")), b(model.getParameterHandle("b", "ft")), num(nnum) {}
+	virtual void run()
+	{
+		ParameterSet set;
+		for (unsigned int i = 1; i <= num; i++) {
+			set.clear();
+			set.add(a, i);
+			OpenThreads::Thread::YieldCurrentThread();
+			set.add(b, i);
+			sim.applyParameterSet(set);
+		}
+	}
+	Simulation& sim;
+	ParameterHandle a, b;
+	unsigned int num;
+};
+
+TEST(ParameterSets) {
+	smrt::ref_ptr<Group> grp = new Group;
+	smrt::ref_ptr<GainPair> gains = new GainPair;
+	grp->addChild(gains.get());
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.init();
+	
+	// Applied by the next step, before the models are updated
+	ParameterSet set;
+	set.add(*gains, "a", 2);
+	set.add(*gains, "b", 200, "cm");
+	CHECK_EQUAL(2u, set.size());
+	sim.applyParameterSet(set);
+	CHECK_EQUAL(0, gains->a);
+	sim.step();
+	CHECK_EQUAL(1u, sim.getNumAppliedParameterSets());
+	CHECK_EQUAL(0u, gains->mismatches);
+	CHECK_CLOSE(2, gains->b, 1e-12);
+	
+	// Sets posted from another thread are never applied halfway
+	const unsigned int num = 2000;
+	ParameterPoster poster(sim, *gains, num);
+	poster.start();
+	while (sim.getNumAppliedParameterSets() < num+1)
+		sim.step();
+	poster.join();
+	CHECK_EQUAL(0u, gains->mismatches);
+	CHECK_CLOSE(num*0.3048, gains->a, 1e-9);
+	CHECK_EQUAL(gains->a, gains->b);
+}
+
+TEST(ParallelStepAllocations) {
+	smrt::ref_ptr<Group> grp = createBenchGraph(RANDOMDAG, 200);
+	Simulation sim(grp.get());
+	sim.setTraversalMode(PARALLEL);
+	sim.setContinuousDisplay(false); // display walks the model tree
+	sim.init();
+	// First steps compile the schedule and grow the task queues
+	for (int i = 0; i < 5; i++)
+		sim.step();
+	num_allocations.exchange(0);
+	count_allocations = true;
+	for (int i = 0; i < 100; i++)
+		sim.step();
+	count_allocations = false;
+	CHECK_EQUAL(0, (unsigned int) num_allocations);
+}
+
+static double benchmarkSteps(Simulation& sim, const unsigned int steps)
+{
+	sim.init();
+	Timer timer;
+	for (unsigned int i = 0; i < steps; i++)
+		sim.step();
+	return steps/timer.time_s();
+}
+
+TEST(UpdateScheduleBenchmark) {
+	const char* names[] = { "chain", "fan-out", "random DAG" };
+	const unsigned int num = 500, steps = 200;
+	dout(1) << "Update steps/second, " << num << " models: traversal / compiled schedule\n";
+	for (int type = CHAIN; type <= RANDOMDAG; type++) {
+		smrt::ref_ptr<Group> grp = createBenchGraph((BenchGraph) type, num);
+		Simulation sim(grp.get());
+		sim.setRealTime(false);
+		sim.setContinuousDisplay(false);
+		sim.setCompiledSchedule(false);
+		double traversed = benchmarkSteps(sim, steps);
+		std::vector<double> values;
+		for (unsigned int i = 0; i < num; i++)
+			values.push_back(((SumModel*)grp->getChild(i))->value());
+		sim.setCompiledSchedule(true);
+		double compiled = benchmarkSteps(sim, steps);
+		for (unsigned int i = 0; i < num; i++)
+			CHECK_EQUAL(values[i], ((SumModel*)grp->getChild(i))->value());
+		dout(1) << "  " << names[type] << ": " << traversed << " / " << compiled << "\n";
+	}
+}
+
+TEST(OperatorFusionBenchmark) {
+	const unsigned int num = 500, steps = 2000;
+	smrt::ref_ptr<Group> grp = createOperatorChain(num);
+	SumModel* sum = (SumModel*) grp->getChild(grp->getNumChildren()-1);
+	Simulation sim(grp.get());
+	sim.setRealTime(false);
+	sim.setContinuousDisplay(false);
+	double separate = benchmarkSteps(sim, steps);
+	double value = sum->value();
+	sim.setOperatorFusion(true);
+	double fused = benchmarkSteps(sim, steps);
+	CHECK_EQUAL(value, sum->value());
+	CHECK_EQUAL(num+1, sim.getUpdateVisitor().getNumFusedModels()); // with the Constant
+	dout(1) << "Update steps/second, chain of " << num << " operators: separate / fused " << separate << " / " << fused << "\n";
+}
@@ -1,7 +1,13 @@
 #include <UnitTest++/UnitTest++.h>
 #include <sbx/StateSpaceModel.h>
+#include <sbx/ModelArray.h>
+#include <sbx/Timer.h>
+#include <sbx/Log.h>
 #include <numerix/RungeKuttaSolvers.h>
+#include <numerix/AdaptiveRungeKuttaSolvers.h>
+#include <numerix/ImplicitSolvers.h>
 #include <iostream>
+#include <vector>
 
 // A simple SISO state-space model of a DC motor, found in the documentation of a
 // popular scientific computing application.
@@ -20,6 +26,19 @@ public:
 		registerParameter(&Kf, Parameter::DOUBLE, "Kf");
 		registerParameter(&J, Parameter::DOUBLE, "J","kg * m^2");
 	}
+	DCMotor(const DCMotor& source)
+	:	sbx::StateSpaceModel<double, 2, 1, 1>(source),
+		R(source.R), L(source.L), Km(source.Km), Kb(source.Kb), Kf(source.Kf), J(source.J)
+	{
+		copyPort(source, "vapp", vapp);
+		copyPort(source, "omega", omega);
+		copyParameter(source, "R", &R);
+		copyParameter(source, "L", &L);
+		copyParameter(source, "Km", &Km);
+		copyParameter(source, "Kb", &Kb);
+		copyParameter(source, "Kf", &Kf);
+		copyParameter(source, "J", &J);
+	}
 	META_Object(test, DCMotor);
 	virtual const char* description() const { return "Simple test of sbx::StateSpaceModel"; }
 	virtual void transferInputs()
@@ -95,3 +114,270 @@ TEST(StateSpaceModel) {
 }
 
 
+
+// The same responses from an adaptive solver, which takes its own internal steps and has to restart
+// from the last update when the input steps
+
+TEST(AdaptiveStateSpaceModel) {
+	typedef numerix::AdaptiveSolver< Eigen::Matrix<double, 2, 1> > Solver;
+	DCMotor motor;
+	motor.setParameter("R", 2);
+	motor.setParameter("L", 0.5);
+	motor.setParameter("Km", 0.015);
+	motor.setParameter("Kb", 0.015);
+	motor.setParameter("Kf", 0.2);
+	motor.setParameter("J", 0.02);
+	motor.setParameter("solver", std::string("dopri5"));
+	motor.setParameter("relative_tolerance", 1e-8);
+	motor.setParameter("absolute_tolerance", 1e-10);
+	sbx::OutUnitPort<double> v_out;
+	sbx::InUnitPort<double> omega_in;
+	v_out.connect(motor.getPort("vapp"));
+	omega_in.connect(motor.getPort("omega"));
+	v_out = 1;
+	motor.init();
+	Solver* solver = dynamic_cast<Solver*>(motor.getSolver());
+	CHECK(solver != NULL);
+	CHECK_CLOSE(1e-8, solver->getRelativeTolerance(), 1e-15);
+	
+	for (double t = 0; t < 0.25; t += 0.01)
+		motor.update(0.01);
+	CHECK_CLOSE(0.0165, *omega_in, 0.0001);
+	for (double t = 0.25; t < 1; t += 0.01)
+		motor.update(0.01);
+	CHECK_CLOSE(0.0363, *omega_in, 0.0001);
+	
+	// Re-initializing keeps the solver
+	motor.init();
+	CHECK(motor.getSolver() == solver);
+	CHECK_CLOSE(0, *omega_in, 0.001);
+	
+	v_out = 100;
+	double tmax = 0, ymax = 0;
+	for (double t = 0; t < 1; t += 0.01) {
+		if (*omega_in > ymax) {
+			ymax = *omega_in;
+			tmax = t;
+		}
+		motor.update(0.01);
+		v_out = 0;
+	}
+	CHECK_CLOSE(0.0813, ymax, 0.001);
+	CHECK_CLOSE(0.16, tmax, 0.001);
+	CHECK_CLOSE(0.0046, *omega_in, 0.001);
+	
+	// A copy creates its own solver from the parameter
+	DCMotor copy(motor);
+	copy.init();
+	CHECK(dynamic_cast<Solver*>(copy.getSolver()) != NULL);
+	
+	motor.setParameter("solver", std::string("nosuchsolver"));
+	CHECK_THROW(motor.init(), sbx::ModelException);
+}
+
+// Implicit solvers take A as the Jacobian, and factorize once for a constant time step
+
+TEST(ImplicitStateSpaceModel) {
+	typedef numerix::ImplicitSolver< Eigen::Matrix<double, 2, 1> > Solver;
+	const char* names[] = { "bdf2", "ros2" };
+	for (int i = 0; i < 2; i++) {
+		DCMotor motor;
+		motor.setParameter("R", 2);
+		motor.setParameter("L", 0.5);
+		motor.setParameter("Km", 0.015);
+		motor.setParameter("Kb", 0.015);
+		motor.setParameter("Kf", 0.2);
+		motor.setParameter("J", 0.02);
+		motor.setParameter("solver", std::string(names[i]));
+		sbx::OutUnitPort<double> v_out;
+		sbx::InUnitPort<double> omega_in;
+		v_out.connect(motor.getPort("vapp"));
+		omega_in.connect(motor.getPort("omega"));
+		v_out = 1;
+		motor.init();
+		for (double t = 0; t < 0.25; t += 0.01)
+			motor.update(0.01);
+		CHECK_CLOSE(0.0165, *omega_in, 0.0002);
+		for (double t = 0.25; t < 1; t += 0.01)
+			motor.update(0.01);
+		CHECK_CLOSE(0.0363, *omega_in, 0.0002);
+		
+		Solver* solver = dynamic_cast<Solver*>(motor.getSolver());
+		CHECK(solver != NULL);
+		CHECK(solver->isJacobianAnalytic());
+		CHECK_EQUAL(i == 0 ? 2u : 1u, solver->getNumFactorizations());
+	}
+}
+
+/// Set up \a motor with the parameters of the example, \a R scaled by \a scale
+static void setupMotor(sbx::Model& motor, const double scale = 1)
+{
+	motor.setParameter("R", 2*scale);
+	motor.setParameter("L", 0.5);
+	motor.setParameter("Km", 0.015);
+	motor.setParameter("Kb", 0.015);
+	motor.setParameter("Kf", 0.2);
+	motor.setParameter("J", 0.02);
+}
+
+// A model array of state-space models integrates them as one batch, with the same results as
+// integrating them one by one
+
+TEST(StateSpaceModelBatch) {
+	typedef sbx::StateSpaceModel<double, 2, 1, 1> Base;
+	const unsigned int size = 20;
+	smrt::ref_ptr<DCMotor> prototype = new DCMotor;
+	setupMotor(*prototype);
+	smrt::ref_ptr<sbx::ModelArray> array = new sbx::ModelArray;
+	array->setPrototype(prototype.get());
+	array->setSize(size);
+	std::vector< smrt::ref_ptr<DCMotor> > motors;
+	sbx::OutUnitPort<double> v_out[2*size];
+	sbx::InUnitPort<double> omega_in[2*size];
+	for (unsigned int i = 0; i < size; i++) {
+		motors.push_back(new DCMotor);
+		setupMotor(*motors[i]);
+		v_out[i].connect(array->getElement(i)->getPort("vapp"));
+		omega_in[i].connect(array->getElement(i)->getPort("omega"));
+		v_out[size+i].connect(motors[i]->getPort("vapp"));
+		omega_in[size+i].connect(motors[i]->getPort("omega"));
+		v_out[i] = i;
+		v_out[size+i] = i;
+	}
+	
+	for (int pass = 0; pass < 2; pass++) {
+		array->init();
+		for (unsigned int i = 0; i < size; i++)
+			motors[i]->init();
+		Base* kernel = dynamic_cast<Base*>(array->getPrototype());
+		CHECK(array->isBatched());
+		CHECK_EQUAL(pass == 0, kernel->getBatch() != NULL);
+		for (int step = 0; step < 50; step++) {
+			array->update(0.01);
+			for (unsigned int i = 0; i < size; i++)
+				motors[i]->update(0.01);
+			// Inputs changing between steps
+			for (unsigned int i = 0; i < size; i++) {
+				v_out[i] = (step % 10 < 5 ? 1.0 : -1.0) * i;
+				v_out[size+i] = *v_out[i];
+			}
+		}
+		for (unsigned int i = 0; i < size; i++)
+			CHECK_CLOSE(*omega_in[size+i], *omega_in[i], 1e-12);
+		
+		// Elements with other matrices are updated one by one
+		array->getElement(3)->setParameter("R", 3);
+		motors[3]->setParameter("R", 3);
+	}
+}
+
+TEST(StateSpaceModelBatchBenchmark) {
+	const unsigned int size = 500, steps = 1000;
+	smrt::ref_ptr<DCMotor> prototype = new DCMotor;
+	setupMotor(*prototype);
+	smrt::ref_ptr<sbx::ModelArray> array = new sbx::ModelArray;
+	array->setPrototype(prototype.get());
+	array->setSize(size);
+	std::vector< smrt::ref_ptr<DCMotor> > motors;
+	sbx::OutUnitPort<double> v_out;
+	v_out = 1;
+	for (unsigned int i = 0; i < size; i++) {
+		motors.push_back(new DCMotor);
+		setupMotor(*motors[i]);
+		v_out.connect(array->getElement(i)->getPort("vapp"));
+		v_out.connect(motors[i]->getPort("vapp"));
+	}
+	
+	array->init();
+	sbx::Timer timer;
+	for (unsigned int step = 0; step < steps; step++)
+		array->update(0.01);
+	double batched = timer.time_s();
+	
+	for (unsigned int i = 0; i < size; i++)
+		motors[i]->init();
+	timer.setStartTick();
+	for (unsigned int step = 0; step < steps; step++)
+		for (unsigned int i = 0; i < size; i++)
+			motors[i]->update(0.01);
+	double single = timer.time_s();
+	sbx::dout(1) << size << " DC motors, RK4: " << steps/single << " steps/s one by one, " << steps/batched << " steps/s batched\n";
+}
+
+// The exact discretization gives the step response of the example, with any step sizes
+
+TEST(DiscretizedStateSpaceModel) {
+	DCMotor motor, reference;
+	setupMotor(motor);
+	setupMotor(reference);
+	motor.setParameter("solver", std::string("zoh"));
+	sbx::OutUnitPort<double> v_out;
+	sbx::InUnitPort<double> omega_in, omega_ref;
+	v_out.connect(motor.getPort("vapp"));
+	v_out.connect(reference.getPort("vapp"));
+	omega_in.connect(motor.getPort("omega"));
+	omega_ref.connect(reference.getPort("omega"));
+	v_out = 1;
+	motor.init();
+	reference.init();
+	CHECK(motor.getSolver() == NULL);
+	
+	for (double t = 0; t < 0.25; t += 0.01)
+		motor.update(0.01);
+	CHECK_CLOSE(0.0165, *omega_in, 0.0001);
+	// Steps of 0.01 and 0.02 (multirate) against a fine RK4 reference
+	for (int i = 0; i < 25; i++) {
+		motor.update(i % 2 ? 0.02 : 0.01);
+		for (int j = 0; j < (i % 2 ? 20 : 10); j++)
+			reference.update(0.001);
+	}
+	for (int j = 0; j < 250; j++)
+		reference.update(0.001);
+	CHECK_CLOSE(*omega_ref, *omega_in, 1e-9);
+	CHECK_EQUAL(2u, motor.getNumDiscretizations());
+	
+	// One step is as exact as many for a constant input
+	motor.init();
+	for (int i = 0; i < 100; i++)
+		motor.update(0.01);
+	double omega = *omega_in;
+	motor.init();
+	motor.update(0.5);
+	motor.update(0.25);
+	motor.update(0.25);
+	CHECK_CLOSE(omega, *omega_in, 1e-12);
+	CHECK_CLOSE(0.0363, *omega_in, 0.0001);
+	CHECK_EQUAL(2u, motor.getNumDiscretizations());
+	
+	// Re-initializing discretizes the new matrices
+	motor.setParameter("R", 4);
+	motor.init();
+	CHECK_EQUAL(0u, motor.getNumDiscretizations());
+	CHECK_CLOSE(0, *omega_in, 1e-12);
+	motor.update(0.01);
+	CHECK_EQUAL(1u, motor.getNumDiscretizations());
+}
+
+TEST(DiscretizedStateSpaceModelBenchmark) {
+	const int steps = 1000000;
+	DCMotor rk4, zoh;
+	setupMotor(rk4);
+	setupMotor(zoh);
+	zoh.setParameter("solver", std::string("zoh"));
+	sbx::OutUnitPort<double> v_out;
+	v_out.connect(rk4.getPort("vapp"));
+	v_out.connect(zoh.getPort("vapp"));
+	v_out = 1;
+	rk4.init();
+	zoh.init();
+	
+	sbx::Timer timer;
+	for (int i = 0; i < steps; i++)
+		rk4.update(0.01);
+	double rk4time = timer.time_s();
+	timer.setStartTick();
+	for (int i = 0; i < steps; i++)
+		zoh.update(0.01);
+	double zohtime = timer.time_s();
+	sbx::dout(1) << "DC motor: " << steps/rk4time << " steps/s with RK4, " << steps/zohtime << " steps/s discretized\n";
+}
@@ -53,3 +53,88 @@ TEST (SleepThreadPool) {
 	CHECK_EQUAL(1000, pool.getTaskCount());
 	pool.waitDone();
 }
+
+class NopTask : public Task {
+public:
+	NopTask(OpenThreads::Atomic& ncount) : count(ncount) {}
+	virtual void perform() { ++count; }
+	OpenThreads::Atomic& count;
+};
+
+/// Task that schedules more tasks on the pool it is running in
+class SpawnTask : public Task {
+public:
+	SpawnTask(TaskThreadPool& npool, OpenThreads::Atomic& ncount, unsigned int ndepth) : pool(npool), count(ncount), depth(ndepth) {}
+	virtual void perform() {
+		++count;
+		if (depth > 0) {
+			pool.schedule(new SpawnTask(pool, count, depth-1));
+			pool.schedule(new SpawnTask(pool, count, depth-1));
+		}
+	}
+	TaskThreadPool& pool;
+	OpenThreads::Atomic& count;
+	unsigned int depth;
+};
+
+TEST (NestedThreadPool) {
+	UNITTEST_TIME_CONSTRAINT(2000);
+	TaskThreadPool pool(4);
+	pool.start();
+	OpenThreads::Atomic count;
+	pool.schedule(new SpawnTask(pool, count, 9));
+	pool.wait();
+	CHECK_EQUAL(1023, (unsigned int) count);
+	CHECK_EQUAL(1023, pool.getTaskCount());
+	CHECK_EQUAL(0, pool.getNumScheduled());
+	pool.waitDone();
+	CHECK(pool.isDone());
+}
+
+TEST (InhibitThreadPool) {
+	UNITTEST_TIME_CONSTRAINT(1000);
+	TaskThreadPool pool(2);
+	pool.start();
+	OpenThreads::Atomic count;
+	pool.setInhibit(true);
+	for (unsigned int i = 0; i < 10; i++)
+		pool.schedule(new NopTask(count));
+	Timer::sleep(10);
+	CHECK_EQUAL(0, (unsigned int) count);
+	CHECK_EQUAL(10, pool.getNumScheduled());
+	pool.setInhibit(false);
+	pool.wait();
+	CHECK_EQUAL(10, (unsigned int) count);
+}
+
+TEST (ThreadPoolBenchmark) {
+	const unsigned int num = 100000, rounds = 2000;
+	TaskThreadPool pool(4);
+	pool.start();
+	OpenThreads::Atomic count;
+	Timer timer;
+	// Throughput: many small tasks scheduled in one go
+	timer.setStartTick();
+	for (unsigned int i = 0; i < num; i++)
+		pool.schedule(new NopTask(count));
+	pool.wait();
+	double throughput = num / timer.time_s();
+	CHECK_EQUAL(num, (unsigned int) count);
+	// Latency: one task at a time, schedule to wait() returning
+	timer.setStartTick();
+	for (unsigned int i = 0; i < rounds; i++) {
+		pool.schedule(new NopTask(count));
+		pool.wait();
+	}
+	double latency = timer.time_u() / rounds;
+	CHECK_EQUAL(num+rounds, (unsigned int) count);
+	// Nested: tasks spawning tasks, queued on and stolen from the workers' own deques
+	timer.setStartTick();
+	pool.schedule(new SpawnTask(pool, count, 16));
+	pool.wait();
+	double nested = ((1 << 17) - 1) / timer.time_s();
+	CHECK_EQUAL(num+rounds+(1 << 17)-1, (unsigned int) count);
+	dout(1) << "Thread pool, " << pool.getNumThreads() << " threads: " << throughput << " tasks/s, "
+		<< latency << " us round trip, " << nested << " nested tasks/s\n";
+	pool.waitDone();
+}
@@ -9,6 +9,7 @@
 #include <sbx/Group.h>
 #include <sbx/ModelVisitor.h>
 #include <sbx/Simulation.h>
+#include <sbx/Ensemble.h>
 #include <sbx/PluginManager.h>
 #include <sbx/Version.h>
 #include <sbx/Ports.h>
@@ -39,7 +40,9 @@ void usage()
 		 << "    -A  -loadall           load all plugins at startup\n"
 		 << "    -l  -list              list available models and exit \n"
 		 << "    -s  -stats             print performance statistics when finished\n"
-		 << "    -L  -logfile <file>    log to a file instead of stdout/stderr\n";
+		 << "    -L  -logfile <file>    log to a file instead of stdout/stderr\n"
+		 << "    -E  -ensemble <num>    run an ensemble of <num> perturbed simulations (see the 'Ensemble' element)\n"
+		 << "    -T  -threads <num>     number of threads for running an ensemble (default one per processor)\n";
 	exit(1);
 }
 
@@ -49,6 +52,8 @@ PluginManager& plugman = PluginManager::instance();
 bool 	list = false,
 		dostats = false,
 		loadall = false;
+int		ensemblesize = 0,
+		numthreads = 0;
 const char 	*datapath = NULL, 
 			*pluginpath = NULL,
 			*logfile = NULL;
@@ -63,6 +68,8 @@ struct option long_options[] = {
 	{"list", 0, 0, 'l'},
 	{"stats", 0, 0, 's'},
 	{"logfile", 0, 0, 'L'},
+	{"ensemble", 1, 0, 'E'},
+	{"threads", 1, 0, 'T'},
 	{0, 0, 0, 0}
 };
 
@@ -72,7 +79,7 @@ int parseArguments(int *argc, char **argv)
 	int option_index = 1;
     while (1) {
     	int i;
-        int c = getopt_long_only(*argc,argv,"hd:p:P:AlsL:",long_options,&option_index);
+        int c = getopt_long_only(*argc,argv,"hd:p:P:AlsL:E:T:",long_options,&option_index);
         if (c == -1)
             break;
         switch (c) {
@@ -112,6 +119,12 @@ int parseArguments(int *argc, char **argv)
 			case 'L':
 				logfile = optarg;
 				break;
+			case 'E':
+				ensemblesize = atoi(optarg);
+				break;
+			case 'T':
+				numthreads = atoi(optarg);
+				break;
 			default:
 				usage();
 				exit(1);
@@ -211,6 +224,34 @@ protected:
 	int indentlevel;
 };
 
+void runEnsemble(const char* filename)
+{
+	smrt::ref_ptr<Group> root = parser.loadModels(filename);
+	Simulation *sim = parser.loadSimulation(filename);
+	smrt::ref_ptr<Ensemble> ensemble;
+	try {
+		ensemble = parser.loadEnsemble(filename);
+	} catch (ParseNoElementException&) {
+		ensemble = new Ensemble; // no perturbations or records
+	}
+	ensemble->setRoot(root.get());
+	ensemble->setSize(ensemblesize);
+	if (numthreads > 0)
+		ensemble->setNumThreads(numthreads);
+	ensemble->setEndTime(sim->getEndTime());
+	ensemble->setTimeStep(sim->getTimeStep());
+	delete sim;
+	
+	unsigned int failed = ensemble->run();
+	dout(INFO) << "Ran " << ensemble->getNumMembers() << " ensemble members in " << ensemble->getRunTime() << " seconds ("
+		<< ensemble->getNumMembers()/ensemble->getRunTime() << " members/second)";
+	if (failed > 0)
+		dout(INFO) << ", " << failed << " failed";
+	dout(INFO) << "\n";
+	if (ensemble->getNumPerturbations() > 0 || ensemble->getNumRecords() > 0)
+		ensemble->writeResults(std::cout);
+}
+
 int main(int argc, char* argv[])
 {
 	int exitcode = 0;
@@ -254,28 +295,32 @@ int main(int argc, char* argv[])
 			exit(0);
 		}
 		
-		Group *root = parser.loadModels(argv[optind]);
-		Simulation *sim = parser.loadSimulation(argv[optind]);
-		sim->setRoot(root);
-		if (dostats)
-			sim->doStatistics();
+		if (ensemblesize > 0)
+			runEnsemble(argv[optind]);
+		else {
+			Group *root = parser.loadModels(argv[optind]);
+			Simulation *sim = parser.loadSimulation(argv[optind]);
+			sim->setRoot(root);
+			if (dostats)
+				sim->doStatistics();
 			
-		sim->run();
+			sim->run();
 		
-		if (dostats) {
-			CallbackVisitor statsvis(new PrintStatsCallback(sim));
-			statsvis.setTraversalMode(SEQUENTIAL);
-			statsvis.visit(*sim->getRoot());
-			dout(INFO) << "Total simulation time " << sim->getTime() << "\n";
-			dout(INFO) << "Total real time " << sim->getRealTimeSinceStart() << "\n";
-			dout(INFO) << "Average realtime ratio " << sim->getAverageRealTimeRatio() << "\n";
-		}
-		delete sim;
+			if (dostats) {
+				CallbackVisitor statsvis(new PrintStatsCallback(sim));
+				statsvis.setTraversalMode(SEQUENTIAL);
+				statsvis.visit(*sim->getRoot());
+				dout(INFO) << "Total simulation time " << sim->getTime() << "\n";
+				dout(INFO) << "Total real time " << sim->getRealTimeSinceStart() << "\n";
+				dout(INFO) << "Average realtime ratio " << sim->getAverageRealTimeRatio() << "\n";
+			}
+			delete sim;
 		
-		//sim.setRoot(NULL);
-		//root = NULL; // frees the memory (since it's a smart pointer)
-		// Note: if any models from the plugin libraries have been instantiated, these need
-		// to be deleted before we unload(), so perhaps it's safer to just not do this..
+			//sim.setRoot(NULL);
+			//root = NULL; // frees the memory (since it's a smart pointer)
+			// Note: if any models from the plugin libraries have been instantiated, these need
+			// to be deleted before we unload(), so perhaps it's safer to just not do this..
+		}
 		plugman.unload();
 	} catch (exception& e) {
 		dout(ERROR) << "Caught " << e.what() << endl;